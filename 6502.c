@@ -5,17 +5,167 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <limits.h>
+#include <stddef.h>
+#include <time.h>
+#include <errno.h>
+#include <ctype.h>
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#if defined(__APPLE__)
+#include <pthread.h>
+#endif
+
+typedef struct CPU CPU;
+typedef struct Jit Jit;
+typedef struct DecodeCache DecodeCache;
+typedef struct SnapshotPage SnapshotPage;
+typedef struct Tracer Tracer;
+typedef struct Profiler Profiler;
+typedef struct RomImage RomImage;
+
+// Handlers for a memory-mapped I/O page, registered with map_io()
+typedef uint8_t (*io_read_fn)(CPU* cpu, uint16_t address, void* ctx);
+typedef void (*io_write_fn)(CPU* cpu, uint16_t address, uint8_t value, void* ctx);
+typedef int (*io_idle_fn)(CPU* cpu, uint16_t address, void* ctx);
+
+// What an idle loop waits for, see idle_loop(). An io_idle_fn returns the
+// IDLE_EVENT or IDLE_INPUT a register read waits for, or 0 if reading it
+// now has an effect or may give a different value before either.
+#define IDLE_LOOP 0x01 // PC is in a loop that comes back to the same state
+#define IDLE_EVENT 0x02 // It can end when an interrupt source fires
+#define IDLE_INPUT 0x04 // It can end when a key is typed
 
-// Define CPU state
 typedef struct {
+    io_read_fn read;
+    io_write_fn write;
+    io_idle_fn idle; // See set_io_idle(); NULL if no read may wait
+    void* ctx;
+    // Addresses the handlers care about, one bit each. The rest of the
+    // page must behave as plain RAM in mem; see set_io_registers().
+    uint8_t regs[32];
+} IoPage;
+
+// Interrupt controller registers, just past screen memory. Each source
+// has a bit in the control and status registers: INT_VBLANK raises an NMI
+// as emulated time reaches each frame, INT_TIMER an IRQ every timer period.
+#define INT_CONTROL 0x4200 // Sources allowed to interrupt
+#define INT_STATUS 0x4201 // Sources that fired since acknowledged; write 1s to acknowledge
+#define INT_TIMER_LO 0x4202 // Timer period in cycles, low byte
+#define INT_TIMER_HI 0x4203 // High byte; writing it restarts the timer, a period of 0 stops it
+#define INT_VBLANK 0x01
+#define INT_TIMER 0x02
+
+// Interrupt controller state. run_until() ends its runs where events are
+// due and updates it in between (see interrupt_update()), so the engines
+// never look at it.
+typedef struct {
+    uint8_t control;
+    uint8_t status;
+    uint8_t nmi; // A vblank NMI waits to be taken
+    uint8_t timer_low; // Written to INT_TIMER_LO, used once the high byte is
+    uint8_t restart; // The timer was written and starts over where the run ends
+    uint16_t timer_period;
+    uint64_t timer_at; // Cycle of the next timer event, UINT64_MAX while stopped
+    uint64_t vblank_at; // Cycle of the next vblank
+    uint64_t clock; // Cycles per second, which places the vblanks
+} Interrupts;
+
+// Define CPU state
+struct CPU {
     uint8_t A;  // Accumulator
     uint8_t X;  // X Register
     uint8_t Y;  // Y Register
     uint8_t SP; // Stack Pointer
     uint16_t PC; // Program Counter
     uint8_t P;  // Status Register
+    uint64_t cycles; // Cycles executed since reset
+    uint8_t page_crossed; // Set by get_address() when indexing crosses a page
+    uint8_t stop; // Why the last batch ended early (STOP_*)
+    uint8_t stop_on_brk; // Stop at a BRK instead of taking it
+    uint8_t watchdog; // Stop in idle loops that wait for nothing but input, which never comes
+    int32_t stop_pc; // Stop before executing this address, -1 for none
+    uint8_t engine; // ENGINE_* that run_until() uses
+    int32_t jit_left; // Instructions translated code may still execute
+    uint64_t jit_cycle_limit; // Translated loops stop short of this cycle
+    Jit* jit; // Translator state, allocated on first use
+    DecodeCache* decoded; // Predecoded runs, allocated on first use
+    Tracer* trace; // Instruction trace, see trace_open()
+    Profiler* profile; // Execution profile, see profile_create()
+    Interrupts interrupts;
+    uint8_t idle; // IDLE_* for the loop the last run ended in, 0 if none
+
+    // Page tables, one entry per 256-byte page. RAM pages point into mem;
+    // a NULL entry sends the access to that page's I/O handler instead.
+    // They point into this struct, so a CPU must not be copied as bytes.
+    uint8_t* read_map[256];
+    uint8_t* write_map[256];
+    IoPage io[256];
+
+    // Pages holding predecoded or translated code have their writes
+    // trapped (see watch_code_page()); this is the mapping the trap replaced
+    uint8_t code_watchers[256];
+    uint8_t* code_write_map[256];
+    io_write_fn code_write[256];
+
+    // The snapshot page each page last matched, or NULL. While read_map
+    // still points into it the page is shared, and the first write copies
+    // it into mem (see shared_page_write()). Otherwise it lets the next
+    // snapshot keep the page if it did not change.
+    SnapshotPage* snapshot_pages[256];
+
     uint8_t mem[65536]; // 64KB RAM
-} CPU;
+};
+
+// A page of memory held by snapshots and the CPUs restored from them. It
+// never changes once filled; the last reference frees it.
+struct SnapshotPage {
+    SDL_atomic_t refs;
+    uint8_t data[256];
+};
+
+// ROM file formats, see rom_open()
+#define ROM_RAW 0 // Bytes to put at the load address
+#define ROM_PRG 1 // Load address in the first two bytes, as C64 .prg files
+#define ROM_HEX 2 // Intel HEX records
+#define ROM_XEX 3 // Segments with their start and end address, as Atari .xex files
+#define ROM_ASM 4 // Assembly source, see assemble_file()
+#define ROM_FORMATS 5
+
+static const char rom_format_names[ROM_FORMATS][4] = { "raw", "prg", "hex", "xex", "asm" }; // For --format
+
+// A ROM file read once and put into any number of machines: the pages it
+// fills, with zeros around its data as a reset leaves memory. Machines
+// share the pages until they write to them.
+struct RomImage {
+    SnapshotPage* pages[256]; // NULL for pages it leaves alone
+    long size; // Bytes of data
+    uint16_t start; // Where execution starts unless --pc says otherwise
+    uint8_t vectors; // Bytes of $FFFA-$FFFF it sets, one bit each
+    int32_t first; // Address of its first segment, -1 for none
+};
+
+// Stop reasons left in cpu->stop. PC is left at the opcode that stopped.
+#define STOP_NONE 0
+#define STOP_KIL 1     // KIL opcode
+#define STOP_UNKNOWN 2 // Unknown opcode
+#define STOP_BRK 3     // BRK with stop_on_brk set
+#define STOP_PC 4      // PC reached stop_pc
+#define STOP_IO 5      // A device needs run_until() to look at it; never seen outside it
+#define STOP_TRAP 6    // In a loop nothing can leave, with watchdog set
+
+// Execution engines selectable per CPU. The interpreter is the switch in
+// execute_instruction() or the computed-goto engine, see THREADED_DISPATCH.
+#define ENGINE_INTERPRETER 0
+#define ENGINE_PREDECODE 1 // Cached predecoded runs, see run_predecoded()
+#define ENGINE_JIT 2       // x86-64 translation, see run_jit()
 
 // Status Register Flags
 #define FLAG_N 0x80 // Negative
@@ -28,7 +178,23 @@ typedef struct {
 
 // Function prototypes
 void reset(CPU* cpu);
-void load_rom(CPU* cpu, const char* filename, uint16_t address);
+void map_ram(CPU* cpu, uint8_t first_page, uint8_t last_page);
+void map_io(CPU* cpu, uint8_t page, io_read_fn read, io_write_fn write, void* ctx);
+void set_io_registers(CPU* cpu, uint16_t first, uint16_t last);
+void set_io_idle(CPU* cpu, uint8_t page, io_idle_fn idle);
+void watch_code_page(CPU* cpu, uint8_t page);
+void unwatch_code_page(CPU* cpu, uint8_t page);
+void flush_code_caches(CPU* cpu);
+void decode_code_written(CPU* cpu, uint16_t address);
+void decode_flush(CPU* cpu);
+void release_cpu(CPU* cpu);
+void snapshot_page_release(SnapshotPage* page);
+void share_page(CPU* cpu, int page, SnapshotPage* shared);
+int rom_format(const char* filename);
+RomImage* rom_open(const char* filename, int format, uint16_t address);
+void rom_apply(CPU* cpu, const RomImage* image);
+void rom_close(RomImage* image);
+long assemble_file(CPU* cpu, const char* filename, uint16_t origin, uint16_t* start, const char* listing, const char* symbols);
 void dump_memory(CPU* cpu, uint16_t start, uint16_t end);
 void dump_registers(CPU* cpu);
 uint8_t fetch_byte(CPU* cpu);
@@ -36,11 +202,223 @@ uint16_t fetch_word(CPU* cpu);
 void push_byte(CPU* cpu, uint8_t val);
 uint8_t pull_byte(CPU* cpu);
 void set_zero_and_negative_flags(CPU* cpu, uint8_t value);
-void branch(CPU* cpu, int8_t offset);
+void branch(CPU* cpu, uint16_t target);
+void decimal_init(void);
 uint16_t get_address(CPU* cpu, uint8_t mode);
-void execute_instruction(CPU* cpu);
+int execute_instruction(CPU* cpu);
 void handle_interrupt(CPU* cpu, uint16_t vector);
+void interrupt_reset(CPU* cpu, uint64_t clock);
+void interrupt_update(CPU* cpu);
+int run_until(CPU* cpu, int max_instructions, uint64_t max_cycles);
+int run_for(CPU* cpu, int n_instructions);
+uint64_t run_cycles(CPU* cpu, uint64_t budget);
+
+#if defined(_MSC_VER)
+#define FORCE_INLINE static __forceinline
+#else
+#define FORCE_INLINE static inline __attribute__((always_inline))
+#endif
+
+// Whether address is one of the registers of its I/O page, see
+// set_io_registers()
+FORCE_INLINE int io_register(const CPU* cpu, uint16_t address)
+{
+    return cpu->io[address >> 8].regs[(address & 0xFF) >> 3] & (1 << (address & 7));
+}
+
+// Memory bus. Every CPU access goes through these: a RAM page costs one
+// table lookup, an I/O page calls the handler registered for it. Reads of
+// the rest of an I/O page come straight from mem, so the zero page, which
+// only has $FE and $FF as registers, costs no call.
+FORCE_INLINE uint8_t mem_read(CPU* cpu, uint16_t address)
+{
+    uint8_t* page = cpu->read_map[address >> 8];
+    if (page)
+        return page[address & 0xFF];
+    if (!io_register(cpu, address))
+        return cpu->mem[address];
+    return cpu->io[address >> 8].read(cpu, address, cpu->io[address >> 8].ctx);
+}
+
+FORCE_INLINE void mem_write(CPU* cpu, uint16_t address, uint8_t value)
+{
+    uint8_t* page = cpu->write_map[address >> 8];
+    if (page)
+        page[address & 0xFF] = value;
+    else
+        cpu->io[address >> 8].write(cpu, address, value, cpu->io[address >> 8].ctx);
+}
+
+// The RAM behind a page without side effects: what read_map points at, or
+// mem under an I/O page's handlers
+FORCE_INLINE const uint8_t* ram_page(const CPU* cpu, int page)
+{
+    return cpu->read_map[page] ? cpu->read_map[page] : &cpu->mem[page << 8];
+}
+
+// Read a byte without side effects, for looking at code
+FORCE_INLINE uint8_t peek_byte(const CPU* cpu, uint16_t address)
+{
+    return ram_page(cpu, address >> 8)[address & 0xFF];
+}
+
+// The cycle a run of max_cycles from start ends at. run_for() passes
+// UINT64_MAX, so the sum saturates rather than wrap below start.
+FORCE_INLINE uint64_t cycle_limit(uint64_t start, uint64_t max_cycles)
+{
+    return start + max_cycles < start ? UINT64_MAX : start + max_cycles;
+}
+
+// One traced instruction, as stored in a trace file: the state before it
+// executes. Multi-byte fields are little endian.
+typedef struct {
+    uint8_t pc[2];
+    uint8_t opcode;
+    uint8_t operand[2]; // The next two bytes, whether the opcode uses them or not
+    uint8_t a, x, y, sp, p;
+    uint8_t cycles[6]; // Low 48 bits of the cycle count
+} TraceRecord;
+
+#define TRACE_MAGIC "6502TRC1" // File header
+#define TRACE_RING (1 << 20) // Records buffered for the writer thread
+#define TRACE_BATCH 1024 // Records handed to the writer at a time
+
+// A trace being recorded. The CPU's thread adds records to the ring and
+// a writer thread saves them to the file; neither ever takes a lock. The
+// CPU only waits when the writer is a whole ring behind.
+struct Tracer {
+    TraceRecord* ring;
+    uint32_t head; // Records added, counting from 0 and wrapping
+    uint32_t limit; // head may reach this before checking for room again
+    SDL_atomic_t published; // Records the writer may save
+    SDL_atomic_t saved; // Records the writer is done with
+    SDL_atomic_t closing;
+    int failed; // A write failed, set by the writer
+    FILE* file;
+    SDL_Thread* writer;
+};
+
+Tracer* trace_open(const char* filename);
+void trace_publish(Tracer* tracer);
+void trace_wait(Tracer* tracer);
+int trace_close(Tracer* tracer);
+int decode_trace(const char* filename);
+int instruction_length(uint8_t opcode);
+int disassemble(uint16_t pc, const uint8_t* bytes, char* text, size_t size);
+
+// Record the instruction at pc, about to execute with these registers.
+// Code is read without side effects, so an I/O page reads as its RAM.
+FORCE_INLINE void trace_add(Tracer* tracer, const CPU* cpu, uint16_t pc, uint8_t a, uint8_t x, uint8_t y, uint8_t sp, uint8_t p, uint64_t cycles)
+{
+    if (tracer->head == tracer->limit)
+        trace_wait(tracer);
+
+    TraceRecord* record = &tracer->ring[tracer->head & (TRACE_RING - 1)];
+    record->pc[0] = (uint8_t)pc;
+    record->pc[1] = (uint8_t)(pc >> 8);
+    record->opcode = peek_byte(cpu, pc);
+    record->operand[0] = peek_byte(cpu, (uint16_t)(pc + 1));
+    record->operand[1] = peek_byte(cpu, (uint16_t)(pc + 2));
+    record->a = a;
+    record->x = x;
+    record->y = y;
+    record->sp = sp;
+    record->p = p;
+    for (int i = 0; i < 6; i++)
+        record->cycles[i] = (uint8_t)(cycles >> (8 * i));
+    if ((++tracer->head & (TRACE_BATCH - 1)) == 0)
+        trace_publish(tracer);
+}
+
+#define PROFILE_DEPTH 64 // Deepest call stack followed
+#define PROFILE_NODES (1 << 16) // Most distinct call stacks kept
+#define PROFILE_TOP 40 // Rows per table in a profile report
+
+// A function as reached through one particular call stack
+typedef struct {
+    uint32_t parent; // Caller's node; the root is its own parent
+    uint16_t entry; // Address the function was called at
+    uint64_t weight; // Cycles spent in the function itself, or samples taken there
+    uint64_t count; // Instructions executed there, exact profiles only
+} ProfileNode;
+
+typedef struct {
+    char* name;
+    uint16_t address;
+} Symbol;
+
+// Where a program spends its time. An exact profile runs the reference
+// interpreter and counts every instruction, following JSR and RTS for the
+// call stack; a sampled one lets the engine run and looks at where the CPU
+// is every sample_every cycles. Weights are cycles when exact and samples
+// when sampled.
+struct Profiler {
+    uint64_t pc_weight[65536];
+    uint64_t pc_count[65536];
+    uint64_t opcode_weight[256];
+    uint64_t opcode_count[256];
+    uint64_t weight; // Total cycles or samples
+    uint64_t instructions; // Total instructions, exact profiles only
+    uint64_t sample_every; // 0 for an exact profile
+    uint64_t next_sample; // Cycle count to take the next sample at
+    struct {
+        uint32_t node;
+        int sp; // Stack pointer before the JSR
+    } stack[PROFILE_DEPTH]; // stack[0] is the root
+    int depth;
+    ProfileNode* nodes;
+    uint32_t node_count;
+    uint32_t* node_table; // Hash of (parent, entry), node + 1 per slot, 0 if free
+    Symbol* symbols; // Sorted by address
+    int symbol_count;
+};
+
+Profiler* profile_create(const CPU* cpu, uint64_t sample_every);
+int profile_load_symbols(Profiler* profiler, const char* filename);
+int profile_run(CPU* cpu, int max_instructions, uint64_t max_cycles);
+void profile_resume(Profiler* profiler, const CPU* cpu);
+int profile_report(const Profiler* profiler, const CPU* cpu, const char* filename);
+int profile_folded(const Profiler* profiler, const char* filename);
+void profile_free(Profiler* profiler);
+
+// Dispatch engine behind run_for(). The switch in execute_instruction() is the
+// reference engine; GCC/Clang builds default to the computed-goto engine in
+// run_threaded(). Build with -DTHREADED_DISPATCH=0 to use the switch only.
+#ifndef THREADED_DISPATCH
+#if defined(__GNUC__)
+#define THREADED_DISPATCH 1
+#else
+#define THREADED_DISPATCH 0
+#endif
+#endif
+
+// x86-64 translator behind --jit. It needs a System V host (Linux, macOS,
+// BSD); build with -DJIT_X64=0 to leave it out.
+#ifndef JIT_X64
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(_WIN32)
+#define JIT_X64 1
+#else
+#define JIT_X64 0
+#endif
+#endif
+
+// Most machines the lockstep batch engine (--batch) steps together. Match
+// the host's vector width in bytes: 16 for SSE2, 32 for AVX2, 64 for AVX-512.
+#ifndef BATCH_LANES
+#define BATCH_LANES 32
+#endif
+
+// Instruction tracer behind --trace. Build with -DTRACE=1 to include it;
+// without it the engines carry no trace code at all.
+#ifndef TRACE
+#define TRACE 0
+#endif
 
+#if JIT_X64
+void jit_code_written(CPU* cpu, uint16_t address);
+void jit_flush(CPU* cpu);
+void jit_release(CPU* cpu);
+#endif
 
 // Addressing Mode Constants
 #define AM_IMM 0  // Immediate
@@ -56,15 +434,197 @@ void handle_interrupt(CPU* cpu, uint16_t vector);
 #define AM_REL 10  // Relative
 #define AM_IMP 11 // Implied
 
+// Base cycle count per opcode (NMOS 6502, including illegal opcodes)
+static const uint8_t cycle_table[256] = {
+    //0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
+    7, 6, 2, 8, 3, 3, 5, 5, 3, 2, 2, 2, 4, 4, 6, 6,  // 0x
+    2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,  // 1x
+    6, 6, 2, 8, 3, 3, 5, 5, 4, 2, 2, 2, 4, 4, 6, 6,  // 2x
+    2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,  // 3x
+    6, 6, 2, 8, 3, 3, 5, 5, 3, 2, 2, 2, 3, 4, 6, 6,  // 4x
+    2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,  // 5x
+    6, 6, 2, 8, 3, 3, 5, 5, 4, 2, 2, 2, 5, 4, 6, 6,  // 6x
+    2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,  // 7x
+    2, 6, 2, 6, 3, 3, 3, 3, 2, 2, 2, 2, 4, 4, 4, 4,  // 8x
+    2, 6, 2, 6, 4, 4, 4, 4, 2, 5, 2, 5, 5, 5, 5, 5,  // 9x
+    2, 6, 2, 6, 3, 3, 3, 3, 2, 2, 2, 2, 4, 4, 4, 4,  // Ax
+    2, 5, 2, 5, 4, 4, 4, 4, 2, 4, 2, 4, 4, 4, 4, 4,  // Bx
+    2, 6, 2, 8, 3, 3, 5, 5, 2, 2, 2, 2, 4, 4, 6, 6,  // Cx
+    2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,  // Dx
+    2, 6, 2, 8, 3, 3, 5, 5, 2, 2, 2, 2, 4, 4, 6, 6,  // Ex
+    2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,  // Fx
+};
+
+// Mnemonic and addressing mode per opcode, for disassembly. Illegal opcodes
+// use their common names; $89 is an unknown opcode here.
+static const char opcode_names[256][4] = {
+    "BRK", "ORA", "KIL", "SLO", "NOP", "ORA", "ASL", "SLO", "PHP", "ORA", "ASL", "ANC", "NOP", "ORA", "ASL", "SLO",  // 0x
+    "BPL", "ORA", "KIL", "SLO", "NOP", "ORA", "ASL", "SLO", "CLC", "ORA", "NOP", "SLO", "NOP", "ORA", "ASL", "SLO",  // 1x
+    "JSR", "AND", "KIL", "RLA", "BIT", "AND", "ROL", "RLA", "PLP", "AND", "ROL", "ANC", "BIT", "AND", "ROL", "RLA",  // 2x
+    "BMI", "AND", "KIL", "RLA", "NOP", "AND", "ROL", "RLA", "SEC", "AND", "NOP", "RLA", "NOP", "AND", "ROL", "RLA",  // 3x
+    "RTI", "EOR", "KIL", "SRE", "NOP", "EOR", "LSR", "SRE", "PHA", "EOR", "LSR", "ALR", "JMP", "EOR", "LSR", "SRE",  // 4x
+    "BVC", "EOR", "KIL", "SRE", "NOP", "EOR", "LSR", "SRE", "CLI", "EOR", "NOP", "SRE", "NOP", "EOR", "LSR", "SRE",  // 5x
+    "RTS", "ADC", "KIL", "RRA", "NOP", "ADC", "ROR", "RRA", "PLA", "ADC", "ROR", "ARR", "JMP", "ADC", "ROR", "RRA",  // 6x
+    "BVS", "ADC", "KIL", "RRA", "NOP", "ADC", "ROR", "RRA", "SEI", "ADC", "NOP", "RRA", "NOP", "ADC", "ROR", "RRA",  // 7x
+    "NOP", "STA", "NOP", "SAX", "STY", "STA", "STX", "SAX", "DEY", "???", "TXA", "XAA", "STY", "STA", "STX", "SAX",  // 8x
+    "BCC", "STA", "KIL", "AHX", "STY", "STA", "STX", "SAX", "TYA", "STA", "TXS", "TAS", "SHY", "STA", "SHX", "AHX",  // 9x
+    "LDY", "LDA", "LDX", "LAX", "LDY", "LDA", "LDX", "LAX", "TAY", "LDA", "TAX", "LAX", "LDY", "LDA", "LDX", "LAX",  // Ax
+    "BCS", "LDA", "KIL", "LAX", "LDY", "LDA", "LDX", "LAX", "CLV", "LDA", "TSX", "LAS", "LDY", "LDA", "LDX", "LAX",  // Bx
+    "CPY", "CMP", "NOP", "DCP", "CPY", "CMP", "DEC", "DCP", "INY", "CMP", "DEX", "AXS", "CPY", "CMP", "DEC", "DCP",  // Cx
+    "BNE", "CMP", "KIL", "DCP", "NOP", "CMP", "DEC", "DCP", "CLD", "CMP", "NOP", "DCP", "NOP", "CMP", "DEC", "DCP",  // Dx
+    "CPX", "SBC", "NOP", "ISC", "CPX", "SBC", "INC", "ISC", "INX", "SBC", "NOP", "SBC", "CPX", "SBC", "INC", "ISC",  // Ex
+    "BEQ", "SBC", "KIL", "ISC", "NOP", "SBC", "INC", "ISC", "SED", "SBC", "NOP", "ISC", "NOP", "SBC", "INC", "ISC",  // Fx
+};
+
+static const uint8_t opcode_modes[256] = {
+    AM_IMP, AM_IZX, AM_IMP, AM_IZX, AM_ZP, AM_ZP, AM_ZP, AM_ZP, AM_IMP, AM_IMM, AM_IMP, AM_IMM, AM_ABS, AM_ABS, AM_ABS, AM_ABS,  // 0x
+    AM_REL, AM_IZY, AM_IMP, AM_IZY, AM_ZPX, AM_ZPX, AM_ZPX, AM_ZPX, AM_IMP, AM_ABY, AM_IMP, AM_ABY, AM_ABX, AM_ABX, AM_ABX, AM_ABX,  // 1x
+    AM_ABS, AM_IZX, AM_IMP, AM_IZX, AM_ZP, AM_ZP, AM_ZP, AM_ZP, AM_IMP, AM_IMM, AM_IMP, AM_IMM, AM_ABS, AM_ABS, AM_ABS, AM_ABS,  // 2x
+    AM_REL, AM_IZY, AM_IMP, AM_IZY, AM_ZPX, AM_ZPX, AM_ZPX, AM_ZPX, AM_IMP, AM_ABY, AM_IMP, AM_ABY, AM_ABX, AM_ABX, AM_ABX, AM_ABX,  // 3x
+    AM_IMP, AM_IZX, AM_IMP, AM_IZX, AM_ZP, AM_ZP, AM_ZP, AM_ZP, AM_IMP, AM_IMM, AM_IMP, AM_IMM, AM_ABS, AM_ABS, AM_ABS, AM_ABS,  // 4x
+    AM_REL, AM_IZY, AM_IMP, AM_IZY, AM_ZPX, AM_ZPX, AM_ZPX, AM_ZPX, AM_IMP, AM_ABY, AM_IMP, AM_ABY, AM_ABX, AM_ABX, AM_ABX, AM_ABX,  // 5x
+    AM_IMP, AM_IZX, AM_IMP, AM_IZX, AM_ZP, AM_ZP, AM_ZP, AM_ZP, AM_IMP, AM_IMM, AM_IMP, AM_IMM, AM_IND, AM_ABS, AM_ABS, AM_ABS,  // 6x
+    AM_REL, AM_IZY, AM_IMP, AM_IZY, AM_ZPX, AM_ZPX, AM_ZPX, AM_ZPX, AM_IMP, AM_ABY, AM_IMP, AM_ABY, AM_ABX, AM_ABX, AM_ABX, AM_ABX,  // 7x
+    AM_IMM, AM_IZX, AM_IMM, AM_IZX, AM_ZP, AM_ZP, AM_ZP, AM_ZP, AM_IMP, AM_IMP, AM_IMP, AM_IMM, AM_ABS, AM_ABS, AM_ABS, AM_ABS,  // 8x
+    AM_REL, AM_IZY, AM_IMP, AM_IZY, AM_ZPX, AM_ZPX, AM_ZPY, AM_ZPY, AM_IMP, AM_ABY, AM_IMP, AM_ABY, AM_ABX, AM_ABX, AM_ABY, AM_ABY,  // 9x
+    AM_IMM, AM_IZX, AM_IMM, AM_IZX, AM_ZP, AM_ZP, AM_ZP, AM_ZP, AM_IMP, AM_IMM, AM_IMP, AM_IMM, AM_ABS, AM_ABS, AM_ABS, AM_ABS,  // Ax
+    AM_REL, AM_IZY, AM_IMP, AM_IZY, AM_ZPX, AM_ZPX, AM_ZPY, AM_ZPY, AM_IMP, AM_ABY, AM_IMP, AM_ABY, AM_ABX, AM_ABX, AM_ABY, AM_ABY,  // Bx
+    AM_IMM, AM_IZX, AM_IMM, AM_IZX, AM_ZP, AM_ZP, AM_ZP, AM_ZP, AM_IMP, AM_IMM, AM_IMP, AM_IMM, AM_ABS, AM_ABS, AM_ABS, AM_ABS,  // Cx
+    AM_REL, AM_IZY, AM_IMP, AM_IZY, AM_ZPX, AM_ZPX, AM_ZPX, AM_ZPX, AM_IMP, AM_ABY, AM_IMP, AM_ABY, AM_ABX, AM_ABX, AM_ABX, AM_ABX,  // Dx
+    AM_IMM, AM_IZX, AM_IMM, AM_IZX, AM_ZP, AM_ZP, AM_ZP, AM_ZP, AM_IMP, AM_IMM, AM_IMP, AM_IMM, AM_ABS, AM_ABS, AM_ABS, AM_ABS,  // Ex
+    AM_REL, AM_IZY, AM_IMP, AM_IZY, AM_ZPX, AM_ZPX, AM_ZPX, AM_ZPX, AM_IMP, AM_ABY, AM_IMP, AM_ABY, AM_ABX, AM_ABX, AM_ABX, AM_ABX,  // Fx
+};
+
+// Opcodes that take one extra cycle when ABX/ABY/IZY indexing crosses a
+// page. Stores and read-modify-write opcodes already pay it in the base.
+static const uint8_t page_cross_table[256] = {
+    //0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 0x
+    0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 1, 1, 0, 0,  // 1x
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 2x
+    0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 1, 1, 0, 0,  // 3x
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 4x
+    0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 1, 1, 0, 0,  // 5x
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 6x
+    0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 1, 1, 0, 0,  // 7x
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 8x
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 9x
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // Ax
+    0, 1, 0, 1, 0, 0, 0, 0, 0, 1, 0, 1, 1, 1, 1, 1,  // Bx
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // Cx
+    0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 1, 1, 0, 0,  // Dx
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // Ex
+    0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 1, 1, 0, 0,  // Fx
+};
+
 #define SCREEN_WIDTH 128
 #define SCREEN_HEIGHT 128
 
+// Emulated clock rate unless --clock says otherwise, in cycles per second,
+// and frames per second of emulated time
+#ifndef CLOCK_HZ
+#define CLOCK_HZ 1000000
+#endif
+#define FRAME_RATE 60
+
+// Rewind history: a checkpoint every REWIND_FRAMES frames, kept as deltas
+// in a ring of REWIND_BYTES bytes (see rewind_record())
+#ifndef REWIND_FRAMES
+#define REWIND_FRAMES 4
+#endif
+#ifndef REWIND_BYTES
+#define REWIND_BYTES (4 << 20)
+#endif
+
+// The window shows one machine, so it belongs to the process
 SDL_Window* window = NULL;
 SDL_Renderer* renderer = NULL;
 SDL_Texture* texture = NULL;
-uint32_t pixels[SCREEN_WIDTH * SCREEN_HEIGHT];
+uint8_t shown_rows[SCREEN_HEIGHT][SCREEN_WIDTH]; // Each screen row as last uploaded
+int screen_lost = 1; // Upload every row next time, e.g. after the window lost its contents
+
+// Keys typed but not read yet, oldest first. Keys typed while it is full
+// are dropped.
+#define KEY_QUEUE 16
+
+typedef struct {
+    uint8_t keys[KEY_QUEUE];
+    uint8_t first; // Index of the oldest key
+    uint8_t count;
+} KeyQueue;
+
+// One emulated machine: the CPU and the devices wired to it. Machines share
+// no state, so any number of them can run at once on different threads.
+typedef struct {
+    CPU cpu;
+    KeyQueue keys; // Read one at a time at $FF
+    uint32_t rng; // xorshift32 state behind $FE, never zero
+} Machine;
 
-uint8_t keyboard_input = 0;
+int key_push(KeyQueue* queue, uint8_t key);
+uint8_t key_pop(KeyQueue* queue);
+void machine_reset(Machine* machine, uint32_t seed);
+void init_bus(Machine* machine);
+uint8_t next_random(uint32_t* state);
+
+// A machine's state at one point: registers, devices and memory. Pages the
+// machine did not change since its last snapshot or restore are shared
+// with that one, so a snapshot costs little more than the pages written.
+typedef struct {
+    uint8_t A, X, Y, SP, P;
+    uint16_t PC;
+    uint64_t cycles;
+    uint8_t stop_on_brk;
+    uint8_t watchdog;
+    int32_t stop_pc;
+    uint8_t engine;
+    Interrupts interrupts;
+    KeyQueue keys;
+    uint32_t rng;
+    SnapshotPage* pages[256];
+} Snapshot;
+
+Snapshot* machine_snapshot(Machine* machine);
+void machine_restore(Machine* machine, const Snapshot* snapshot);
+Machine* machine_fork(const Machine* parent, const Snapshot* snapshot);
+void snapshot_free(Snapshot* snapshot);
+
+// Most a checkpoint's delta can take: a page count, then per page its number
+// and at worst two bytes of run header for each changed byte
+#define REWIND_MAX_DELTA (2 + 256 * (1 + 3 * 256))
+
+// Registers and devices at a checkpoint, plus where its delta is in the ring
+typedef struct {
+    uint8_t A, X, Y, SP, P;
+    uint16_t PC;
+    uint64_t cycles;
+    uint64_t instructions; // Executed since the run started
+    Interrupts interrupts;
+    KeyQueue keys;
+    uint32_t rng;
+    size_t offset; // Delta turning this checkpoint's memory into the previous one's
+    size_t length;
+} Checkpoint;
+
+// Checkpoints, newest last, in a fixed amount of memory. Only the newest
+// checkpoint's memory is kept whole; each older one is reached by undoing
+// the deltas in turn. The oldest checkpoints make room for new ones.
+typedef struct {
+    uint8_t image[65536]; // Memory at the newest checkpoint
+    uint8_t* data; // Deltas, written round the ring
+    size_t size;
+    size_t head; // Where the next delta goes
+    Checkpoint* checkpoints; // Ring of capacity entries, from first
+    int capacity;
+    int first;
+    int count;
+    uint8_t scratch[REWIND_MAX_DELTA];
+} Rewind;
+
+Rewind* rewind_create(size_t bytes);
+void rewind_free(Rewind* rewind);
+void rewind_record(Rewind* rewind, Machine* machine, uint64_t instructions);
+int rewind_step(Rewind* rewind, Machine* machine, uint64_t* instructions);
 
 //Color palette
 uint32_t palette[16] = {
@@ -98,7 +658,9 @@ int init_sdl() {
         return 1;
     }
 
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    // Presenting runs on its own thread (see run_window()), so waiting for
+    // vsync there does not hold up emulation
+    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
     if (renderer == NULL) {
         fprintf(stderr, "Renderer could not be created! SDL_Error: %s\n", SDL_GetError());
         return 1;
@@ -110,2017 +672,9821 @@ int init_sdl() {
         return 1;
     }
 
-    memset(pixels, 0, sizeof(pixels));
-
     return 0;
 }
 
-void render_screen()
+// Whether a row differs from what was uploaded last; remembers the new row
+static int screen_row_changed(const uint8_t* screen, int row)
 {
-    SDL_UpdateTexture(texture, NULL, pixels, SCREEN_WIDTH * sizeof(uint32_t));
-    SDL_RenderClear(renderer);
-    SDL_RenderCopy(renderer, texture, NULL, NULL);
-    SDL_RenderPresent(renderer);
-}
+    const uint8_t* bytes = screen + row * SCREEN_WIDTH;
 
-int main() {
-    CPU cpu;
-    char rom_filename[256];
-    uint16_t rom_load_address = 0x8000; // Default ROM load address
+    if (!screen_lost && memcmp(shown_rows[row], bytes, SCREEN_WIDTH) == 0)
+        return 0;
+    memcpy(shown_rows[row], bytes, SCREEN_WIDTH);
+    return 1;
+}
 
-    if (init_sdl() != 0)
+// Turn screen rows into texture pixels. The low 4 bits of a byte pick its
+// color, so colors repeat every 16 values.
+static void expand_rows(const uint8_t* screen, int first, int count, uint8_t* pixels, int pitch)
+{
+#if defined(__SSSE3__)
+    // Look up 16 pixels at a time, one shuffle per byte of the color
+    uint8_t planes[4][16];
+    for (int i = 0; i < 16; i++)
     {
-        return 1;
+        for (int b = 0; b < 4; b++)
+            planes[b][i] = (uint8_t)(palette[i] >> (8 * b));
     }
+    __m128i blue = _mm_loadu_si128((const __m128i*)planes[0]);
+    __m128i green = _mm_loadu_si128((const __m128i*)planes[1]);
+    __m128i red = _mm_loadu_si128((const __m128i*)planes[2]);
+    __m128i alpha = _mm_loadu_si128((const __m128i*)planes[3]);
+    __m128i low_bits = _mm_set1_epi8(0x0F);
 
-    reset(&cpu); // Initialize the CPU
-
-    printf("Enter ROM filename: ");
-    scanf("%s", rom_filename);
+    for (int row = first; row < first + count; row++, pixels += pitch)
+    {
+        const uint8_t* bytes = screen + row * SCREEN_WIDTH;
+        for (int x = 0; x < SCREEN_WIDTH; x += 16)
+        {
+            __m128i index = _mm_and_si128(_mm_loadu_si128((const __m128i*)(bytes + x)), low_bits);
+            __m128i b = _mm_shuffle_epi8(blue, index);
+            __m128i g = _mm_shuffle_epi8(green, index);
+            __m128i r = _mm_shuffle_epi8(red, index);
+            __m128i a = _mm_shuffle_epi8(alpha, index);
+            __m128i* out = (__m128i*)(pixels + 4 * x);
+            __m128i bg = _mm_unpacklo_epi8(b, g);
+            __m128i ra = _mm_unpacklo_epi8(r, a);
+            _mm_storeu_si128(out, _mm_unpacklo_epi16(bg, ra));
+            _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(bg, ra));
+            bg = _mm_unpackhi_epi8(b, g);
+            ra = _mm_unpackhi_epi8(r, a);
+            _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(bg, ra));
+            _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(bg, ra));
+        }
+    }
+#else
+    for (int row = first; row < first + count; row++, pixels += pitch)
+    {
+        const uint8_t* bytes = screen + row * SCREEN_WIDTH;
+        uint32_t* out = (uint32_t*)pixels;
+        for (int x = 0; x < SCREEN_WIDTH; x++)
+            out[x] = palette[bytes[x] & 0x0F];
+    }
+#endif
+}
 
-    // Load the rom
-    load_rom(&cpu, rom_filename, rom_load_address);
-    cpu.PC = rom_load_address;
+// Upload the rows of a frame that changed since the last call and present
+// them. Frames are screen memory as bytes, converted here rather than on
+// every store. Nothing is presented when no row changed.
+void render_screen(const uint8_t* screen)
+{
+    int changed = 0;
+    int row = 0;
 
-    // Execution loop
-    SDL_Event event;
-    int cycles = 0;
-    while (cycles < 100000)
+    while (row < SCREEN_HEIGHT)
     {
-        if (SDL_PollEvent(&event))
+        // Lock and fill each run of consecutive changed rows at once
+        int first = row;
+        while (row < SCREEN_HEIGHT && screen_row_changed(screen, row))
+            row++;
+        if (row == first)
         {
-            if (event.type == SDL_QUIT)
-            {
-                cycles = 1000000;
-                break;
-            }
-            else if (event.type == SDL_KEYDOWN) // Handle key press
-            {
-                keyboard_input = event.key.keysym.sym & 0xFF;
-            }
-            else if (event.type == SDL_KEYUP)
-            {
-                keyboard_input = 0;
-            }
+            row++;
+            continue;
         }
-        execute_instruction(&cpu);
-        cycles++;
-        render_screen();
-        if (cpu.PC == 0xFFFF)
-            break;
-    }
 
-    printf("\n--- CPU State ---\n");
-    dump_registers(&cpu);
-    printf("\n--- Memory Dump ---\n");
-    dump_memory(&cpu, rom_load_address - 10, rom_load_address + 100);
+        SDL_Rect rect = { 0, first, SCREEN_WIDTH, row - first };
+        void* pixels;
+        int pitch;
+        if (SDL_LockTexture(texture, &rect, &pixels, &pitch) == 0)
+        {
+            expand_rows(screen, rect.y, rect.h, pixels, pitch);
+            SDL_UnlockTexture(texture);
+        }
+        changed = 1;
+    }
 
-    SDL_DestroyTexture(texture);
-    SDL_DestroyRenderer(renderer);
-    SDL_DestroyWindow(window);
-    SDL_Quit();
+    screen_lost = 0;
+    if (!changed)
+        return;
 
-    return 0;
+    SDL_RenderClear(renderer);
+    SDL_RenderCopy(renderer, texture, NULL, NULL);
+    SDL_RenderPresent(renderer);
 }
 
-void reset(CPU* cpu) {
-    memset(cpu, 0, sizeof(CPU));
-    cpu->SP = 0xFF;
-    // Set the unused bit in status reg
-    cpu->P |= 0x20;
-
-    // Load the reset vector
-    cpu->PC = cpu->mem[0xFFFC] | (cpu->mem[0xFFFD] << 8);
+// Frames from the emulation thread to the window: a lock-free triple
+// buffer. The emulation thread fills back and swaps it with latest; the
+// window swaps front with latest when a new frame is there. Neither ever
+// waits for the other, and the window always gets the newest frame.
+#define FRAME_NEW 4 // Flag in latest: the frame there was not taken yet
 
-    // Seed the random number generator
-    srand(time(NULL));
+typedef struct {
+    uint8_t screens[3][SCREEN_WIDTH * SCREEN_HEIGHT];
+    SDL_atomic_t latest; // Buffer published last, plus FRAME_NEW
+    int back; // Buffer the emulation thread fills next
+    int front; // Buffer the window shows
+} FrameBuffer;
 
-    keyboard_input = 0;
+void frame_init(FrameBuffer* frames)
+{
+    memset(frames->screens, 0, sizeof(frames->screens));
+    SDL_AtomicSet(&frames->latest, 0);
+    frames->back = 1;
+    frames->front = 2;
 }
 
-void load_rom(CPU* cpu, const char* filename, uint16_t address) {
-    FILE* fp = fopen(filename, "rb");
-    if (!fp) {
-        perror("Error opening ROM file");
-        exit(EXIT_FAILURE);
-    }
-
-    fseek(fp, 0, SEEK_END);
-    long rom_size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
-    if (rom_size > 65536 - address) {
-        fprintf(stderr, "Error: ROM too large to fit in memory.\n");
-        fclose(fp);
-        exit(EXIT_FAILURE);
-    }
+// Copy screen memory into the back buffer and make it the latest frame
+void frame_publish(FrameBuffer* frames, const CPU* cpu)
+{
+    uint8_t* screen = frames->screens[frames->back];
 
-    fread(&cpu->mem[address], 1, rom_size, fp);
-    fclose(fp);
-    printf("Loaded ROM '%s' into memory at $%04X. Size %ld bytes\n", filename, address, rom_size);
+    for (int page = 0; page < SCREEN_WIDTH * SCREEN_HEIGHT / 256; page++)
+        memcpy(screen + page * 256, ram_page(cpu, 0x02 + page), 256);
+    // The pixels go out before the index, and the window is done with
+    // the buffer coming back before it is filled
+    SDL_MemoryBarrierRelease();
+    frames->back = SDL_AtomicSet(&frames->latest, frames->back | FRAME_NEW) & ~FRAME_NEW;
+    SDL_MemoryBarrierAcquire();
 }
 
-void dump_memory(CPU* cpu, uint16_t start, uint16_t end) {
-    for (uint16_t i = start; i <= end; ++i) {
-        printf("$%04X: %02X ", i, cpu->mem[i]);
-        if ((i - start + 1) % 8 == 0) {
-            printf("\n");
-        }
-    }
-    printf("\n");
+// The newest frame published since the last call, or NULL if none was
+uint8_t* frame_take(FrameBuffer* frames)
+{
+    if (!(SDL_AtomicGet(&frames->latest) & FRAME_NEW))
+        return NULL;
+    SDL_MemoryBarrierRelease();
+    frames->front = SDL_AtomicSet(&frames->latest, frames->front) & ~FRAME_NEW;
+    SDL_MemoryBarrierAcquire();
+    return frames->screens[frames->front];
 }
 
+// Input from the window to the emulation thread: a lock-free queue with
+// one writer and one reader
+#define INPUT_QUEUE 256 // Events it holds, a power of two
 
-void dump_registers(CPU* cpu) {
-    printf("A:  $%02X\n", cpu->A);
-    printf("X:  $%02X\n", cpu->X);
-    printf("Y:  $%02X\n", cpu->Y);
-    printf("SP: $%02X\n", cpu->SP);
-    printf("PC: $%04X\n", cpu->PC);
-    printf("P:  $%02X (N=%d, V=%d, B=%d, D=%d, I=%d, Z=%d, C=%d)\n", cpu->P,
-        (cpu->P & FLAG_N) ? 1 : 0,
-        (cpu->P & FLAG_V) ? 1 : 0,
-        (cpu->P & FLAG_B) ? 1 : 0,
-        (cpu->P & FLAG_D) ? 1 : 0,
-        (cpu->P & FLAG_I) ? 1 : 0,
-        (cpu->P & FLAG_Z) ? 1 : 0,
-        (cpu->P & FLAG_C) ? 1 : 0);
-}
+#define INPUT_KEY 0 // key was typed
+#define INPUT_REWIND 1 // key is 1 while Backspace is held, 0 once released
+#define INPUT_PROFILE 2 // F9: pause or resume the profile
+#define INPUT_QUIT 3 // The window was closed
+#define INPUT_TURBO 4 // key is 1 while Tab is held, 0 once released
 
+typedef struct {
+    uint8_t type; // INPUT_*
+    uint8_t key;
+} InputEvent;
 
-uint8_t fetch_byte(CPU* cpu) {
-    uint16_t address = cpu->PC;
-    cpu->PC++;
+typedef struct {
+    InputEvent events[INPUT_QUEUE];
+    SDL_atomic_t head; // Events written, changed by the window only
+    SDL_atomic_t tail; // Events read, changed by the emulation thread only
+} InputQueue;
 
-    if (address == 0x00FE) {
-        // If the address is $00FE (random number generator):
-        return rand() & 0xff;
-    }
-    else if (address == 0x00FF) {
-        // If the address is $00FF (keyboard input):
-        return keyboard_input;
-    }
-    else {
-        // For all other addresses
-        return cpu->mem[address];
-    }
-}
+// Add an event. Returns 0 if the queue was full.
+int input_push(InputQueue* queue, uint8_t type, uint8_t key)
+{
+    unsigned int head = (unsigned int)SDL_AtomicGet(&queue->head);
 
-uint16_t fetch_word(CPU* cpu) {
-    uint16_t low = cpu->mem[cpu->PC++];
-    uint16_t high = cpu->mem[cpu->PC++];
-    return (high << 8) | low;
+    if (head - (unsigned int)SDL_AtomicGet(&queue->tail) == INPUT_QUEUE)
+        return 0;
+    SDL_MemoryBarrierAcquire();
+    queue->events[head % INPUT_QUEUE].type = type;
+    queue->events[head % INPUT_QUEUE].key = key;
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&queue->head, (int)(head + 1));
+    return 1;
 }
 
-void push_byte(CPU* cpu, uint8_t val)
+// Take the oldest event. Returns 0 when the queue is empty.
+int input_pop(InputQueue* queue, InputEvent* event)
 {
-    cpu->mem[0x100 + cpu->SP] = val;
-    cpu->SP--;
-}
+    unsigned int tail = (unsigned int)SDL_AtomicGet(&queue->tail);
 
-uint8_t pull_byte(CPU* cpu)
-{
-    cpu->SP++;
-    return cpu->mem[0x100 + cpu->SP];
+    if (tail == (unsigned int)SDL_AtomicGet(&queue->head))
+        return 0;
+    SDL_MemoryBarrierAcquire();
+    *event = queue->events[tail % INPUT_QUEUE];
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&queue->tail, (int)(tail + 1));
+    return 1;
 }
 
-void set_zero_and_negative_flags(CPU* cpu, uint8_t value)
-{
-    cpu->P &= ~(FLAG_N | FLAG_Z);
-    if (value == 0)
-        cpu->P |= FLAG_Z;
-    if (value & 0x80)
-        cpu->P |= FLAG_N;
-}
+// Process exit status, so scripts can tell how a run ended
+#define STATUS_OK 0      // Stop condition met, or window closed
+#define STATUS_ERROR 1   // Bad arguments or ROM
+#define STATUS_LIMIT 2   // Instruction or cycle limit reached
+#define STATUS_KIL 3     // KIL opcode
+#define STATUS_UNKNOWN 4 // Unknown opcode
+#define STATUS_TRAP 5    // Trapped in a loop nothing can leave
+
+// Command-line options
+typedef struct {
+    const char* rom;
+    uint16_t load_address;
+    int32_t start_pc; // -1: start at the load address
+    uint64_t max_instructions;
+    uint64_t max_cycles;
+    int32_t stop_pc;
+    int stop_on_brk;
+    int no_watchdog; // Run trapped headless programs on to their limits
+    int headless;
+    int engine;
+    int seeded;
+    unsigned int seed;
+    const char* farm; // Job file to run instead of a single ROM
+    int threads; // Farm workers, 0 for one per CPU core
+    int batch; // Farm jobs to run in lockstep, 0 or 1 for none
+    int forks; // Children to fork at fork_at, 0 for none
+    uint64_t fork_at;
+    int rewind; // Checkpoints to step back once a headless run ends
+    const char* trace; // File to trace every instruction to
+    const char* decode_trace; // Trace file to print instead of running
+    const char* profile; // File to write a profile report to
+    const char* flamegraph; // File to write profiled call stacks to
+    const char* symbols; // Labels for the profile
+    uint64_t profile_sample; // Cycles between profile samples, 0 to count everything
+    int bench; // Run the built-in benchmarks instead of a ROM
+    const char* listing; // File to write the assembly listing of a .asm ROM to
+    const char* write_symbols; // File to write the symbols of a .asm ROM to
+    int format; // ROM_*, by the ROM's extension unless --format says
+    uint64_t clock; // Emulated cycles per second in the window, 0 for unlimited
+} Options;
 
-void branch(CPU* cpu, int8_t offset)
+void usage(const char* program)
 {
-    cpu->PC += offset;
+    fprintf(stderr,
+        "usage: %s [options] <rom>\n"
+        "       %s --farm <jobs> [--threads <n>] [--batch <n>]\n"
+        "       %s --decode-trace <file>\n"
+        "       %s --bench [--max-instructions <n>]\n"
+        "  --headless              run without a window and print a JSON summary\n"
+        "  --format <name>         ROM format: raw, prg (load address first), hex (Intel\n"
+        "                          HEX), xex (segments) or asm (source); by default picked\n"
+        "                          by extension (.prg, .hex/.ihx, .xex, .asm/.s), else raw\n"
+        "  --load <addr>           load address of a raw ROM, or origin of a .asm source\n"
+        "                          (default $8000)\n"
+        "  --pc <addr>             start address (default: where the ROM loads, its start\n"
+        "                          record or reset vector, or its first assembled byte)\n"
+        "  --max-instructions <n>  stop after n instructions\n"
+        "  --max-cycles <n>        stop after n cycles\n"
+        "  --stop-pc <addr>        stop when PC reaches addr\n"
+        "  --stop-on-brk           stop at a BRK instead of taking it\n"
+        "  --no-watchdog           let headless runs trapped in a loop that nothing can\n"
+        "                          leave run on to their limits\n"
+        "  --clock <hz>            emulated clock rate in the window (default %d), or\n"
+        "                          unlimited (or 0) to run as fast as the host can; hold Tab\n"
+        "                          to run unlimited for a while\n"
+        "  --seed <n>              seed for the random number at $FE\n"
+        "  --engine <name>         interp (default), predecode, or jit; all give the same results\n"
+        "  --jit                   same as --engine jit\n"
+        "  --farm <jobs>           run every job in the file headless, one per line as\n"
+        "                          [options] <rom>, and print a JSON summary for each\n"
+        "  --threads <n>           farm worker threads (default: one per CPU core)\n"
+        "  --batch <n>             run up to n consecutive farm jobs with the same ROM, load\n"
+        "                          and start address in lockstep (at most %d)\n"
+        "  --fork <n>              with --headless: run to --fork-at, then run n copies of the\n"
+        "                          machine from there, each with its own random numbers, and\n"
+        "                          print a JSON summary for each\n"
+        "  --fork-at <n>           instruction to fork at (default 0)\n"
+        "  --rewind <n>            with --headless: record checkpoints, and once the run ends\n"
+        "                          step back n of them and report the state there\n"
+        "  --trace <file>          save every instruction to a binary trace (TRACE builds only)\n"
+        "  --decode-trace <file>   print a trace as text\n"
+        "  --profile <file>        count where the time goes and write a report\n"
+        "  --flamegraph <file>     write the profile's call stacks for flamegraph tools\n"
+        "  --symbols <file>        label the profile from an assembler symbol file\n"
+        "  --profile-sample <n>    sample every n cycles instead of counting everything\n"
+        "                          (keeps the chosen engine, call stacks are guessed)\n"
+        "  --listing <file>        write the listing of an assembled .asm source\n"
+        "  --write-symbols <file>  write the labels of an assembled .asm source\n"
+        "  --bench                 time the built-in kernels on every engine and print JSON;\n"
+        "                          --max-instructions sets the length of a run\n"
+        "Numbers may be decimal, 0x hex or $ hex. A KIL or unknown opcode always stops.\n"
+        "Exit status: 0 stop condition met or window closed, 1 error,\n"
+        "2 limit reached, 3 KIL, 4 unknown opcode, 5 trapped in a loop. A farm or --fork exits 0\n"
+        "once every job or child ran.\n",
+        program, program, program, program, CLOCK_HZ, BATCH_LANES);
 }
 
-uint16_t get_address(CPU* cpu, uint8_t mode)
+// Parse a decimal, 0x or $ prefixed number no larger than max
+int parse_number(const char* text, uint64_t max, uint64_t* value)
 {
-    uint16_t address = 0;
-    uint8_t zp_addr;
-    uint16_t abs_addr;
-    uint8_t temp_byte;
+    int base = 0;
+    char* end;
 
-    switch (mode)
+    if (*text == '$')
     {
-    case AM_IMM:
-        address = cpu->PC++;
-        break;
-    case AM_ZP:
-        zp_addr = fetch_byte(cpu);
-        address = zp_addr;
-        break;
-    case AM_ZPX:
-        zp_addr = fetch_byte(cpu);
-        address = (zp_addr + cpu->X) & 0xFF;
-        break;
-    case AM_ZPY:
-        zp_addr = fetch_byte(cpu);
-        address = (zp_addr + cpu->Y) & 0xFF;
-        break;
-    case AM_IZX:
-        zp_addr = fetch_byte(cpu);
-        temp_byte = (zp_addr + cpu->X) & 0xFF;
-        address = cpu->mem[temp_byte] | (cpu->mem[(temp_byte + 1) & 0xFF] << 8);
-        break;
-    case AM_IZY:
-        zp_addr = fetch_byte(cpu);
-        address = cpu->mem[zp_addr] | (cpu->mem[(zp_addr + 1) & 0xFF] << 8);
-        address += cpu->Y;
-        break;
-    case AM_ABS:
-        address = fetch_word(cpu);
-        break;
-    case AM_ABX:
-        address = fetch_word(cpu);
-        address += cpu->X;
-        break;
-    case AM_ABY:
-        address = fetch_word(cpu);
-        address += cpu->Y;
-        break;
-    case AM_IND:
-        abs_addr = fetch_word(cpu);
-        address = cpu->mem[abs_addr] | (cpu->mem[(abs_addr & 0xFF00) | ((abs_addr + 1) & 0xFF)] << 8);
-        break;
-    case AM_REL:
-        address = cpu->PC + (int8_t)fetch_byte(cpu);
-        break;
-
-    default:
-        break;
+        text++;
+        base = 16;
     }
-    return address;
+    if (*text == '\0' || *text == '-')
+        return 0;
+    errno = 0;
+    unsigned long long result = strtoull(text, &end, base);
+    if (*end != '\0' || errno == ERANGE || result > max)
+        return 0;
+    *value = result;
+    return 1;
 }
 
-void execute_instruction(CPU* cpu) {
-    uint8_t opcode = fetch_byte(cpu);
-    uint16_t address = 0;
-    uint8_t value = 0;
-    uint16_t temp_word = 0;
-    uint8_t temp_byte = 0;
-    uint8_t temp_carry = 0;
+int parse_args(int argc, char** argv, Options* opt)
+{
+    memset(opt, 0, sizeof(*opt));
+    opt->load_address = 0x8000;
+    opt->start_pc = -1;
+    opt->max_instructions = UINT64_MAX;
+    opt->max_cycles = UINT64_MAX;
+    opt->stop_pc = -1;
+    opt->format = -1;
+    opt->clock = CLOCK_HZ;
 
-    switch (opcode)
+    for (int i = 1; i < argc; i++)
     {
-        // --- 0x ---
-    case 0x00: // BRK
-        push_byte(cpu, cpu->PC >> 8);
-        push_byte(cpu, cpu->PC & 0xFF);
-        push_byte(cpu, cpu->P | FLAG_B);
-        cpu->P |= FLAG_I; // Set interrupt flag
-        cpu->PC = (cpu->mem[0xFFFE] | (cpu->mem[0xFFFF] << 8)); // Load interrupt vector
-        break;
-    case 0x01: // ORA izx
-        address = get_address(cpu, AM_IZX);
-        cpu->A |= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x02: // KIL
-    case 0x12:
-    case 0x22:
-    case 0x32:
-    case 0x42:
-    case 0x52:
-    case 0x62:
-    case 0x72:
-    case 0x92:
-    case 0xB2:
-    case 0xD2:
-    case 0xF2:
-        printf("KIL Instruction executed, halting.\n");
-        cpu->PC = 0xFFFF;
-        break;
-    case 0x03: // SLO izx
-        address = get_address(cpu, AM_IZX);
-        value = cpu->mem[address];
-        cpu->P &= ~FLAG_C;
-        if (value & 0x80)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = value << 1;
-        cpu->A |= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x04: // NOP zp
-        get_address(cpu, AM_ZP);
-        break;
-    case 0x05: // ORA zp
-        address = get_address(cpu, AM_ZP);
-        cpu->A |= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x06: // ASL zp
-        address = get_address(cpu, AM_ZP);
-        value = cpu->mem[address];
-        cpu->P &= ~FLAG_C;
-        if (value & 0x80)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = value << 1;
-        set_zero_and_negative_flags(cpu, cpu->mem[address]);
-        break;
-    case 0x07: // SLO zp
-        address = get_address(cpu, AM_ZP);
-        value = cpu->mem[address];
-        cpu->P &= ~FLAG_C;
-        if (value & 0x80)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = value << 1;
-        cpu->A |= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x08: // PHP
-        push_byte(cpu, cpu->P);
-        break;
-    case 0x09: // ORA imm
-        address = get_address(cpu, AM_IMM);
-        cpu->A |= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x0A: // ASL
-        cpu->P &= ~FLAG_C;
-        if (cpu->A & 0x80)
-            cpu->P |= FLAG_C;
-        cpu->A = cpu->A << 1;
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x0B: // ANC imm
-        address = get_address(cpu, AM_IMM);
-        cpu->A &= cpu->mem[address];
-        if (cpu->A & 0x80)
-            cpu->P |= FLAG_C;
+        const char* arg = argv[i];
+        uint64_t value = 0;
+
+        if (strcmp(arg, "--headless") == 0)
+            opt->headless = 1;
+        else if (strcmp(arg, "--stop-on-brk") == 0)
+            opt->stop_on_brk = 1;
+        else if (strcmp(arg, "--no-watchdog") == 0)
+            opt->no_watchdog = 1;
+        else if (strcmp(arg, "--bench") == 0)
+            opt->bench = 1;
+        else if (strcmp(arg, "--jit") == 0 || strcmp(arg, "--engine") == 0)
+        {
+            const char* name = strcmp(arg, "--jit") == 0 ? "jit" : (i + 1 < argc ? argv[++i] : "");
+            if (strcmp(name, "interp") == 0)
+                opt->engine = ENGINE_INTERPRETER;
+            else if (strcmp(name, "predecode") == 0)
+                opt->engine = ENGINE_PREDECODE;
+#if JIT_X64
+            else if (strcmp(name, "jit") == 0)
+                opt->engine = ENGINE_JIT;
+#else
+            else if (strcmp(name, "jit") == 0)
+            {
+                fprintf(stderr, "This build has no JIT\n");
+                return 0;
+            }
+#endif
+            else
+            {
+                fprintf(stderr, "Unknown engine: %s\n", name);
+                return 0;
+            }
+        }
+        else if (strcmp(arg, "--format") == 0)
+        {
+            const char* name = i + 1 < argc ? argv[++i] : "";
+            for (opt->format = 0; opt->format < ROM_FORMATS && strcmp(name, rom_format_names[opt->format]) != 0; opt->format++)
+                ;
+            if (opt->format == ROM_FORMATS)
+            {
+                fprintf(stderr, "Unknown ROM format: %s\n", name);
+                return 0;
+            }
+        }
+        else if (strcmp(arg, "--farm") == 0 || strcmp(arg, "--trace") == 0 || strcmp(arg, "--decode-trace") == 0 ||
+                 strcmp(arg, "--profile") == 0 || strcmp(arg, "--flamegraph") == 0 || strcmp(arg, "--symbols") == 0 ||
+                 strcmp(arg, "--listing") == 0 || strcmp(arg, "--write-symbols") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Missing value for %s\n", arg);
+                return 0;
+            }
+            if (strcmp(arg, "--farm") == 0)
+                opt->farm = argv[++i];
+            else if (strcmp(arg, "--decode-trace") == 0)
+                opt->decode_trace = argv[++i];
+            else if (strcmp(arg, "--profile") == 0)
+                opt->profile = argv[++i];
+            else if (strcmp(arg, "--flamegraph") == 0)
+                opt->flamegraph = argv[++i];
+            else if (strcmp(arg, "--symbols") == 0)
+                opt->symbols = argv[++i];
+            else if (strcmp(arg, "--listing") == 0)
+                opt->listing = argv[++i];
+            else if (strcmp(arg, "--write-symbols") == 0)
+                opt->write_symbols = argv[++i];
+#if TRACE
+            else
+                opt->trace = argv[++i];
+#else
+            else
+            {
+                fprintf(stderr, "This build has no tracer\n");
+                return 0;
+            }
+#endif
+        }
+        else if (strncmp(arg, "--", 2) == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Missing value for %s\n", arg);
+                return 0;
+            }
+            const char* text = argv[++i];
+            uint64_t max = UINT64_MAX;
+            if (strcmp(arg, "--clock") == 0 && strcmp(text, "unlimited") == 0)
+                text = "0";
+            if (strcmp(arg, "--load") == 0 || strcmp(arg, "--pc") == 0 || strcmp(arg, "--stop-pc") == 0)
+                max = 0xFFFF;
+            else if (strcmp(arg, "--seed") == 0 || strcmp(arg, "--profile-sample") == 0 || strcmp(arg, "--clock") == 0)
+                max = UINT_MAX;
+            else if (strcmp(arg, "--threads") == 0)
+                max = 1024;
+            else if (strcmp(arg, "--batch") == 0)
+                max = BATCH_LANES;
+            else if (strcmp(arg, "--fork") == 0 || strcmp(arg, "--rewind") == 0)
+                max = 65536;
+            if (!parse_number(text, max, &value))
+            {
+                fprintf(stderr, "Invalid value for %s: %s\n", arg, text);
+                return 0;
+            }
+
+            if (strcmp(arg, "--load") == 0)
+                opt->load_address = (uint16_t)value;
+            else if (strcmp(arg, "--pc") == 0)
+                opt->start_pc = (int32_t)value;
+            else if (strcmp(arg, "--stop-pc") == 0)
+                opt->stop_pc = (int32_t)value;
+            else if (strcmp(arg, "--max-instructions") == 0)
+                opt->max_instructions = value;
+            else if (strcmp(arg, "--max-cycles") == 0)
+                opt->max_cycles = value;
+            else if (strcmp(arg, "--seed") == 0)
+            {
+                opt->seed = (unsigned int)value;
+                opt->seeded = 1;
+            }
+            else if (strcmp(arg, "--threads") == 0)
+                opt->threads = (int)value;
+            else if (strcmp(arg, "--batch") == 0)
+                opt->batch = (int)value;
+            else if (strcmp(arg, "--fork") == 0)
+                opt->forks = (int)value;
+            else if (strcmp(arg, "--fork-at") == 0)
+                opt->fork_at = value;
+            else if (strcmp(arg, "--rewind") == 0)
+                opt->rewind = (int)value;
+            else if (strcmp(arg, "--profile-sample") == 0)
+                opt->profile_sample = value;
+            else if (strcmp(arg, "--clock") == 0)
+                opt->clock = value;
+            else
+            {
+                fprintf(stderr, "Unknown option: %s\n", arg);
+                return 0;
+            }
+        }
+        else if (opt->rom == NULL)
+            opt->rom = arg;
         else
-            cpu->P &= ~FLAG_C;
-        set_zero_and_negative_flags(cpu, cpu->A);
+        {
+            fprintf(stderr, "Unexpected argument: %s\n", arg);
+            return 0;
+        }
+    }
 
-        break;
-    case 0x0C: // NOP abs
-        get_address(cpu, AM_ABS);
-        break;
-    case 0x0D: // ORA abs
-        address = get_address(cpu, AM_ABS);
-        cpu->A |= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x0E: // ASL abs
-        address = get_address(cpu, AM_ABS);
-        value = cpu->mem[address];
-        cpu->P &= ~FLAG_C;
-        if (value & 0x80)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = value << 1;
-        set_zero_and_negative_flags(cpu, cpu->mem[address]);
-        break;
-    case 0x0F: // SLO abs
-        address = get_address(cpu, AM_ABS);
-        value = cpu->mem[address];
-        cpu->P &= ~FLAG_C;
-        if (value & 0x80)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = value << 1;
-        cpu->A |= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-        // --- 1x ---
-    case 0x10: // BPL rel
-        address = get_address(cpu, AM_REL);
-        if (!(cpu->P & FLAG_N))
-            cpu->PC = address;
-        break;
-    case 0x11: // ORA izy
-        address = get_address(cpu, AM_IZY);
-        cpu->A |= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x13: // SLO izy
-        address = get_address(cpu, AM_IZY);
-        value = cpu->mem[address];
-        cpu->P &= ~FLAG_C;
-        if (value & 0x80)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = value << 1;
-        cpu->A |= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x14: // NOP zpx
-        get_address(cpu, AM_ZPX);
-        break;
-    case 0x15: // ORA zpx
-        address = get_address(cpu, AM_ZPX);
-        cpu->A |= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x16: // ASL zpx
-        address = get_address(cpu, AM_ZPX);
-        value = cpu->mem[address];
-        cpu->P &= ~FLAG_C;
-        if (value & 0x80)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = value << 1;
-        set_zero_and_negative_flags(cpu, cpu->mem[address]);
-        break;
-    case 0x17: // SLO zpx
-        address = get_address(cpu, AM_ZPX);
-        value = cpu->mem[address];
-        cpu->P &= ~FLAG_C;
-        if (value & 0x80)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = value << 1;
-        cpu->A |= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x18: // CLC
-        cpu->P &= ~FLAG_C;
-        break;
-    case 0x19: // ORA aby
-        address = get_address(cpu, AM_ABY);
-        cpu->A |= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x1A: // NOP
-        break;
-    case 0x1B: // SLO aby
-        address = get_address(cpu, AM_ABY);
-        value = cpu->mem[address];
-        cpu->P &= ~FLAG_C;
-        if (value & 0x80)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = value << 1;
-        cpu->A |= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x1C: // NOP abx
-        get_address(cpu, AM_ABX);
-        break;
-    case 0x1D: // ORA abx
-        address = get_address(cpu, AM_ABX);
-        cpu->A |= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x1E: // ASL abx
-        address = get_address(cpu, AM_ABX);
-        value = cpu->mem[address];
-        cpu->P &= ~FLAG_C;
-        if (value & 0x80)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = value << 1;
-        set_zero_and_negative_flags(cpu, cpu->mem[address]);
-        break;
-    case 0x1F: // SLO abx
-        address = get_address(cpu, AM_ABX);
-        value = cpu->mem[address];
-        cpu->P &= ~FLAG_C;
-        if (value & 0x80)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = value << 1;
-        cpu->A |= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
+    if ((opt->farm || opt->decode_trace || opt->bench) && opt->rom)
+    {
+        fprintf(stderr, "Unexpected argument: %s\n", opt->rom);
+        return 0;
+    }
+    if (opt->rom == NULL && opt->farm == NULL && opt->decode_trace == NULL && !opt->bench)
+        return 0;
+    if (opt->forks && !opt->headless)
+    {
+        fprintf(stderr, "--fork needs --headless\n");
+        return 0;
+    }
+    if (opt->rewind && (!opt->headless || opt->forks))
+    {
+        fprintf(stderr, "--rewind needs --headless and no --fork\n");
+        return 0;
+    }
+    if (opt->rom && opt->format < 0)
+        opt->format = rom_format(opt->rom);
+    if ((opt->listing || opt->write_symbols) && opt->format != ROM_ASM)
+    {
+        fprintf(stderr, "--listing and --write-symbols need a .asm source\n");
+        return 0;
+    }
+    if ((opt->symbols || opt->profile_sample) && !opt->profile && !opt->flamegraph)
+    {
+        fprintf(stderr, "--symbols and --profile-sample need --profile or --flamegraph\n");
+        return 0;
+    }
+    if ((opt->profile || opt->flamegraph) && (opt->forks || opt->trace))
+    {
+        fprintf(stderr, "A profile can't be taken with --fork or --trace\n");
+        return 0;
+    }
+    return 1;
+}
 
-        // --- 2x ---
-    case 0x20: // JSR abs
-        push_byte(cpu, cpu->PC >> 8);
-        push_byte(cpu, cpu->PC & 0xFF);
-        cpu->PC = get_address(cpu, AM_ABS);
+// Instructions to run next, given the total so far and the limit
+int instruction_budget(uint64_t executed, uint64_t limit)
+{
+    return limit - executed > INT_MAX ? INT_MAX : (int)(limit - executed);
+}
+
+// How a run ended: the final registers plus why it stopped
+typedef struct {
+    const char* reason;
+    int status; // STATUS_*
+    uint16_t pc;
+    uint8_t a, x, y, sp, p;
+    uint64_t instructions;
+    uint64_t cycles;
+} RunResult;
+
+void finish_run(const CPU* cpu, const Options* opt, uint64_t instructions, int quit, RunResult* result)
+{
+    switch (cpu->stop)
+    {
+    case STOP_KIL:
+        result->reason = "kil";
+        result->status = STATUS_KIL;
         break;
-    case 0x21: // AND izx
-        address = get_address(cpu, AM_IZX);
-        cpu->A &= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
+    case STOP_UNKNOWN:
+        result->reason = "unknown_opcode";
+        result->status = STATUS_UNKNOWN;
         break;
-    case 0x23: // RLA izx
-        address = get_address(cpu, AM_IZX);
-        value = cpu->mem[address];
-        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
-        cpu->P &= ~FLAG_C;
-        if (value & 0x80)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = (value << 1) | temp_carry;
-        cpu->A &= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
+    case STOP_BRK:
+        result->reason = "brk";
+        result->status = STATUS_OK;
         break;
-    case 0x24: // BIT zp
-        address = get_address(cpu, AM_ZP);
-        value = cpu->mem[address];
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z);
-        if (value & FLAG_N)
-            cpu->P |= FLAG_N;
-        if (value & FLAG_V)
-            cpu->P |= FLAG_V;
-        if (!(cpu->A & value))
-            cpu->P |= FLAG_Z;
+    case STOP_PC:
+        result->reason = "pc";
+        result->status = STATUS_OK;
         break;
-    case 0x25: // AND zp
-        address = get_address(cpu, AM_ZP);
-        cpu->A &= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
+    case STOP_TRAP:
+        result->reason = "trap";
+        result->status = STATUS_TRAP;
         break;
-    case 0x26: // ROL zp
-        address = get_address(cpu, AM_ZP);
-        value = cpu->mem[address];
-        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
-        cpu->P &= ~FLAG_C;
-        if (value & 0x80)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = (value << 1) | temp_carry;
-        set_zero_and_negative_flags(cpu, cpu->mem[address]);
+    default:
+        if (quit)
+        {
+            result->reason = "quit";
+            result->status = STATUS_OK;
+        }
+        else
+        {
+            result->reason = instructions >= opt->max_instructions ? "instruction_limit" : "cycle_limit";
+            result->status = STATUS_LIMIT;
+        }
         break;
-    case 0x27: // RLA zp
-        address = get_address(cpu, AM_ZP);
-        value = cpu->mem[address];
-        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
-        cpu->P &= ~FLAG_C;
-        if (value & 0x80)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = (value << 1) | temp_carry;
-        cpu->A &= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x28: // PLP
-        cpu->P = pull_byte(cpu);
-        cpu->P |= 0x20; // Ensure B flag is always 1
-        break;
-    case 0x29: // AND imm
-        address = get_address(cpu, AM_IMM);
-        cpu->A &= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x2A: // ROL
-        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
-        cpu->P &= ~FLAG_C;
-        if (cpu->A & 0x80)
-            cpu->P |= FLAG_C;
-        cpu->A = (cpu->A << 1) | temp_carry;
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x2B: // ANC imm
-        address = get_address(cpu, AM_IMM);
-        cpu->A &= cpu->mem[address];
-        if (cpu->A & 0x80)
-            cpu->P |= FLAG_C;
+    }
+    result->pc = cpu->PC;
+    result->a = cpu->A;
+    result->x = cpu->X;
+    result->y = cpu->Y;
+    result->sp = cpu->SP;
+    result->p = cpu->P;
+    result->instructions = instructions;
+    result->cycles = cpu->cycles;
+}
+
+// The fields of a JSON summary, without the enclosing braces
+void print_result(const RunResult* result)
+{
+    printf("\"stop\":\"%s\",\"status\":%d,\"pc\":%u,\"a\":%u,\"x\":%u,\"y\":%u,\"sp\":%u,\"p\":%u,"
+        "\"instructions\":%llu,\"cycles\":%llu",
+        result->reason, result->status, result->pc, result->a, result->x, result->y, result->sp, result->p,
+        (unsigned long long)result->instructions, (unsigned long long)result->cycles);
+}
+
+// Reset the machine and load the ROM as the options say, from image if it
+// was opened already. Returns the ROM size, or -1 if it could not be
+// loaded.
+long start_machine(Machine* machine, const Options* opt, const RomImage* image)
+{
+    CPU* cpu = &machine->cpu;
+
+    machine_reset(machine, opt->seeded ? opt->seed : (uint32_t)time(NULL));
+
+    uint16_t start = opt->load_address;
+    long size = -1;
+    if (opt->format == ROM_ASM)
+        size = assemble_file(cpu, opt->rom, opt->load_address, &start, opt->listing, opt->write_symbols);
+    else
+    {
+        RomImage* opened = image ? NULL : rom_open(opt->rom, opt->format, opt->load_address);
+        if (image || (image = opened))
+        {
+            rom_apply(cpu, image);
+            size = image->size;
+            start = image->start;
+        }
+        rom_close(opened);
+    }
+    cpu->PC = opt->start_pc >= 0 ? (uint16_t)opt->start_pc : start;
+    cpu->stop_pc = opt->stop_pc;
+    cpu->stop_on_brk = (uint8_t)opt->stop_on_brk;
+    // Headless runs get no input, so a loop waiting for a key is as stuck
+    // as one waiting for nothing
+    cpu->watchdog = opt->headless && !opt->no_watchdog;
+    cpu->engine = (uint8_t)opt->engine;
+    interrupt_reset(cpu, opt->clock ? opt->clock : CLOCK_HZ);
+    return size;
+}
+
+// Run without a window until a stop condition or limit. Returns the
+// number of instructions executed.
+uint64_t run_headless(CPU* cpu, const Options* opt)
+{
+    uint64_t instructions = 0;
+
+    while (!cpu->stop && instructions < opt->max_instructions && cpu->cycles < opt->max_cycles)
+        instructions += run_until(cpu, instruction_budget(instructions, opt->max_instructions), opt->max_cycles - cpu->cycles);
+    return instructions;
+}
+
+// Cycles in the given frame at the --clock rate (CLOCK_HZ when unlimited).
+// Frame lengths are rounded so that every FRAME_RATE frames make exactly
+// a second.
+uint64_t frame_cycles(const Options* opt, uint64_t frame)
+{
+    uint64_t clock = opt->clock ? opt->clock : CLOCK_HZ;
+    frame %= FRAME_RATE;
+    return clock * (frame + 1) / FRAME_RATE - clock * frame / FRAME_RATE;
+}
+
+// Run the given frame's worth of cycles within the limits. Returns the
+// number of instructions executed.
+uint64_t run_frame(CPU* cpu, const Options* opt, uint64_t instructions, uint64_t frame, uint64_t* overshoot)
+{
+    // The last instruction of a frame may overshoot the quantum; take
+    // the excess out of the next frame so the average stays exact
+    uint64_t budget = frame_cycles(opt, frame) - *overshoot;
+    if (budget > opt->max_cycles - cpu->cycles)
+        budget = opt->max_cycles - cpu->cycles;
+    uint64_t start = cpu->cycles;
+    int executed = run_until(cpu, instruction_budget(instructions, opt->max_instructions), budget);
+    uint64_t used = cpu->cycles - start;
+    *overshoot = used > budget ? used - budget : 0;
+    return executed;
+}
+
+// Run headless a frame at a time, as the window would, keeping rewind
+// checkpoints. Once the run ends, step back --rewind checkpoints from
+// there. The summary gives how the run ended, the registers and counts at
+// the checkpoint reached, and how many steps back were taken.
+int run_rewound(Machine* machine, const Options* opt)
+{
+    CPU* cpu = &machine->cpu;
+    Rewind* rewind = rewind_create(REWIND_BYTES);
+    RunResult result;
+    RunResult reached;
+    uint64_t instructions = 0;
+    uint64_t overshoot = 0;
+    uint64_t frames = 0;
+    int steps = 0;
+
+    if (!rewind)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return STATUS_ERROR;
+    }
+    rewind_record(rewind, machine, instructions);
+    while (!cpu->stop && instructions < opt->max_instructions && cpu->cycles < opt->max_cycles)
+    {
+        instructions += run_frame(cpu, opt, instructions, frames, &overshoot);
+        if (++frames % REWIND_FRAMES == 0)
+            rewind_record(rewind, machine, instructions);
+    }
+    finish_run(cpu, opt, instructions, 0, &result);
+
+    rewind_record(rewind, machine, instructions);
+    while (steps < opt->rewind && rewind_step(rewind, machine, &instructions))
+        steps++;
+    finish_run(cpu, opt, instructions, 0, &reached);
+    reached.reason = result.reason;
+    reached.status = result.status;
+    printf("{\"rewound\":%d,", steps);
+    print_result(&reached);
+    printf("}\n");
+    rewind_free(rewind);
+    return result.status;
+}
+
+// Run to --fork-at, then run --fork children from there one after another.
+// Children differ only in the random numbers they read. Prints a JSON
+// summary per child, or the parent's if it ended before the fork.
+int run_forks(Machine* parent, const Options* opt)
+{
+    Options rest = *opt;
+    RunResult result;
+
+    if (rest.max_instructions > opt->fork_at)
+        rest.max_instructions = opt->fork_at;
+    uint64_t forked_at = run_headless(&parent->cpu, &rest);
+    if (parent->cpu.stop || forked_at >= opt->max_instructions || parent->cpu.cycles >= opt->max_cycles)
+    {
+        finish_run(&parent->cpu, opt, forked_at, 0, &result);
+        printf("{");
+        print_result(&result);
+        printf("}\n");
+        return result.status;
+    }
+
+    Snapshot* snapshot = machine_snapshot(parent);
+    if (!snapshot)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return STATUS_ERROR;
+    }
+    rest.max_instructions = opt->max_instructions - forked_at;
+
+    int status = STATUS_OK;
+    for (int i = 0; i < opt->forks; i++)
+    {
+        Machine* child = machine_fork(parent, snapshot);
+        if (!child)
+        {
+            fprintf(stderr, "Out of memory\n");
+            status = STATUS_ERROR;
+            break;
+        }
+        child->rng ^= (uint32_t)(i + 1) * 0x9E3779B9;
+        if (child->rng == 0)
+            child->rng = 1;
+
+        uint64_t instructions = forked_at + run_headless(&child->cpu, &rest);
+        finish_run(&child->cpu, opt, instructions, 0, &result);
+        printf("{\"child\":%d,", i);
+        print_result(&result);
+        printf("}\n");
+        release_cpu(&child->cpu);
+        free(child);
+    }
+    snapshot_free(snapshot);
+    return status;
+}
+
+// Lockstep batch engine, see batch_step()
+typedef struct Batch Batch;
+Batch* batch_create(void);
+void batch_clear(Batch* batch);
+void batch_load(Batch* batch, int lane, const Machine* machine, uint64_t max_instructions, uint64_t max_cycles);
+void batch_run(Batch* batch);
+void batch_result(Batch* batch, int lane, const Options* opt, RunResult* result);
+int batch_left(const Batch* batch, int lane);
+
+// A farm runs many independent headless machines across worker threads.
+// The jobs are split into units, single jobs or --batch groups. Each worker
+// starts with an equal slice of the units and takes them from the front; a
+// worker that runs dry steals the back half of another's slice, so long and
+// short units even out without a shared queue.
+typedef struct {
+    Options opt;
+    int line; // Line in the job file
+    RunResult result;
+} FarmJob;
+
+typedef struct {
+    int first; // Jobs first..first+count-1
+    int count;
+} FarmUnit;
+
+typedef struct {
+    SDL_SpinLock lock;
+    int next; // Units next..end-1 are not taken yet
+    int end;
+    char pad[64 - 3 * sizeof(int)]; // One cache line per worker
+} FarmQueue;
+
+typedef struct {
+    FarmJob* jobs;
+    FarmUnit* units;
+    FarmQueue* queues;
+    Machine** machines; // One per worker, reused for each of its jobs
+    Batch** batches; // One per worker, allocated by its first batch
+    RomImage** images; // One per worker: the last ROM it opened, or NULL
+    const Options** image_options; // The job each worker's image was opened for
+    int workers;
+} Farm;
+
+typedef struct {
+    Farm* farm;
+    int id;
+} FarmWorker;
+
+// Next unit for a worker, or -1 when no worker has any left
+int farm_take(Farm* farm, int id)
+{
+    FarmQueue* own = &farm->queues[id];
+    int job = -1;
+
+    SDL_AtomicLock(&own->lock);
+    if (own->next < own->end)
+        job = own->next++;
+    SDL_AtomicUnlock(&own->lock);
+    if (job >= 0)
+        return job;
+
+    for (int i = 1; i < farm->workers; i++)
+    {
+        FarmQueue* victim = &farm->queues[(id + i) % farm->workers];
+        int first = 0;
+        int count = 0;
+
+        SDL_AtomicLock(&victim->lock);
+        count = (victim->end - victim->next + 1) / 2;
+        if (count > 0)
+        {
+            victim->end -= count;
+            first = victim->end;
+        }
+        SDL_AtomicUnlock(&victim->lock);
+
+        if (count > 0)
+        {
+            // Keep the first stolen unit, queue the rest as our own
+            SDL_AtomicLock(&own->lock);
+            own->next = first + 1;
+            own->end = first + count;
+            SDL_AtomicUnlock(&own->lock);
+            return first;
+        }
+    }
+    return -1;
+}
+
+// The ROM image for a job. A worker keeps its last one while its jobs load
+// the same file the same way, so a ROM run many times is read once per
+// worker and its pages are shared rather than copied. NULL for assembly
+// sources, which are assembled per job, and for ROMs that failed to open.
+const RomImage* farm_image(Farm* farm, int id, const Options* opt)
+{
+    const Options* last = farm->image_options[id];
+
+    if (opt->format == ROM_ASM)
+        return NULL;
+    if (last && strcmp(last->rom, opt->rom) == 0 && last->format == opt->format && last->load_address == opt->load_address)
+        return farm->images[id];
+    rom_close(farm->images[id]);
+    farm->images[id] = rom_open(opt->rom, opt->format, opt->load_address);
+    farm->image_options[id] = opt;
+    return farm->images[id];
+}
+
+void farm_run_job(Machine* machine, FarmJob* job, const RomImage* image)
+{
+    if ((job->opt.format != ROM_ASM && !image) || start_machine(machine, &job->opt, image) < 0)
+    {
+        memset(&job->result, 0, sizeof(job->result));
+        job->result.reason = "error";
+        job->result.status = STATUS_ERROR;
+    }
+    else
+    {
+        uint64_t instructions = run_headless(&machine->cpu, &job->opt);
+        finish_run(&machine->cpu, &job->opt, instructions, 0, &job->result);
+    }
+    release_cpu(&machine->cpu);
+}
+
+// Run a unit's jobs in lockstep, one lane each
+void farm_run_batch(Machine* machine, Batch* batch, FarmJob* jobs, int count, const RomImage* image)
+{
+    int loaded[BATCH_LANES];
+
+    batch_clear(batch);
+    for (int i = 0; i < count; i++)
+    {
+        loaded[i] = (jobs[i].opt.format == ROM_ASM || image) && start_machine(machine, &jobs[i].opt, image) >= 0;
+        if (loaded[i])
+            batch_load(batch, i, machine, jobs[i].opt.max_instructions, jobs[i].opt.max_cycles);
+        release_cpu(&machine->cpu);
+        if (!loaded[i])
+        {
+            memset(&jobs[i].result, 0, sizeof(jobs[i].result));
+            jobs[i].result.reason = "error";
+            jobs[i].result.status = STATUS_ERROR;
+        }
+    }
+    batch_run(batch);
+    for (int i = 0; i < count; i++)
+    {
+        if (loaded[i] && batch_left(batch, i))
+            farm_run_job(machine, &jobs[i], image);
+        else if (loaded[i])
+            batch_result(batch, i, &jobs[i].opt, &jobs[i].result);
+    }
+}
+
+int farm_worker(void* data)
+{
+    FarmWorker* worker = data;
+    Farm* farm = worker->farm;
+    Machine* machine = farm->machines[worker->id];
+    int unit;
+
+    while ((unit = farm_take(farm, worker->id)) >= 0)
+    {
+        FarmJob* jobs = &farm->jobs[farm->units[unit].first];
+        int count = farm->units[unit].count;
+
+        if (count > 1 && !farm->batches[worker->id])
+            farm->batches[worker->id] = batch_create();
+        if (count > 1 && farm->batches[worker->id])
+            farm_run_batch(machine, farm->batches[worker->id], jobs, count, farm_image(farm, worker->id, &jobs[0].opt));
         else
-            cpu->P &= ~FLAG_C;
-        set_zero_and_negative_flags(cpu, cpu->A);
+        {
+            for (int i = 0; i < count; i++)
+                farm_run_job(machine, &jobs[i], farm_image(farm, worker->id, &jobs[i].opt));
+        }
+    }
+    return 0;
+}
 
-        break;
-    case 0x2C: // BIT abs
-        address = get_address(cpu, AM_ABS);
-        value = cpu->mem[address];
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z);
-        if (value & FLAG_N)
-            cpu->P |= FLAG_N;
-        if (value & FLAG_V)
-            cpu->P |= FLAG_V;
-        if (!(cpu->A & value))
-            cpu->P |= FLAG_Z;
-        break;
-    case 0x2D: // AND abs
-        address = get_address(cpu, AM_ABS);
-        cpu->A &= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x2E: // ROL abs
-        address = get_address(cpu, AM_ABS);
-        value = cpu->mem[address];
-        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
-        cpu->P &= ~FLAG_C;
-        if (value & 0x80)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = (value << 1) | temp_carry;
-        set_zero_and_negative_flags(cpu, cpu->mem[address]);
-        break;
-    case 0x2F: // RLA abs
-        address = get_address(cpu, AM_ABS);
-        value = cpu->mem[address];
-        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
-        cpu->P &= ~FLAG_C;
-        if (value & 0x80)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = (value << 1) | temp_carry;
-        cpu->A &= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
+// Jobs that may share a batch: they load the same program the same way
+int farm_batchable(const Options* a, const Options* b)
+{
+    return strcmp(a->rom, b->rom) == 0 && a->format == b->format && a->load_address == b->load_address &&
+        a->start_pc == b->start_pc;
+}
 
-        // --- 3x ---
-    case 0x30: // BMI rel
-        address = get_address(cpu, AM_REL);
-        if (cpu->P & FLAG_N)
-            cpu->PC = address;
-        break;
-    case 0x31: // AND izy
-        address = get_address(cpu, AM_IZY);
-        cpu->A &= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x33: // RLA izy
-        address = get_address(cpu, AM_IZY);
-        value = cpu->mem[address];
-        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
-        cpu->P &= ~FLAG_C;
-        if (value & 0x80)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = (value << 1) | temp_carry;
-        cpu->A &= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x34: // NOP zpx
-        get_address(cpu, AM_ZPX);
-        break;
-    case 0x35: // AND zpx
-        address = get_address(cpu, AM_ZPX);
-        cpu->A &= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x36: // ROL zpx
-        address = get_address(cpu, AM_ZPX);
-        value = cpu->mem[address];
-        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
-        cpu->P &= ~FLAG_C;
-        if (value & 0x80)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = (value << 1) | temp_carry;
-        set_zero_and_negative_flags(cpu, cpu->mem[address]);
-        break;
-    case 0x37: // RLA zpx
-        address = get_address(cpu, AM_ZPX);
-        value = cpu->mem[address];
-        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
-        cpu->P &= ~FLAG_C;
-        if (value & 0x80)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = (value << 1) | temp_carry;
-        cpu->A &= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x38: // SEC
-        cpu->P |= FLAG_C;
-        break;
-    case 0x39: // AND aby
-        address = get_address(cpu, AM_ABY);
-        cpu->A &= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x3A: // NOP
-        break;
-    case 0x3B: // RLA aby
-        address = get_address(cpu, AM_ABY);
-        value = cpu->mem[address];
-        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
-        cpu->P &= ~FLAG_C;
-        if (value & 0x80)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = (value << 1) | temp_carry;
-        cpu->A &= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x3C: // NOP abx
-        get_address(cpu, AM_ABX);
-        break;
-    case 0x3D: // AND abx
-        address = get_address(cpu, AM_ABX);
-        cpu->A &= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x3E: // ROL abx
-        address = get_address(cpu, AM_ABX);
-        value = cpu->mem[address];
-        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
-        cpu->P &= ~FLAG_C;
-        if (value & 0x80)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = (value << 1) | temp_carry;
-        set_zero_and_negative_flags(cpu, cpu->mem[address]);
-        break;
-    case 0x3F: // RLA abx
-        address = get_address(cpu, AM_ABX);
-        value = cpu->mem[address];
-        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
-        cpu->P &= ~FLAG_C;
-        if (value & 0x80)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = (value << 1) | temp_carry;
-        cpu->A &= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-        // --- 4x ---
-    case 0x40: // RTI
-        cpu->P = pull_byte(cpu);
-        cpu->P |= 0x20; // Ensure B flag is always 1
-        cpu->PC = pull_byte(cpu);
-        cpu->PC |= pull_byte(cpu) << 8;
-        break;
-    case 0x41: // EOR izx
-        address = get_address(cpu, AM_IZX);
-        cpu->A ^= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x43: // SRE izx
-        address = get_address(cpu, AM_IZX);
-        value = cpu->mem[address];
-        cpu->P &= ~FLAG_C;
-        if (value & 0x01)
+// Read the job file: one job per line, in the same syntax as the command
+// line. Blank lines and lines starting with # are skipped. Returns the
+// number of jobs, or -1 after printing what was wrong.
+int read_farm_jobs(const char* filename, FarmJob** jobs)
+{
+    FILE* fp = fopen(filename, "r");
+    char line[4096];
+    int count = 0;
+    int capacity = 0;
+    int number = 0;
+
+    *jobs = NULL;
+    if (!fp)
+    {
+        fprintf(stderr, "Error opening job file '%s': %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp))
+    {
+        char* argv[64];
+        int argc = 1;
+
+        number++;
+        // The options point into the line, so it is kept for the whole run
+        char* text = malloc(strlen(line) + 1);
+        if (!text)
+            break;
+        strcpy(text, line);
+        argv[0] = (char*)filename;
+        for (char* token = strtok(text, " \t\r\n"); token && argc < 64; token = strtok(NULL, " \t\r\n"))
+            argv[argc++] = token;
+        if (argc == 1 || argv[1][0] == '#')
+        {
+            free(text);
+            continue;
+        }
+
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            FarmJob* grown = realloc(*jobs, capacity * sizeof(FarmJob));
+            if (!grown)
+            {
+                free(text);
+                break;
+            }
+            *jobs = grown;
+        }
+        FarmJob* job = &(*jobs)[count];
+        if (!parse_args(argc, argv, &job->opt) || job->opt.farm || job->opt.forks || job->opt.rewind || job->opt.trace ||
+            job->opt.decode_trace || job->opt.profile || job->opt.flamegraph || job->opt.bench ||
+            job->opt.listing || job->opt.write_symbols || argc == 64)
+        {
+            fprintf(stderr, "%s:%d: invalid job\n", filename, number);
+            free(text);
+            fclose(fp);
+            return -1;
+        }
+        job->opt.headless = 1;
+        job->line = number;
+        count++;
+    }
+
+    int failed = ferror(fp) || !feof(fp);
+    fclose(fp);
+    if (failed)
+    {
+        fprintf(stderr, "Error reading job file '%s'\n", filename);
+        return -1;
+    }
+    return count;
+}
+
+// --farm: run every job and print their summaries in file order
+int run_farm(const Options* opt)
+{
+    Farm farm;
+    int count = read_farm_jobs(opt->farm, &farm.jobs);
+    if (count < 0)
+        return STATUS_ERROR;
+
+    // Units are single jobs, or runs of batchable jobs with --batch
+    int units = 0;
+    farm.units = calloc(count ? count : 1, sizeof(FarmUnit));
+    if (!farm.units)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return STATUS_ERROR;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        FarmUnit* last = units ? &farm.units[units - 1] : NULL;
+        if (last && last->count < opt->batch && farm_batchable(&farm.jobs[last->first].opt, &farm.jobs[i].opt))
+            last->count++;
+        else
+        {
+            farm.units[units].first = i;
+            farm.units[units].count = 1;
+            units++;
+        }
+    }
+
+    farm.workers = opt->threads ? opt->threads : SDL_GetCPUCount();
+    if (farm.workers > units)
+        farm.workers = units;
+    if (farm.workers < 1)
+        farm.workers = 1;
+
+    farm.queues = calloc(farm.workers, sizeof(FarmQueue));
+    farm.machines = calloc(farm.workers, sizeof(Machine*));
+    farm.batches = calloc(farm.workers, sizeof(Batch*));
+    farm.images = calloc(farm.workers, sizeof(RomImage*));
+    farm.image_options = calloc(farm.workers, sizeof(Options*));
+    FarmWorker* workers = calloc(farm.workers, sizeof(FarmWorker));
+    SDL_Thread** threads = calloc(farm.workers, sizeof(SDL_Thread*));
+    if (!farm.queues || !farm.machines || !farm.batches || !farm.images || !farm.image_options || !workers || !threads)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return STATUS_ERROR;
+    }
+    for (int i = 0; i < farm.workers; i++)
+    {
+        farm.machines[i] = calloc(1, sizeof(Machine));
+        if (!farm.machines[i])
+        {
+            fprintf(stderr, "Out of memory\n");
+            return STATUS_ERROR;
+        }
+        farm.queues[i].next = (int)((int64_t)units * i / farm.workers);
+        farm.queues[i].end = (int)((int64_t)units * (i + 1) / farm.workers);
+        workers[i].farm = &farm;
+        workers[i].id = i;
+    }
+
+    // Worker 0 is this thread. A worker that cannot start leaves its
+    // slice to be stolen by the others.
+    for (int i = 1; i < farm.workers; i++)
+    {
+        threads[i] = SDL_CreateThread(farm_worker, "farm", &workers[i]);
+        if (!threads[i])
+            fprintf(stderr, "Could not start a farm thread: %s\n", SDL_GetError());
+    }
+    farm_worker(&workers[0]);
+    for (int i = 1; i < farm.workers; i++)
+    {
+        if (threads[i])
+            SDL_WaitThread(threads[i], NULL);
+    }
+
+    int status = STATUS_OK;
+    for (int i = 0; i < count; i++)
+    {
+        printf("{\"line\":%d,", farm.jobs[i].line);
+        print_result(&farm.jobs[i].result);
+        printf("}\n");
+        if (farm.jobs[i].result.status == STATUS_ERROR)
+            status = STATUS_ERROR;
+    }
+    return status;
+}
+
+// Benchmark kernels for --bench. Each loops forever from $8000, keeping its
+// data in $5000-$7FFF clear of the screen, except fill, which draws to it.
+
+// Copy 16 pages from $5000 to $6000 through (zp),Y pointers
+static const uint8_t bench_copy[] = {
+    0xA9, 0x00,         // start:  LDA #$00
+    0x85, 0x10,         //         STA $10
+    0x85, 0x12,         //         STA $12
+    0xA9, 0x50,         //         LDA #$50
+    0x85, 0x11,         //         STA $11
+    0xA9, 0x60,         //         LDA #$60
+    0x85, 0x13,         //         STA $13
+    0xA2, 0x10,         //         LDX #16
+    0xA0, 0x00,         //         LDY #0
+    0xB1, 0x10,         // loop:   LDA ($10),Y
+    0x91, 0x12,         //         STA ($12),Y
+    0xC8,               //         INY
+    0xD0, 0xF9,         //         BNE loop
+    0xE6, 0x11,         //         INC $11
+    0xE6, 0x13,         //         INC $13
+    0xCA,               //         DEX
+    0xD0, 0xF2,         //         BNE loop
+    0x4C, 0x00, 0x80,   //         JMP start
+};
+
+// Fill 256 bytes at $5000 from the random number generator, then bubble sort them
+static const uint8_t bench_sort[] = {
+    0xA2, 0x00,         // start:  LDX #0
+    0xA5, 0xFE,         // fill:   LDA $FE
+    0x9D, 0x00, 0x50,   //         STA $5000,X
+    0xE8,               //         INX
+    0xD0, 0xF8,         //         BNE fill
+    0xA0, 0x00,         // pass:   LDY #0
+    0xA2, 0x00,         //         LDX #0
+    0xBD, 0x00, 0x50,   // inner:  LDA $5000,X
+    0xDD, 0x01, 0x50,   //         CMP $5001,X
+    0x90, 0x11,         //         BCC next
+    0xF0, 0x0F,         //         BEQ next
+    0x85, 0x20,         //         STA $20
+    0xBD, 0x01, 0x50,   //         LDA $5001,X
+    0x9D, 0x00, 0x50,   //         STA $5000,X
+    0xA5, 0x20,         //         LDA $20
+    0x9D, 0x01, 0x50,   //         STA $5001,X
+    0xA0, 0x01,         //         LDY #1
+    0xE8,               // next:   INX
+    0xE0, 0xFF,         //         CPX #$FF
+    0xD0, 0xE2,         //         BNE inner
+    0xC0, 0x00,         //         CPY #0
+    0xD0, 0xDA,         //         BNE pass
+    0x4C, 0x00, 0x80,   //         JMP start
+};
+
+// CRC-16/CCITT of the bytes 0-255, a bit at a time
+static const uint8_t bench_crc[] = {
+    0xA9, 0xFF,         // start:  LDA #$FF
+    0x85, 0x20,         //         STA $20
+    0x85, 0x21,         //         STA $21
+    0xA2, 0x00,         //         LDX #0
+    0x8A,               // byte:   TXA
+    0x45, 0x21,         //         EOR $21
+    0x85, 0x21,         //         STA $21
+    0xA0, 0x08,         //         LDY #8
+    0x06, 0x20,         // bit:    ASL $20
+    0x26, 0x21,         //         ROL $21
+    0x90, 0x0C,         //         BCC noxor
+    0xA5, 0x21,         //         LDA $21
+    0x49, 0x10,         //         EOR #$10
+    0x85, 0x21,         //         STA $21
+    0xA5, 0x20,         //         LDA $20
+    0x49, 0x21,         //         EOR #$21
+    0x85, 0x20,         //         STA $20
+    0x88,               // noxor:  DEY
+    0xD0, 0xEB,         //         BNE bit
+    0xE8,               //         INX
+    0xD0, 0xE1,         //         BNE byte
+    0x4C, 0x00, 0x80,   //         JMP start
+};
+
+// Sieve of Eratosthenes over 8 KB of flags at $5000, crossing out multiples of 2-255
+static const uint8_t bench_sieve[] = {
+    0xA9, 0x00,         // start:  LDA #$00
+    0x85, 0x10,         //         STA $10
+    0xA9, 0x50,         //         LDA #$50
+    0x85, 0x11,         //         STA $11
+    0xA2, 0x20,         //         LDX #$20
+    0xA0, 0x00,         //         LDY #0
+    0x98,               //         TYA
+    0x91, 0x10,         // clear:  STA ($10),Y
+    0xC8,               //         INY
+    0xD0, 0xFB,         //         BNE clear
+    0xE6, 0x11,         //         INC $11
+    0xCA,               //         DEX
+    0xD0, 0xF6,         //         BNE clear
+    0xA9, 0x02,         //         LDA #2
+    0x85, 0x12,         //         STA $12
+    0xA5, 0x12,         // prime:  LDA $12
+    0x85, 0x10,         //         STA $10
+    0xA9, 0x50,         //         LDA #$50
+    0x85, 0x11,         //         STA $11
+    0xB1, 0x10,         //         LDA ($10),Y
+    0xD0, 0x17,         //         BNE next
+    0xA5, 0x10,         // mark:   LDA $10
+    0x18,               //         CLC
+    0x65, 0x12,         //         ADC $12
+    0x85, 0x10,         //         STA $10
+    0xA5, 0x11,         //         LDA $11
+    0x69, 0x00,         //         ADC #0
+    0x85, 0x11,         //         STA $11
+    0xC9, 0x70,         //         CMP #$70
+    0xB0, 0x06,         //         BCS next
+    0xA9, 0x01,         //         LDA #1
+    0x91, 0x10,         //         STA ($10),Y
+    0xD0, 0xE9,         //         BNE mark
+    0xE6, 0x12,         // next:   INC $12
+    0xD0, 0xD9,         //         BNE prime
+    0x4C, 0x00, 0x80,   //         JMP start
+};
+
+// Nested counting loops with data-dependent branches
+static const uint8_t bench_branch[] = {
+    0xA2, 0x00,         // start:  LDX #0
+    0xA0, 0x00,         // outer:  LDY #0
+    0xC0, 0x80,         // inner:  CPY #$80
+    0x90, 0x02,         //         BCC low
+    0x24, 0x20,         //         BIT $20
+    0x98,               // low:    TYA
+    0x29, 0x03,         //         AND #$03
+    0xD0, 0x01,         //         BNE skip
+    0x18,               //         CLC
+    0x88,               // skip:   DEY
+    0xD0, 0xF1,         //         BNE inner
+    0xCA,               //         DEX
+    0xD0, 0xEC,         //         BNE outer
+    0x4C, 0x00, 0x80,   //         JMP start
+};
+
+// Fill the screen with a random colour, like exampleprogram.asm
+static const uint8_t bench_fill[] = {
+    0xA9, 0x00,         // start:  LDA #$00
+    0x85, 0x10,         //         STA $10
+    0xA9, 0x02,         //         LDA #$02
+    0x85, 0x11,         //         STA $11
+    0xA5, 0xFE,         //         LDA $FE
+    0xA2, 0x40,         //         LDX #64
+    0xA0, 0x00,         //         LDY #0
+    0x91, 0x10,         // loop:   STA ($10),Y
+    0xC8,               //         INY
+    0xD0, 0xFB,         //         BNE loop
+    0xE6, 0x11,         //         INC $11
+    0xCA,               //         DEX
+    0xD0, 0xF6,         //         BNE loop
+    0x4C, 0x00, 0x80,   //         JMP start
+};
+
+// Read-modify-write and load/store illegal opcodes over zero page and $5000-$53FF
+static const uint8_t bench_illegal[] = {
+    0xA2, 0x00,         // start:  LDX #0
+    0x17, 0x20,         // loop:   SLO $20,X
+    0x3F, 0x00, 0x50,   //         RLA $5000,X
+    0x47, 0x40,         //         SRE $40
+    0x7F, 0x00, 0x51,   //         RRA $5100,X
+    0xD7, 0x60,         //         DCP $60,X
+    0xFF, 0x00, 0x52,   //         ISC $5200,X
+    0xBF, 0x00, 0x53,   //         LAX $5300,Y
+    0x87, 0x80,         //         SAX $80
+    0xE8,               //         INX
+    0xD0, 0xE9,         //         BNE loop
+    0x4C, 0x00, 0x80,   //         JMP start
+};
+
+// Calls to a subroutine that saves and restores registers on the stack
+static const uint8_t bench_calls[] = {
+    0xA2, 0x00,         // start:  LDX #0
+    0x20, 0x0B, 0x80,   // loop:   JSR sub
+    0xCA,               //         DEX
+    0xD0, 0xFA,         //         BNE loop
+    0x4C, 0x00, 0x80,   //         JMP start
+    0x48,               // sub:    PHA
+    0x8A,               //         TXA
+    0x48,               //         PHA
+    0x68,               //         PLA
+    0xAA,               //         TAX
+    0x68,               //         PLA
+    0x60,               //         RTS
+};
+
+// 8x8-bit shift-and-add multiplication
+static const uint8_t bench_multiply[] = {
+    0xE6, 0x20,         // start:  INC $20
+    0xA5, 0x20,         //         LDA $20
+    0x49, 0x5A,         //         EOR #$5A
+    0x85, 0x21,         //         STA $21
+    0xA9, 0x00,         //         LDA #0
+    0xA2, 0x08,         //         LDX #8
+    0x46, 0x21,         //         LSR $21
+    0x90, 0x03,         // loop:   BCC noadd
+    0x18,               //         CLC
+    0x65, 0x20,         //         ADC $20
+    0x6A,               // noadd:  ROR A
+    0x66, 0x22,         //         ROR $22
+    0x46, 0x21,         //         LSR $21
+    0xCA,               //         DEX
+    0xD0, 0xF3,         //         BNE loop
+    0x85, 0x23,         //         STA $23
+    0x4C, 0x00, 0x80,   //         JMP start
+};
+
+// Decimal mode: adds up 8-digit BCD numbers, as games keep their scores
+static const uint8_t bench_decimal[] = {
+    0xF8,               // start:  SED
+    0x18,               //         CLC
+    0xA2, 0x00,         //         LDX #0
+    0xB5, 0x30,         // loop:   LDA $30,X
+    0x75, 0x40,         //         ADC $40,X
+    0x95, 0x30,         //         STA $30,X
+    0xE8,               //         INX
+    0xE0, 0x04,         //         CPX #4
+    0xD0, 0xF5,         //         BNE loop
+    0xA5, 0x30,         //         LDA $30
+    0x38,               //         SEC
+    0xE9, 0x01,         //         SBC #1
+    0x85, 0x40,         //         STA $40
+    0xD8,               //         CLD
+    0x4C, 0x00, 0x80,   //         JMP start
+};
+
+static const struct {
+    const char* name;
+    const uint8_t* code;
+    size_t size;
+} bench_kernels[] = {
+    { "copy", bench_copy, sizeof(bench_copy) },
+    { "sort", bench_sort, sizeof(bench_sort) },
+    { "crc", bench_crc, sizeof(bench_crc) },
+    { "sieve", bench_sieve, sizeof(bench_sieve) },
+    { "branch", bench_branch, sizeof(bench_branch) },
+    { "fill", bench_fill, sizeof(bench_fill) },
+    { "illegal", bench_illegal, sizeof(bench_illegal) },
+    { "calls", bench_calls, sizeof(bench_calls) },
+    { "multiply", bench_multiply, sizeof(bench_multiply) },
+    { "decimal", bench_decimal, sizeof(bench_decimal) },
+};
+
+#define BENCH_INSTRUCTIONS 20000000 // Per timed run, unless --max-instructions says otherwise
+#define BENCH_RUNS 3 // Timed runs per kernel and engine; the fastest counts
+#define BENCH_MIX_INSTRUCTIONS 1000000 // Profiled to find a kernel's opcode mix
+
+// Opcode families --bench reports throughput for
+enum { FAMILY_LOAD_STORE, FAMILY_ALU, FAMILY_SHIFT_RMW, FAMILY_BRANCH, FAMILY_JUMP_STACK, FAMILY_TRANSFER_FLAGS, FAMILY_ILLEGAL, FAMILY_COUNT };
+
+static const char* const family_names[FAMILY_COUNT] = {
+    "load_store", "alu", "shift_rmw", "branch", "jump_stack", "transfer_flags", "illegal",
+};
+
+// The family of an opcode, going by its name. Unofficial opcodes are all
+// illegal, including the duplicates of NOP and SBC.
+static int opcode_family(uint8_t opcode)
+{
+    static const char* const members[FAMILY_ILLEGAL] = {
+        "LDA LDX LDY STA STX STY",
+        "ADC SBC AND ORA EOR CMP CPX CPY BIT INX INY DEX DEY",
+        "ASL LSR ROL ROR INC DEC",
+        "BPL BMI BVC BVS BCC BCS BNE BEQ",
+        "JMP JSR RTS RTI BRK PHA PLA PHP PLP",
+        "TAX TAY TXA TYA TSX TXS CLC SEC CLI SEI CLV CLD SED NOP",
+    };
+
+    if ((strcmp(opcode_names[opcode], "NOP") == 0 && opcode != 0xEA) || opcode == 0xEB)
+        return FAMILY_ILLEGAL;
+    for (int family = 0; family < FAMILY_ILLEGAL; family++)
+        if (strstr(members[family], opcode_names[opcode]))
+            return family;
+    return FAMILY_ILLEGAL;
+}
+
+// Reset the machine and load a kernel to run on the given engine
+static void bench_load(Machine* machine, int kernel, int engine)
+{
+    CPU* cpu = &machine->cpu;
+
+    release_cpu(cpu);
+    machine_reset(machine, 1);
+    for (size_t i = 0; i < bench_kernels[kernel].size; i++)
+        mem_write(cpu, (uint16_t)(0x8000 + i), bench_kernels[kernel].code[i]);
+    cpu->PC = 0x8000;
+    cpu->engine = (uint8_t)engine;
+}
+
+// --bench: time every kernel on every engine and print a JSON line for
+// each, then one per engine with its overall and per-family throughput.
+// A family's throughput counts each kernel's time in proportion to the
+// share of its instructions in that family. Every engine must leave each
+// kernel in the state the interpreter does; exits 1 if one doesn't.
+int run_bench(const Options* opt)
+{
+    static const struct {
+        const char* name;
+        int engine;
+    } engines[] = {
+        { "interp", ENGINE_INTERPRETER },
+        { "predecode", ENGINE_PREDECODE },
+#if JIT_X64
+        { "jit", ENGINE_JIT },
+#endif
+    };
+    enum { ENGINE_COUNT = sizeof(engines) / sizeof(engines[0]) };
+    double family_instructions[ENGINE_COUNT][FAMILY_COUNT] = { { 0 } };
+    double family_seconds[ENGINE_COUNT][FAMILY_COUNT] = { { 0 } };
+    uint64_t total_instructions[ENGINE_COUNT] = { 0 };
+    double total_seconds[ENGINE_COUNT] = { 0 };
+    int families[256];
+    int status = STATUS_OK;
+
+    Options limits = *opt;
+    if (limits.max_instructions == UINT64_MAX)
+        limits.max_instructions = BENCH_INSTRUCTIONS;
+    Options mix_limits = limits;
+    if (mix_limits.max_instructions > BENCH_MIX_INSTRUCTIONS)
+        mix_limits.max_instructions = BENCH_MIX_INSTRUCTIONS;
+
+    Machine* machine = calloc(1, sizeof(Machine));
+    if (!machine)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return STATUS_ERROR;
+    }
+    CPU* cpu = &machine->cpu;
+    for (int opcode = 0; opcode < 256; opcode++)
+        families[opcode] = opcode_family((uint8_t)opcode);
+
+    printf("{\"build\":{\"dispatch\":\"%s\",\"jit\":%s,\"trace\":%s,\"instructions\":%llu,\"runs\":%d}}\n",
+        THREADED_DISPATCH ? "threaded" : "switch", JIT_X64 ? "true" : "false", TRACE ? "true" : "false",
+        (unsigned long long)limits.max_instructions, BENCH_RUNS);
+
+    for (int kernel = 0; kernel < (int)(sizeof(bench_kernels) / sizeof(bench_kernels[0])); kernel++)
+    {
+        double mix[FAMILY_COUNT] = { 0 };
+        RunResult reference = { 0 };
+
+        // The opcode mix, from a short exact profile
+        bench_load(machine, kernel, ENGINE_INTERPRETER);
+        cpu->profile = profile_create(cpu, 0);
+        if (!cpu->profile)
+        {
+            fprintf(stderr, "Out of memory\n");
+            status = STATUS_ERROR;
+            break;
+        }
+        run_headless(cpu, &mix_limits);
+        for (int opcode = 0; opcode < 256; opcode++)
+            mix[families[opcode]] += (double)cpu->profile->opcode_count[opcode] / cpu->profile->instructions;
+        profile_free(cpu->profile);
+        cpu->profile = NULL;
+
+        for (int e = 0; e < ENGINE_COUNT; e++)
+        {
+            RunResult result;
+            double best = 0;
+
+            for (int run = 0; run < BENCH_RUNS; run++)
+            {
+                bench_load(machine, kernel, engines[e].engine);
+                uint64_t start = SDL_GetPerformanceCounter();
+                uint64_t instructions = run_headless(cpu, &limits);
+                double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+                if (run == 0 || seconds < best)
+                    best = seconds;
+                finish_run(cpu, &limits, instructions, 0, &result);
+            }
+
+            if (e == 0)
+                reference = result;
+            else if (result.pc != reference.pc || result.a != reference.a || result.x != reference.x || result.y != reference.y ||
+                     result.sp != reference.sp || result.p != reference.p || result.instructions != reference.instructions ||
+                     result.cycles != reference.cycles)
+            {
+                fprintf(stderr, "%s: %s does not end where %s does\n", bench_kernels[kernel].name, engines[e].name, engines[0].name);
+                status = STATUS_ERROR;
+            }
+
+            printf("{\"kernel\":\"%s\",\"engine\":\"%s\",\"instructions\":%llu,\"cycles\":%llu,\"seconds\":%.6f,\"mips\":%.2f,\"mhz\":%.2f,\"mix\":{",
+                bench_kernels[kernel].name, engines[e].name, (unsigned long long)result.instructions, (unsigned long long)result.cycles,
+                best, result.instructions / best / 1e6, result.cycles / best / 1e6);
+            for (int f = 0; f < FAMILY_COUNT; f++)
+                printf("%s\"%s\":%.3f", f ? "," : "", family_names[f], mix[f]);
+            printf("}}\n");
+
+            total_instructions[e] += result.instructions;
+            total_seconds[e] += best;
+            for (int f = 0; f < FAMILY_COUNT; f++)
+            {
+                family_instructions[e][f] += mix[f] * result.instructions;
+                family_seconds[e][f] += mix[f] * best;
+            }
+        }
+    }
+
+    for (int e = 0; e < ENGINE_COUNT && status == STATUS_OK; e++)
+    {
+        printf("{\"engine\":\"%s\",\"mips\":%.2f,\"families\":{", engines[e].name, total_instructions[e] / total_seconds[e] / 1e6);
+        for (int f = 0; f < FAMILY_COUNT; f++)
+            printf("%s\"%s\":%.2f", f ? "," : "", family_names[f],
+                family_seconds[e][f] > 0 ? family_instructions[e][f] / family_seconds[e][f] / 1e6 : 0.0);
+        printf("}}\n");
+    }
+
+    release_cpu(cpu);
+    free(machine);
+    return status;
+}
+
+// The window's emulation thread and what it shares with the window
+typedef struct {
+    Machine* machine;
+    const Options* opt;
+    FrameBuffer frames;
+    InputQueue input;
+    SDL_atomic_t done; // Set by the emulation thread once it stops
+    SDL_atomic_t speed; // Emulated kHz over the last second, 0 until measured
+    uint64_t instructions; // Executed, once done
+    int quit; // The window was closed, once done
+} Emulation;
+
+// Wait until the next of *frames frames run since the host time *start is
+// due. If emulation fell more than a few frames behind, count again from
+// now rather than racing to catch up.
+void pace_frame(uint64_t* start, uint64_t* frames)
+{
+    uint64_t frequency = SDL_GetPerformanceFrequency();
+    uint64_t due = *start + ++*frames * frequency / FRAME_RATE;
+    uint64_t now = SDL_GetPerformanceCounter();
+
+    if (now > due + 4 * frequency / FRAME_RATE)
+    {
+        *start = now;
+        *frames = 0;
+        return;
+    }
+    // Sleep through all but the last millisecond, which SDL_Delay may
+    // overshoot, then spin
+    while (now < due)
+    {
+        uint64_t ms = (due - now) * 1000 / frequency;
+        if (ms > 1)
+            SDL_Delay((uint32_t)(ms - 1));
+        now = SDL_GetPerformanceCounter();
+    }
+}
+
+// Emulation thread of the window: run a frame's worth of cycles, apply the
+// input that arrived meanwhile and publish the frame, paced to the --clock
+// rate. Holding Tab runs unpaced, holding Backspace steps back through the
+// rewind checkpoints instead; F9 pauses and resumes a profile. Frames that
+// end in an idle loop waiting for a key are always paced.
+int emulate(void* data)
+{
+    Emulation* emulation = data;
+    Machine* machine = emulation->machine;
+    const Options* opt = emulation->opt;
+    CPU* cpu = &machine->cpu;
+    Profiler* paused_profile = NULL;
+    uint64_t instructions = 0;
+    uint64_t overshoot = 0;
+    uint64_t frames = 0;
+    int rewinding = 0;
+    int turbo = 0;
+    int quit = 0;
+    Rewind* rewind = rewind_create(REWIND_BYTES);
+    uint64_t paced_from = SDL_GetPerformanceCounter();
+    uint64_t paced_frames = 0;
+    uint64_t measured_from = paced_from;
+    uint64_t measured_cycles = cpu->cycles;
+
+    if (rewind)
+        rewind_record(rewind, machine, instructions);
+    frame_publish(&emulation->frames, cpu);
+    while (!cpu->stop && instructions < opt->max_instructions && cpu->cycles < opt->max_cycles)
+    {
+        InputEvent event;
+        while (input_pop(&emulation->input, &event))
+        {
+            if (event.type == INPUT_KEY)
+                key_push(&machine->keys, event.key);
+            else if (event.type == INPUT_REWIND)
+                rewinding = event.key ? (rewinding ? rewinding : 1) : 0;
+            else if (event.type == INPUT_TURBO)
+                turbo = event.key;
+            else if (event.type == INPUT_PROFILE)
+            {
+                Profiler* profile = cpu->profile;
+                cpu->profile = paused_profile;
+                paused_profile = profile;
+                if (cpu->profile)
+                    profile_resume(cpu->profile, cpu);
+            }
+            else if (event.type == INPUT_QUIT)
+                quit = 1;
+        }
+        if (quit)
+            break;
+
+        if (rewinding && rewind)
+        {
+            // Checkpoint where rewinding starts, so the first step
+            // lands on the newest checkpoint rather than the one before
+            if (rewinding == 1)
+                rewind_record(rewind, machine, instructions);
+            rewinding = 2;
+            rewind_step(rewind, machine, &instructions);
+            overshoot = 0;
+            frame_publish(&emulation->frames, cpu);
+            SDL_Delay(1000 / FRAME_RATE);
+            paced_from = measured_from = SDL_GetPerformanceCounter();
+            paced_frames = 0;
+            measured_cycles = cpu->cycles;
+            continue;
+        }
+
+        instructions += run_frame(cpu, opt, instructions, frames, &overshoot);
+        frame_publish(&emulation->frames, cpu);
+        if (rewind && ++frames % REWIND_FRAMES == 0)
+            rewind_record(rewind, machine, instructions);
+
+        // A program idling until a key is typed has nothing to run ahead
+        // for, so it is paced even when unlimited or fast-forwarding
+        if ((opt->clock && !turbo) || (cpu->idle && !(cpu->idle & IDLE_EVENT)))
+            pace_frame(&paced_from, &paced_frames);
+        else
+        {
+            paced_from = SDL_GetPerformanceCounter();
+            paced_frames = 0;
+        }
+
+        // Report the speed reached once a second
+        uint64_t now = SDL_GetPerformanceCounter();
+        if (now - measured_from >= SDL_GetPerformanceFrequency())
+        {
+            double seconds = (double)(now - measured_from) / SDL_GetPerformanceFrequency();
+            SDL_AtomicSet(&emulation->speed, (int)((cpu->cycles - measured_cycles) / seconds / 1000 + 0.5));
+            measured_from = now;
+            measured_cycles = cpu->cycles;
+        }
+    }
+
+    if (rewind)
+        rewind_free(rewind);
+    emulation->instructions = instructions;
+    emulation->quit = quit;
+    SDL_AtomicSet(&emulation->done, 1);
+    return 0;
+}
+
+// Run the machine in the window. Emulation runs on its own thread, so a
+// slow present never holds it up; this thread forwards input to it and
+// presents the newest frame. Returns the number of instructions executed;
+// sets *quit if the window was closed.
+uint64_t run_window(Machine* machine, const Options* opt, int* quit)
+{
+    Emulation* emulation = calloc(1, sizeof(Emulation));
+    if (!emulation)
+    {
+        fprintf(stderr, "Out of memory\n");
+        *quit = 1;
+        return 0;
+    }
+    emulation->machine = machine;
+    emulation->opt = opt;
+    frame_init(&emulation->frames);
+    uint64_t started = SDL_GetPerformanceCounter();
+    uint64_t start_cycles = machine->cpu.cycles;
+
+    SDL_Thread* thread = SDL_CreateThread(emulate, "emulation", emulation);
+    if (!thread)
+    {
+        fprintf(stderr, "Could not start the emulation thread: %s\n", SDL_GetError());
+        emulate(emulation);
+    }
+
+    const uint8_t* shown = NULL;
+    int closing = 0;
+    int shown_speed = 0;
+    while (!SDL_AtomicGet(&emulation->done))
+    {
+        SDL_Event event;
+        while (SDL_PollEvent(&event))
+        {
+            SDL_Keycode key = event.key.keysym.sym;
+            int pressed = event.type == SDL_KEYDOWN;
+
+            if (event.type == SDL_QUIT)
+                closing = 1;
+            else if ((pressed || event.type == SDL_KEYUP) && key == SDLK_BACKSPACE)
+                input_push(&emulation->input, INPUT_REWIND, (uint8_t)pressed);
+            else if ((pressed || event.type == SDL_KEYUP) && key == SDLK_TAB)
+                input_push(&emulation->input, INPUT_TURBO, (uint8_t)pressed);
+            else if ((pressed || event.type == SDL_KEYUP) && key == SDLK_F9)
+            {
+                if (pressed && !event.key.repeat)
+                    input_push(&emulation->input, INPUT_PROFILE, 0);
+            }
+            else if (pressed && (key & 0xFF))
+                input_push(&emulation->input, INPUT_KEY, key & 0xFF);
+            else if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_EXPOSED)
+            {
+                // The window contents were lost; upload and present everything
+                screen_lost = 1;
+            }
+        }
+        if (closing == 1 && input_push(&emulation->input, INPUT_QUIT, 0))
+            closing = 2;
+
+        int speed = SDL_AtomicGet(&emulation->speed);
+        if (speed != shown_speed)
+        {
+            char title[80];
+            if (opt->clock)
+                snprintf(title, sizeof(title), "6502 Emulator - %.2f MHz (%.0f%% of %.2f MHz)", speed / 1e3, speed * 1e5 / opt->clock, opt->clock / 1e6);
+            else
+                snprintf(title, sizeof(title), "6502 Emulator - %.2f MHz (unlimited)", speed / 1e3);
+            SDL_SetWindowTitle(window, title);
+            shown_speed = speed;
+        }
+
+        const uint8_t* screen = frame_take(&emulation->frames);
+        if (screen || (screen_lost && shown))
+            render_screen(shown = screen ? screen : shown);
+        else
+            SDL_Delay(1);
+    }
+    if (thread)
+        SDL_WaitThread(thread, NULL);
+
+    // Show where it stopped
+    const uint8_t* screen = frame_take(&emulation->frames);
+    if (screen)
+        render_screen(screen);
+
+    double seconds = (double)(SDL_GetPerformanceCounter() - started) / SDL_GetPerformanceFrequency();
+    if (seconds > 0)
+    {
+        printf("Emulated %.3f MHz on average", (machine->cpu.cycles - start_cycles) / seconds / 1e6);
+        if (opt->clock)
+            printf(" against %.3f MHz\n", opt->clock / 1e6);
+        else
+            printf(", unlimited\n");
+    }
+
+    uint64_t instructions = emulation->instructions;
+    *quit = emulation->quit;
+    free(emulation);
+    return instructions;
+}
+
+// Run the machine headless or in the window as the options say. Returns
+// the exit status.
+int run_machine(Machine* machine, const Options* opt)
+{
+    CPU* cpu = &machine->cpu;
+
+    uint64_t instructions = 0;
+    int quit = 0;
+    if (opt->headless && opt->forks)
+    {
+        return run_forks(machine, opt);
+    }
+    else if (opt->headless && opt->rewind)
+    {
+        return run_rewound(machine, opt);
+    }
+    else if (opt->headless)
+    {
+        instructions = run_headless(cpu, opt);
+    }
+    else
+    {
+        instructions = run_window(machine, opt, &quit);
+    }
+
+    RunResult result;
+    finish_run(cpu, opt, instructions, quit, &result);
+
+    if (opt->headless)
+    {
+        printf("{");
+        print_result(&result);
+        printf("}\n");
+        return result.status;
+    }
+
+    printf("\n--- CPU State ---\n");
+    printf("Stopped: %s\n", result.reason);
+    dump_registers(cpu);
+    printf("\n--- Memory Dump ---\n");
+    dump_memory(cpu, opt->load_address - 10, opt->load_address + 100);
+
+    SDL_DestroyTexture(texture);
+    SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(window);
+    SDL_Quit();
+
+    return result.status;
+}
+
+int main(int argc, char** argv) {
+    Options opt;
+
+    if (!parse_args(argc, argv, &opt))
+    {
+        usage(argv[0]);
+        return STATUS_ERROR;
+    }
+
+    decimal_init();
+    if (opt.farm)
+        return run_farm(&opt);
+    if (opt.decode_trace)
+        return decode_trace(opt.decode_trace);
+    if (opt.bench)
+        return run_bench(&opt);
+
+    Machine* machine = calloc(1, sizeof(Machine));
+    if (!machine)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return STATUS_ERROR;
+    }
+    CPU* cpu = &machine->cpu;
+
+    if (!opt.headless && init_sdl() != 0)
+    {
+        return STATUS_ERROR;
+    }
+
+    // Load the rom
+    long rom_size = start_machine(machine, &opt, NULL);
+    if (rom_size < 0)
+        return STATUS_ERROR;
+    if (opt.format == ROM_ASM)
+        printf("Assembled '%s' into memory. Size %ld bytes, running from $%04X\n", opt.rom, rom_size, cpu->PC);
+    else if (opt.format != ROM_RAW)
+        printf("Loaded %s ROM '%s' into memory. Size %ld bytes, running from $%04X\n",
+            rom_format_names[opt.format], opt.rom, rom_size, cpu->PC);
+    else
+        printf("Loaded ROM '%s' into memory at $%04X. Size %ld bytes\n", opt.rom, opt.load_address, rom_size);
+
+    if (opt.trace && !(cpu->trace = trace_open(opt.trace)))
+        return STATUS_ERROR;
+    Profiler* profiler = NULL;
+    if (opt.profile || opt.flamegraph)
+    {
+        profiler = profile_create(cpu, opt.profile_sample);
+        if (!profiler)
+        {
+            fprintf(stderr, "Out of memory\n");
+            return STATUS_ERROR;
+        }
+        if (opt.symbols && !profile_load_symbols(profiler, opt.symbols))
+            return STATUS_ERROR;
+        cpu->profile = profiler;
+    }
+
+    int status = run_machine(machine, &opt);
+    if (cpu->trace && !trace_close(cpu->trace))
+    {
+        fprintf(stderr, "Error writing trace file '%s'\n", opt.trace);
+        status = STATUS_ERROR;
+    }
+    if (profiler)
+    {
+        if (opt.profile && !profile_report(profiler, cpu, opt.profile))
+            status = STATUS_ERROR;
+        if (opt.flamegraph && !profile_folded(profiler, opt.flamegraph))
+            status = STATUS_ERROR;
+        profile_free(profiler);
+    }
+    return status;
+}
+
+// Reset a bare CPU with all memory mapped as RAM. The CPU must not hold
+// code caches or snapshot pages (see release_cpu()).
+void reset(CPU* cpu) {
+    memset(cpu, 0, sizeof(CPU));
+    map_ram(cpu, 0x00, 0xFF);
+    cpu->SP = 0xFF;
+    // Set the unused bit in status reg
+    cpu->P |= 0x20;
+
+    // Load the reset vector
+    cpu->PC = mem_read(cpu, 0xFFFC) | (mem_read(cpu, 0xFFFD) << 8);
+
+    cpu->stop_pc = -1;
+    interrupt_reset(cpu, CLOCK_HZ);
+}
+
+// Reset a machine and wire up its devices. The seed starts the random
+// number sequence at $FE, so runs with equal seeds are identical.
+void machine_reset(Machine* machine, uint32_t seed)
+{
+    reset(&machine->cpu);
+    init_bus(machine);
+    memset(&machine->keys, 0, sizeof(machine->keys));
+    machine->rng = seed ^ 0x9E3779B9;
+    if (machine->rng == 0)
+        machine->rng = 1;
+}
+
+// The format of a ROM file by its extension; raw if none matches
+int rom_format(const char* filename)
+{
+    static const struct { const char* extension; int format; } extensions[] = {
+        { ".prg", ROM_PRG }, { ".hex", ROM_HEX }, { ".ihx", ROM_HEX }, { ".xex", ROM_XEX },
+        { ".asm", ROM_ASM }, { ".s", ROM_ASM },
+    };
+    const char* dot = strrchr(filename, '.');
+
+    for (size_t i = 0; dot && i < sizeof(extensions) / sizeof(extensions[0]); i++)
+    {
+        const char* a = dot;
+        const char* b = extensions[i].extension;
+        while (*a && tolower((unsigned char)*a) == *b)
+            a++, b++;
+        if (*a == '\0' && *b == '\0')
+            return extensions[i].format;
+    }
+    return ROM_RAW;
+}
+
+// Map a whole file read-only, or read it where there is no mmap. Returns
+// NULL after printing why it could not be opened.
+static const uint8_t* rom_map(const char* filename, size_t* size)
+{
+#ifdef _WIN32
+    FILE* fp = fopen(filename, "rb");
+    uint8_t* data = NULL;
+    long length = -1;
+
+    if (fp && fseek(fp, 0, SEEK_END) == 0 && (length = ftell(fp)) >= 0 && fseek(fp, 0, SEEK_SET) == 0 &&
+        (data = malloc(length ? length : 1)) && fread(data, 1, length, fp) == (size_t)length)
+    {
+        fclose(fp);
+        *size = length;
+        return data;
+    }
+    fprintf(stderr, "Error opening ROM file '%s': %s\n", filename, strerror(errno));
+    if (fp)
+        fclose(fp);
+    free(data);
+    return NULL;
+#else
+    static const uint8_t empty[1];
+    struct stat info;
+    int fd = open(filename, O_RDONLY);
+    void* data = MAP_FAILED;
+
+    if (fd >= 0 && fstat(fd, &info) == 0)
+    {
+        *size = (size_t)info.st_size;
+        data = *size ? mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0) : (void*)empty;
+    }
+    if (data == MAP_FAILED)
+        fprintf(stderr, "Error opening ROM file '%s': %s\n", filename, strerror(errno));
+    if (fd >= 0)
+        close(fd);
+    return data == MAP_FAILED ? NULL : data;
+#endif
+}
+
+static void rom_unmap(const uint8_t* data, size_t size)
+{
+#ifdef _WIN32
+    (void)size;
+    free((void*)data);
+#else
+    if (size)
+        munmap((void*)data, size);
+#endif
+}
+
+// Add a segment, which must end by $FFFF, to an image. Returns 0 when out
+// of memory.
+static int rom_put(RomImage* image, uint32_t address, const uint8_t* data, size_t length)
+{
+    if (image->first < 0 && length)
+        image->first = (int32_t)address;
+    for (size_t i = 0; i < length; )
+    {
+        uint32_t at = address + (uint32_t)i;
+        SnapshotPage** page = &image->pages[at >> 8];
+        size_t count = 256 - (at & 0xFF);
+
+        if (count > length - i)
+            count = length - i;
+        if (!*page)
+        {
+            if (!(*page = calloc(1, sizeof(SnapshotPage))))
+                return 0;
+            SDL_AtomicSet(&(*page)->refs, 1);
+        }
+        memcpy(&(*page)->data[at & 0xFF], data + i, count);
+        i += count;
+    }
+    for (uint32_t at = address; at < address + length; at++)
+    {
+        if (at >= 0xFFFA)
+            image->vectors |= 1 << (at - 0xFFFA);
+    }
+    image->size += (long)length;
+    return 1;
+}
+
+static int rom_hex_digits(const uint8_t* text, int count, uint32_t* value)
+{
+    *value = 0;
+    for (int i = 0; i < count; i++)
+    {
+        int c = tolower(text[i]);
+        if (!isxdigit(c))
+            return 0;
+        *value = (*value << 4) | (uint32_t)(c <= '9' ? c - '0' : c - 'a' + 10);
+    }
+    return 1;
+}
+
+// Parse Intel HEX: data records, the end record, and a start address
+// record, which also becomes the reset vector. Addresses must stay within
+// 64K, so extended address records may only give 0.
+static int rom_parse_hex(RomImage* image, const char* filename, const uint8_t* text, size_t size, int32_t* entry)
+{
+    int line = 0;
+
+    for (size_t at = 0; at < size; )
+    {
+        size_t end = at;
+        while (end < size && text[end] != '\n')
+            end++;
+        size_t length = end - at;
+        const uint8_t* record = text + at;
+        at = end + 1;
+        line++;
+        while (length && (record[length - 1] == '\r' || record[length - 1] == ' ' || record[length - 1] == '\t'))
+            length--;
+        if (length == 0)
+            continue;
+
+        uint8_t bytes[256 + 5] = { 0 };
+        uint32_t count = 0;
+        uint8_t sum = 0;
+        if (record[0] != ':' || length < 11 || !rom_hex_digits(record + 1, 2, &count) || length != 11 + 2 * count)
+        {
+            fprintf(stderr, "%s:%d: not an Intel HEX record\n", filename, line);
+            return 0;
+        }
+        for (uint32_t i = 0; i < count + 5; i++)
+        {
+            uint32_t value;
+            if (!rom_hex_digits(record + 1 + 2 * i, 2, &value))
+            {
+                fprintf(stderr, "%s:%d: not an Intel HEX record\n", filename, line);
+                return 0;
+            }
+            bytes[i] = (uint8_t)value;
+            sum += (uint8_t)value;
+        }
+        if (sum != 0)
+        {
+            fprintf(stderr, "%s:%d: checksum mismatch\n", filename, line);
+            return 0;
+        }
+
+        uint32_t address = (bytes[1] << 8) | bytes[2];
+        switch (bytes[3])
+        {
+        case 0x00: // Data
+            if (address + count > 0x10000)
+            {
+                fprintf(stderr, "%s:%d: data runs past $FFFF\n", filename, line);
+                return 0;
+            }
+            if (!rom_put(image, address, bytes + 4, count))
+            {
+                fprintf(stderr, "Out of memory\n");
+                return 0;
+            }
+            break;
+        case 0x01: // End of file
+            return 1;
+        case 0x02: // Extended segment address
+        case 0x04: // Extended linear address
+            if (count != 2 || bytes[4] || bytes[5])
+            {
+                fprintf(stderr, "%s:%d: addresses beyond $FFFF\n", filename, line);
+                return 0;
+            }
+            break;
+        case 0x03: // Start segment address, CS:IP
+        case 0x05: // Start linear address
+        {
+            uint32_t value = UINT32_MAX;
+            if (count == 4 && bytes[3] == 0x03)
+                value = ((bytes[4] << 8) | bytes[5]) * 16 + ((bytes[6] << 8) | bytes[7]);
+            else if (count == 4)
+                value = ((uint32_t)bytes[4] << 24) | (bytes[5] << 16) | (bytes[6] << 8) | bytes[7];
+            if (value > 0xFFFF)
+            {
+                fprintf(stderr, "%s:%d: start address beyond $FFFF\n", filename, line);
+                return 0;
+            }
+            *entry = (int32_t)value;
+            break;
+        }
+        default:
+            fprintf(stderr, "%s:%d: unknown record type %02X\n", filename, line, bytes[3]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Parse segments: a $FFFF header, then for each segment its start and end
+// address (inclusive, little endian) and its bytes. A segment may start
+// with another $FFFF.
+static int rom_parse_xex(RomImage* image, const char* filename, const uint8_t* data, size_t size)
+{
+    if (size < 2 || data[0] != 0xFF || data[1] != 0xFF)
+    {
+        fprintf(stderr, "ROM '%s' has no $FFFF header\n", filename);
+        return 0;
+    }
+    for (size_t at = 2; at < size; )
+    {
+        if (at + 2 <= size && data[at] == 0xFF && data[at + 1] == 0xFF)
+            at += 2;
+        if (at + 4 > size)
+        {
+            fprintf(stderr, "ROM '%s' has a cut-off segment header at offset %zu\n", filename, at);
+            return 0;
+        }
+        uint32_t first = data[at] | (data[at + 1] << 8);
+        uint32_t last = data[at + 2] | (data[at + 3] << 8);
+        at += 4;
+        if (last < first || at + (last - first + 1) > size)
+        {
+            fprintf(stderr, "ROM '%s' has a bad segment $%04X-$%04X\n", filename, first, last);
+            return 0;
+        }
+        if (!rom_put(image, first, data + at, last - first + 1))
+        {
+            fprintf(stderr, "Out of memory\n");
+            return 0;
+        }
+        at += last - first + 1;
+    }
+    return 1;
+}
+
+// Read a ROM file into an image. A raw file goes to address; the others
+// say where they go. Raw and PRG images start where they load; HEX and
+// segmented images at their start address record, else the reset vector
+// if they set it, else their first byte. Returns NULL after printing why
+// the file could not be loaded.
+RomImage* rom_open(const char* filename, int format, uint16_t address)
+{
+    size_t size = 0;
+    const uint8_t* data = rom_map(filename, &size);
+    RomImage* image = calloc(1, sizeof(RomImage));
+    int32_t entry = -1;
+    int ok = 0;
+
+    if (!data || !image)
+    {
+        if (data && !image)
+            fprintf(stderr, "Out of memory\n");
+        if (data)
+            rom_unmap(data, size);
+        free(image);
+        return NULL;
+    }
+    image->first = -1;
+
+    switch (format)
+    {
+    case ROM_RAW:
+    case ROM_PRG:
+    {
+        size_t skip = format == ROM_PRG ? 2 : 0;
+        if (size < skip)
+        {
+            fprintf(stderr, "ROM '%s' is too short for a PRG load address\n", filename);
+            break;
+        }
+        if (format == ROM_PRG)
+            address = data[0] | (data[1] << 8);
+        if (size - skip > 65536u - address)
+            fprintf(stderr, "Error: ROM '%s' too large to fit in memory.\n", filename);
+        else if (!rom_put(image, address, data + skip, size - skip))
+            fprintf(stderr, "Out of memory\n");
+        else
+            ok = 1;
+        entry = address;
+        break;
+    }
+    case ROM_HEX:
+        ok = rom_parse_hex(image, filename, data, size, &entry);
+        if (ok && entry >= 0)
+        {
+            uint8_t vector[2] = { (uint8_t)entry, (uint8_t)(entry >> 8) };
+            ok = rom_put(image, 0xFFFC, vector, 2);
+        }
+        break;
+    case ROM_XEX:
+        ok = rom_parse_xex(image, filename, data, size);
+        break;
+    }
+    rom_unmap(data, size);
+    if (!ok)
+    {
+        rom_close(image);
+        return NULL;
+    }
+
+    if (entry >= 0)
+        image->start = (uint16_t)entry;
+    else if ((image->vectors & 0x0C) == 0x0C)
+        image->start = image->pages[0xFF]->data[0xFC] | (image->pages[0xFF]->data[0xFD] << 8);
+    else
+        image->start = image->first >= 0 ? (uint16_t)image->first : address;
+    return image;
+}
+
+// Put an image into a freshly reset machine
+void rom_apply(CPU* cpu, const RomImage* image)
+{
+    flush_code_caches(cpu);
+    for (int page = 0; page < 256; page++)
+    {
+        if (image->pages[page])
+            share_page(cpu, page, image->pages[page]);
+    }
+}
+
+void rom_close(RomImage* image)
+{
+    if (!image)
+        return;
+    for (int page = 0; page < 256; page++)
+    {
+        if (image->pages[page])
+            snapshot_page_release(image->pages[page]);
+    }
+    free(image);
+}
+
+// Built-in assembler for .asm sources, in the syntax of exampleprogram.asm
+// (the 6502js/easy6502 dialect): "*=$addr" sets the origin, "name:" is a
+// label, "define name value" names a constant and "dcb" lays down bytes.
+// Numbers are $hex, %binary or decimal; "<" and ">" take the low and high
+// byte; "*" is the current address. Mnemonics include the illegal opcodes.
+// Operands that fit in a byte use the zero page forms, unless they refer to
+// a label or define further down the file.
+typedef struct {
+    char* name;
+    uint16_t value;
+    int line; // Line defined on; forward references use absolute forms
+} AsmSymbol;
+
+typedef struct {
+    const char* filename;
+    int pass;
+    int line;
+    int errors;
+    uint16_t pc;
+    int past_end; // The last byte went to $FFFF, so pc wrapped round
+    long size; // Bytes assembled
+    int32_t first; // Address of the first byte, -1 before it
+    AsmSymbol* symbols;
+    int symbol_count;
+    int symbol_capacity;
+    int32_t* buckets; // Hash table of symbol indexes, -1 if empty
+    uint8_t* mem;
+    FILE* listing;
+} Assembler;
+
+#define ASM_BUCKETS 4096
+#define ASM_MAX_ERRORS 20
+
+static void asm_error(Assembler* as, const char* message, const char* detail)
+{
+    if (++as->errors <= ASM_MAX_ERRORS)
+        fprintf(stderr, "%s:%d: %s%s\n", as->filename, as->line, message, detail ? detail : "");
+}
+
+static uint32_t asm_hash(const char* name, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    return hash & (ASM_BUCKETS - 1);
+}
+
+static AsmSymbol* asm_find(Assembler* as, const char* name, size_t length)
+{
+    for (uint32_t slot = asm_hash(name, length); as->buckets[slot] >= 0; slot = (slot + 1) & (ASM_BUCKETS - 1))
+    {
+        AsmSymbol* symbol = &as->symbols[as->buckets[slot]];
+        if (strlen(symbol->name) == length && memcmp(symbol->name, name, length) == 0)
+            return symbol;
+    }
+    return NULL;
+}
+
+// Define a symbol in the first pass. known is whether its value is final
+// yet; one that isn't counts as a forward reference wherever it is used.
+static void asm_define(Assembler* as, const char* name, size_t length, uint16_t value, int known)
+{
+    if (as->pass == 2)
+    {
+        AsmSymbol* symbol = asm_find(as, name, length);
+        if (symbol)
+            symbol->value = value;
+        return;
+    }
+    if (asm_find(as, name, length))
+    {
+        char text[64];
+        snprintf(text, sizeof(text), "%.*s", (int)(length < 60 ? length : 60), name);
+        asm_error(as, "duplicate symbol ", text);
+        return;
+    }
+    if (as->symbol_count == ASM_BUCKETS / 2)
+    {
+        asm_error(as, "too many symbols", NULL);
+        return;
+    }
+    if (as->symbol_count == as->symbol_capacity)
+    {
+        int capacity = as->symbol_capacity ? as->symbol_capacity * 2 : 64;
+        AsmSymbol* grown = realloc(as->symbols, capacity * sizeof(AsmSymbol));
+        if (!grown)
+        {
+            asm_error(as, "out of memory", NULL);
+            return;
+        }
+        as->symbols = grown;
+        as->symbol_capacity = capacity;
+    }
+    AsmSymbol* symbol = &as->symbols[as->symbol_count];
+    symbol->name = malloc(length + 1);
+    if (!symbol->name)
+    {
+        asm_error(as, "out of memory", NULL);
+        return;
+    }
+    memcpy(symbol->name, name, length);
+    symbol->name[length] = '\0';
+    symbol->value = value;
+    symbol->line = known ? as->line : INT_MAX;
+
+    uint32_t slot = asm_hash(name, length);
+    while (as->buckets[slot] >= 0)
+        slot = (slot + 1) & (ASM_BUCKETS - 1);
+    as->buckets[slot] = as->symbol_count++;
+}
+
+// Whether text of this length is word, ignoring case
+static int asm_word_is(const char* text, size_t length, const char* word)
+{
+    if (strlen(word) != length)
+        return 0;
+    for (size_t i = 0; i < length; i++)
+        if (toupper((unsigned char)text[i]) != word[i])
+            return 0;
+    return 1;
+}
+
+static const char* asm_skip_space(const char* text)
+{
+    while (*text == ' ' || *text == '\t')
+        text++;
+    return text;
+}
+
+static int asm_is_name(char c, int first)
+{
+    return isalpha((unsigned char)c) || c == '_' || c == '.' || (!first && isdigit((unsigned char)c));
+}
+
+// Evaluate an expression: terms joined by + and -, optionally preceded by
+// < or >. *known is cleared if it uses a symbol not defined above.
+// Returns the text after it, or NULL after reporting an error.
+static const char* asm_expression(Assembler* as, const char* text, int32_t* value, int* known)
+{
+    int part = 0;
+    int32_t result = 0;
+    int sign = 1;
+
+    text = asm_skip_space(text);
+    if (*text == '<' || *text == '>')
+        part = *text++;
+    *known = 1;
+    for (;;)
+    {
+        int32_t term = 0;
+        text = asm_skip_space(text);
+        if (*text == '$' || *text == '%')
+        {
+            int base = *text++ == '$' ? 16 : 2;
+            char* end;
+            term = (int32_t)strtol(text, &end, base);
+            if (end == text)
+            {
+                asm_error(as, "bad number", NULL);
+                return NULL;
+            }
+            text = end;
+        }
+        else if (isdigit((unsigned char)*text))
+        {
+            char* end;
+            term = (int32_t)strtol(text, &end, 10);
+            text = end;
+        }
+        else if (*text == '*')
+        {
+            term = as->pc;
+            text++;
+        }
+        else if (asm_is_name(*text, 1))
+        {
+            const char* name = text;
+            while (asm_is_name(*text, 0))
+                text++;
+            AsmSymbol* symbol = asm_find(as, name, text - name);
+            if (symbol)
+                term = symbol->value;
+            if (!symbol || symbol->line > as->line)
+                *known = 0;
+            if (!symbol && as->pass == 2)
+            {
+                char label[64];
+                snprintf(label, sizeof(label), "%.*s", (int)(text - name < 60 ? text - name : 60), name);
+                asm_error(as, "unknown symbol ", label);
+                return NULL;
+            }
+        }
+        else
+        {
+            asm_error(as, "expected a value", NULL);
+            return NULL;
+        }
+        result += sign * term;
+
+        text = asm_skip_space(text);
+        if (*text != '+' && *text != '-')
+            break;
+        sign = *text++ == '+' ? 1 : -1;
+    }
+
+    if (part == '<')
+        result &= 0xFF;
+    else if (part == '>')
+        result = (result >> 8) & 0xFF;
+    *value = result;
+    return text;
+}
+
+static int asm_at_end(const char* text)
+{
+    text = asm_skip_space(text);
+    return *text == '\0';
+}
+
+// Opcode for a mnemonic in an addressing mode, preferring official
+// opcodes. -1 if there is none.
+static int asm_opcode(const char* mnemonic, int mode)
+{
+    int found = -1;
+    for (int opcode = 0; opcode < 256; opcode++)
+    {
+        if (opcode_modes[opcode] != mode || memcmp(opcode_names[opcode], mnemonic, 3) != 0)
+            continue;
+        if (opcode_family((uint8_t)opcode) != FAMILY_ILLEGAL)
+            return opcode;
+        if (found < 0)
+            found = opcode;
+    }
+    return found;
+}
+
+static void asm_emit(Assembler* as, uint8_t byte)
+{
+    if (as->past_end)
+    {
+        asm_error(as, "code runs past $FFFF", NULL);
+        as->past_end = 0;
+    }
+    if (as->first < 0)
+        as->first = as->pc;
+    if (as->pass == 2)
+        as->mem[as->pc] = byte;
+    as->pc++;
+    as->size++;
+    as->past_end = as->pc == 0;
+}
+
+// Assemble an instruction; text follows the mnemonic
+static void asm_instruction(Assembler* as, const char* mnemonic, const char* text)
+{
+    int32_t value = 0;
+    int known = 1;
+    int mode;
+    int index = 0; // 'X' or 'Y'
+
+    text = asm_skip_space(text);
+    if (*text == '\0')
+        mode = AM_IMP;
+    else if ((*text == 'A' || *text == 'a') && asm_at_end(text + 1))
+    {
+        mode = AM_IMP; // Accumulator
+        text++;
+    }
+    else if (*text == '#')
+    {
+        if (!(text = asm_expression(as, text + 1, &value, &known)))
+            return;
+        mode = AM_IMM;
+        if (value < -128 || value > 255)
+            asm_error(as, "immediate value out of range", NULL);
+    }
+    else if (*text == '(')
+    {
+        if (!(text = asm_expression(as, text + 1, &value, &known)))
+            return;
+        text = asm_skip_space(text);
+        if (*text == ',')
+        {
+            text = asm_skip_space(text + 1);
+            if (*text != 'X' && *text != 'x')
+            {
+                asm_error(as, "expected ,X)", NULL);
+                return;
+            }
+            text = asm_skip_space(text + 1);
+            mode = AM_IZX;
+            if (*text++ != ')')
+            {
+                asm_error(as, "expected )", NULL);
+                return;
+            }
+        }
+        else if (*text++ == ')')
+        {
+            text = asm_skip_space(text);
+            mode = AM_IND;
+            if (*text == ',')
+            {
+                text = asm_skip_space(text + 1);
+                if (*text != 'Y' && *text != 'y')
+                {
+                    asm_error(as, "expected ),Y", NULL);
+                    return;
+                }
+                text++;
+                mode = AM_IZY;
+            }
+        }
+        else
+        {
+            asm_error(as, "expected )", NULL);
+            return;
+        }
+    }
+    else
+    {
+        if (!(text = asm_expression(as, text, &value, &known)))
+            return;
+        text = asm_skip_space(text);
+        if (*text == ',')
+        {
+            text = asm_skip_space(text + 1);
+            index = toupper((unsigned char)*text);
+            if (index != 'X' && index != 'Y')
+            {
+                asm_error(as, "expected X or Y", NULL);
+                return;
+            }
+            text++;
+        }
+        mode = index == 'X' ? AM_ABX : index == 'Y' ? AM_ABY : AM_ABS;
+        if (asm_opcode(mnemonic, AM_REL) >= 0)
+            mode = AM_REL;
+        else if (known && value >= 0 && value < 0x100)
+        {
+            int zp = index == 'X' ? AM_ZPX : index == 'Y' ? AM_ZPY : AM_ZP;
+            if (asm_opcode(mnemonic, zp) >= 0)
+                mode = zp;
+        }
+    }
+    if (!asm_at_end(text))
+    {
+        asm_error(as, "unexpected text after operand: ", asm_skip_space(text));
+        return;
+    }
+
+    int opcode = asm_opcode(mnemonic, mode);
+    if (opcode < 0)
+    {
+        asm_error(as, "addressing mode not available for ", mnemonic);
+        return;
+    }
+    asm_emit(as, (uint8_t)opcode);
+    switch (instruction_length((uint8_t)opcode))
+    {
+    case 2:
+        if (mode == AM_REL)
+        {
+            int32_t offset = value - (as->pc + 1);
+            if (as->pass == 2 && (offset < -128 || offset > 127))
+                asm_error(as, "branch out of range", NULL);
+            value = offset;
+        }
+        else if (as->pass == 2 && mode != AM_IMM && (value < 0 || value > 0xFF))
+            asm_error(as, "zero page address out of range", NULL);
+        asm_emit(as, (uint8_t)value);
+        break;
+    case 3:
+        if (as->pass == 2 && (value < 0 || value > 0xFFFF))
+            asm_error(as, "address out of range", NULL);
+        asm_emit(as, (uint8_t)value);
+        asm_emit(as, (uint8_t)(value >> 8));
+        break;
+    }
+}
+
+// Assemble one line (without its newline)
+static void asm_line(Assembler* as, char* line)
+{
+    char* comment = strchr(line, ';');
+    if (comment)
+        *comment = '\0';
+    const char* text = asm_skip_space(line);
+
+    if (*text == '*')
+    {
+        int32_t value;
+        int known;
+        text = asm_skip_space(text + 1);
+        if (*text != '=')
+        {
+            asm_error(as, "expected *=", NULL);
+            return;
+        }
+        if (!(text = asm_expression(as, text + 1, &value, &known)))
+            return;
+        if (!known || value < 0 || value > 0xFFFF)
+            asm_error(as, "origin must be an address defined above", NULL);
+        else if (!asm_at_end(text))
+            asm_error(as, "unexpected text after origin", NULL);
+        else
+        {
+            as->pc = (uint16_t)value;
+            as->past_end = 0;
+        }
+        return;
+    }
+
+    // Label
+    const char* name = text;
+    while (asm_is_name(*text, text == name))
+        text++;
+    if (text > name && *text == ':')
+    {
+        asm_define(as, name, text - name, as->pc, 1);
+        text = asm_skip_space(text + 1);
+        name = text;
+        while (asm_is_name(*text, text == name))
+            text++;
+    }
+    if (text == name)
+    {
+        if (!asm_at_end(text))
+            asm_error(as, "expected an instruction: ", text);
+        return;
+    }
+
+    size_t length = text - name;
+    if (asm_word_is(name, length, "DEFINE"))
+    {
+        int32_t value;
+        int known;
+        text = asm_skip_space(text);
+        const char* symbol = text;
+        while (asm_is_name(*text, text == symbol))
+            text++;
+        if (text == symbol)
+        {
+            asm_error(as, "expected a name after define", NULL);
+            return;
+        }
+        size_t symbol_length = text - symbol;
+        if (!(text = asm_expression(as, text, &value, &known)))
+            return;
+        if (!asm_at_end(text))
+            asm_error(as, "unexpected text after define", NULL);
+        else
+            asm_define(as, symbol, symbol_length, (uint16_t)value, known);
+        return;
+    }
+    if (asm_word_is(name, length, "DCB"))
+    {
+        for (;;)
+        {
+            int32_t value;
+            int known;
+            if (!(text = asm_expression(as, text, &value, &known)))
+                return;
+            if (as->pass == 2 && (value < -128 || value > 255))
+                asm_error(as, "byte out of range", NULL);
+            asm_emit(as, (uint8_t)value);
+            text = asm_skip_space(text);
+            if (*text != ',')
+                break;
+            text++;
+        }
+        if (!asm_at_end(text))
+            asm_error(as, "unexpected text after dcb", NULL);
+        return;
+    }
+
+    char mnemonic[4] = "";
+    int opcode = 256;
+    if (length == 3)
+    {
+        for (int i = 0; i < 3; i++)
+            mnemonic[i] = (char)toupper((unsigned char)name[i]);
+        for (opcode = 0; opcode < 256 && memcmp(opcode_names[opcode], mnemonic, 3) != 0; opcode++)
+            ;
+    }
+    if (opcode == 256 || strcmp(mnemonic, "???") == 0)
+    {
+        char word[16];
+        snprintf(word, sizeof(word), "%.*s", (int)(length < 12 ? length : 12), name);
+        asm_error(as, "unknown instruction ", word);
+        return;
+    }
+    asm_instruction(as, mnemonic, text);
+}
+
+// Print a listing row for a line: address, up to three of the bytes it
+// assembled, line number and source. Further bytes get rows of their own.
+static void asm_list(Assembler* as, uint16_t pc, long count, const char* source)
+{
+    long done = 0;
+
+    do
+    {
+        char bytes[12] = "";
+        for (int i = 0; i < 3 && done + i < count; i++)
+            snprintf(bytes + 3 * i, sizeof(bytes) - 3 * i, "%02X ", as->mem[(uint16_t)(pc + done + i)]);
+        if (done > 0)
+        {
+            bytes[strlen(bytes) - 1] = '\0';
+            fprintf(as->listing, "%04X  %s\n", (uint16_t)(pc + done), bytes);
+        }
+        else
+        {
+            if (count)
+                fprintf(as->listing, "%04X  %-9s", pc, bytes);
+            else
+                fprintf(as->listing, "%15s", "");
+            fprintf(as->listing, *source ? " %5d  %s\n" : " %5d\n", as->line, source);
+        }
+        done += 3;
+    } while (done < count);
+}
+
+static int asm_symbol_order(const void* a, const void* b)
+{
+    const AsmSymbol* x = a;
+    const AsmSymbol* y = b;
+    return x->value != y->value ? (x->value < y->value ? -1 : 1) : strcmp(x->name, y->name);
+}
+
+// Assemble a source file into memory, starting at origin unless it sets
+// one. Returns the number of bytes assembled, or -1 after printing the
+// errors; *start gets the address of the first byte. If asked for, writes
+// a listing and the symbols, as "name = $C000" lines that --symbols reads.
+long assemble_file(CPU* cpu, const char* filename, uint16_t origin, uint16_t* start, const char* listing, const char* symbols)
+{
+    Assembler as = { 0 };
+    FILE* fp = fopen(filename, "rb");
+
+    if (!fp)
+    {
+        fprintf(stderr, "Error opening source file '%s': %s\n", filename, strerror(errno));
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    long length = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char* source = malloc(length + 1);
+    char* line = malloc(length + 1);
+    char* kept = malloc(length + 1);
+    as.buckets = malloc(ASM_BUCKETS * sizeof(int32_t));
+    if (!source || !line || !kept || !as.buckets || fread(source, 1, length, fp) != (size_t)length)
+    {
+        fprintf(stderr, "Error reading source file '%s'\n", filename);
+        fclose(fp);
+        free(source);
+        free(line);
+        free(kept);
+        free(as.buckets);
+        return -1;
+    }
+    fclose(fp);
+    source[length] = '\0';
+    memset(as.buckets, 0xFF, ASM_BUCKETS * sizeof(int32_t));
+    as.filename = filename;
+    as.mem = cpu->mem;
+
+    for (as.pass = 1; as.pass <= 2 && !as.errors; as.pass++)
+    {
+        if (as.pass == 2 && listing && !(as.listing = fopen(listing, "w")))
+        {
+            fprintf(stderr, "Error opening listing '%s': %s\n", listing, strerror(errno));
+            as.errors++;
+            break;
+        }
+        as.pc = origin;
+        as.past_end = 0;
+        as.size = 0;
+        as.first = -1;
+        as.line = 0;
+        for (const char* cursor = source; *cursor;)
+        {
+            const char* end = strchr(cursor, '\n');
+            size_t size = end ? (size_t)(end - cursor) : strlen(cursor);
+            memcpy(line, cursor, size);
+            line[size] = '\0';
+            if (size && line[size - 1] == '\r')
+                line[size - 1] = '\0';
+            cursor += end ? size + 1 : size;
+            as.line++;
+
+            // asm_line() cuts off the comment, the listing keeps it
+            uint16_t pc = as.pc;
+            long before = as.size;
+            if (as.listing)
+                strcpy(kept, line);
+            asm_line(&as, line);
+            if (as.listing)
+                asm_list(&as, pc, as.size - before, kept);
+        }
+    }
+    if (as.errors > ASM_MAX_ERRORS)
+        fprintf(stderr, "%s: %d errors\n", filename, as.errors);
+
+    if (as.listing && fclose(as.listing) != 0)
+    {
+        fprintf(stderr, "Error writing listing '%s'\n", listing);
+        as.errors++;
+    }
+    if (!as.errors && symbols)
+    {
+        FILE* out = fopen(symbols, "w");
+        int failed = !out;
+        if (out)
+        {
+            qsort(as.symbols, as.symbol_count, sizeof(AsmSymbol), asm_symbol_order);
+            for (int i = 0; i < as.symbol_count; i++)
+                fprintf(out, "%s = $%04X\n", as.symbols[i].name, as.symbols[i].value);
+            failed = ferror(out);
+            if (fclose(out) != 0)
+                failed = 1;
+        }
+        if (failed)
+        {
+            fprintf(stderr, "Error writing symbols to '%s'\n", symbols);
+            as.errors++;
+        }
+    }
+
+    for (int i = 0; i < as.symbol_count; i++)
+        free(as.symbols[i].name);
+    free(as.symbols);
+    free(as.buckets);
+    free(source);
+    free(line);
+    free(kept);
+    *start = as.first >= 0 ? (uint16_t)as.first : origin;
+    return as.errors ? -1 : as.size;
+}
+
+void dump_memory(CPU* cpu, uint16_t start, uint16_t end) {
+    for (uint16_t i = start; i <= end; ++i) {
+        printf("$%04X: %02X ", i, ram_page(cpu, i >> 8)[i & 0xFF]);
+        if ((i - start + 1) % 8 == 0) {
+            printf("\n");
+        }
+    }
+    printf("\n");
+}
+
+
+void dump_registers(CPU* cpu) {
+    printf("A:  $%02X\n", cpu->A);
+    printf("X:  $%02X\n", cpu->X);
+    printf("Y:  $%02X\n", cpu->Y);
+    printf("SP: $%02X\n", cpu->SP);
+    printf("PC: $%04X\n", cpu->PC);
+    printf("P:  $%02X (N=%d, V=%d, B=%d, D=%d, I=%d, Z=%d, C=%d)\n", cpu->P,
+        (cpu->P & FLAG_N) ? 1 : 0,
+        (cpu->P & FLAG_V) ? 1 : 0,
+        (cpu->P & FLAG_B) ? 1 : 0,
+        (cpu->P & FLAG_D) ? 1 : 0,
+        (cpu->P & FLAG_I) ? 1 : 0,
+        (cpu->P & FLAG_Z) ? 1 : 0,
+        (cpu->P & FLAG_C) ? 1 : 0);
+    printf("Cycles: %llu\n", (unsigned long long)cpu->cycles);
+}
+
+
+void map_ram(CPU* cpu, uint8_t first_page, uint8_t last_page)
+{
+    flush_code_caches(cpu);
+    for (int page = first_page; page <= last_page; page++)
+    {
+        cpu->read_map[page] = &cpu->mem[page << 8];
+        cpu->write_map[page] = &cpu->mem[page << 8];
+        memset(&cpu->io[page], 0, sizeof(IoPage));
+    }
+}
+
+// Route a page's reads and/or writes to handlers. Pass NULL for either
+// direction to leave it on RAM.
+void map_io(CPU* cpu, uint8_t page, io_read_fn read, io_write_fn write, void* ctx)
+{
+    flush_code_caches(cpu);
+    cpu->read_map[page] = read ? NULL : &cpu->mem[page << 8];
+    cpu->write_map[page] = write ? NULL : &cpu->mem[page << 8];
+    cpu->io[page].read = read;
+    cpu->io[page].write = write;
+    cpu->io[page].idle = NULL;
+    cpu->io[page].ctx = ctx;
+    memset(cpu->io[page].regs, 0xFF, sizeof(cpu->io[page].regs));
+}
+
+// Narrow an I/O page's handlers to the registers first..last (same page).
+// The other addresses on the page promise to act as plain RAM, which lets
+// translated code access them directly.
+void set_io_registers(CPU* cpu, uint16_t first, uint16_t last)
+{
+    IoPage* io = &cpu->io[first >> 8];
+
+    flush_code_caches(cpu);
+    memset(io->regs, 0, sizeof(io->regs));
+    for (int address = first; address <= last; address++)
+        io->regs[(address & 0xFF) >> 3] |= 1 << (address & 7);
+}
+
+// Let idle loops read an I/O page's registers, as far as the callback
+// allows; see idle_loop()
+void set_io_idle(CPU* cpu, uint8_t page, io_idle_fn idle)
+{
+    cpu->io[page].idle = idle;
+}
+
+// Step a machine's xorshift32 generator and return the byte $FE reads
+uint8_t next_random(uint32_t* state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x >> 24;
+}
+
+// Queue a typed key. Returns 0 if the queue was full and the key dropped.
+int key_push(KeyQueue* queue, uint8_t key)
+{
+    if (queue->count == KEY_QUEUE)
+        return 0;
+    queue->keys[(queue->first + queue->count++) % KEY_QUEUE] = key;
+    return 1;
+}
+
+// Take the oldest typed key, or 0 if there is none
+uint8_t key_pop(KeyQueue* queue)
+{
+    if (queue->count == 0)
+        return 0;
+    uint8_t key = queue->keys[queue->first];
+    queue->first = (queue->first + 1) % KEY_QUEUE;
+    queue->count--;
+    return key;
+}
+
+// $00FE reads a random byte and $00FF takes the oldest key typed (0 when
+// none is waiting); the rest of the zero page is RAM
+uint8_t zero_page_read(CPU* cpu, uint16_t address, void* ctx)
+{
+    Machine* machine = ctx;
+
+    if (address == 0x00FE)
+        return next_random(&machine->rng);
+    if (address == 0x00FF)
+        return key_pop(&machine->keys);
+    return cpu->mem[address];
+}
+
+// Reading $00FF waits for a key while none is waiting; $00FE changes with
+// every read
+int zero_page_idle(CPU* cpu, uint16_t address, void* ctx)
+{
+    Machine* machine = ctx;
+
+    return address == 0x00FF && machine->keys.count == 0 ? IDLE_INPUT : 0;
+}
+
+// The cycle of the first vblank after the given cycle. Vblank n comes at
+// n * clock / FRAME_RATE, where the window's frame n ends.
+static uint64_t vblank_after(uint64_t clock, uint64_t cycle)
+{
+    uint64_t frame = (FRAME_RATE * (cycle + 1) - 1) / clock + 1;
+    return frame * clock / FRAME_RATE;
+}
+
+// Stop the timer, mask every source and place vblanks at the given clock
+// rate
+void interrupt_reset(CPU* cpu, uint64_t clock)
+{
+    Interrupts* interrupts = &cpu->interrupts;
+
+    memset(interrupts, 0, sizeof(*interrupts));
+    interrupts->timer_at = UINT64_MAX;
+    interrupts->clock = clock;
+    interrupts->vblank_at = vblank_after(clock, cpu->cycles);
+}
+
+// Catch the interrupt sources up with the cycle count
+void interrupt_update(CPU* cpu)
+{
+    Interrupts* interrupts = &cpu->interrupts;
+
+    if (interrupts->restart)
+    {
+        interrupts->restart = 0;
+        interrupts->timer_at = interrupts->timer_period ? cpu->cycles + interrupts->timer_period : UINT64_MAX;
+    }
+    if (cpu->cycles >= interrupts->vblank_at)
+    {
+        interrupts->status |= INT_VBLANK;
+        if (interrupts->control & INT_VBLANK)
+            interrupts->nmi = 1;
+        interrupts->vblank_at = vblank_after(interrupts->clock, cpu->cycles);
+    }
+    if (cpu->cycles >= interrupts->timer_at)
+    {
+        uint64_t period = interrupts->timer_period;
+        interrupts->status |= INT_TIMER;
+        interrupts->timer_at += (cpu->cycles - interrupts->timer_at) / period * period + period;
+    }
+}
+
+// No event falls inside a run, so the registers are up to date as they
+// are. Writes that change when interrupts come end the run with STOP_IO
+// after the instruction, for run_until() to plan again from there.
+uint8_t interrupt_read(CPU* cpu, uint16_t address, void* ctx)
+{
+    Interrupts* interrupts = &cpu->interrupts;
+
+    if (address == INT_CONTROL)
+        return interrupts->control;
+    if (address == INT_STATUS)
+        return interrupts->status;
+    if (address == INT_TIMER_LO)
+        return interrupts->timer_period & 0xFF;
+    if (address == INT_TIMER_HI)
+        return interrupts->timer_period >> 8;
+    return cpu->mem[address];
+}
+
+void interrupt_write(CPU* cpu, uint16_t address, uint8_t value, void* ctx)
+{
+    Interrupts* interrupts = &cpu->interrupts;
+
+    if (address == INT_CONTROL)
+    {
+        interrupts->control = value & (INT_VBLANK | INT_TIMER);
+        cpu->stop = STOP_IO;
+    }
+    else if (address == INT_STATUS)
+        interrupts->status &= ~value;
+    else if (address == INT_TIMER_LO)
+        interrupts->timer_low = value;
+    else if (address == INT_TIMER_HI)
+    {
+        interrupts->timer_period = interrupts->timer_low | (value << 8);
+        interrupts->restart = 1;
+        cpu->stop = STOP_IO;
+    }
+    else
+        cpu->mem[address] = value;
+}
+
+// The registers change only as events fire or when written
+int interrupt_idle(CPU* cpu, uint16_t address, void* ctx)
+{
+    return IDLE_EVENT;
+}
+
+void init_bus(Machine* machine)
+{
+    CPU* cpu = &machine->cpu;
+
+    map_io(cpu, 0x00, zero_page_read, NULL, machine);
+    set_io_registers(cpu, 0x00FE, 0x00FF);
+    set_io_idle(cpu, 0x00, zero_page_idle);
+    map_io(cpu, INT_CONTROL >> 8, interrupt_read, interrupt_write, NULL);
+    set_io_registers(cpu, INT_CONTROL, INT_TIMER_HI);
+    set_io_idle(cpu, INT_CONTROL >> 8, interrupt_idle);
+}
+
+// Write handler of watched pages: do the original write, then tell the
+// engines caching code from the page
+void code_page_write(CPU* cpu, uint16_t address, uint8_t value, void* ctx)
+{
+    uint8_t* ram = cpu->code_write_map[address >> 8];
+
+    if (ram)
+    {
+        if (ram[address & 0xFF] == value)
+            return;
+        ram[address & 0xFF] = value;
+    }
+    else
+    {
+        cpu->code_write[address >> 8](cpu, address, value, ctx);
+    }
+    if (cpu->decoded)
+        decode_code_written(cpu, address);
+#if JIT_X64
+    if (cpu->jit)
+        jit_code_written(cpu, address);
+#endif
+}
+
+// Write handler of pages still shared with a snapshot: copy the page into
+// mem, map it as RAM again and do the write there
+void shared_page_write(CPU* cpu, uint16_t address, uint8_t value, void* ctx)
+{
+    uint8_t page = address >> 8;
+    uint8_t* own = &cpu->mem[page << 8];
+
+    memcpy(own, cpu->read_map[page], 256);
+    cpu->read_map[page] = own;
+    if (cpu->code_watchers[page])
+    {
+        // Called through code_page_write(), which keeps trapping the page
+        cpu->code_write_map[page] = own;
+        cpu->code_write[page] = NULL;
+    }
+    else
+    {
+        cpu->write_map[page] = own;
+        cpu->io[page].write = NULL;
+    }
+    own[address & 0xFF] = value;
+}
+
+// Trap writes to a page that code is cached from. Calls nest; the page
+// gets its own mapping back after the last unwatch_code_page().
+void watch_code_page(CPU* cpu, uint8_t page)
+{
+    if (cpu->code_watchers[page]++)
+        return;
+    cpu->code_write_map[page] = cpu->write_map[page];
+    cpu->code_write[page] = cpu->io[page].write;
+    cpu->write_map[page] = NULL;
+    cpu->io[page].write = code_page_write;
+}
+
+void unwatch_code_page(CPU* cpu, uint8_t page)
+{
+    if (--cpu->code_watchers[page])
+        return;
+    cpu->write_map[page] = cpu->code_write_map[page];
+    cpu->io[page].write = cpu->code_write[page];
+}
+
+// Drop all cached and translated code, e.g. because the memory map changes
+void flush_code_caches(CPU* cpu)
+{
+    if (cpu->decoded)
+        decode_flush(cpu);
+#if JIT_X64
+    if (cpu->jit)
+        jit_flush(cpu);
+#endif
+}
+
+void snapshot_page_release(SnapshotPage* page)
+{
+    if (SDL_AtomicDecRef(&page->refs))
+        free(page);
+}
+
+// Free what a CPU holds outside itself, e.g. before it is reset or
+// discarded: the engines' caches, which are set up again on the next
+// run_until(), and its snapshot pages.
+void release_cpu(CPU* cpu)
+{
+    for (int page = 0; page < 256; page++)
+    {
+        if (cpu->snapshot_pages[page])
+            snapshot_page_release(cpu->snapshot_pages[page]);
+        cpu->snapshot_pages[page] = NULL;
+    }
+
+    if (cpu->decoded)
+    {
+        decode_flush(cpu);
+        free(cpu->decoded);
+        cpu->decoded = NULL;
+    }
+#if JIT_X64
+    if (cpu->jit)
+        jit_release(cpu);
+#endif
+}
+
+// Capture the machine's state. Returns NULL when out of memory.
+Snapshot* machine_snapshot(Machine* machine)
+{
+    CPU* cpu = &machine->cpu;
+    Snapshot* snapshot = malloc(sizeof(Snapshot));
+    if (!snapshot)
+        return NULL;
+
+    for (int page = 0; page < 256; page++)
+    {
+        SnapshotPage* last = cpu->snapshot_pages[page];
+        const uint8_t* data = ram_page(cpu, page);
+
+        // Pages still shared or written back unchanged are kept
+        if (!last || (data != last->data && memcmp(data, last->data, 256) != 0))
+        {
+            SnapshotPage* copy = malloc(sizeof(SnapshotPage));
+            if (!copy)
+            {
+                memset(&snapshot->pages[page], 0, (256 - page) * sizeof(SnapshotPage*));
+                snapshot_free(snapshot);
+                return NULL;
+            }
+            SDL_AtomicSet(&copy->refs, 1);
+            memcpy(copy->data, data, 256);
+            if (last)
+                snapshot_page_release(last);
+            cpu->snapshot_pages[page] = last = copy;
+        }
+        SDL_AtomicIncRef(&last->refs);
+        snapshot->pages[page] = last;
+    }
+
+    snapshot->A = cpu->A;
+    snapshot->X = cpu->X;
+    snapshot->Y = cpu->Y;
+    snapshot->SP = cpu->SP;
+    snapshot->P = cpu->P;
+    snapshot->PC = cpu->PC;
+    snapshot->cycles = cpu->cycles;
+    snapshot->stop_on_brk = cpu->stop_on_brk;
+    snapshot->stop_pc = cpu->stop_pc;
+    snapshot->watchdog = cpu->watchdog;
+    snapshot->engine = cpu->engine;
+    snapshot->interrupts = cpu->interrupts;
+    snapshot->keys = machine->keys;
+    snapshot->rng = machine->rng;
+    return snapshot;
+}
+
+// Give a page the contents of a snapshot page. A RAM page maps it until the
+// first write; an I/O page gets a copy in mem, which its handlers may use
+// directly. Code caches must have been flushed.
+void share_page(CPU* cpu, int page, SnapshotPage* shared)
+{
+    SDL_AtomicIncRef(&shared->refs);
+    if (cpu->snapshot_pages[page])
+        snapshot_page_release(cpu->snapshot_pages[page]);
+    cpu->snapshot_pages[page] = shared;
+
+    if (cpu->io[page].read || (cpu->io[page].write && cpu->io[page].write != shared_page_write))
+    {
+        memcpy(&cpu->mem[page << 8], shared->data, 256);
+    }
+    else
+    {
+        cpu->read_map[page] = shared->data;
+        cpu->write_map[page] = NULL;
+        cpu->io[page].write = shared_page_write;
+    }
+}
+
+// Put a machine back in the state of a snapshot, keeping its memory map.
+// RAM pages are shared with the snapshot until written; I/O pages are
+// copied into mem, which their handlers may use directly.
+void machine_restore(Machine* machine, const Snapshot* snapshot)
+{
+    CPU* cpu = &machine->cpu;
+
+    flush_code_caches(cpu);
+    for (int page = 0; page < 256; page++)
+        share_page(cpu, page, snapshot->pages[page]);
+
+    cpu->A = snapshot->A;
+    cpu->X = snapshot->X;
+    cpu->Y = snapshot->Y;
+    cpu->SP = snapshot->SP;
+    cpu->P = snapshot->P;
+    cpu->PC = snapshot->PC;
+    cpu->cycles = snapshot->cycles;
+    cpu->page_crossed = 0;
+    cpu->stop = STOP_NONE;
+    cpu->stop_on_brk = snapshot->stop_on_brk;
+    cpu->stop_pc = snapshot->stop_pc;
+    cpu->watchdog = snapshot->watchdog;
+    cpu->engine = snapshot->engine;
+    cpu->interrupts = snapshot->interrupts;
+    machine->keys = snapshot->keys;
+    machine->rng = snapshot->rng;
+}
+
+// A new machine wired like parent and restored to snapshot, sharing the
+// snapshot's pages. Handlers given the parent as context get the child.
+// Returns NULL when out of memory.
+Machine* machine_fork(const Machine* parent, const Snapshot* snapshot)
+{
+    const CPU* from = &parent->cpu;
+    Machine* child = calloc(1, sizeof(Machine));
+    if (!child)
+        return NULL;
+
+    machine_reset(child, 0);
+    for (int page = 0; page < 256; page++)
+    {
+        CPU* cpu = &child->cpu;
+        io_write_fn write = from->code_watchers[page] ? from->code_write[page] : from->io[page].write;
+        void* ctx = from->io[page].ctx == parent ? child : from->io[page].ctx;
+
+        if (write == shared_page_write)
+            write = NULL;
+        if (from->io[page].read || write)
+        {
+            map_io(cpu, (uint8_t)page, from->io[page].read, write, ctx);
+            memcpy(cpu->io[page].regs, from->io[page].regs, sizeof(cpu->io[page].regs));
+            cpu->io[page].idle = from->io[page].idle;
+        }
+        else if (cpu->io[page].read || cpu->io[page].write)
+        {
+            map_ram(cpu, (uint8_t)page, (uint8_t)page);
+        }
+    }
+    machine_restore(child, snapshot);
+    return child;
+}
+
+void snapshot_free(Snapshot* snapshot)
+{
+    for (int page = 0; page < 256; page++)
+    {
+        if (snapshot->pages[page])
+            snapshot_page_release(snapshot->pages[page]);
+    }
+    free(snapshot);
+}
+
+// A rewind ring holding about bytes of deltas. Returns NULL when out of memory.
+Rewind* rewind_create(size_t bytes)
+{
+    Rewind* rewind = calloc(1, sizeof(Rewind));
+    if (!rewind)
+        return NULL;
+
+    if (bytes < 2 * REWIND_MAX_DELTA)
+        bytes = 2 * REWIND_MAX_DELTA;
+    rewind->size = bytes;
+    // An unchanged checkpoint takes two bytes, but most change a few pages
+    rewind->capacity = (int)(bytes / 64);
+    rewind->data = malloc(rewind->size);
+    rewind->checkpoints = malloc(rewind->capacity * sizeof(Checkpoint));
+    if (!rewind->data || !rewind->checkpoints)
+    {
+        rewind_free(rewind);
+        return NULL;
+    }
+    return rewind;
+}
+
+void rewind_free(Rewind* rewind)
+{
+    free(rewind->data);
+    free(rewind->checkpoints);
+    free(rewind);
+}
+
+// A page's XOR against its old contents as runs: a count of unchanged bytes
+// to skip, a count of changed bytes, then those. A lone unchanged byte costs
+// less inside a run than as a new one. Returns the bytes written to out.
+static size_t rewind_encode_page(const uint8_t* delta, uint8_t* out)
+{
+    size_t length = 0;
+    int pos = 0;
+
+    while (pos < 256)
+    {
+        int skip = 0;
+        int count = 0;
+        while (pos + skip < 256 && !delta[pos + skip] && skip < 255)
+            skip++;
+        pos += skip;
+        while (pos + count < 256 && count < 255 &&
+            (delta[pos + count] || (pos + count + 1 < 256 && delta[pos + count + 1])))
+            count++;
+        out[length++] = (uint8_t)skip;
+        out[length++] = (uint8_t)count;
+        memcpy(&out[length], &delta[pos], count);
+        length += count;
+        pos += count;
+    }
+    return length;
+}
+
+// Undo a page's delta. Returns the encoded bytes that follow it.
+static const uint8_t* rewind_apply_page(uint8_t* page, const uint8_t* in)
+{
+    int pos = 0;
+
+    while (pos < 256)
+    {
+        pos += *in++;
+        int count = *in++;
+        for (int i = 0; i < count; i++)
+            page[pos++] ^= *in++;
+    }
+    return in;
+}
+
+static void rewind_drop_oldest(Rewind* rewind)
+{
+    rewind->first = (rewind->first + 1) % rewind->capacity;
+    rewind->count--;
+}
+
+// Find room for length bytes at the head, dropping the oldest checkpoints
+// it would overwrite
+static size_t rewind_reserve(Rewind* rewind, size_t length)
+{
+    while (rewind->count > 0)
+    {
+        size_t tail = rewind->checkpoints[rewind->first].offset;
+        if (tail >= rewind->head && rewind->head + length <= tail)
+            break;
+        if (tail < rewind->head)
+        {
+            if (rewind->head + length <= rewind->size)
+                break;
+            rewind->head = 0;
+            continue;
+        }
+        rewind_drop_oldest(rewind);
+    }
+    if (rewind->count == 0 && rewind->head + length > rewind->size)
+        rewind->head = 0;
+
+    size_t offset = rewind->head;
+    rewind->head += length;
+    return offset;
+}
+
+// Add a checkpoint of the machine's current state. The delta holds only
+// the pages that changed since the previous checkpoint.
+void rewind_record(Rewind* rewind, Machine* machine, uint64_t instructions)
+{
+    CPU* cpu = &machine->cpu;
+    uint8_t* out = rewind->scratch + 2;
+    int pages = 0;
+
+    for (int page = 0; page < 256; page++)
+    {
+        const uint8_t* now = ram_page(cpu, page);
+        uint8_t* old = &rewind->image[page << 8];
+        uint8_t delta[256];
+
+        if (rewind->count == 0)
+        {
+            memcpy(old, now, 256);
+            continue;
+        }
+        if (memcmp(old, now, 256) == 0)
+            continue;
+        for (int i = 0; i < 256; i++)
+            delta[i] = old[i] ^ now[i];
+        memcpy(old, now, 256);
+        *out++ = (uint8_t)page;
+        out += rewind_encode_page(delta, out);
+        pages++;
+    }
+    rewind->scratch[0] = (uint8_t)pages;
+    rewind->scratch[1] = (uint8_t)(pages >> 8);
+
+    size_t length = out - rewind->scratch;
+    if (rewind->count == rewind->capacity)
+        rewind_drop_oldest(rewind);
+    size_t offset = rewind_reserve(rewind, length);
+    memcpy(&rewind->data[offset], rewind->scratch, length);
+
+    Checkpoint* checkpoint = &rewind->checkpoints[(rewind->first + rewind->count++) % rewind->capacity];
+    checkpoint->A = cpu->A;
+    checkpoint->X = cpu->X;
+    checkpoint->Y = cpu->Y;
+    checkpoint->SP = cpu->SP;
+    checkpoint->P = cpu->P;
+    checkpoint->PC = cpu->PC;
+    checkpoint->cycles = cpu->cycles;
+    checkpoint->instructions = instructions;
+    checkpoint->interrupts = cpu->interrupts;
+    checkpoint->keys = machine->keys;
+    checkpoint->rng = machine->rng;
+    checkpoint->offset = offset;
+    checkpoint->length = length;
+}
+
+// Put the machine back to the checkpoint before the newest and forget the
+// newest, so each call goes one further. The oldest checkpoint stays. Sets
+// instructions to the count at the checkpoint. Returns 0 when there is no
+// older checkpoint, leaving the machine as it is.
+int rewind_step(Rewind* rewind, Machine* machine, uint64_t* instructions)
+{
+    CPU* cpu = &machine->cpu;
+
+    if (rewind->count < 2)
+        return 0;
+
+    const Checkpoint* newest = &rewind->checkpoints[(rewind->first + rewind->count - 1) % rewind->capacity];
+    const uint8_t* in = &rewind->data[newest->offset];
+    int pages = in[0] | (in[1] << 8);
+    in += 2;
+    for (int i = 0; i < pages; i++)
+    {
+        uint8_t page = *in++;
+        in = rewind_apply_page(&rewind->image[page << 8], in);
+    }
+    rewind->head = newest->offset;
+    rewind->count--;
+
+    // Memory changes wholesale; bring each page that differs back
+    flush_code_caches(cpu);
+    for (int page = 0; page < 256; page++)
+    {
+        const uint8_t* old = &rewind->image[page << 8];
+        if (memcmp(ram_page(cpu, page), old, 256) == 0)
+            continue;
+        if (cpu->read_map[page] && cpu->read_map[page] != &cpu->mem[page << 8])
+            shared_page_write(cpu, (uint16_t)(page << 8), old[0], NULL);
+        memcpy(&cpu->mem[page << 8], old, 256);
+    }
+
+    const Checkpoint* checkpoint = &rewind->checkpoints[(rewind->first + rewind->count - 1) % rewind->capacity];
+    cpu->A = checkpoint->A;
+    cpu->X = checkpoint->X;
+    cpu->Y = checkpoint->Y;
+    cpu->SP = checkpoint->SP;
+    cpu->P = checkpoint->P;
+    cpu->PC = checkpoint->PC;
+    cpu->cycles = checkpoint->cycles;
+    cpu->page_crossed = 0;
+    cpu->stop = STOP_NONE;
+    cpu->interrupts = checkpoint->interrupts;
+    machine->keys = checkpoint->keys;
+    machine->rng = checkpoint->rng;
+    *instructions = checkpoint->instructions;
+    return 1;
+}
+
+uint8_t fetch_byte(CPU* cpu) {
+    return mem_read(cpu, cpu->PC++);
+}
+
+uint16_t fetch_word(CPU* cpu) {
+    uint16_t low = mem_read(cpu, cpu->PC++);
+    uint16_t high = mem_read(cpu, cpu->PC++);
+    return (high << 8) | low;
+}
+
+void push_byte(CPU* cpu, uint8_t val)
+{
+    mem_write(cpu, 0x100 + cpu->SP, val);
+    cpu->SP--;
+}
+
+uint8_t pull_byte(CPU* cpu)
+{
+    cpu->SP++;
+    return mem_read(cpu, 0x100 + cpu->SP);
+}
+
+// Take an IRQ or NMI through the vector at the given address: push PC and
+// P with B clear, so the handler can tell it from a BRK, and mask IRQs.
+// RTI returns to where it struck.
+void handle_interrupt(CPU* cpu, uint16_t vector)
+{
+    push_byte(cpu, cpu->PC >> 8);
+    push_byte(cpu, cpu->PC & 0xFF);
+    push_byte(cpu, (cpu->P & ~FLAG_B) | 0x20);
+    cpu->P |= FLAG_I;
+    cpu->PC = mem_read(cpu, vector) | (mem_read(cpu, vector + 1) << 8);
+    cpu->cycles += 7;
+}
+
+void set_zero_and_negative_flags(CPU* cpu, uint8_t value)
+{
+    cpu->P &= ~(FLAG_N | FLAG_Z);
+    if (value == 0)
+        cpu->P |= FLAG_Z;
+    if (value & 0x80)
+        cpu->P |= FLAG_N;
+}
+
+void branch(CPU* cpu, uint16_t target)
+{
+    // A taken branch costs one extra cycle, two if it lands in another page
+    cpu->cycles += ((cpu->PC ^ target) & 0xFF00) ? 2 : 1;
+    cpu->PC = target;
+}
+
+// ADC and SBC in decimal mode, as the NMOS 6502 does them, for each carry
+// in, A and operand: the result in the low byte and the N, V, Z and C flags
+// in the high one. Filled by decimal_init().
+static uint16_t decimal_adc[2][256][256];
+static uint16_t decimal_sbc[2][256][256];
+
+// Binary ADC, setting N, V, Z and C in *p. SBC is ADC of the inverted operand.
+FORCE_INLINE uint8_t adc_binary(uint8_t a, uint8_t value, uint8_t* p)
+{
+    uint16_t result = a + value + (*p & FLAG_C);
+    uint8_t flags = *p & ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
+
+    flags |= (result >> 8) & FLAG_C;
+    flags |= ((a ^ result) & (value ^ result) & 0x80) >> 1;
+    flags |= (result & FLAG_N) | ((uint8_t)result ? 0 : FLAG_Z);
+    *p = flags;
+    return (uint8_t)result;
+}
+
+// The one ADC and SBC of every engine and addressing mode, and of RRA and
+// ISC: returns the new A and sets N, V, Z and C in *p, decimal mode
+// included. A decimal one costs a table lookup, about as much as a binary one.
+FORCE_INLINE uint8_t adc_core(uint8_t a, uint8_t value, uint8_t* p)
+{
+    if (*p & FLAG_D)
+    {
+        uint16_t entry = decimal_adc[*p & FLAG_C][a][value];
+        *p = (*p & ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C)) | (entry >> 8);
+        return (uint8_t)entry;
+    }
+    return adc_binary(a, value, p);
+}
+
+FORCE_INLINE uint8_t sbc_core(uint8_t a, uint8_t value, uint8_t* p)
+{
+    if (*p & FLAG_D)
+    {
+        uint16_t entry = decimal_sbc[*p & FLAG_C][a][value];
+        *p = (*p & ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C)) | (entry >> 8);
+        return (uint8_t)entry;
+    }
+    return adc_binary(a, (uint8_t)~value, p);
+}
+
+void decimal_init(void)
+{
+    for (int carry = 0; carry < 2; carry++)
+        for (int a = 0; a < 256; a++)
+            for (int b = 0; b < 256; b++)
+            {
+                // ADC: Z as in binary mode, N and V from the high digit
+                // before it is adjusted, C after
+                int low = (a & 0x0F) + (b & 0x0F) + carry;
+                if (low >= 0x0A)
+                    low = ((low + 0x06) & 0x0F) + 0x10;
+                int sum = (a & 0xF0) + (b & 0xF0) + low;
+                uint8_t flags = (uint8_t)(a + b + carry) ? 0 : FLAG_Z;
+                flags |= sum & FLAG_N;
+                flags |= ((a ^ sum) & (b ^ sum) & 0x80) >> 1;
+                if (sum >= 0xA0)
+                    sum += 0x60;
+                flags |= sum >= 0x100 ? FLAG_C : 0;
+                decimal_adc[carry][a][b] = (uint8_t)sum | flags << 8;
+
+                // SBC: the flags of binary mode, digits adjusted
+                uint8_t p = carry;
+                adc_binary((uint8_t)a, (uint8_t)~b, &p);
+                low = (a & 0x0F) - (b & 0x0F) + carry - 1;
+                if (low < 0)
+                    low = ((low - 0x06) & 0x0F) - 0x10;
+                int difference = (a & 0xF0) - (b & 0xF0) + low;
+                if (difference < 0)
+                    difference -= 0x60;
+                decimal_sbc[carry][a][b] = (uint8_t)difference | p << 8;
+            }
+}
+
+uint16_t get_address(CPU* cpu, uint8_t mode)
+{
+    uint16_t address = 0;
+    uint8_t zp_addr;
+    uint16_t abs_addr;
+    uint8_t temp_byte;
+
+    switch (mode)
+    {
+    case AM_IMM:
+        address = cpu->PC++;
+        break;
+    case AM_ZP:
+        zp_addr = fetch_byte(cpu);
+        address = zp_addr;
+        break;
+    case AM_ZPX:
+        zp_addr = fetch_byte(cpu);
+        address = (zp_addr + cpu->X) & 0xFF;
+        break;
+    case AM_ZPY:
+        zp_addr = fetch_byte(cpu);
+        address = (zp_addr + cpu->Y) & 0xFF;
+        break;
+    case AM_IZX:
+        zp_addr = fetch_byte(cpu);
+        temp_byte = (zp_addr + cpu->X) & 0xFF;
+        address = mem_read(cpu, temp_byte) | (mem_read(cpu, (temp_byte + 1) & 0xFF) << 8);
+        break;
+    case AM_IZY:
+        zp_addr = fetch_byte(cpu);
+        abs_addr = mem_read(cpu, zp_addr) | (mem_read(cpu, (zp_addr + 1) & 0xFF) << 8);
+        address = abs_addr + cpu->Y;
+        cpu->page_crossed = (abs_addr ^ address) >> 8 != 0;
+        break;
+    case AM_ABS:
+        address = fetch_word(cpu);
+        break;
+    case AM_ABX:
+        abs_addr = fetch_word(cpu);
+        address = abs_addr + cpu->X;
+        cpu->page_crossed = (abs_addr ^ address) >> 8 != 0;
+        break;
+    case AM_ABY:
+        abs_addr = fetch_word(cpu);
+        address = abs_addr + cpu->Y;
+        cpu->page_crossed = (abs_addr ^ address) >> 8 != 0;
+        break;
+    case AM_IND:
+        abs_addr = fetch_word(cpu);
+        address = mem_read(cpu, abs_addr) | (mem_read(cpu, (abs_addr & 0xFF00) | ((abs_addr + 1) & 0xFF)) << 8);
+        break;
+    case AM_REL:
+        // Fetch first: the offset is relative to the byte after the operand
+        temp_byte = fetch_byte(cpu);
+        address = cpu->PC + (int8_t)temp_byte;
+        break;
+
+    default:
+        break;
+    }
+    return address;
+}
+
+int execute_instruction(CPU* cpu) {
+    uint64_t start_cycles = cpu->cycles;
+    uint8_t opcode = fetch_byte(cpu);
+    uint16_t address = 0;
+    uint8_t value = 0;
+    uint16_t temp_word = 0;
+    uint8_t temp_byte = 0;
+    uint8_t temp_carry = 0;
+
+    cpu->page_crossed = 0;
+    switch (opcode)
+    {
+        // --- 0x ---
+    case 0x00: // BRK
+        if (cpu->stop_on_brk)
+        {
+            cpu->PC--;
+            cpu->stop = STOP_BRK;
+            return 0;
+        }
+        push_byte(cpu, cpu->PC >> 8);
+        push_byte(cpu, cpu->PC & 0xFF);
+        push_byte(cpu, cpu->P | FLAG_B);
+        cpu->P |= FLAG_I; // Set interrupt flag
+        cpu->PC = (mem_read(cpu, 0xFFFE) | (mem_read(cpu, 0xFFFF) << 8)); // Load interrupt vector
+        break;
+    case 0x01: // ORA izx
+        address = get_address(cpu, AM_IZX);
+        cpu->A |= mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x02: // KIL
+    case 0x12:
+    case 0x22:
+    case 0x32:
+    case 0x42:
+    case 0x52:
+    case 0x62:
+    case 0x72:
+    case 0x92:
+    case 0xB2:
+    case 0xD2:
+    case 0xF2:
+        fprintf(stderr, "KIL Instruction executed, halting.\n");
+        cpu->PC--;
+        cpu->stop = STOP_KIL;
+        break;
+    case 0x03: // SLO izx
+        address = get_address(cpu, AM_IZX);
+        value = mem_read(cpu, address);
+        cpu->P &= ~FLAG_C;
+        if (value & 0x80)
+            cpu->P |= FLAG_C;
+        value = value << 1;
+        mem_write(cpu, address, value);
+        cpu->A |= value;
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x04: // NOP zp
+        get_address(cpu, AM_ZP);
+        break;
+    case 0x05: // ORA zp
+        address = get_address(cpu, AM_ZP);
+        cpu->A |= mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x06: // ASL zp
+        address = get_address(cpu, AM_ZP);
+        value = mem_read(cpu, address);
+        cpu->P &= ~FLAG_C;
+        if (value & 0x80)
+            cpu->P |= FLAG_C;
+        value = value << 1;
+        mem_write(cpu, address, value);
+        set_zero_and_negative_flags(cpu, value);
+        break;
+    case 0x07: // SLO zp
+        address = get_address(cpu, AM_ZP);
+        value = mem_read(cpu, address);
+        cpu->P &= ~FLAG_C;
+        if (value & 0x80)
+            cpu->P |= FLAG_C;
+        value = value << 1;
+        mem_write(cpu, address, value);
+        cpu->A |= value;
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x08: // PHP
+        push_byte(cpu, cpu->P);
+        break;
+    case 0x09: // ORA imm
+        address = get_address(cpu, AM_IMM);
+        cpu->A |= mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x0A: // ASL
+        cpu->P &= ~FLAG_C;
+        if (cpu->A & 0x80)
+            cpu->P |= FLAG_C;
+        cpu->A = cpu->A << 1;
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x0B: // ANC imm
+        address = get_address(cpu, AM_IMM);
+        cpu->A &= mem_read(cpu, address);
+        if (cpu->A & 0x80)
+            cpu->P |= FLAG_C;
+        else
+            cpu->P &= ~FLAG_C;
+        set_zero_and_negative_flags(cpu, cpu->A);
+
+        break;
+    case 0x0C: // NOP abs
+        get_address(cpu, AM_ABS);
+        break;
+    case 0x0D: // ORA abs
+        address = get_address(cpu, AM_ABS);
+        cpu->A |= mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x0E: // ASL abs
+        address = get_address(cpu, AM_ABS);
+        value = mem_read(cpu, address);
+        cpu->P &= ~FLAG_C;
+        if (value & 0x80)
+            cpu->P |= FLAG_C;
+        value = value << 1;
+        mem_write(cpu, address, value);
+        set_zero_and_negative_flags(cpu, value);
+        break;
+    case 0x0F: // SLO abs
+        address = get_address(cpu, AM_ABS);
+        value = mem_read(cpu, address);
+        cpu->P &= ~FLAG_C;
+        if (value & 0x80)
+            cpu->P |= FLAG_C;
+        value = value << 1;
+        mem_write(cpu, address, value);
+        cpu->A |= value;
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+        // --- 1x ---
+    case 0x10: // BPL rel
+        address = get_address(cpu, AM_REL);
+        if (!(cpu->P & FLAG_N))
+            branch(cpu, address);
+        break;
+    case 0x11: // ORA izy
+        address = get_address(cpu, AM_IZY);
+        cpu->A |= mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x13: // SLO izy
+        address = get_address(cpu, AM_IZY);
+        value = mem_read(cpu, address);
+        cpu->P &= ~FLAG_C;
+        if (value & 0x80)
+            cpu->P |= FLAG_C;
+        value = value << 1;
+        mem_write(cpu, address, value);
+        cpu->A |= value;
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x14: // NOP zpx
+        get_address(cpu, AM_ZPX);
+        break;
+    case 0x15: // ORA zpx
+        address = get_address(cpu, AM_ZPX);
+        cpu->A |= mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x16: // ASL zpx
+        address = get_address(cpu, AM_ZPX);
+        value = mem_read(cpu, address);
+        cpu->P &= ~FLAG_C;
+        if (value & 0x80)
+            cpu->P |= FLAG_C;
+        value = value << 1;
+        mem_write(cpu, address, value);
+        set_zero_and_negative_flags(cpu, value);
+        break;
+    case 0x17: // SLO zpx
+        address = get_address(cpu, AM_ZPX);
+        value = mem_read(cpu, address);
+        cpu->P &= ~FLAG_C;
+        if (value & 0x80)
+            cpu->P |= FLAG_C;
+        value = value << 1;
+        mem_write(cpu, address, value);
+        cpu->A |= value;
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x18: // CLC
+        cpu->P &= ~FLAG_C;
+        break;
+    case 0x19: // ORA aby
+        address = get_address(cpu, AM_ABY);
+        cpu->A |= mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x1A: // NOP
+        break;
+    case 0x1B: // SLO aby
+        address = get_address(cpu, AM_ABY);
+        value = mem_read(cpu, address);
+        cpu->P &= ~FLAG_C;
+        if (value & 0x80)
+            cpu->P |= FLAG_C;
+        value = value << 1;
+        mem_write(cpu, address, value);
+        cpu->A |= value;
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x1C: // NOP abx
+        get_address(cpu, AM_ABX);
+        break;
+    case 0x1D: // ORA abx
+        address = get_address(cpu, AM_ABX);
+        cpu->A |= mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x1E: // ASL abx
+        address = get_address(cpu, AM_ABX);
+        value = mem_read(cpu, address);
+        cpu->P &= ~FLAG_C;
+        if (value & 0x80)
+            cpu->P |= FLAG_C;
+        value = value << 1;
+        mem_write(cpu, address, value);
+        set_zero_and_negative_flags(cpu, value);
+        break;
+    case 0x1F: // SLO abx
+        address = get_address(cpu, AM_ABX);
+        value = mem_read(cpu, address);
+        cpu->P &= ~FLAG_C;
+        if (value & 0x80)
+            cpu->P |= FLAG_C;
+        value = value << 1;
+        mem_write(cpu, address, value);
+        cpu->A |= value;
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+
+        // --- 2x ---
+    case 0x20: // JSR abs
+        // Push the address of the operand's last byte; RTS adds one
+        push_byte(cpu, (cpu->PC + 1) >> 8);
+        push_byte(cpu, (cpu->PC + 1) & 0xFF);
+        cpu->PC = get_address(cpu, AM_ABS);
+        break;
+    case 0x21: // AND izx
+        address = get_address(cpu, AM_IZX);
+        cpu->A &= mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x23: // RLA izx
+        address = get_address(cpu, AM_IZX);
+        value = mem_read(cpu, address);
+        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
+        cpu->P &= ~FLAG_C;
+        if (value & 0x80)
+            cpu->P |= FLAG_C;
+        value = (value << 1) | temp_carry;
+        mem_write(cpu, address, value);
+        cpu->A &= value;
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x24: // BIT zp
+        address = get_address(cpu, AM_ZP);
+        value = mem_read(cpu, address);
+        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z);
+        if (value & FLAG_N)
+            cpu->P |= FLAG_N;
+        if (value & FLAG_V)
+            cpu->P |= FLAG_V;
+        if (!(cpu->A & value))
+            cpu->P |= FLAG_Z;
+        break;
+    case 0x25: // AND zp
+        address = get_address(cpu, AM_ZP);
+        cpu->A &= mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x26: // ROL zp
+        address = get_address(cpu, AM_ZP);
+        value = mem_read(cpu, address);
+        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
+        cpu->P &= ~FLAG_C;
+        if (value & 0x80)
+            cpu->P |= FLAG_C;
+        value = (value << 1) | temp_carry;
+        mem_write(cpu, address, value);
+        set_zero_and_negative_flags(cpu, value);
+        break;
+    case 0x27: // RLA zp
+        address = get_address(cpu, AM_ZP);
+        value = mem_read(cpu, address);
+        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
+        cpu->P &= ~FLAG_C;
+        if (value & 0x80)
+            cpu->P |= FLAG_C;
+        value = (value << 1) | temp_carry;
+        mem_write(cpu, address, value);
+        cpu->A &= value;
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x28: // PLP
+        cpu->P = pull_byte(cpu);
+        cpu->P |= 0x20; // Ensure B flag is always 1
+        break;
+    case 0x29: // AND imm
+        address = get_address(cpu, AM_IMM);
+        cpu->A &= mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x2A: // ROL
+        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
+        cpu->P &= ~FLAG_C;
+        if (cpu->A & 0x80)
+            cpu->P |= FLAG_C;
+        cpu->A = (cpu->A << 1) | temp_carry;
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x2B: // ANC imm
+        address = get_address(cpu, AM_IMM);
+        cpu->A &= mem_read(cpu, address);
+        if (cpu->A & 0x80)
+            cpu->P |= FLAG_C;
+        else
+            cpu->P &= ~FLAG_C;
+        set_zero_and_negative_flags(cpu, cpu->A);
+
+        break;
+    case 0x2C: // BIT abs
+        address = get_address(cpu, AM_ABS);
+        value = mem_read(cpu, address);
+        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z);
+        if (value & FLAG_N)
+            cpu->P |= FLAG_N;
+        if (value & FLAG_V)
+            cpu->P |= FLAG_V;
+        if (!(cpu->A & value))
+            cpu->P |= FLAG_Z;
+        break;
+    case 0x2D: // AND abs
+        address = get_address(cpu, AM_ABS);
+        cpu->A &= mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x2E: // ROL abs
+        address = get_address(cpu, AM_ABS);
+        value = mem_read(cpu, address);
+        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
+        cpu->P &= ~FLAG_C;
+        if (value & 0x80)
+            cpu->P |= FLAG_C;
+        value = (value << 1) | temp_carry;
+        mem_write(cpu, address, value);
+        set_zero_and_negative_flags(cpu, value);
+        break;
+    case 0x2F: // RLA abs
+        address = get_address(cpu, AM_ABS);
+        value = mem_read(cpu, address);
+        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
+        cpu->P &= ~FLAG_C;
+        if (value & 0x80)
+            cpu->P |= FLAG_C;
+        value = (value << 1) | temp_carry;
+        mem_write(cpu, address, value);
+        cpu->A &= value;
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+
+        // --- 3x ---
+    case 0x30: // BMI rel
+        address = get_address(cpu, AM_REL);
+        if (cpu->P & FLAG_N)
+            branch(cpu, address);
+        break;
+    case 0x31: // AND izy
+        address = get_address(cpu, AM_IZY);
+        cpu->A &= mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x33: // RLA izy
+        address = get_address(cpu, AM_IZY);
+        value = mem_read(cpu, address);
+        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
+        cpu->P &= ~FLAG_C;
+        if (value & 0x80)
+            cpu->P |= FLAG_C;
+        value = (value << 1) | temp_carry;
+        mem_write(cpu, address, value);
+        cpu->A &= value;
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x34: // NOP zpx
+        get_address(cpu, AM_ZPX);
+        break;
+    case 0x35: // AND zpx
+        address = get_address(cpu, AM_ZPX);
+        cpu->A &= mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x36: // ROL zpx
+        address = get_address(cpu, AM_ZPX);
+        value = mem_read(cpu, address);
+        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
+        cpu->P &= ~FLAG_C;
+        if (value & 0x80)
+            cpu->P |= FLAG_C;
+        value = (value << 1) | temp_carry;
+        mem_write(cpu, address, value);
+        set_zero_and_negative_flags(cpu, value);
+        break;
+    case 0x37: // RLA zpx
+        address = get_address(cpu, AM_ZPX);
+        value = mem_read(cpu, address);
+        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
+        cpu->P &= ~FLAG_C;
+        if (value & 0x80)
+            cpu->P |= FLAG_C;
+        value = (value << 1) | temp_carry;
+        mem_write(cpu, address, value);
+        cpu->A &= value;
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x38: // SEC
+        cpu->P |= FLAG_C;
+        break;
+    case 0x39: // AND aby
+        address = get_address(cpu, AM_ABY);
+        cpu->A &= mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x3A: // NOP
+        break;
+    case 0x3B: // RLA aby
+        address = get_address(cpu, AM_ABY);
+        value = mem_read(cpu, address);
+        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
+        cpu->P &= ~FLAG_C;
+        if (value & 0x80)
+            cpu->P |= FLAG_C;
+        value = (value << 1) | temp_carry;
+        mem_write(cpu, address, value);
+        cpu->A &= value;
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x3C: // NOP abx
+        get_address(cpu, AM_ABX);
+        break;
+    case 0x3D: // AND abx
+        address = get_address(cpu, AM_ABX);
+        cpu->A &= mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x3E: // ROL abx
+        address = get_address(cpu, AM_ABX);
+        value = mem_read(cpu, address);
+        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
+        cpu->P &= ~FLAG_C;
+        if (value & 0x80)
+            cpu->P |= FLAG_C;
+        value = (value << 1) | temp_carry;
+        mem_write(cpu, address, value);
+        set_zero_and_negative_flags(cpu, value);
+        break;
+    case 0x3F: // RLA abx
+        address = get_address(cpu, AM_ABX);
+        value = mem_read(cpu, address);
+        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
+        cpu->P &= ~FLAG_C;
+        if (value & 0x80)
+            cpu->P |= FLAG_C;
+        value = (value << 1) | temp_carry;
+        mem_write(cpu, address, value);
+        cpu->A &= value;
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+        // --- 4x ---
+    case 0x40: // RTI
+        cpu->P = pull_byte(cpu);
+        cpu->P |= 0x20; // Ensure B flag is always 1
+        cpu->PC = pull_byte(cpu);
+        cpu->PC |= pull_byte(cpu) << 8;
+        break;
+    case 0x41: // EOR izx
+        address = get_address(cpu, AM_IZX);
+        cpu->A ^= mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x43: // SRE izx
+        address = get_address(cpu, AM_IZX);
+        value = mem_read(cpu, address);
+        cpu->P &= ~FLAG_C;
+        if (value & 0x01)
+            cpu->P |= FLAG_C;
+        value = value >> 1;
+        mem_write(cpu, address, value);
+        cpu->A ^= value;
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x44: // NOP zp
+        get_address(cpu, AM_ZP);
+        break;
+    case 0x45: // EOR zp
+        address = get_address(cpu, AM_ZP);
+        cpu->A ^= mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x46: // LSR zp
+        address = get_address(cpu, AM_ZP);
+        uint8_t value = mem_read(cpu, address);
+        cpu->P &= ~FLAG_C;
+        if (value & 0x01)
+            cpu->P |= FLAG_C;
+        value = value >> 1;
+        mem_write(cpu, address, value);
+        set_zero_and_negative_flags(cpu, value);
+        break;
+    case 0x47: // SRE zp
+        address = get_address(cpu, AM_ZP);
+        value = mem_read(cpu, address);
+        cpu->P &= ~FLAG_C;
+        if (value & 0x01)
+            cpu->P |= FLAG_C;
+        value = value >> 1;
+        mem_write(cpu, address, value);
+        cpu->A ^= value;
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x48: // PHA
+        push_byte(cpu, cpu->A);
+        break;
+    case 0x49: // EOR imm
+        address = get_address(cpu, AM_IMM);
+        cpu->A ^= mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x4A: // LSR
+        cpu->P &= ~FLAG_C;
+        if (cpu->A & 0x01)
+            cpu->P |= FLAG_C;
+        cpu->A = cpu->A >> 1;
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x4B: // ALR imm
+        address = get_address(cpu, AM_IMM);
+        cpu->A &= mem_read(cpu, address);
+        cpu->P &= ~FLAG_C;
+        if (cpu->A & 0x01)
+            cpu->P |= FLAG_C;
+        cpu->A = cpu->A >> 1;
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x4C: // JMP abs
+        cpu->PC = get_address(cpu, AM_ABS);
+        break;
+    case 0x4D: // EOR abs
+        address = get_address(cpu, AM_ABS);
+        cpu->A ^= mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x4E: // LSR abs
+        address = get_address(cpu, AM_ABS);
+        value = mem_read(cpu, address);
+        cpu->P &= ~FLAG_C;
+        if (value & 0x01)
+            cpu->P |= FLAG_C;
+        value = value >> 1;
+        mem_write(cpu, address, value);
+        set_zero_and_negative_flags(cpu, value);
+        break;
+    case 0x4F: // SRE abs
+        address = get_address(cpu, AM_ABS);
+        value = mem_read(cpu, address);
+        cpu->P &= ~FLAG_C;
+        if (value & 0x01)
+            cpu->P |= FLAG_C;
+        value = value >> 1;
+        mem_write(cpu, address, value);
+        cpu->A ^= value;
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+        // --- 5x ---
+    case 0x50: // BVC rel
+        address = get_address(cpu, AM_REL);
+        if (!(cpu->P & FLAG_V))
+            branch(cpu, address);
+        break;
+    case 0x51: // EOR izy
+        address = get_address(cpu, AM_IZY);
+        cpu->A ^= mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x53: // SRE izy
+        address = get_address(cpu, AM_IZY);
+        value = mem_read(cpu, address);
+        cpu->P &= ~FLAG_C;
+        if (value & 0x01)
+            cpu->P |= FLAG_C;
+        value = value >> 1;
+        mem_write(cpu, address, value);
+        cpu->A ^= value;
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x54: // NOP zpx
+        get_address(cpu, AM_ZPX);
+        break;
+    case 0x55: // EOR zpx
+        address = get_address(cpu, AM_ZPX);
+        cpu->A ^= mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x56: // LSR zpx
+        address = get_address(cpu, AM_ZPX);
+        value = mem_read(cpu, address);
+        cpu->P &= ~FLAG_C;
+        if (value & 0x01)
+            cpu->P |= FLAG_C;
+        value = value >> 1;
+        mem_write(cpu, address, value);
+        set_zero_and_negative_flags(cpu, value);
+        break;
+    case 0x57: // SRE zpx
+        address = get_address(cpu, AM_ZPX);
+        value = mem_read(cpu, address);
+        cpu->P &= ~FLAG_C;
+        if (value & 0x01)
+            cpu->P |= FLAG_C;
+        value = value >> 1;
+        mem_write(cpu, address, value);
+        cpu->A ^= value;
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x58: // CLI
+        cpu->P &= ~FLAG_I;
+        break;
+    case 0x59: // EOR aby
+        address = get_address(cpu, AM_ABY);
+        cpu->A ^= mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x5A: // NOP
+        break;
+    case 0x5B: // SRE aby
+        address = get_address(cpu, AM_ABY);
+        value = mem_read(cpu, address);
+        cpu->P &= ~FLAG_C;
+        if (value & 0x01)
+            cpu->P |= FLAG_C;
+        value = value >> 1;
+        mem_write(cpu, address, value);
+        cpu->A ^= value;
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x5C: // NOP abx
+        get_address(cpu, AM_ABX);
+        break;
+    case 0x5D: // EOR abx
+        address = get_address(cpu, AM_ABX);
+        cpu->A ^= mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x5E: // LSR abx
+        address = get_address(cpu, AM_ABX);
+        value = mem_read(cpu, address);
+        cpu->P &= ~FLAG_C;
+        if (value & 0x01)
+            cpu->P |= FLAG_C;
+        value = value >> 1;
+        mem_write(cpu, address, value);
+        set_zero_and_negative_flags(cpu, value);
+        break;
+    case 0x5F: // SRE abx
+        address = get_address(cpu, AM_ABX);
+        value = mem_read(cpu, address);
+        cpu->P &= ~FLAG_C;
+        if (value & 0x01)
+            cpu->P |= FLAG_C;
+        value = value >> 1;
+        mem_write(cpu, address, value);
+        cpu->A ^= value;
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+
+        // --- 6x ---
+    case 0x60: // RTS
+        cpu->PC = pull_byte(cpu);
+        cpu->PC |= pull_byte(cpu) << 8;
+        cpu->PC++; // Increment PC after returning
+        break;
+    case 0x61: // ADC izx
+        address = get_address(cpu, AM_IZX);
+        value = mem_read(cpu, address);
+        cpu->A = adc_core(cpu->A, value, &cpu->P);
+        break;
+    case 0x63: // RRA izx
+        address = get_address(cpu, AM_IZX);
+        value = mem_read(cpu, address);
+        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
+        cpu->P &= ~FLAG_C;
+        if (value & 0x01)
+            cpu->P |= FLAG_C;
+        value = (value >> 1) | (temp_carry << 7);
+        mem_write(cpu, address, value);
+        cpu->A = adc_core(cpu->A, value, &cpu->P);
+        break;
+    case 0x64: // NOP zp
+        get_address(cpu, AM_ZP);
+        break;
+    case 0x65: // ADC zp
+        address = get_address(cpu, AM_ZP);
+        value = mem_read(cpu, address);
+        cpu->A = adc_core(cpu->A, value, &cpu->P);
+        break;
+    case 0x66: // ROR zp
+        address = get_address(cpu, AM_ZP);
+        value = mem_read(cpu, address);
+        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
+        cpu->P &= ~FLAG_C;
+        if (value & 0x01)
+            cpu->P |= FLAG_C;
+        value = (value >> 1) | (temp_carry << 7);
+        mem_write(cpu, address, value);
+        set_zero_and_negative_flags(cpu, value);
+        break;
+    case 0x67: // RRA zp
+        address = get_address(cpu, AM_ZP);
+        value = mem_read(cpu, address);
+        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
+        cpu->P &= ~FLAG_C;
+        if (value & 0x01)
+            cpu->P |= FLAG_C;
+        value = (value >> 1) | (temp_carry << 7);
+        mem_write(cpu, address, value);
+        cpu->A = adc_core(cpu->A, value, &cpu->P);
+        break;
+    case 0x68: // PLA
+        cpu->A = pull_byte(cpu);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x69: // ADC imm
+        address = get_address(cpu, AM_IMM);
+        value = mem_read(cpu, address);
+        cpu->A = adc_core(cpu->A, value, &cpu->P);
+        break;
+    case 0x6A: // ROR
+        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
+        cpu->P &= ~FLAG_C;
+        if (cpu->A & 0x01)
+            cpu->P |= FLAG_C;
+        cpu->A = (cpu->A >> 1) | (temp_carry << 7);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x6B: // ARR imm
+        address = get_address(cpu, AM_IMM);
+        cpu->A &= mem_read(cpu, address);
+        temp_byte = cpu->A; // Store result of AND
+        cpu->P &= ~FLAG_C;
+        if ((cpu->A & 0x01))
+            cpu->P |= FLAG_C;
+        cpu->A = (cpu->A >> 1) | ((cpu->P & FLAG_C) << 7);
+        uint8_t temp_result = (temp_byte + (temp_byte & 0x0F));
+        cpu->P &= ~FLAG_V;
+        if ((temp_result ^ cpu->A) & 0x40)
+            cpu->P |= FLAG_V;
+
+        set_zero_and_negative_flags(cpu, cpu->A);
+
+        break;
+    case 0x6C: // JMP ind
+        cpu->PC = get_address(cpu, AM_IND);
+        break;
+    case 0x6D: // ADC abs
+        address = get_address(cpu, AM_ABS);
+        value = mem_read(cpu, address);
+        cpu->A = adc_core(cpu->A, value, &cpu->P);
+        break;
+    case 0x6E: // ROR abs
+        address = get_address(cpu, AM_ABS);
+        value = mem_read(cpu, address);
+        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
+        cpu->P &= ~FLAG_C;
+        if (value & 0x01)
+            cpu->P |= FLAG_C;
+        value = (value >> 1) | (temp_carry << 7);
+        mem_write(cpu, address, value);
+        set_zero_and_negative_flags(cpu, value);
+        break;
+    case 0x6F: // RRA abs
+        address = get_address(cpu, AM_ABS);
+        value = mem_read(cpu, address);
+        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
+        cpu->P &= ~FLAG_C;
+        if (value & 0x01)
+            cpu->P |= FLAG_C;
+        value = (value >> 1) | (temp_carry << 7);
+        mem_write(cpu, address, value);
+        cpu->A = adc_core(cpu->A, value, &cpu->P);
+        break;
+        // --- 7x ---
+    case 0x70: // BVS rel
+        address = get_address(cpu, AM_REL);
+        if (cpu->P & FLAG_V)
+            branch(cpu, address);
+        break;
+    case 0x71: // ADC izy
+        address = get_address(cpu, AM_IZY);
+        value = mem_read(cpu, address);
+        cpu->A = adc_core(cpu->A, value, &cpu->P);
+        break;
+    case 0x73: // RRA izy
+        address = get_address(cpu, AM_IZY);
+        value = mem_read(cpu, address);
+        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
+        cpu->P &= ~FLAG_C;
+        if (value & 0x01)
+            cpu->P |= FLAG_C;
+        value = (value >> 1) | (temp_carry << 7);
+        mem_write(cpu, address, value);
+        cpu->A = adc_core(cpu->A, value, &cpu->P);
+        break;
+    case 0x74: // NOP zpx
+        get_address(cpu, AM_ZPX);
+        break;
+    case 0x75: // ADC zpx
+        address = get_address(cpu, AM_ZPX);
+        value = mem_read(cpu, address);
+        cpu->A = adc_core(cpu->A, value, &cpu->P);
+        break;
+    case 0x76: // ROR zpx
+        address = get_address(cpu, AM_ZPX);
+        value = mem_read(cpu, address);
+        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
+        cpu->P &= ~FLAG_C;
+        if (value & 0x01)
+            cpu->P |= FLAG_C;
+        value = (value >> 1) | (temp_carry << 7);
+        mem_write(cpu, address, value);
+        set_zero_and_negative_flags(cpu, value);
+        break;
+    case 0x77: // RRA zpx
+        address = get_address(cpu, AM_ZPX);
+        value = mem_read(cpu, address);
+        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
+        cpu->P &= ~FLAG_C;
+        if (value & 0x01)
+            cpu->P |= FLAG_C;
+        value = (value >> 1) | (temp_carry << 7);
+        mem_write(cpu, address, value);
+        cpu->A = adc_core(cpu->A, value, &cpu->P);
+        break;
+    case 0x78: // SEI
+        cpu->P |= FLAG_I;
+        break;
+    case 0x79: // ADC aby
+        address = get_address(cpu, AM_ABY);
+        value = mem_read(cpu, address);
+        cpu->A = adc_core(cpu->A, value, &cpu->P);
+        break;
+    case 0x7A: // NOP
+        break;
+    case 0x7B: // RRA aby
+        address = get_address(cpu, AM_ABY);
+        value = mem_read(cpu, address);
+        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
+        cpu->P &= ~FLAG_C;
+        if (value & 0x01)
+            cpu->P |= FLAG_C;
+        value = (value >> 1) | (temp_carry << 7);
+        mem_write(cpu, address, value);
+        cpu->A = adc_core(cpu->A, value, &cpu->P);
+        break;
+    case 0x7C: // NOP abx
+        get_address(cpu, AM_ABX);
+        break;
+    case 0x7D: // ADC abx
+        address = get_address(cpu, AM_ABX);
+        value = mem_read(cpu, address);
+        cpu->A = adc_core(cpu->A, value, &cpu->P);
+        break;
+    case 0x7E: // ROR abx
+        address = get_address(cpu, AM_ABX);
+        value = mem_read(cpu, address);
+        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
+        cpu->P &= ~FLAG_C;
+        if (value & 0x01)
+            cpu->P |= FLAG_C;
+        value = (value >> 1) | (temp_carry << 7);
+        mem_write(cpu, address, value);
+        set_zero_and_negative_flags(cpu, value);
+        break;
+    case 0x7F: // RRA abx
+        address = get_address(cpu, AM_ABX);
+        value = mem_read(cpu, address);
+        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
+        cpu->P &= ~FLAG_C;
+        if (value & 0x01)
+            cpu->P |= FLAG_C;
+        value = (value >> 1) | (temp_carry << 7);
+        mem_write(cpu, address, value);
+        cpu->A = adc_core(cpu->A, value, &cpu->P);
+        break;
+
+        // --- 8x ---
+    case 0x80: // NOP imm
+        get_address(cpu, AM_IMM);
+        break;
+    case 0x81: // STA izx
+        address = get_address(cpu, AM_IZX);
+        mem_write(cpu, address, cpu->A);
+        break;
+    case 0x82: // NOP imm
+        get_address(cpu, AM_IMM);
+        break;
+    case 0x83: // SAX izx
+        address = get_address(cpu, AM_IZX);
+        mem_write(cpu, address, cpu->A & cpu->X);
+        break;
+    case 0x84: // STY zp
+        address = get_address(cpu, AM_ZP);
+        mem_write(cpu, address, cpu->Y);
+        break;
+    case 0x85: // STA zp
+        address = get_address(cpu, AM_ZP);
+        mem_write(cpu, address, cpu->A);
+        break;
+    case 0x86: // STX zp
+        address = get_address(cpu, AM_ZP);
+        mem_write(cpu, address, cpu->X);
+        break;
+    case 0x87: // SAX zp
+        address = get_address(cpu, AM_ZP);
+        mem_write(cpu, address, cpu->A & cpu->X);
+        break;
+    case 0x88: // DEY
+        cpu->Y--;
+        set_zero_and_negative_flags(cpu, cpu->Y);
+        break;
+    case 0x8A: // TXA
+        cpu->A = cpu->X;
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x8B: // XAA imm
+        address = get_address(cpu, AM_IMM);
+        cpu->A = cpu->X & mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+
+        break;
+    case 0x8C: // STY abs
+        address = get_address(cpu, AM_ABS);
+        mem_write(cpu, address, cpu->Y);
+        break;
+    case 0x8D: // STA abs
+        address = get_address(cpu, AM_ABS);
+        mem_write(cpu, address, cpu->A);
+        break;
+    case 0x8E: // STX abs
+        address = get_address(cpu, AM_ABS);
+        mem_write(cpu, address, cpu->X);
+        break;
+    case 0x8F: // SAX abs
+        address = get_address(cpu, AM_ABS);
+        mem_write(cpu, address, cpu->A & cpu->X);
+        break;
+        // --- 9x ---
+    case 0x90: // BCC rel
+        address = get_address(cpu, AM_REL);
+        if (!(cpu->P & FLAG_C))
+            branch(cpu, address);
+        break;
+    case 0x91: // STA izy
+        address = get_address(cpu, AM_IZY);
+        mem_write(cpu, address, cpu->A);
+        break;
+    case 0x93: // AHX izy
+        address = get_address(cpu, AM_IZY);
+        mem_write(cpu, address, cpu->A & cpu->X & (address >> 8));
+        break;
+    case 0x94: // STY zpx
+        address = get_address(cpu, AM_ZPX);
+        mem_write(cpu, address, cpu->Y);
+        break;
+    case 0x95: // STA zpx
+        address = get_address(cpu, AM_ZPX);
+        mem_write(cpu, address, cpu->A);
+        break;
+    case 0x96: // STX zpy
+        address = get_address(cpu, AM_ZPY);
+        mem_write(cpu, address, cpu->X);
+        break;
+    case 0x97: // SAX zpy
+        address = get_address(cpu, AM_ZPY);
+        mem_write(cpu, address, cpu->A & cpu->X);
+        break;
+    case 0x98: // TYA
+        cpu->A = cpu->Y;
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0x99: // STA aby
+        address = get_address(cpu, AM_ABY);
+        mem_write(cpu, address, cpu->A);
+        break;
+    case 0x9A: // TXS
+        cpu->SP = cpu->X;
+        break;
+    case 0x9B: // TAS aby
+        address = get_address(cpu, AM_ABY);
+        cpu->SP = cpu->A & cpu->X;
+        mem_write(cpu, address, cpu->SP & (address >> 8));
+        break;
+    case 0x9C: // SHY abx
+        address = get_address(cpu, AM_ABX);
+        mem_write(cpu, address, cpu->Y & (address >> 8));
+        break;
+    case 0x9D: // STA abx
+        address = get_address(cpu, AM_ABX);
+        mem_write(cpu, address, cpu->A);
+        break;
+    case 0x9E: // SHX aby
+        address = get_address(cpu, AM_ABY);
+        mem_write(cpu, address, cpu->X & (address >> 8));
+        break;
+    case 0x9F: // AHX aby
+        address = get_address(cpu, AM_ABY);
+        mem_write(cpu, address, cpu->A & cpu->X & (address >> 8));
+        break;
+        // --- Ax ---
+    case 0xA0: // LDY imm
+        address = get_address(cpu, AM_IMM);
+        cpu->Y = mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->Y);
+        break;
+    case 0xA1: // LDA izx
+        address = get_address(cpu, AM_IZX);
+        cpu->A = mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0xA2: // LDX imm
+        address = get_address(cpu, AM_IMM);
+        cpu->X = mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->X);
+        break;
+    case 0xA3: // LAX izx
+        address = get_address(cpu, AM_IZX);
+        cpu->A = cpu->X = mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0xA4: // LDY zp
+        address = get_address(cpu, AM_ZP);
+        cpu->Y = mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->Y);
+        break;
+    case 0xA5: // LDA zp
+        address = get_address(cpu, AM_ZP);
+        cpu->A = mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0xA6: // LDX zp
+        address = get_address(cpu, AM_ZP);
+        cpu->X = mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->X);
+        break;
+    case 0xA7: // LAX zp
+        address = get_address(cpu, AM_ZP);
+        cpu->A = cpu->X = mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0xA8: // TAY
+        cpu->Y = cpu->A;
+        set_zero_and_negative_flags(cpu, cpu->Y);
+        break;
+    case 0xA9: // LDA imm
+        address = get_address(cpu, AM_IMM);
+        cpu->A = mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0xAA: // TAX
+        cpu->X = cpu->A;
+        set_zero_and_negative_flags(cpu, cpu->X);
+        break;
+    case 0xAB: // LAX imm
+        address = get_address(cpu, AM_IMM);
+        cpu->A = cpu->X = mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0xAC: // LDY abs
+        address = get_address(cpu, AM_ABS);
+        cpu->Y = mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->Y);
+        break;
+    case 0xAD: // LDA abs
+        address = get_address(cpu, AM_ABS);
+        cpu->A = mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0xAE: // LDX abs
+        address = get_address(cpu, AM_ABS);
+        cpu->X = mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->X);
+        break;
+    case 0xAF: // LAX abs
+        address = get_address(cpu, AM_ABS);
+        cpu->A = cpu->X = mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+
+        // --- Bx ---
+    case 0xB0: // BCS rel
+        address = get_address(cpu, AM_REL);
+        if (cpu->P & FLAG_C)
+            branch(cpu, address);
+        break;
+    case 0xB1: // LDA izy
+        address = get_address(cpu, AM_IZY);
+        cpu->A = mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0xB3: // LAX izy
+        address = get_address(cpu, AM_IZY);
+        cpu->A = cpu->X = mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0xB4: // LDY zpx
+        address = get_address(cpu, AM_ZPX);
+        cpu->Y = mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->Y);
+        break;
+    case 0xB5: // LDA zpx
+        address = get_address(cpu, AM_ZPX);
+        cpu->A = mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0xB6: // LDX zpy
+        address = get_address(cpu, AM_ZPY);
+        cpu->X = mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->X);
+        break;
+    case 0xB7: // LAX zpy
+        address = get_address(cpu, AM_ZPY);
+        cpu->A = cpu->X = mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0xB8: // CLV
+        cpu->P &= ~FLAG_V;
+        break;
+    case 0xB9: // LDA aby
+        address = get_address(cpu, AM_ABY);
+        cpu->A = mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0xBA: // TSX
+        cpu->X = cpu->SP;
+        set_zero_and_negative_flags(cpu, cpu->X);
+        break;
+    case 0xBB: // LAS aby
+        address = get_address(cpu, AM_ABY);
+        cpu->A = cpu->X = cpu->SP = mem_read(cpu, address) & cpu->SP;
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0xBC: // LDY abx
+        address = get_address(cpu, AM_ABX);
+        cpu->Y = mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->Y);
+        break;
+    case 0xBD: // LDA abx
+        address = get_address(cpu, AM_ABX);
+        cpu->A = mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+    case 0xBE: // LDX aby
+        address = get_address(cpu, AM_ABY);
+        cpu->X = mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->X);
+        break;
+    case 0xBF: // LAX aby
+        address = get_address(cpu, AM_ABY);
+        cpu->A = cpu->X = mem_read(cpu, address);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        break;
+
+        // --- Cx ---
+    case 0xC0: // CPY imm
+        address = get_address(cpu, AM_IMM);
+        value = mem_read(cpu, address);
+        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
+        if (cpu->Y >= value)
+            cpu->P |= FLAG_C;
+        set_zero_and_negative_flags(cpu, cpu->Y - value);
+        break;
+    case 0xC1: // CMP izx
+        address = get_address(cpu, AM_IZX);
+        value = mem_read(cpu, address);
+        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
+        if (cpu->A >= value)
+            cpu->P |= FLAG_C;
+        set_zero_and_negative_flags(cpu, cpu->A - value);
+        break;
+    case 0xC2: // NOP imm
+        get_address(cpu, AM_IMM);
+        break;
+    case 0xC3: // DCP izx
+        address = get_address(cpu, AM_IZX);
+        value = mem_read(cpu, address);
+        value--;
+        mem_write(cpu, address, value);
+        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
+        if (cpu->A >= value)
+            cpu->P |= FLAG_C;
+        set_zero_and_negative_flags(cpu, cpu->A - value);
+        break;
+    case 0xC4: // CPY zp
+        address = get_address(cpu, AM_ZP);
+        value = mem_read(cpu, address);
+        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
+        if (cpu->Y >= value)
+            cpu->P |= FLAG_C;
+        set_zero_and_negative_flags(cpu, cpu->Y - value);
+        break;
+    case 0xC5: // CMP zp
+        address = get_address(cpu, AM_ZP);
+        value = mem_read(cpu, address);
+        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
+        if (cpu->A >= value)
+            cpu->P |= FLAG_C;
+        set_zero_and_negative_flags(cpu, cpu->A - value);
+        break;
+    case 0xC6: // DEC zp
+        address = get_address(cpu, AM_ZP);
+        value = mem_read(cpu, address);
+        value--;
+        mem_write(cpu, address, value);
+        set_zero_and_negative_flags(cpu, value);
+        break;
+    case 0xC7: // DCP zp
+        address = get_address(cpu, AM_ZP);
+        value = mem_read(cpu, address);
+        value--;
+        mem_write(cpu, address, value);
+        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
+        if (cpu->A >= value)
+            cpu->P |= FLAG_C;
+        set_zero_and_negative_flags(cpu, cpu->A - value);
+        break;
+    case 0xC8: // INY
+        cpu->Y++;
+        set_zero_and_negative_flags(cpu, cpu->Y);
+        break;
+    case 0xC9: // CMP imm
+        address = get_address(cpu, AM_IMM);
+        value = mem_read(cpu, address);
+        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
+        if (cpu->A >= value)
+            cpu->P |= FLAG_C;
+        set_zero_and_negative_flags(cpu, cpu->A - value);
+        break;
+    case 0xCA: // DEX
+        cpu->X--;
+        set_zero_and_negative_flags(cpu, cpu->X);
+        break;
+    case 0xCB: // AXS imm
+        address = get_address(cpu, AM_IMM);
+        value = mem_read(cpu, address);
+        cpu->X = (cpu->A & cpu->X) - value;
+        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
+        if ((cpu->A & cpu->X) >= value)
+            cpu->P |= FLAG_C;
+        set_zero_and_negative_flags(cpu, cpu->X);
+
+        break;
+    case 0xCC: // CPY abs
+        address = get_address(cpu, AM_ABS);
+        value = mem_read(cpu, address);
+        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
+        if (cpu->Y >= value)
             cpu->P |= FLAG_C;
-        cpu->mem[address] = value >> 1;
-        cpu->A ^= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
+        set_zero_and_negative_flags(cpu, cpu->Y - value);
         break;
-    case 0x44: // NOP zp
-        get_address(cpu, AM_ZP);
+    case 0xCD: // CMP abs
+        address = get_address(cpu, AM_ABS);
+        value = mem_read(cpu, address);
+        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
+        if (cpu->A >= value)
+            cpu->P |= FLAG_C;
+        set_zero_and_negative_flags(cpu, cpu->A - value);
         break;
-    case 0x45: // EOR zp
-        address = get_address(cpu, AM_ZP);
-        cpu->A ^= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
+    case 0xCE: // DEC abs
+        address = get_address(cpu, AM_ABS);
+        value = mem_read(cpu, address);
+        value--;
+        mem_write(cpu, address, value);
+        set_zero_and_negative_flags(cpu, value);
         break;
-    case 0x46: // LSR zp
-        address = get_address(cpu, AM_ZP);
-        uint8_t value = cpu->mem[address];
-        cpu->P &= ~FLAG_C;
-        if (value & 0x01)
+    case 0xCF: // DCP abs
+        address = get_address(cpu, AM_ABS);
+        value = mem_read(cpu, address);
+        value--;
+        mem_write(cpu, address, value);
+        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
+        if (cpu->A >= value)
             cpu->P |= FLAG_C;
-        cpu->mem[address] = value >> 1;
-        set_zero_and_negative_flags(cpu, cpu->mem[address]);
+        set_zero_and_negative_flags(cpu, cpu->A - value);
         break;
-    case 0x47: // SRE zp
-        address = get_address(cpu, AM_ZP);
-        value = cpu->mem[address];
-        cpu->P &= ~FLAG_C;
-        if (value & 0x01)
+
+        // --- Dx ---
+    case 0xD0: // BNE rel
+        address = get_address(cpu, AM_REL);
+        if (!(cpu->P & FLAG_Z))
+            branch(cpu, address);
+        break;
+    case 0xD1: // CMP izy
+        address = get_address(cpu, AM_IZY);
+        value = mem_read(cpu, address);
+        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
+        if (cpu->A >= value)
             cpu->P |= FLAG_C;
-        cpu->mem[address] = value >> 1;
-        cpu->A ^= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
+        set_zero_and_negative_flags(cpu, cpu->A - value);
         break;
-    case 0x48: // PHA
-        push_byte(cpu, cpu->A);
+    case 0xD3: // DCP izy
+        address = get_address(cpu, AM_IZY);
+        value = mem_read(cpu, address);
+        value--;
+        mem_write(cpu, address, value);
+        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
+        if (cpu->A >= value)
+            cpu->P |= FLAG_C;
+        set_zero_and_negative_flags(cpu, cpu->A - value);
         break;
-    case 0x49: // EOR imm
-        address = get_address(cpu, AM_IMM);
-        cpu->A ^= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
+    case 0xD4: // NOP zpx
+        get_address(cpu, AM_ZPX);
         break;
-    case 0x4A: // LSR
-        cpu->P &= ~FLAG_C;
-        if (cpu->A & 0x01)
+    case 0xD5: // CMP zpx
+        address = get_address(cpu, AM_ZPX);
+        value = mem_read(cpu, address);
+        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
+        if (cpu->A >= value)
             cpu->P |= FLAG_C;
-        cpu->A = cpu->A >> 1;
-        set_zero_and_negative_flags(cpu, cpu->A);
+        set_zero_and_negative_flags(cpu, cpu->A - value);
         break;
-    case 0x4B: // ALR imm
+    case 0xD6: // DEC zpx
+        address = get_address(cpu, AM_ZPX);
+        value = mem_read(cpu, address);
+        value--;
+        mem_write(cpu, address, value);
+        set_zero_and_negative_flags(cpu, value);
+        break;
+    case 0xD7: // DCP zpx
+        address = get_address(cpu, AM_ZPX);
+        value = mem_read(cpu, address);
+        value--;
+        mem_write(cpu, address, value);
+        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
+        if (cpu->A >= value)
+            cpu->P |= FLAG_C;
+        set_zero_and_negative_flags(cpu, cpu->A - value);
+        break;
+    case 0xD8: // CLD
+        cpu->P &= ~FLAG_D;
+        break;
+    case 0xD9: // CMP aby
+        address = get_address(cpu, AM_ABY);
+        value = mem_read(cpu, address);
+        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
+        if (cpu->A >= value)
+            cpu->P |= FLAG_C;
+        set_zero_and_negative_flags(cpu, cpu->A - value);
+        break;
+    case 0xDA: // NOP
+        break;
+    case 0xDB: // DCP aby
+        address = get_address(cpu, AM_ABY);
+        value = mem_read(cpu, address);
+        value--;
+        mem_write(cpu, address, value);
+        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
+        if (cpu->A >= value)
+            cpu->P |= FLAG_C;
+        set_zero_and_negative_flags(cpu, cpu->A - value);
+        break;
+    case 0xDC: // NOP abx
+        get_address(cpu, AM_ABX);
+        break;
+    case 0xDD: // CMP abx
+        address = get_address(cpu, AM_ABX);
+        value = mem_read(cpu, address);
+        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
+        if (cpu->A >= value)
+            cpu->P |= FLAG_C;
+        set_zero_and_negative_flags(cpu, cpu->A - value);
+        break;
+    case 0xDE: // DEC abx
+        address = get_address(cpu, AM_ABX);
+        value = mem_read(cpu, address);
+        value--;
+        mem_write(cpu, address, value);
+        set_zero_and_negative_flags(cpu, value);
+        break;
+    case 0xDF: // DCP abx
+        address = get_address(cpu, AM_ABX);
+        value = mem_read(cpu, address);
+        value--;
+        mem_write(cpu, address, value);
+        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
+        if (cpu->A >= value)
+            cpu->P |= FLAG_C;
+        set_zero_and_negative_flags(cpu, cpu->A - value);
+        break;
+
+        // --- Ex ---
+    case 0xE0: // CPX imm
         address = get_address(cpu, AM_IMM);
-        cpu->A &= cpu->mem[address];
-        cpu->P &= ~FLAG_C;
-        if (cpu->A & 0x01)
+        value = mem_read(cpu, address);
+        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
+        if (cpu->X >= value)
             cpu->P |= FLAG_C;
-        cpu->A = cpu->A >> 1;
-        set_zero_and_negative_flags(cpu, cpu->A);
+        set_zero_and_negative_flags(cpu, cpu->X - value);
         break;
-    case 0x4C: // JMP abs
-        cpu->PC = get_address(cpu, AM_ABS);
+    case 0xE1: // SBC izx
+        address = get_address(cpu, AM_IZX);
+        value = mem_read(cpu, address);
+        cpu->A = sbc_core(cpu->A, value, &cpu->P);
         break;
-    case 0x4D: // EOR abs
-        address = get_address(cpu, AM_ABS);
-        cpu->A ^= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
+    case 0xE2: // NOP imm
+        get_address(cpu, AM_IMM);
         break;
-    case 0x4E: // LSR abs
-        address = get_address(cpu, AM_ABS);
-        value = cpu->mem[address];
-        cpu->P &= ~FLAG_C;
-        if (value & 0x01)
+    case 0xE3: // ISC izx
+        address = get_address(cpu, AM_IZX);
+        value = mem_read(cpu, address);
+        value++;
+        mem_write(cpu, address, value);
+        cpu->A = sbc_core(cpu->A, value, &cpu->P);
+        break;
+    case 0xE4: // CPX zp
+        address = get_address(cpu, AM_ZP);
+        value = mem_read(cpu, address);
+        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
+        if (cpu->X >= value)
             cpu->P |= FLAG_C;
-        cpu->mem[address] = value >> 1;
-        set_zero_and_negative_flags(cpu, cpu->mem[address]);
+        set_zero_and_negative_flags(cpu, cpu->X - value);
         break;
-    case 0x4F: // SRE abs
+    case 0xE5: // SBC zp
+        address = get_address(cpu, AM_ZP);
+        value = mem_read(cpu, address);
+        cpu->A = sbc_core(cpu->A, value, &cpu->P);
+        break;
+    case 0xE6: // INC zp
+        address = get_address(cpu, AM_ZP);
+        value = mem_read(cpu, address);
+        value++;
+        mem_write(cpu, address, value);
+        set_zero_and_negative_flags(cpu, value);
+        break;
+    case 0xE7: // ISC zp
+        address = get_address(cpu, AM_ZP);
+        value = mem_read(cpu, address);
+        value++;
+        mem_write(cpu, address, value);
+        cpu->A = sbc_core(cpu->A, value, &cpu->P);
+        break;
+    case 0xE8: // INX
+        cpu->X++;
+        set_zero_and_negative_flags(cpu, cpu->X);
+        break;
+    case 0xE9: // SBC imm
+        address = get_address(cpu, AM_IMM);
+        value = mem_read(cpu, address);
+        cpu->A = sbc_core(cpu->A, value, &cpu->P);
+        break;
+    case 0xEA: // NOP
+        break;
+    case 0xEB: // SBC imm
+        address = get_address(cpu, AM_IMM);
+        value = mem_read(cpu, address);
+        cpu->A = sbc_core(cpu->A, value, &cpu->P);
+        break;
+    case 0xEC: // CPX abs
         address = get_address(cpu, AM_ABS);
-        value = cpu->mem[address];
-        cpu->P &= ~FLAG_C;
-        if (value & 0x01)
+        value = mem_read(cpu, address);
+        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
+        if (cpu->X >= value)
             cpu->P |= FLAG_C;
-        cpu->mem[address] = value >> 1;
-        cpu->A ^= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
+        set_zero_and_negative_flags(cpu, cpu->X - value);
         break;
-        // --- 5x ---
-    case 0x50: // BVC rel
+    case 0xED: // SBC abs
+        address = get_address(cpu, AM_ABS);
+        value = mem_read(cpu, address);
+        cpu->A = sbc_core(cpu->A, value, &cpu->P);
+        break;
+    case 0xEE: // INC abs
+        address = get_address(cpu, AM_ABS);
+        value = mem_read(cpu, address);
+        value++;
+        mem_write(cpu, address, value);
+        set_zero_and_negative_flags(cpu, value);
+        break;
+    case 0xEF: // ISC abs
+        address = get_address(cpu, AM_ABS);
+        value = mem_read(cpu, address);
+        value++;
+        mem_write(cpu, address, value);
+        cpu->A = sbc_core(cpu->A, value, &cpu->P);
+        break;
+
+        // --- Fx ---
+    case 0xF0: // BEQ rel
         address = get_address(cpu, AM_REL);
-        if (!(cpu->P & FLAG_V))
-            cpu->PC = address;
+        if (cpu->P & FLAG_Z)
+            branch(cpu, address);
         break;
-    case 0x51: // EOR izy
+    case 0xF1: // SBC izy
         address = get_address(cpu, AM_IZY);
-        cpu->A ^= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
+        value = mem_read(cpu, address);
+        cpu->A = sbc_core(cpu->A, value, &cpu->P);
+        break;
+    case 0xF3: // ISC izy
+        address = get_address(cpu, AM_IZY);
+        value = mem_read(cpu, address);
+        value++;
+        mem_write(cpu, address, value);
+        cpu->A = sbc_core(cpu->A, value, &cpu->P);
+        break;
+    case 0xF4: // NOP zpx
+        get_address(cpu, AM_ZPX);
+        break;
+    case 0xF5: // SBC zpx
+        address = get_address(cpu, AM_ZPX);
+        value = mem_read(cpu, address);
+        cpu->A = sbc_core(cpu->A, value, &cpu->P);
+        break;
+    case 0xF6: // INC zpx
+        address = get_address(cpu, AM_ZPX);
+        value = mem_read(cpu, address);
+        value++;
+        mem_write(cpu, address, value);
+        set_zero_and_negative_flags(cpu, value);
+        break;
+    case 0xF7: // ISC zpx
+        address = get_address(cpu, AM_ZPX);
+        value = mem_read(cpu, address);
+        value++;
+        mem_write(cpu, address, value);
+        cpu->A = sbc_core(cpu->A, value, &cpu->P);
+        break;
+    case 0xF8: // SED
+        cpu->P |= FLAG_D;
+        break;
+    case 0xF9: // SBC aby
+        address = get_address(cpu, AM_ABY);
+        value = mem_read(cpu, address);
+        cpu->A = sbc_core(cpu->A, value, &cpu->P);
+        break;
+    case 0xFA: // NOP
+        break;
+    case 0xFB: // ISC aby
+        address = get_address(cpu, AM_ABY);
+        value = mem_read(cpu, address);
+        value++;
+        mem_write(cpu, address, value);
+        cpu->A = sbc_core(cpu->A, value, &cpu->P);
+        break;
+    case 0xFC: // NOP abx
+        get_address(cpu, AM_ABX);
+        break;
+    case 0xFD: // SBC abx
+        address = get_address(cpu, AM_ABX);
+        value = mem_read(cpu, address);
+        cpu->A = sbc_core(cpu->A, value, &cpu->P);
+        break;
+    case 0xFE: // INC abx
+        address = get_address(cpu, AM_ABX);
+        value = mem_read(cpu, address);
+        value++;
+        mem_write(cpu, address, value);
+        set_zero_and_negative_flags(cpu, value);
+        break;
+    case 0xFF: // ISC abx
+        address = get_address(cpu, AM_ABX);
+        value = mem_read(cpu, address);
+        value++;
+        mem_write(cpu, address, value);
+        cpu->A = sbc_core(cpu->A, value, &cpu->P);
         break;
-    case 0x53: // SRE izy
-        address = get_address(cpu, AM_IZY);
-        value = cpu->mem[address];
-        cpu->P &= ~FLAG_C;
-        if (value & 0x01)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = value >> 1;
-        cpu->A ^= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
+    default:
+        fprintf(stderr, "Unknown Opcode: 0x%02X at $%04X\n", opcode, cpu->PC - 1);
+        cpu->PC--;
+        cpu->stop = STOP_UNKNOWN;
         break;
-    case 0x54: // NOP zpx
-        get_address(cpu, AM_ZPX);
+    }
+
+    cpu->cycles += cycle_table[opcode];
+    if (cpu->page_crossed && page_cross_table[opcode])
+        cpu->cycles++;
+    return (int)(cpu->cycles - start_cycles);
+}
+
+#if THREADED_DISPATCH
+
+// Building blocks for the threaded engine. They operate on the register
+// locals of run_threaded() so the whole batch stays in host registers.
+#define SET_NZ(v) P = (P & ~(FLAG_N | FLAG_Z)) | ((uint8_t)(v) & FLAG_N) | ((uint8_t)(v) ? 0 : FLAG_Z)
+#define SET_C(cond) P = (cond) ? (P | FLAG_C) : (P & ~FLAG_C)
+
+// Bus access for the threaded engine. Instruction fetches read through a
+// cached pointer to the current code page; every I/O handler call drops
+// that cache because a handler may remap pages. The page holding stop_pc is
+// never cached, so only fetches from it pay for the stop check.
+FORCE_INLINE uint8_t engine_fetch(CPU* cpu, uint16_t address, const uint8_t** code, unsigned* code_page, unsigned stop_page)
+{
+    if ((unsigned)(address >> 8) != *code_page)
+    {
+        *code = cpu->read_map[address >> 8];
+        if (!*code)
+        {
+            *code_page = 0x100;
+            if (!io_register(cpu, address))
+                return cpu->mem[address];
+            return cpu->io[address >> 8].read(cpu, address, cpu->io[address >> 8].ctx);
+        }
+        *code_page = (unsigned)(address >> 8) != stop_page ? (unsigned)(address >> 8) : 0x100;
+    }
+    return (*code)[address & 0xFF];
+}
+
+FORCE_INLINE uint8_t engine_read(CPU* cpu, uint16_t address, unsigned* code_page)
+{
+    uint8_t* page = cpu->read_map[address >> 8];
+    if (page)
+        return page[address & 0xFF];
+    if (!io_register(cpu, address))
+        return cpu->mem[address];
+    *code_page = 0x100;
+    return cpu->io[address >> 8].read(cpu, address, cpu->io[address >> 8].ctx);
+}
+
+// Returns nonzero when the handler asked to end the batch (STOP_IO)
+FORCE_INLINE int engine_write(CPU* cpu, uint16_t address, uint8_t value, unsigned* code_page)
+{
+    uint8_t* page = cpu->write_map[address >> 8];
+    if (page)
+    {
+        page[address & 0xFF] = value;
+        return 0;
+    }
+    *code_page = 0x100;
+    cpu->io[address >> 8].write(cpu, address, value, cpu->io[address >> 8].ctx);
+    return cpu->stop;
+}
+
+#define LOAD(a) engine_read(cpu, a, &code_page)
+#define STORE(a, val) do { if (engine_write(cpu, a, val, &code_page)) limit = 0; } while (0)
+#define FETCH() engine_fetch(cpu, PC++, &code, &code_page, stop_page)
+#define PUSH(val) mem_write(cpu, 0x100 + SP--, val)
+#define PULL() mem_read(cpu, 0x100 + ++SP)
+
+#define EA_IMM() ea = PC++
+#define EA_ZP() ea = FETCH()
+#define EA_ZPX() ea = (uint8_t)(FETCH() + X)
+#define EA_ZPY() ea = (uint8_t)(FETCH() + Y)
+#define EA_IZX() do { t = FETCH() + X; ea = LOAD(t) | (LOAD((uint8_t)(t + 1)) << 8); } while (0)
+#define EA_IZY() do { t = FETCH(); ea = (LOAD(t) | (LOAD((uint8_t)(t + 1)) << 8)) + Y; } while (0)
+#define EA_ABS() do { ea = FETCH(); ea |= FETCH() << 8; } while (0)
+#define EA_ABX() do { EA_ABS(); ea += X; } while (0)
+#define EA_ABY() do { EA_ABS(); ea += Y; } while (0)
+// Extra cycle for reads whose indexed address crosses a page
+#define CROSS_IMM()
+#define CROSS_ZP()
+#define CROSS_ZPX()
+#define CROSS_ZPY()
+#define CROSS_IZX()
+#define CROSS_ABS()
+#define CROSS_IZY() cycles += (uint16_t)(ea - Y) >> 8 != ea >> 8
+#define CROSS_ABX() cycles += (uint16_t)(ea - X) >> 8 != ea >> 8
+#define CROSS_ABY() cycles += (uint16_t)(ea - Y) >> 8 != ea >> 8
+#define EA_IND() do { EA_ABS(); ea = LOAD(ea) | (LOAD((ea & 0xFF00) | ((ea + 1) & 0xFF)) << 8); } while (0)
+
+#define OP_ORA(val) do { A |= (val); SET_NZ(A); } while (0)
+#define OP_AND(val) do { A &= (val); SET_NZ(A); } while (0)
+#define OP_EOR(val) do { A ^= (val); SET_NZ(A); } while (0)
+#define OP_LDA(val) do { A = (val); SET_NZ(A); } while (0)
+#define OP_LDX(val) do { X = (val); SET_NZ(X); } while (0)
+#define OP_LDY(val) do { Y = (val); SET_NZ(Y); } while (0)
+#define OP_LAX(val) do { A = X = (val); SET_NZ(A); } while (0)
+#define OP_CMP(reg, val) do { v = (val); SET_C((reg) >= v); SET_NZ((reg) - v); } while (0)
+#define OP_BIT(val) do { \
+        v = (val); \
+        P = (P & ~(FLAG_N | FLAG_V | FLAG_Z)) | (v & (FLAG_N | FLAG_V)) | ((A & v) ? 0 : FLAG_Z); \
+    } while (0)
+#define OP_ADC(val) do { v = (val); A = adc_core(A, v, &P); } while (0)
+#define OP_SBC(val) do { v = (val); A = sbc_core(A, v, &P); } while (0)
+#define OP_BRANCH(cond) do { \
+        v = FETCH(); \
+        ea = PC + (int8_t)v; \
+        if (cond) { \
+            cycles += ((PC ^ ea) & 0xFF00) ? 2 : 1; \
+            PC = ea; \
+        } \
+    } while (0)
+
+// Read-modify-write helpers; they leave the stored value in v
+#define RMW_ASL() do { v = LOAD(ea); SET_C(v & 0x80); v <<= 1; STORE(ea, v); } while (0)
+#define RMW_LSR() do { v = LOAD(ea); SET_C(v & 0x01); v >>= 1; STORE(ea, v); } while (0)
+#define RMW_ROL() do { v = LOAD(ea); t = P & FLAG_C; SET_C(v & 0x80); v = (v << 1) | t; STORE(ea, v); } while (0)
+#define RMW_ROR() do { v = LOAD(ea); t = P & FLAG_C; SET_C(v & 0x01); v = (v >> 1) | (t << 7); STORE(ea, v); } while (0)
+#define RMW_INC() do { v = LOAD(ea) + 1; STORE(ea, v); } while (0)
+#define RMW_DEC() do { v = LOAD(ea) - 1; STORE(ea, v); } while (0)
+
+#define ASL(mode) EA_##mode(); RMW_ASL(); SET_NZ(v)
+#define LSR(mode) EA_##mode(); RMW_LSR(); SET_NZ(v)
+#define ROL(mode) EA_##mode(); RMW_ROL(); SET_NZ(v)
+#define ROR(mode) EA_##mode(); RMW_ROR(); SET_NZ(v)
+#define INC(mode) EA_##mode(); RMW_INC(); SET_NZ(v)
+#define DEC(mode) EA_##mode(); RMW_DEC(); SET_NZ(v)
+#define SLO(mode) EA_##mode(); RMW_ASL(); OP_ORA(v)
+#define RLA(mode) EA_##mode(); RMW_ROL(); OP_AND(v)
+#define SRE(mode) EA_##mode(); RMW_LSR(); OP_EOR(v)
+#define RRA(mode) EA_##mode(); RMW_ROR(); OP_ADC(v)
+#define DCP(mode) EA_##mode(); RMW_DEC(); OP_CMP(A, v)
+#define ISC(mode) EA_##mode(); RMW_INC(); OP_SBC(v)
+#define READ(op, mode) EA_##mode(); CROSS_##mode(); op(LOAD(ea))
+#define CMPR(reg, mode) EA_##mode(); CROSS_##mode(); v = LOAD(ea); OP_CMP(reg, v)
+#define WRITE(val, mode) EA_##mode(); STORE(ea, val)
+
+static int run_threaded(CPU* cpu, int max_instructions, uint64_t max_cycles)
+{
+    static const void* const dispatch[256] = {
+        &&op_00, &&op_01, &&op_kil, &&op_03, &&op_04, &&op_05, &&op_06, &&op_07, &&op_08, &&op_09, &&op_0A, &&op_0B, &&op_0C, &&op_0D, &&op_0E, &&op_0F,
+        &&op_10, &&op_11, &&op_kil, &&op_13, &&op_14, &&op_15, &&op_16, &&op_17, &&op_18, &&op_19, &&op_1A, &&op_1B, &&op_1C, &&op_1D, &&op_1E, &&op_1F,
+        &&op_20, &&op_21, &&op_kil, &&op_23, &&op_24, &&op_25, &&op_26, &&op_27, &&op_28, &&op_29, &&op_2A, &&op_2B, &&op_2C, &&op_2D, &&op_2E, &&op_2F,
+        &&op_30, &&op_31, &&op_kil, &&op_33, &&op_34, &&op_35, &&op_36, &&op_37, &&op_38, &&op_39, &&op_3A, &&op_3B, &&op_3C, &&op_3D, &&op_3E, &&op_3F,
+        &&op_40, &&op_41, &&op_kil, &&op_43, &&op_44, &&op_45, &&op_46, &&op_47, &&op_48, &&op_49, &&op_4A, &&op_4B, &&op_4C, &&op_4D, &&op_4E, &&op_4F,
+        &&op_50, &&op_51, &&op_kil, &&op_53, &&op_54, &&op_55, &&op_56, &&op_57, &&op_58, &&op_59, &&op_5A, &&op_5B, &&op_5C, &&op_5D, &&op_5E, &&op_5F,
+        &&op_60, &&op_61, &&op_kil, &&op_63, &&op_64, &&op_65, &&op_66, &&op_67, &&op_68, &&op_69, &&op_6A, &&op_6B, &&op_6C, &&op_6D, &&op_6E, &&op_6F,
+        &&op_70, &&op_71, &&op_kil, &&op_73, &&op_74, &&op_75, &&op_76, &&op_77, &&op_78, &&op_79, &&op_7A, &&op_7B, &&op_7C, &&op_7D, &&op_7E, &&op_7F,
+        &&op_80, &&op_81, &&op_82, &&op_83, &&op_84, &&op_85, &&op_86, &&op_87, &&op_88, &&op_unknown, &&op_8A, &&op_8B, &&op_8C, &&op_8D, &&op_8E, &&op_8F,
+        &&op_90, &&op_91, &&op_kil, &&op_93, &&op_94, &&op_95, &&op_96, &&op_97, &&op_98, &&op_99, &&op_9A, &&op_9B, &&op_9C, &&op_9D, &&op_9E, &&op_9F,
+        &&op_A0, &&op_A1, &&op_A2, &&op_A3, &&op_A4, &&op_A5, &&op_A6, &&op_A7, &&op_A8, &&op_A9, &&op_AA, &&op_AB, &&op_AC, &&op_AD, &&op_AE, &&op_AF,
+        &&op_B0, &&op_B1, &&op_kil, &&op_B3, &&op_B4, &&op_B5, &&op_B6, &&op_B7, &&op_B8, &&op_B9, &&op_BA, &&op_BB, &&op_BC, &&op_BD, &&op_BE, &&op_BF,
+        &&op_C0, &&op_C1, &&op_C2, &&op_C3, &&op_C4, &&op_C5, &&op_C6, &&op_C7, &&op_C8, &&op_C9, &&op_CA, &&op_CB, &&op_CC, &&op_CD, &&op_CE, &&op_CF,
+        &&op_D0, &&op_D1, &&op_kil, &&op_D3, &&op_D4, &&op_D5, &&op_D6, &&op_D7, &&op_D8, &&op_D9, &&op_DA, &&op_DB, &&op_DC, &&op_DD, &&op_DE, &&op_DF,
+        &&op_E0, &&op_E1, &&op_E2, &&op_E3, &&op_E4, &&op_E5, &&op_E6, &&op_E7, &&op_E8, &&op_E9, &&op_EA, &&op_EB, &&op_EC, &&op_ED, &&op_EE, &&op_EF,
+        &&op_F0, &&op_F1, &&op_kil, &&op_F3, &&op_F4, &&op_F5, &&op_F6, &&op_F7, &&op_F8, &&op_F9, &&op_FA, &&op_FB, &&op_FC, &&op_FD, &&op_FE, &&op_FF,
+    };
+
+    uint8_t A = cpu->A;
+    uint8_t X = cpu->X;
+    uint8_t Y = cpu->Y;
+    uint8_t SP = cpu->SP;
+    uint16_t PC = cpu->PC;
+    uint8_t P = cpu->P;
+    uint64_t cycles = cpu->cycles;
+    uint64_t limit = cycle_limit(cycles, max_cycles); // 0 once a write asks to stop
+    const int32_t stop_pc = cpu->stop_pc;
+    const unsigned stop_page = stop_pc >= 0 ? (unsigned)stop_pc >> 8 : 0x100;
+    const uint8_t* code = NULL;
+    unsigned code_page = 0x100; // Page code points into, 0x100 for none
+    uint8_t opcode;
+    uint16_t ea;
+    uint8_t v;
+    uint8_t t;
+    int executed = 0;
+
+#define NEXT() \
+    cycles += cycle_table[opcode]; \
+    if (++executed >= max_instructions || cycles >= limit) \
+        goto done; \
+    if ((unsigned)(PC >> 8) != code_page && PC == stop_pc) \
+        goto stop_at_pc; \
+    opcode = FETCH(); \
+    goto *dispatch[opcode]
+
+    cpu->stop = STOP_NONE;
+    if (max_instructions <= 0 || max_cycles == 0)
+        return 0;
+    if (PC == stop_pc)
+        goto stop_at_pc;
+    opcode = FETCH();
+    goto *dispatch[opcode];
+
+    // --- 0x ---
+op_00: // BRK
+    if (cpu->stop_on_brk)
+    {
+        PC--;
+        cpu->stop = STOP_BRK;
+        goto done;
+    }
+    PUSH(PC >> 8);
+    PUSH(PC & 0xFF);
+    PUSH(P | FLAG_B);
+    P |= FLAG_I;
+    PC = LOAD(0xFFFE) | (LOAD(0xFFFF) << 8);
+    NEXT();
+op_01: READ(OP_ORA, IZX); NEXT(); // ORA izx
+op_03: SLO(IZX); NEXT(); // SLO izx
+op_04: PC += 1; NEXT(); // NOP zp
+op_05: READ(OP_ORA, ZP); NEXT(); // ORA zp
+op_06: ASL(ZP); NEXT(); // ASL zp
+op_07: SLO(ZP); NEXT(); // SLO zp
+op_08: PUSH(P); NEXT(); // PHP
+op_09: READ(OP_ORA, IMM); NEXT(); // ORA imm
+op_0A: SET_C(A & 0x80); A <<= 1; SET_NZ(A); NEXT(); // ASL
+op_0B: READ(OP_AND, IMM); SET_C(A & 0x80); NEXT(); // ANC imm
+op_0C: PC += 2; NEXT(); // NOP abs
+op_0D: READ(OP_ORA, ABS); NEXT(); // ORA abs
+op_0E: ASL(ABS); NEXT(); // ASL abs
+op_0F: SLO(ABS); NEXT(); // SLO abs
+
+    // --- 1x ---
+op_10: OP_BRANCH(!(P & FLAG_N)); NEXT(); // BPL rel
+op_11: READ(OP_ORA, IZY); NEXT(); // ORA izy
+op_13: SLO(IZY); NEXT(); // SLO izy
+op_14: PC += 1; NEXT(); // NOP zpx
+op_15: READ(OP_ORA, ZPX); NEXT(); // ORA zpx
+op_16: ASL(ZPX); NEXT(); // ASL zpx
+op_17: SLO(ZPX); NEXT(); // SLO zpx
+op_18: P &= ~FLAG_C; NEXT(); // CLC
+op_19: READ(OP_ORA, ABY); NEXT(); // ORA aby
+op_1A: NEXT(); // NOP
+op_1B: SLO(ABY); NEXT(); // SLO aby
+op_1C: EA_ABX(); CROSS_ABX(); NEXT(); // NOP abx
+op_1D: READ(OP_ORA, ABX); NEXT(); // ORA abx
+op_1E: ASL(ABX); NEXT(); // ASL abx
+op_1F: SLO(ABX); NEXT(); // SLO abx
+
+    // --- 2x ---
+op_20: // JSR abs
+    PUSH((PC + 1) >> 8);
+    PUSH((PC + 1) & 0xFF);
+    EA_ABS();
+    PC = ea;
+    NEXT();
+op_21: READ(OP_AND, IZX); NEXT(); // AND izx
+op_23: RLA(IZX); NEXT(); // RLA izx
+op_24: READ(OP_BIT, ZP); NEXT(); // BIT zp
+op_25: READ(OP_AND, ZP); NEXT(); // AND zp
+op_26: ROL(ZP); NEXT(); // ROL zp
+op_27: RLA(ZP); NEXT(); // RLA zp
+op_28: P = PULL() | 0x20; NEXT(); // PLP
+op_29: READ(OP_AND, IMM); NEXT(); // AND imm
+op_2A: t = P & FLAG_C; SET_C(A & 0x80); A = (A << 1) | t; SET_NZ(A); NEXT(); // ROL
+op_2B: READ(OP_AND, IMM); SET_C(A & 0x80); NEXT(); // ANC imm
+op_2C: READ(OP_BIT, ABS); NEXT(); // BIT abs
+op_2D: READ(OP_AND, ABS); NEXT(); // AND abs
+op_2E: ROL(ABS); NEXT(); // ROL abs
+op_2F: RLA(ABS); NEXT(); // RLA abs
+
+    // --- 3x ---
+op_30: OP_BRANCH(P & FLAG_N); NEXT(); // BMI rel
+op_31: READ(OP_AND, IZY); NEXT(); // AND izy
+op_33: RLA(IZY); NEXT(); // RLA izy
+op_34: PC += 1; NEXT(); // NOP zpx
+op_35: READ(OP_AND, ZPX); NEXT(); // AND zpx
+op_36: ROL(ZPX); NEXT(); // ROL zpx
+op_37: RLA(ZPX); NEXT(); // RLA zpx
+op_38: P |= FLAG_C; NEXT(); // SEC
+op_39: READ(OP_AND, ABY); NEXT(); // AND aby
+op_3A: NEXT(); // NOP
+op_3B: RLA(ABY); NEXT(); // RLA aby
+op_3C: EA_ABX(); CROSS_ABX(); NEXT(); // NOP abx
+op_3D: READ(OP_AND, ABX); NEXT(); // AND abx
+op_3E: ROL(ABX); NEXT(); // ROL abx
+op_3F: RLA(ABX); NEXT(); // RLA abx
+
+    // --- 4x ---
+op_40: // RTI
+    P = PULL() | 0x20;
+    PC = PULL();
+    PC |= PULL() << 8;
+    NEXT();
+op_41: READ(OP_EOR, IZX); NEXT(); // EOR izx
+op_43: SRE(IZX); NEXT(); // SRE izx
+op_44: PC += 1; NEXT(); // NOP zp
+op_45: READ(OP_EOR, ZP); NEXT(); // EOR zp
+op_46: LSR(ZP); NEXT(); // LSR zp
+op_47: SRE(ZP); NEXT(); // SRE zp
+op_48: PUSH(A); NEXT(); // PHA
+op_49: READ(OP_EOR, IMM); NEXT(); // EOR imm
+op_4A: SET_C(A & 0x01); A >>= 1; SET_NZ(A); NEXT(); // LSR
+op_4B: READ(OP_AND, IMM); SET_C(A & 0x01); A >>= 1; SET_NZ(A); NEXT(); // ALR imm
+op_4C: EA_ABS(); PC = ea; NEXT(); // JMP abs
+op_4D: READ(OP_EOR, ABS); NEXT(); // EOR abs
+op_4E: LSR(ABS); NEXT(); // LSR abs
+op_4F: SRE(ABS); NEXT(); // SRE abs
+
+    // --- 5x ---
+op_50: OP_BRANCH(!(P & FLAG_V)); NEXT(); // BVC rel
+op_51: READ(OP_EOR, IZY); NEXT(); // EOR izy
+op_53: SRE(IZY); NEXT(); // SRE izy
+op_54: PC += 1; NEXT(); // NOP zpx
+op_55: READ(OP_EOR, ZPX); NEXT(); // EOR zpx
+op_56: LSR(ZPX); NEXT(); // LSR zpx
+op_57: SRE(ZPX); NEXT(); // SRE zpx
+op_58: P &= ~FLAG_I; NEXT(); // CLI
+op_59: READ(OP_EOR, ABY); NEXT(); // EOR aby
+op_5A: NEXT(); // NOP
+op_5B: SRE(ABY); NEXT(); // SRE aby
+op_5C: EA_ABX(); CROSS_ABX(); NEXT(); // NOP abx
+op_5D: READ(OP_EOR, ABX); NEXT(); // EOR abx
+op_5E: LSR(ABX); NEXT(); // LSR abx
+op_5F: SRE(ABX); NEXT(); // SRE abx
+
+    // --- 6x ---
+op_60: // RTS
+    PC = PULL();
+    PC |= PULL() << 8;
+    PC++;
+    NEXT();
+op_61: READ(OP_ADC, IZX); NEXT(); // ADC izx
+op_63: RRA(IZX); NEXT(); // RRA izx
+op_64: PC += 1; NEXT(); // NOP zp
+op_65: READ(OP_ADC, ZP); NEXT(); // ADC zp
+op_66: ROR(ZP); NEXT(); // ROR zp
+op_67: RRA(ZP); NEXT(); // RRA zp
+op_68: A = PULL(); SET_NZ(A); NEXT(); // PLA
+op_69: READ(OP_ADC, IMM); NEXT(); // ADC imm
+op_6A: t = P & FLAG_C; SET_C(A & 0x01); A = (A >> 1) | (t << 7); SET_NZ(A); NEXT(); // ROR
+op_6B: // ARR imm
+    EA_IMM();
+    A &= LOAD(ea);
+    t = A;
+    SET_C(A & 0x01);
+    A = (A >> 1) | ((P & FLAG_C) << 7);
+    v = t + (t & 0x0F);
+    P = ((v ^ A) & 0x40) ? (P | FLAG_V) : (P & ~FLAG_V);
+    SET_NZ(A);
+    NEXT();
+op_6C: EA_IND(); PC = ea; NEXT(); // JMP ind
+op_6D: READ(OP_ADC, ABS); NEXT(); // ADC abs
+op_6E: ROR(ABS); NEXT(); // ROR abs
+op_6F: RRA(ABS); NEXT(); // RRA abs
+
+    // --- 7x ---
+op_70: OP_BRANCH(P & FLAG_V); NEXT(); // BVS rel
+op_71: READ(OP_ADC, IZY); NEXT(); // ADC izy
+op_73: RRA(IZY); NEXT(); // RRA izy
+op_74: PC += 1; NEXT(); // NOP zpx
+op_75: READ(OP_ADC, ZPX); NEXT(); // ADC zpx
+op_76: ROR(ZPX); NEXT(); // ROR zpx
+op_77: RRA(ZPX); NEXT(); // RRA zpx
+op_78: P |= FLAG_I; NEXT(); // SEI
+op_79: READ(OP_ADC, ABY); NEXT(); // ADC aby
+op_7A: NEXT(); // NOP
+op_7B: RRA(ABY); NEXT(); // RRA aby
+op_7C: EA_ABX(); CROSS_ABX(); NEXT(); // NOP abx
+op_7D: READ(OP_ADC, ABX); NEXT(); // ADC abx
+op_7E: ROR(ABX); NEXT(); // ROR abx
+op_7F: RRA(ABX); NEXT(); // RRA abx
+
+    // --- 8x ---
+op_80: PC += 1; NEXT(); // NOP imm
+op_81: WRITE(A, IZX); NEXT(); // STA izx
+op_82: PC += 1; NEXT(); // NOP imm
+op_83: WRITE(A & X, IZX); NEXT(); // SAX izx
+op_84: WRITE(Y, ZP); NEXT(); // STY zp
+op_85: WRITE(A, ZP); NEXT(); // STA zp
+op_86: WRITE(X, ZP); NEXT(); // STX zp
+op_87: WRITE(A & X, ZP); NEXT(); // SAX zp
+op_88: Y--; SET_NZ(Y); NEXT(); // DEY
+op_8A: A = X; SET_NZ(A); NEXT(); // TXA
+op_8B: EA_IMM(); A = X & LOAD(ea); SET_NZ(A); NEXT(); // XAA imm
+op_8C: WRITE(Y, ABS); NEXT(); // STY abs
+op_8D: WRITE(A, ABS); NEXT(); // STA abs
+op_8E: WRITE(X, ABS); NEXT(); // STX abs
+op_8F: WRITE(A & X, ABS); NEXT(); // SAX abs
+
+    // --- 9x ---
+op_90: OP_BRANCH(!(P & FLAG_C)); NEXT(); // BCC rel
+op_91: WRITE(A, IZY); NEXT(); // STA izy
+op_93: EA_IZY(); STORE(ea, A & X & (ea >> 8)); NEXT(); // AHX izy
+op_94: WRITE(Y, ZPX); NEXT(); // STY zpx
+op_95: WRITE(A, ZPX); NEXT(); // STA zpx
+op_96: WRITE(X, ZPY); NEXT(); // STX zpy
+op_97: WRITE(A & X, ZPY); NEXT(); // SAX zpy
+op_98: A = Y; SET_NZ(A); NEXT(); // TYA
+op_99: WRITE(A, ABY); NEXT(); // STA aby
+op_9A: SP = X; NEXT(); // TXS
+op_9B: EA_ABY(); SP = A & X; STORE(ea, SP & (ea >> 8)); NEXT(); // TAS aby
+op_9C: EA_ABX(); STORE(ea, Y & (ea >> 8)); NEXT(); // SHY abx
+op_9D: WRITE(A, ABX); NEXT(); // STA abx
+op_9E: EA_ABY(); STORE(ea, X & (ea >> 8)); NEXT(); // SHX aby
+op_9F: EA_ABY(); STORE(ea, A & X & (ea >> 8)); NEXT(); // AHX aby
+
+    // --- Ax ---
+op_A0: READ(OP_LDY, IMM); NEXT(); // LDY imm
+op_A1: READ(OP_LDA, IZX); NEXT(); // LDA izx
+op_A2: READ(OP_LDX, IMM); NEXT(); // LDX imm
+op_A3: READ(OP_LAX, IZX); NEXT(); // LAX izx
+op_A4: READ(OP_LDY, ZP); NEXT(); // LDY zp
+op_A5: READ(OP_LDA, ZP); NEXT(); // LDA zp
+op_A6: READ(OP_LDX, ZP); NEXT(); // LDX zp
+op_A7: READ(OP_LAX, ZP); NEXT(); // LAX zp
+op_A8: Y = A; SET_NZ(Y); NEXT(); // TAY
+op_A9: READ(OP_LDA, IMM); NEXT(); // LDA imm
+op_AA: X = A; SET_NZ(X); NEXT(); // TAX
+op_AB: READ(OP_LAX, IMM); NEXT(); // LAX imm
+op_AC: READ(OP_LDY, ABS); NEXT(); // LDY abs
+op_AD: READ(OP_LDA, ABS); NEXT(); // LDA abs
+op_AE: READ(OP_LDX, ABS); NEXT(); // LDX abs
+op_AF: READ(OP_LAX, ABS); NEXT(); // LAX abs
+
+    // --- Bx ---
+op_B0: OP_BRANCH(P & FLAG_C); NEXT(); // BCS rel
+op_B1: READ(OP_LDA, IZY); NEXT(); // LDA izy
+op_B3: READ(OP_LAX, IZY); NEXT(); // LAX izy
+op_B4: READ(OP_LDY, ZPX); NEXT(); // LDY zpx
+op_B5: READ(OP_LDA, ZPX); NEXT(); // LDA zpx
+op_B6: READ(OP_LDX, ZPY); NEXT(); // LDX zpy
+op_B7: READ(OP_LAX, ZPY); NEXT(); // LAX zpy
+op_B8: P &= ~FLAG_V; NEXT(); // CLV
+op_B9: READ(OP_LDA, ABY); NEXT(); // LDA aby
+op_BA: X = SP; SET_NZ(X); NEXT(); // TSX
+op_BB: EA_ABY(); CROSS_ABY(); A = X = SP = LOAD(ea) & SP; SET_NZ(A); NEXT(); // LAS aby
+op_BC: READ(OP_LDY, ABX); NEXT(); // LDY abx
+op_BD: READ(OP_LDA, ABX); NEXT(); // LDA abx
+op_BE: READ(OP_LDX, ABY); NEXT(); // LDX aby
+op_BF: READ(OP_LAX, ABY); NEXT(); // LAX aby
+
+    // --- Cx ---
+op_C0: CMPR(Y, IMM); NEXT(); // CPY imm
+op_C1: CMPR(A, IZX); NEXT(); // CMP izx
+op_C2: PC += 1; NEXT(); // NOP imm
+op_C3: DCP(IZX); NEXT(); // DCP izx
+op_C4: CMPR(Y, ZP); NEXT(); // CPY zp
+op_C5: CMPR(A, ZP); NEXT(); // CMP zp
+op_C6: DEC(ZP); NEXT(); // DEC zp
+op_C7: DCP(ZP); NEXT(); // DCP zp
+op_C8: Y++; SET_NZ(Y); NEXT(); // INY
+op_C9: CMPR(A, IMM); NEXT(); // CMP imm
+op_CA: X--; SET_NZ(X); NEXT(); // DEX
+op_CB: // AXS imm
+    EA_IMM();
+    v = LOAD(ea);
+    X = (A & X) - v;
+    SET_C((A & X) >= v);
+    SET_NZ(X);
+    NEXT();
+op_CC: CMPR(Y, ABS); NEXT(); // CPY abs
+op_CD: CMPR(A, ABS); NEXT(); // CMP abs
+op_CE: DEC(ABS); NEXT(); // DEC abs
+op_CF: DCP(ABS); NEXT(); // DCP abs
+
+    // --- Dx ---
+op_D0: OP_BRANCH(!(P & FLAG_Z)); NEXT(); // BNE rel
+op_D1: CMPR(A, IZY); NEXT(); // CMP izy
+op_D3: DCP(IZY); NEXT(); // DCP izy
+op_D4: PC += 1; NEXT(); // NOP zpx
+op_D5: CMPR(A, ZPX); NEXT(); // CMP zpx
+op_D6: DEC(ZPX); NEXT(); // DEC zpx
+op_D7: DCP(ZPX); NEXT(); // DCP zpx
+op_D8: P &= ~FLAG_D; NEXT(); // CLD
+op_D9: CMPR(A, ABY); NEXT(); // CMP aby
+op_DA: NEXT(); // NOP
+op_DB: DCP(ABY); NEXT(); // DCP aby
+op_DC: EA_ABX(); CROSS_ABX(); NEXT(); // NOP abx
+op_DD: CMPR(A, ABX); NEXT(); // CMP abx
+op_DE: DEC(ABX); NEXT(); // DEC abx
+op_DF: DCP(ABX); NEXT(); // DCP abx
+
+    // --- Ex ---
+op_E0: CMPR(X, IMM); NEXT(); // CPX imm
+op_E1: READ(OP_SBC, IZX); NEXT(); // SBC izx
+op_E2: PC += 1; NEXT(); // NOP imm
+op_E3: ISC(IZX); NEXT(); // ISC izx
+op_E4: CMPR(X, ZP); NEXT(); // CPX zp
+op_E5: READ(OP_SBC, ZP); NEXT(); // SBC zp
+op_E6: INC(ZP); NEXT(); // INC zp
+op_E7: ISC(ZP); NEXT(); // ISC zp
+op_E8: X++; SET_NZ(X); NEXT(); // INX
+op_E9: READ(OP_SBC, IMM); NEXT(); // SBC imm
+op_EA: NEXT(); // NOP
+op_EB: READ(OP_SBC, IMM); NEXT(); // SBC imm
+op_EC: CMPR(X, ABS); NEXT(); // CPX abs
+op_ED: READ(OP_SBC, ABS); NEXT(); // SBC abs
+op_EE: INC(ABS); NEXT(); // INC abs
+op_EF: ISC(ABS); NEXT(); // ISC abs
+
+    // --- Fx ---
+op_F0: OP_BRANCH(P & FLAG_Z); NEXT(); // BEQ rel
+op_F1: READ(OP_SBC, IZY); NEXT(); // SBC izy
+op_F3: ISC(IZY); NEXT(); // ISC izy
+op_F4: PC += 1; NEXT(); // NOP zpx
+op_F5: READ(OP_SBC, ZPX); NEXT(); // SBC zpx
+op_F6: INC(ZPX); NEXT(); // INC zpx
+op_F7: ISC(ZPX); NEXT(); // ISC zpx
+op_F8: P |= FLAG_D; NEXT(); // SED
+op_F9: READ(OP_SBC, ABY); NEXT(); // SBC aby
+op_FA: NEXT(); // NOP
+op_FB: ISC(ABY); NEXT(); // ISC aby
+op_FC: EA_ABX(); CROSS_ABX(); NEXT(); // NOP abx
+op_FD: READ(OP_SBC, ABX); NEXT(); // SBC abx
+op_FE: INC(ABX); NEXT(); // INC abx
+op_FF: ISC(ABX); NEXT(); // ISC abx
+
+op_kil:
+    fprintf(stderr, "KIL Instruction executed, halting.\n");
+    PC--;
+    cpu->stop = STOP_KIL;
+    cycles += cycle_table[opcode];
+    executed++;
+    goto done;
+op_unknown:
+    fprintf(stderr, "Unknown Opcode: 0x%02X at $%04X\n", opcode, (uint16_t)(PC - 1));
+    PC--;
+    cpu->stop = STOP_UNKNOWN;
+    cycles += cycle_table[opcode];
+    executed++;
+    goto done;
+stop_at_pc:
+    cpu->stop = STOP_PC;
+    goto done;
+
+#undef NEXT
+
+done:
+    cpu->A = A;
+    cpu->X = X;
+    cpu->Y = Y;
+    cpu->SP = SP;
+    cpu->PC = PC;
+    cpu->P = P;
+    cpu->cycles = cycles;
+    return executed;
+}
+
+#endif // THREADED_DISPATCH
+
+// Predecoded engine behind --engine predecode. Straight-line runs of code
+// are decoded once into DecodedOps (handler, resolved operand, addressing
+// mode, cycle cost) cached by start address, so executing them skips
+// fetch_byte() and get_address(). Opcodes without a handler (BRK, KIL and
+// the illegal opcodes) go through execute_instruction(). Pages holding
+// decoded code are watched; a write to a decoded byte drops every run on
+// that page.
+#define DECODE_MAX_RUN 32 // Instructions per run
+#define DECODE_MAX_OPS (1 << 16)
+#define DECODE_MAX_RUNS (1 << 14)
+
+typedef struct DecodedOp DecodedOp;
+typedef void (*decoded_fn)(CPU* cpu, const DecodedOp* op);
+
+struct DecodedOp {
+    decoded_fn fn; // NULL: run through execute_instruction()
+    uint16_t pc;
+    uint16_t operand; // Immediate value, address, or branch target
+    uint8_t mode;
+    uint8_t cycles;
+    uint8_t length;
+    uint8_t page_cross; // Pays a cycle when its indexed address crosses a page
+};
+
+typedef struct {
+    uint32_t first; // Index of the first op
+    uint8_t count;
+    uint8_t first_page;
+    uint8_t last_page;
+    uint32_t first_generation; // Page generations the run was decoded from
+    uint32_t last_generation;
+} DecodedRun;
+
+struct DecodeCache {
+    DecodedOp ops[DECODE_MAX_OPS];
+    uint32_t op_count;
+    DecodedRun runs[DECODE_MAX_RUNS];
+    uint32_t run_count;
+    int32_t entry[65536]; // Run index + 1 starting at each address
+    uint32_t generation[256]; // Bumped when a page's decoded code changes
+    uint8_t code[8192]; // One bit per decoded byte
+    uint8_t watched[256];
+    int invalidated; // Set when a write dropped runs
+};
+
+// Effective address of a predecoded memory operand
+static uint16_t decoded_address(CPU* cpu, const DecodedOp* op)
+{
+    uint16_t base;
+    uint8_t zp;
+
+    switch (op->mode)
+    {
+    case AM_ZPX:
+        return (op->operand + cpu->X) & 0xFF;
+    case AM_ZPY:
+        return (op->operand + cpu->Y) & 0xFF;
+    case AM_IZX:
+        zp = op->operand + cpu->X;
+        return mem_read(cpu, zp) | (mem_read(cpu, (zp + 1) & 0xFF) << 8);
+    case AM_IZY:
+        base = mem_read(cpu, op->operand) | (mem_read(cpu, (op->operand + 1) & 0xFF) << 8);
+        cpu->page_crossed = ((base & 0xFF) + cpu->Y) > 0xFF;
+        return base + cpu->Y;
+    case AM_ABX:
+        cpu->page_crossed = ((op->operand & 0xFF) + cpu->X) > 0xFF;
+        return op->operand + cpu->X;
+    case AM_ABY:
+        cpu->page_crossed = ((op->operand & 0xFF) + cpu->Y) > 0xFF;
+        return op->operand + cpu->Y;
+    case AM_IND:
+        return mem_read(cpu, op->operand) | (mem_read(cpu, (op->operand & 0xFF00) | ((op->operand + 1) & 0xFF)) << 8);
+    default: // AM_ZP, AM_ABS
+        return op->operand;
+    }
+}
+
+static uint8_t decoded_value(CPU* cpu, const DecodedOp* op)
+{
+    if (op->mode == AM_IMM)
+        return (uint8_t)op->operand;
+    return mem_read(cpu, decoded_address(cpu, op));
+}
+
+static void decoded_compare(CPU* cpu, uint8_t reg, uint8_t value)
+{
+    cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
+    if (reg >= value)
+        cpu->P |= FLAG_C;
+    set_zero_and_negative_flags(cpu, reg - value);
+}
+
+static void decoded_lda(CPU* cpu, const DecodedOp* op)
+{
+    cpu->A = decoded_value(cpu, op);
+    set_zero_and_negative_flags(cpu, cpu->A);
+}
+
+static void decoded_ldx(CPU* cpu, const DecodedOp* op)
+{
+    cpu->X = decoded_value(cpu, op);
+    set_zero_and_negative_flags(cpu, cpu->X);
+}
+
+static void decoded_ldy(CPU* cpu, const DecodedOp* op)
+{
+    cpu->Y = decoded_value(cpu, op);
+    set_zero_and_negative_flags(cpu, cpu->Y);
+}
+
+static void decoded_sta(CPU* cpu, const DecodedOp* op)
+{
+    mem_write(cpu, decoded_address(cpu, op), cpu->A);
+}
+
+static void decoded_stx(CPU* cpu, const DecodedOp* op)
+{
+    mem_write(cpu, decoded_address(cpu, op), cpu->X);
+}
+
+static void decoded_sty(CPU* cpu, const DecodedOp* op)
+{
+    mem_write(cpu, decoded_address(cpu, op), cpu->Y);
+}
+
+static void decoded_ora(CPU* cpu, const DecodedOp* op)
+{
+    cpu->A |= decoded_value(cpu, op);
+    set_zero_and_negative_flags(cpu, cpu->A);
+}
+
+static void decoded_and(CPU* cpu, const DecodedOp* op)
+{
+    cpu->A &= decoded_value(cpu, op);
+    set_zero_and_negative_flags(cpu, cpu->A);
+}
+
+static void decoded_eor(CPU* cpu, const DecodedOp* op)
+{
+    cpu->A ^= decoded_value(cpu, op);
+    set_zero_and_negative_flags(cpu, cpu->A);
+}
+
+static void decoded_adc(CPU* cpu, const DecodedOp* op)
+{
+    cpu->A = adc_core(cpu->A, decoded_value(cpu, op), &cpu->P);
+}
+
+static void decoded_sbc(CPU* cpu, const DecodedOp* op)
+{
+    cpu->A = sbc_core(cpu->A, decoded_value(cpu, op), &cpu->P);
+}
+
+static void decoded_cmp(CPU* cpu, const DecodedOp* op)
+{
+    decoded_compare(cpu, cpu->A, decoded_value(cpu, op));
+}
+
+static void decoded_cpx(CPU* cpu, const DecodedOp* op)
+{
+    decoded_compare(cpu, cpu->X, decoded_value(cpu, op));
+}
+
+static void decoded_cpy(CPU* cpu, const DecodedOp* op)
+{
+    decoded_compare(cpu, cpu->Y, decoded_value(cpu, op));
+}
+
+static void decoded_bit(CPU* cpu, const DecodedOp* op)
+{
+    uint8_t value = decoded_value(cpu, op);
+
+    cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z);
+    cpu->P |= value & (FLAG_N | FLAG_V);
+    if (!(cpu->A & value))
+        cpu->P |= FLAG_Z;
+}
+
+// Read-modify-write operations, applied by decoded_modify()
+static uint8_t modify_asl(CPU* cpu, uint8_t value)
+{
+    cpu->P = (cpu->P & ~FLAG_C) | (value >> 7);
+    return value << 1;
+}
+
+static uint8_t modify_lsr(CPU* cpu, uint8_t value)
+{
+    cpu->P = (cpu->P & ~FLAG_C) | (value & FLAG_C);
+    return value >> 1;
+}
+
+static uint8_t modify_rol(CPU* cpu, uint8_t value)
+{
+    uint8_t carry = cpu->P & FLAG_C;
+    cpu->P = (cpu->P & ~FLAG_C) | (value >> 7);
+    return (value << 1) | carry;
+}
+
+static uint8_t modify_ror(CPU* cpu, uint8_t value)
+{
+    uint8_t carry = cpu->P & FLAG_C;
+    cpu->P = (cpu->P & ~FLAG_C) | (value & FLAG_C);
+    return (value >> 1) | (carry << 7);
+}
+
+static uint8_t modify_inc(CPU* cpu, uint8_t value)
+{
+    return value + 1;
+}
+
+static uint8_t modify_dec(CPU* cpu, uint8_t value)
+{
+    return value - 1;
+}
+
+// Apply a read-modify-write operation to A in implied mode, to memory otherwise
+FORCE_INLINE void decoded_modify(CPU* cpu, const DecodedOp* op, uint8_t (*modify)(CPU*, uint8_t))
+{
+    if (op->mode == AM_IMP)
+    {
+        cpu->A = modify(cpu, cpu->A);
+        set_zero_and_negative_flags(cpu, cpu->A);
+        return;
+    }
+
+    uint16_t address = decoded_address(cpu, op);
+    uint8_t value = modify(cpu, mem_read(cpu, address));
+    mem_write(cpu, address, value);
+    set_zero_and_negative_flags(cpu, value);
+}
+
+static void decoded_asl(CPU* cpu, const DecodedOp* op) { decoded_modify(cpu, op, modify_asl); }
+static void decoded_lsr(CPU* cpu, const DecodedOp* op) { decoded_modify(cpu, op, modify_lsr); }
+static void decoded_rol(CPU* cpu, const DecodedOp* op) { decoded_modify(cpu, op, modify_rol); }
+static void decoded_ror(CPU* cpu, const DecodedOp* op) { decoded_modify(cpu, op, modify_ror); }
+static void decoded_inc(CPU* cpu, const DecodedOp* op) { decoded_modify(cpu, op, modify_inc); }
+static void decoded_dec(CPU* cpu, const DecodedOp* op) { decoded_modify(cpu, op, modify_dec); }
+
+static void decoded_inx(CPU* cpu, const DecodedOp* op)
+{
+    cpu->X++;
+    set_zero_and_negative_flags(cpu, cpu->X);
+}
+
+static void decoded_iny(CPU* cpu, const DecodedOp* op)
+{
+    cpu->Y++;
+    set_zero_and_negative_flags(cpu, cpu->Y);
+}
+
+static void decoded_dex(CPU* cpu, const DecodedOp* op)
+{
+    cpu->X--;
+    set_zero_and_negative_flags(cpu, cpu->X);
+}
+
+static void decoded_dey(CPU* cpu, const DecodedOp* op)
+{
+    cpu->Y--;
+    set_zero_and_negative_flags(cpu, cpu->Y);
+}
+
+static void decoded_tax(CPU* cpu, const DecodedOp* op)
+{
+    cpu->X = cpu->A;
+    set_zero_and_negative_flags(cpu, cpu->X);
+}
+
+static void decoded_tay(CPU* cpu, const DecodedOp* op)
+{
+    cpu->Y = cpu->A;
+    set_zero_and_negative_flags(cpu, cpu->Y);
+}
+
+static void decoded_txa(CPU* cpu, const DecodedOp* op)
+{
+    cpu->A = cpu->X;
+    set_zero_and_negative_flags(cpu, cpu->A);
+}
+
+static void decoded_tya(CPU* cpu, const DecodedOp* op)
+{
+    cpu->A = cpu->Y;
+    set_zero_and_negative_flags(cpu, cpu->A);
+}
+
+static void decoded_tsx(CPU* cpu, const DecodedOp* op)
+{
+    cpu->X = cpu->SP;
+    set_zero_and_negative_flags(cpu, cpu->X);
+}
+
+static void decoded_txs(CPU* cpu, const DecodedOp* op)
+{
+    cpu->SP = cpu->X;
+}
+
+static void decoded_pha(CPU* cpu, const DecodedOp* op)
+{
+    push_byte(cpu, cpu->A);
+}
+
+static void decoded_php(CPU* cpu, const DecodedOp* op)
+{
+    push_byte(cpu, cpu->P);
+}
+
+static void decoded_pla(CPU* cpu, const DecodedOp* op)
+{
+    cpu->A = pull_byte(cpu);
+    set_zero_and_negative_flags(cpu, cpu->A);
+}
+
+static void decoded_plp(CPU* cpu, const DecodedOp* op)
+{
+    cpu->P = pull_byte(cpu) | 0x20;
+}
+
+static void decoded_clc(CPU* cpu, const DecodedOp* op) { cpu->P &= ~FLAG_C; }
+static void decoded_sec(CPU* cpu, const DecodedOp* op) { cpu->P |= FLAG_C; }
+static void decoded_cli(CPU* cpu, const DecodedOp* op) { cpu->P &= ~FLAG_I; }
+static void decoded_sei(CPU* cpu, const DecodedOp* op) { cpu->P |= FLAG_I; }
+static void decoded_clv(CPU* cpu, const DecodedOp* op) { cpu->P &= ~FLAG_V; }
+static void decoded_cld(CPU* cpu, const DecodedOp* op) { cpu->P &= ~FLAG_D; }
+static void decoded_sed(CPU* cpu, const DecodedOp* op) { cpu->P |= FLAG_D; }
+
+static void decoded_nop(CPU* cpu, const DecodedOp* op)
+{
+}
+
+// Branches keep their target in the operand
+static void decoded_bpl(CPU* cpu, const DecodedOp* op) { if (!(cpu->P & FLAG_N)) branch(cpu, op->operand); }
+static void decoded_bmi(CPU* cpu, const DecodedOp* op) { if (cpu->P & FLAG_N) branch(cpu, op->operand); }
+static void decoded_bvc(CPU* cpu, const DecodedOp* op) { if (!(cpu->P & FLAG_V)) branch(cpu, op->operand); }
+static void decoded_bvs(CPU* cpu, const DecodedOp* op) { if (cpu->P & FLAG_V) branch(cpu, op->operand); }
+static void decoded_bcc(CPU* cpu, const DecodedOp* op) { if (!(cpu->P & FLAG_C)) branch(cpu, op->operand); }
+static void decoded_bcs(CPU* cpu, const DecodedOp* op) { if (cpu->P & FLAG_C) branch(cpu, op->operand); }
+static void decoded_bne(CPU* cpu, const DecodedOp* op) { if (!(cpu->P & FLAG_Z)) branch(cpu, op->operand); }
+static void decoded_beq(CPU* cpu, const DecodedOp* op) { if (cpu->P & FLAG_Z) branch(cpu, op->operand); }
+
+static void decoded_jmp(CPU* cpu, const DecodedOp* op)
+{
+    cpu->PC = decoded_address(cpu, op);
+}
+
+static void decoded_jsr(CPU* cpu, const DecodedOp* op)
+{
+    // Push the address of the operand's last byte; RTS adds one
+    push_byte(cpu, (op->pc + 2) >> 8);
+    push_byte(cpu, (op->pc + 2) & 0xFF);
+    cpu->PC = op->operand;
+}
+
+static void decoded_rts(CPU* cpu, const DecodedOp* op)
+{
+    cpu->PC = pull_byte(cpu);
+    cpu->PC |= pull_byte(cpu) << 8;
+    cpu->PC++;
+}
+
+static void decoded_rti(CPU* cpu, const DecodedOp* op)
+{
+    cpu->P = pull_byte(cpu) | 0x20;
+    cpu->PC = pull_byte(cpu);
+    cpu->PC |= pull_byte(cpu) << 8;
+}
+
+// Handler and addressing mode of each official opcode. The rest have no
+// handler and run through execute_instruction().
+static const struct {
+    decoded_fn fn;
+    uint8_t mode;
+} decode_table[256] = {
+    [0x69] = { decoded_adc, AM_IMM }, [0x65] = { decoded_adc, AM_ZP }, [0x75] = { decoded_adc, AM_ZPX }, [0x6D] = { decoded_adc, AM_ABS },
+    [0x7D] = { decoded_adc, AM_ABX }, [0x79] = { decoded_adc, AM_ABY }, [0x61] = { decoded_adc, AM_IZX }, [0x71] = { decoded_adc, AM_IZY },
+    [0x29] = { decoded_and, AM_IMM }, [0x25] = { decoded_and, AM_ZP }, [0x35] = { decoded_and, AM_ZPX }, [0x2D] = { decoded_and, AM_ABS },
+    [0x3D] = { decoded_and, AM_ABX }, [0x39] = { decoded_and, AM_ABY }, [0x21] = { decoded_and, AM_IZX }, [0x31] = { decoded_and, AM_IZY },
+    [0x0A] = { decoded_asl, AM_IMP }, [0x06] = { decoded_asl, AM_ZP }, [0x16] = { decoded_asl, AM_ZPX }, [0x0E] = { decoded_asl, AM_ABS },
+    [0x1E] = { decoded_asl, AM_ABX },
+    [0x10] = { decoded_bpl, AM_REL }, [0x30] = { decoded_bmi, AM_REL }, [0x50] = { decoded_bvc, AM_REL }, [0x70] = { decoded_bvs, AM_REL },
+    [0x90] = { decoded_bcc, AM_REL }, [0xB0] = { decoded_bcs, AM_REL }, [0xD0] = { decoded_bne, AM_REL }, [0xF0] = { decoded_beq, AM_REL },
+    [0x24] = { decoded_bit, AM_ZP }, [0x2C] = { decoded_bit, AM_ABS },
+    [0x18] = { decoded_clc, AM_IMP }, [0x58] = { decoded_cli, AM_IMP }, [0xB8] = { decoded_clv, AM_IMP }, [0xD8] = { decoded_cld, AM_IMP },
+    [0xC9] = { decoded_cmp, AM_IMM }, [0xC5] = { decoded_cmp, AM_ZP }, [0xD5] = { decoded_cmp, AM_ZPX }, [0xCD] = { decoded_cmp, AM_ABS },
+    [0xDD] = { decoded_cmp, AM_ABX }, [0xD9] = { decoded_cmp, AM_ABY }, [0xC1] = { decoded_cmp, AM_IZX }, [0xD1] = { decoded_cmp, AM_IZY },
+    [0xE0] = { decoded_cpx, AM_IMM }, [0xE4] = { decoded_cpx, AM_ZP }, [0xEC] = { decoded_cpx, AM_ABS },
+    [0xC0] = { decoded_cpy, AM_IMM }, [0xC4] = { decoded_cpy, AM_ZP }, [0xCC] = { decoded_cpy, AM_ABS },
+    [0xC6] = { decoded_dec, AM_ZP }, [0xD6] = { decoded_dec, AM_ZPX }, [0xCE] = { decoded_dec, AM_ABS }, [0xDE] = { decoded_dec, AM_ABX },
+    [0xCA] = { decoded_dex, AM_IMP }, [0x88] = { decoded_dey, AM_IMP },
+    [0x49] = { decoded_eor, AM_IMM }, [0x45] = { decoded_eor, AM_ZP }, [0x55] = { decoded_eor, AM_ZPX }, [0x4D] = { decoded_eor, AM_ABS },
+    [0x5D] = { decoded_eor, AM_ABX }, [0x59] = { decoded_eor, AM_ABY }, [0x41] = { decoded_eor, AM_IZX }, [0x51] = { decoded_eor, AM_IZY },
+    [0xE6] = { decoded_inc, AM_ZP }, [0xF6] = { decoded_inc, AM_ZPX }, [0xEE] = { decoded_inc, AM_ABS }, [0xFE] = { decoded_inc, AM_ABX },
+    [0xE8] = { decoded_inx, AM_IMP }, [0xC8] = { decoded_iny, AM_IMP },
+    [0x4C] = { decoded_jmp, AM_ABS }, [0x6C] = { decoded_jmp, AM_IND }, [0x20] = { decoded_jsr, AM_ABS },
+    [0xA9] = { decoded_lda, AM_IMM }, [0xA5] = { decoded_lda, AM_ZP }, [0xB5] = { decoded_lda, AM_ZPX }, [0xAD] = { decoded_lda, AM_ABS },
+    [0xBD] = { decoded_lda, AM_ABX }, [0xB9] = { decoded_lda, AM_ABY }, [0xA1] = { decoded_lda, AM_IZX }, [0xB1] = { decoded_lda, AM_IZY },
+    [0xA2] = { decoded_ldx, AM_IMM }, [0xA6] = { decoded_ldx, AM_ZP }, [0xB6] = { decoded_ldx, AM_ZPY }, [0xAE] = { decoded_ldx, AM_ABS },
+    [0xBE] = { decoded_ldx, AM_ABY },
+    [0xA0] = { decoded_ldy, AM_IMM }, [0xA4] = { decoded_ldy, AM_ZP }, [0xB4] = { decoded_ldy, AM_ZPX }, [0xAC] = { decoded_ldy, AM_ABS },
+    [0xBC] = { decoded_ldy, AM_ABX },
+    [0x4A] = { decoded_lsr, AM_IMP }, [0x46] = { decoded_lsr, AM_ZP }, [0x56] = { decoded_lsr, AM_ZPX }, [0x4E] = { decoded_lsr, AM_ABS },
+    [0x5E] = { decoded_lsr, AM_ABX },
+    [0xEA] = { decoded_nop, AM_IMP },
+    [0x09] = { decoded_ora, AM_IMM }, [0x05] = { decoded_ora, AM_ZP }, [0x15] = { decoded_ora, AM_ZPX }, [0x0D] = { decoded_ora, AM_ABS },
+    [0x1D] = { decoded_ora, AM_ABX }, [0x19] = { decoded_ora, AM_ABY }, [0x01] = { decoded_ora, AM_IZX }, [0x11] = { decoded_ora, AM_IZY },
+    [0x48] = { decoded_pha, AM_IMP }, [0x08] = { decoded_php, AM_IMP }, [0x68] = { decoded_pla, AM_IMP }, [0x28] = { decoded_plp, AM_IMP },
+    [0x2A] = { decoded_rol, AM_IMP }, [0x26] = { decoded_rol, AM_ZP }, [0x36] = { decoded_rol, AM_ZPX }, [0x2E] = { decoded_rol, AM_ABS },
+    [0x3E] = { decoded_rol, AM_ABX },
+    [0x6A] = { decoded_ror, AM_IMP }, [0x66] = { decoded_ror, AM_ZP }, [0x76] = { decoded_ror, AM_ZPX }, [0x6E] = { decoded_ror, AM_ABS },
+    [0x7E] = { decoded_ror, AM_ABX },
+    [0x40] = { decoded_rti, AM_IMP }, [0x60] = { decoded_rts, AM_IMP },
+    [0xE9] = { decoded_sbc, AM_IMM }, [0xE5] = { decoded_sbc, AM_ZP }, [0xF5] = { decoded_sbc, AM_ZPX }, [0xED] = { decoded_sbc, AM_ABS },
+    [0xFD] = { decoded_sbc, AM_ABX }, [0xF9] = { decoded_sbc, AM_ABY }, [0xE1] = { decoded_sbc, AM_IZX }, [0xF1] = { decoded_sbc, AM_IZY },
+    [0x38] = { decoded_sec, AM_IMP }, [0x78] = { decoded_sei, AM_IMP }, [0xF8] = { decoded_sed, AM_IMP },
+    [0x85] = { decoded_sta, AM_ZP }, [0x95] = { decoded_sta, AM_ZPX }, [0x8D] = { decoded_sta, AM_ABS }, [0x9D] = { decoded_sta, AM_ABX },
+    [0x99] = { decoded_sta, AM_ABY }, [0x81] = { decoded_sta, AM_IZX }, [0x91] = { decoded_sta, AM_IZY },
+    [0x86] = { decoded_stx, AM_ZP }, [0x96] = { decoded_stx, AM_ZPY }, [0x8E] = { decoded_stx, AM_ABS },
+    [0x84] = { decoded_sty, AM_ZP }, [0x94] = { decoded_sty, AM_ZPX }, [0x8C] = { decoded_sty, AM_ABS },
+    [0xAA] = { decoded_tax, AM_IMP }, [0xA8] = { decoded_tay, AM_IMP }, [0xBA] = { decoded_tsx, AM_IMP }, [0x8A] = { decoded_txa, AM_IMP },
+    [0x9A] = { decoded_txs, AM_IMP }, [0x98] = { decoded_tya, AM_IMP },
+};
+
+void decode_flush(CPU* cpu)
+{
+    DecodeCache* cache = cpu->decoded;
+
+    for (int page = 0; page < 256; page++)
+    {
+        if (cache->watched[page])
+            unwatch_code_page(cpu, (uint8_t)page);
+        cache->generation[page]++;
+    }
+    memset(cache->entry, 0, sizeof(cache->entry));
+    memset(cache->code, 0, sizeof(cache->code));
+    memset(cache->watched, 0, sizeof(cache->watched));
+    cache->op_count = 0;
+    cache->run_count = 0;
+    cache->invalidated = 1;
+}
+
+// A watched write changed address; drop the page's runs if it was code
+void decode_code_written(CPU* cpu, uint16_t address)
+{
+    DecodeCache* cache = cpu->decoded;
+    uint8_t page = address >> 8;
+
+    if (!(cache->code[address >> 3] & (1 << (address & 7))))
+        return;
+    cache->generation[page]++;
+    memset(&cache->code[page << 5], 0, 32);
+    unwatch_code_page(cpu, page);
+    cache->watched[page] = 0;
+    cache->invalidated = 1;
+}
+
+// Decode the run starting at pc. Returns NULL when pc is not in RAM.
+static const DecodedRun* decode_run(CPU* cpu, uint16_t pc)
+{
+    DecodeCache* cache = cpu->decoded;
+    uint32_t address = pc;
+
+    if (cache->op_count + DECODE_MAX_RUN > DECODE_MAX_OPS || cache->run_count == DECODE_MAX_RUNS)
+        decode_flush(cpu);
+
+    DecodedRun* run = &cache->runs[cache->run_count];
+    run->first = cache->op_count;
+    run->count = 0;
+    while (run->count < DECODE_MAX_RUN)
+    {
+        const uint8_t* page = cpu->read_map[address >> 8];
+        if (!page)
+            break;
+
+        uint8_t opcode = page[address & 0xFF];
+        uint8_t mode = decode_table[opcode].mode;
+        int length = 1;
+        if (decode_table[opcode].fn)
+            length += mode == AM_IMP ? 0 : (mode == AM_ABS || mode == AM_ABX || mode == AM_ABY || mode == AM_IND) ? 2 : 1;
+        if (address + length > 0x10000)
+            break;
+
+        // Operand bytes must be readable without side effects too
+        uint16_t operand = 0;
+        int ok = 1;
+        for (int i = length - 1; i > 0; i--)
+        {
+            const uint8_t* operand_page = cpu->read_map[(address + i) >> 8];
+            if (!operand_page)
+                ok = 0;
+            else
+                operand = (operand << 8) | operand_page[(address + i) & 0xFF];
+        }
+        if (!ok)
+            break;
+
+        DecodedOp* op = &cache->ops[cache->op_count++];
+        op->fn = decode_table[opcode].fn;
+        op->pc = (uint16_t)address;
+        op->operand = operand;
+        op->mode = mode;
+        op->cycles = cycle_table[opcode];
+        op->length = (uint8_t)length;
+        op->page_cross = page_cross_table[opcode];
+        if (mode == AM_REL)
+            op->operand = (uint16_t)(address + 2 + (int8_t)operand);
+        run->count++;
+        address += length;
+
+        // Stop after anything that may change the flow of control
+        if (!op->fn || mode == AM_REL || op->fn == decoded_jmp || op->fn == decoded_jsr
+            || op->fn == decoded_rts || op->fn == decoded_rti)
+            break;
+    }
+    if (run->count == 0)
+        return NULL;
+
+    for (uint32_t a = pc; a < address; a++)
+        cache->code[a >> 3] |= 1 << (a & 7);
+    run->first_page = pc >> 8;
+    run->last_page = (address - 1) >> 8;
+
+    for (int page = run->first_page; page <= run->last_page; page++)
+    {
+        if (!cache->watched[page])
+        {
+            watch_code_page(cpu, (uint8_t)page);
+            cache->watched[page] = 1;
+        }
+    }
+    run->first_generation = cache->generation[run->first_page];
+    run->last_generation = cache->generation[run->last_page];
+    cache->entry[pc] = (int32_t)++cache->run_count;
+    return run;
+}
+
+static int decode_init(CPU* cpu)
+{
+    cpu->decoded = calloc(1, sizeof(DecodeCache));
+    return cpu->decoded != NULL;
+}
+
+// run_until() for --engine predecode
+static int run_predecoded(CPU* cpu, int max_instructions, uint64_t max_cycles)
+{
+    DecodeCache* cache = cpu->decoded;
+    uint64_t limit = cycle_limit(cpu->cycles, max_cycles);
+    int executed = 0;
+
+    cpu->stop = STOP_NONE;
+    while (!cpu->stop && executed < max_instructions && cpu->cycles < limit)
+    {
+        const DecodedRun* run = NULL;
+        int32_t index = cache->entry[cpu->PC];
+        if (index > 0)
+        {
+            run = &cache->runs[index - 1];
+            if (cache->generation[run->first_page] != run->first_generation
+                || cache->generation[run->last_page] != run->last_generation)
+                run = NULL;
+        }
+        if (!run)
+            run = decode_run(cpu, cpu->PC);
+        if (!run)
+        {
+            // Code outside RAM runs through the interpreter
+            if (cpu->PC == cpu->stop_pc)
+            {
+                cpu->stop = STOP_PC;
+                break;
+            }
+            if (execute_instruction(cpu) > 0)
+                executed++;
+            if (cpu->stop)
+                break;
+            continue;
+        }
+
+        const DecodedOp* op = &cache->ops[run->first];
+        const DecodedOp* end = op + run->count;
+        cache->invalidated = 0;
+        for (; op < end; op++)
+        {
+            if (op->pc == cpu->stop_pc)
+            {
+                cpu->stop = STOP_PC;
+                return executed;
+            }
+            if (op->fn)
+            {
+                cpu->PC = op->pc + op->length;
+                op->fn(cpu, op);
+                cpu->cycles += op->cycles;
+                if (op->page_cross && cpu->page_crossed)
+                    cpu->cycles++;
+                executed++;
+            }
+            else
+            {
+                cpu->PC = op->pc;
+                // A BRK stop returns 0 cycles without executing
+                if (execute_instruction(cpu) > 0)
+                    executed++;
+                if (cpu->stop)
+                    return executed;
+            }
+            // A write into the run may have changed the ops after this one,
+            // or a write to a device asked to stop
+            if (executed >= max_instructions || cpu->cycles >= limit || cache->invalidated || cpu->stop)
+                break;
+        }
+    }
+    return executed;
+}
+
+#if JIT_X64
+
+// Translator for --jit. Each basic block becomes a native function that
+// keeps A, X, Y and P in host registers and N/Z as the last result (lazy
+// flags). Code pages get their writes trapped through the bus so stores
+// into translated code drop the affected blocks. Blocks end before any
+// opcode the translator does not handle (BRK, RTI, PLP, SED, JMP ind,
+// illegal opcodes), which the interpreter then executes. A block is
+// translated for the decimal flag it starts with, and only CLD changes it
+// inside a block, so ADC and SBC know their mode when translated.
+//
+// Exits to an address known at translation time are chained: once the
+// block there is translated, the exit's jump is patched to go straight to
+// it instead of back to run_jit(), and patched back when that block is
+// dropped. The code buffer is writable only while it is being changed.
+#define JIT_CODE_SIZE (4 << 20)
+#define JIT_BLOCK_SPACE (32 << 10) // Upper bound on the code for one block
+#define JIT_MAX_BLOCKS 16384
+#define JIT_MAX_INSTRUCTIONS 32 // Per block
+#define JIT_MAX_BYTES (JIT_MAX_INSTRUCTIONS * 3)
+#define JIT_MAX_EXITS 64
+#define JIT_MAX_LINKS (JIT_MAX_BLOCKS * 2) // A block has at most two exits to known addresses
+
+typedef struct {
+    uint16_t start;
+    uint32_t end; // One past the last code byte
+    int length; // Instructions in one pass
+    int max_cycles; // Cycles of one pass, counting every possible penalty
+    void (*code)(CPU* cpu);
+    uint32_t chain; // Offset in the code buffer where chained exits enter
+} JitBlock;
+
+// An exit that can be chained to the block at a known address
+typedef struct {
+    uint32_t site; // Offset in the code buffer of the end of its jump
+    uint32_t home; // Where the jump goes unchained: its block's epilogue
+    int32_t next; // Next link + 1 to the same address and decimal flag
+} JitLink;
+
+struct Jit {
+    uint8_t* code;
+    size_t code_used;
+    JitBlock blocks[JIT_MAX_BLOCKS];
+    int block_count;
+    int32_t entry[2][65536]; // Block index + 1 starting at each address with D clear and set, -1 if untranslatable
+    uint8_t code_refs[65536]; // Blocks covering each byte
+    uint32_t page_refs[256]; // Sum of code_refs per page; nonzero pages are watched
+    int invalidated; // Set when a watched write dropped a block
+    JitLink links[JIT_MAX_LINKS];
+    int link_count;
+    int32_t link_head[2][65536]; // First link + 1 to each address with D clear and set
+};
+
+// Host registers. The pinned ones are callee-saved, so helper calls keep them.
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+#define JA RBX
+#define JX RBP
+#define JY R13
+#define JP R14
+#define JNZ R15 // Last N/Z result when nz_live
+#define JCPU R12
+#define NOREG -1
+
+// Condition codes
+#define CC_O 0x0
+#define CC_C 0x2
+#define CC_NC 0x3
+#define CC_Z 0x4
+#define CC_NZ 0x5
+#define CC_A 0x7
+#define CC_S 0x8
+#define CC_NS 0x9
+#define CC_L 0xC
+
+#define CPU_OFF(field) ((int32_t)offsetof(CPU, field))
+
+typedef struct {
+    CPU* cpu;
+    uint8_t* buf;
+    size_t pos;
+    uint16_t start;
+    int count; // Instructions translated so far
+    int cycles; // Their base cycles plus static branch penalties
+    int max_cycles;
+    int nz_live; // N/Z in P are stale, JNZ holds the result they come from
+    int decimal; // D is set: ADC and SBC look up the decimal tables
+    size_t loop; // Top of the block body
+    size_t exits[JIT_MAX_EXITS]; // Jumps to the epilogue
+    int exit_count;
+    struct {
+        size_t at; // End of the exit's jump
+        uint16_t pc;
+        int decimal;
+    } links[2]; // Exits that can be chained, see jx_exit_to()
+    int link_count;
+} JitGen;
+
+// Effective address of a memory operand, see jx_address()
+typedef struct {
+    int kind;
+    uint16_t address; // JIT_ADDR_STATIC
+    uint8_t page; // JIT_ADDR_PAGE
+} JitAddr;
+
+#define JIT_ADDR_STATIC 0 // Known at translation time
+#define JIT_ADDR_PAGE 1 // In ECX, on a page known at translation time
+#define JIT_ADDR_DYNAMIC 2 // In ECX
+
+static void jx_byte(JitGen* g, uint8_t b)
+{
+    g->buf[g->pos++] = b;
+}
+
+static void jx_word(JitGen* g, uint16_t w)
+{
+    memcpy(&g->buf[g->pos], &w, 2);
+    g->pos += 2;
+}
+
+static void jx_dword(JitGen* g, uint32_t d)
+{
+    memcpy(&g->buf[g->pos], &d, 4);
+    g->pos += 4;
+}
+
+static void jx_qword(JitGen* g, uint64_t q)
+{
+    memcpy(&g->buf[g->pos], &q, 8);
+    g->pos += 8;
+}
+
+// A byte operation on SPL, BPL, SIL or DIL needs a REX prefix, even an empty one
+static void jx_rex(JitGen* g, int w, int reg, int index, int base, int byte_op)
+{
+    uint8_t rex = 0x40;
+
+    if (w)
+        rex |= 8;
+    if (reg >= 8)
+        rex |= 4;
+    if (index >= 8)
+        rex |= 2;
+    if (base >= 8)
+        rex |= 1;
+    if (rex != 0x40 || byte_op)
+        jx_byte(g, rex);
+}
+
+static void jx_op(JitGen* g, unsigned op)
+{
+    if (op > 0xFF)
+        jx_byte(g, op >> 8);
+    jx_byte(g, op & 0xFF);
+}
+
+#define LOW_BYTE_REX(r) ((r) >= RSP && (r) <= RDI)
+
+// op reg, rm with rm a register. For group opcodes reg is the /digit.
+static void jx_rr(JitGen* g, int w, int byte_op, unsigned op, int reg, int rm)
+{
+    jx_rex(g, w, reg, 0, rm, byte_op && (LOW_BYTE_REX(reg) || LOW_BYTE_REX(rm)));
+    jx_op(g, op);
+    jx_byte(g, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// op reg, [base + index * scale + disp]
+static void jx_rm(JitGen* g, int w, int byte_op, unsigned op, int reg, int base, int index, int scale, int32_t disp)
+{
+    jx_rex(g, w, reg, index < 0 ? 0 : index, base, byte_op && LOW_BYTE_REX(reg));
+    jx_op(g, op);
+    if (index < 0 && (base & 7) != RSP)
+    {
+        jx_byte(g, 0x80 | ((reg & 7) << 3) | (base & 7));
+    }
+    else
+    {
+        int ss = scale == 8 ? 3 : scale == 4 ? 2 : scale == 2 ? 1 : 0;
+        jx_byte(g, 0x80 | ((reg & 7) << 3) | RSP);
+        jx_byte(g, (ss << 6) | (((index < 0 ? RSP : index) & 7) << 3) | (base & 7));
+    }
+    jx_dword(g, (uint32_t)disp);
+}
+
+// Group-1 arithmetic (digit: 0 add, 1 or, 4 and, 5 sub, 7 cmp) with an immediate
+static void jx_ri(JitGen* g, int w, int digit, int rm, int32_t imm)
+{
+    if (imm >= -128 && imm <= 127)
+    {
+        jx_rr(g, w, 0, 0x83, digit, rm);
+        jx_byte(g, (uint8_t)imm);
+    }
+    else
+    {
+        jx_rr(g, w, 0, 0x81, digit, rm);
+        jx_dword(g, (uint32_t)imm);
+    }
+}
+
+static void jx_mi(JitGen* g, int w, int digit, int base, int32_t disp, int32_t imm)
+{
+    if (imm >= -128 && imm <= 127)
+    {
+        jx_rm(g, w, 0, 0x83, digit, base, NOREG, 1, disp);
+        jx_byte(g, (uint8_t)imm);
+    }
+    else
+    {
+        jx_rm(g, w, 0, 0x81, digit, base, NOREG, 1, disp);
+        jx_dword(g, (uint32_t)imm);
+    }
+}
+
+static void jx_mov_imm(JitGen* g, int reg, uint32_t imm)
+{
+    if (reg >= 8)
+        jx_byte(g, 0x41);
+    jx_byte(g, 0xB8 + (reg & 7));
+    jx_dword(g, imm);
+}
+
+static void jx_mov(JitGen* g, int dst, int src)
+{
+    jx_rr(g, 0, 0, 0x89, src, dst);
+}
+
+// Shift a 32-bit register by a constant (digit: 4 shl, 5 shr)
+static void jx_shift(JitGen* g, int digit, int reg, uint8_t count)
+{
+    jx_rr(g, 0, 0, 0xC1, digit, reg);
+    jx_byte(g, count);
+}
+
+static void jx_setcc(JitGen* g, int cc, int reg)
+{
+    jx_rr(g, 0, 1, 0x0F90 | cc, 0, reg);
+}
+
+static void jx_movzx8(JitGen* g, int dst, int src)
+{
+    jx_rr(g, 0, 1, 0x0FB6, dst, src);
+}
+
+// Load host CF from the 6502 carry
+static void jx_carry_in(JitGen* g)
+{
+    jx_rr(g, 0, 0, 0x0FBA, 4, JP); // bt r14d, 0
+    jx_byte(g, 0);
+}
+
+// Copy a host condition into the 6502 carry. Clobbers EDX.
+static void jx_carry_out(JitGen* g, int cc)
+{
+    jx_setcc(g, cc, RDX);
+    jx_ri(g, 0, 4, JP, ~FLAG_C & 0xFF);
+    jx_movzx8(g, RDX, RDX);
+    jx_rr(g, 0, 0, 0x09, RDX, JP); // or r14d, edx
+}
+
+static void jx_set_nz(JitGen* g, int reg)
+{
+    jx_mov(g, JNZ, reg);
+    g->nz_live = 1;
+}
+
+static size_t jx_jcc(JitGen* g, int cc)
+{
+    jx_byte(g, 0x0F);
+    jx_byte(g, 0x80 | cc);
+    jx_dword(g, 0);
+    return g->pos;
+}
+
+static size_t jx_jmp(JitGen* g)
+{
+    jx_byte(g, 0xE9);
+    jx_dword(g, 0);
+    return g->pos;
+}
+
+// Point the jump ending at `at` to target
+static void jx_point(JitGen* g, size_t at, size_t target)
+{
+    int32_t rel = (int32_t)(target - at);
+    memcpy(&g->buf[at - 4], &rel, 4);
+}
+
+// Point the jump ending at `at` to the current position
+static void jx_patch(JitGen* g, size_t at)
+{
+    jx_point(g, at, g->pos);
+}
+
+static void jx_call(JitGen* g, const void* fn)
+{
+    jx_rr(g, 1, 0, 0x89, JCPU, RDI); // mov rdi, r12
+    jx_byte(g, 0x48); // mov rax, imm64
+    jx_byte(g, 0xB8);
+    jx_qword(g, (uint64_t)(uintptr_t)fn);
+    jx_rr(g, 0, 0, 0xFF, 2, RAX); // call rax
+}
+
+// Fold the lazily kept N/Z result into P. Only emits code; callers decide
+// whether nz_live changes. Clobbers EAX.
+static void jx_flush_nz(JitGen* g)
+{
+    jx_ri(g, 0, 4, JP, ~(FLAG_N | FLAG_Z) & 0xFF);
+    jx_mov(g, RAX, JNZ);
+    jx_ri(g, 0, 4, RAX, FLAG_N);
+    jx_rr(g, 0, 0, 0x09, RAX, JP); // or r14d, eax
+    jx_rr(g, 0, 1, 0x80, 7, JNZ); // cmp r15b, 1: CF when zero
+    jx_byte(g, 1);
+    jx_setcc(g, CC_C, RAX);
+    jx_rr(g, 0, 1, 0x00, RAX, RAX); // add al, al
+    jx_rr(g, 0, 1, 0x08, RAX, JP); // or r14b, al
+}
+
+// Leave the block after `done` instructions of this pass costing `cycles`,
+// continuing at pc, or at AX when pc is negative
+static void jx_exit(JitGen* g, int done, int cycles, int32_t pc)
+{
+    jx_byte(g, 0x66);
+    if (pc < 0)
+    {
+        jx_rm(g, 0, 0, 0x89, RAX, JCPU, NOREG, 1, CPU_OFF(PC));
+    }
+    else
+    {
+        jx_rm(g, 0, 0, 0xC7, 0, JCPU, NOREG, 1, CPU_OFF(PC));
+        jx_word(g, (uint16_t)pc);
+    }
+    if (g->nz_live)
+        jx_flush_nz(g);
+    if (cycles)
+        jx_mi(g, 1, 0, JCPU, CPU_OFF(cycles), cycles);
+    jx_mi(g, 0, 5, JCPU, CPU_OFF(jit_left), done);
+    g->exits[g->exit_count++] = jx_jmp(g);
+}
+
+// jx_exit() to a known address, with an exit jump that can be chained to
+// the block there
+static void jx_exit_to(JitGen* g, int done, int cycles, uint16_t pc)
+{
+    jx_exit(g, done, cycles, pc);
+    g->links[g->link_count].at = g->exits[g->exit_count - 1];
+    g->links[g->link_count].pc = pc;
+    g->links[g->link_count].decimal = g->decimal;
+    g->link_count++;
+}
+
+// Back edge to the block start: run another pass if the budget allows one,
+// otherwise leave with PC at the start
+static void jx_loop(JitGen* g, int cycles)
+{
+    if (g->nz_live)
+        jx_flush_nz(g);
+    jx_mi(g, 1, 0, JCPU, CPU_OFF(cycles), cycles);
+    jx_mi(g, 0, 5, JCPU, CPU_OFF(jit_left), g->count);
+    jx_mi(g, 0, 7, JCPU, CPU_OFF(jit_left), g->count);
+    size_t out_of_instructions = jx_jcc(g, CC_L);
+    jx_rm(g, 1, 0, 0x8B, RAX, JCPU, NOREG, 1, CPU_OFF(cycles));
+    jx_ri(g, 1, 0, RAX, g->max_cycles);
+    jx_rm(g, 1, 0, 0x3B, RAX, JCPU, NOREG, 1, CPU_OFF(jit_cycle_limit));
+    size_t out_of_cycles = jx_jcc(g, CC_NC);
+    jx_byte(g, 0xE9);
+    jx_dword(g, (uint32_t)(int32_t)(g->loop - (g->pos + 4)));
+    jx_patch(g, out_of_instructions);
+    jx_patch(g, out_of_cycles);
+    jx_byte(g, 0x66);
+    jx_rm(g, 0, 0, 0xC7, 0, JCPU, NOREG, 1, CPU_OFF(PC));
+    jx_word(g, g->start);
+    g->exits[g->exit_count++] = jx_jmp(g);
+}
+
+// Bus helpers for the slow paths of translated code
+static uint8_t jit_read(CPU* cpu, uint16_t address)
+{
+    return mem_read(cpu, address);
+}
+
+// Returns nonzero when the write dropped translated code or asked to stop
+static int jit_write(CPU* cpu, uint16_t address, uint8_t value)
+{
+    cpu->jit->invalidated = 0;
+    mem_write(cpu, address, value);
+    return cpu->jit->invalidated || cpu->stop;
+}
+
+// Offset from the CPU of a RAM page, or -1 when it is not inside the CPU
+static int32_t jx_ram_offset(CPU* cpu, const uint8_t* page)
+{
+    if (!page || page < (const uint8_t*)cpu || page >= (const uint8_t*)(cpu + 1))
+        return -1;
+    return (int32_t)(page - (const uint8_t*)cpu);
+}
+
+// Read the byte at a into EAX. Clobbers ECX, EDX.
+static void jx_read(JitGen* g, const JitAddr* a)
+{
+    CPU* cpu = g->cpu;
+    int32_t off;
+    size_t slow, done;
+
+    if (a->kind == JIT_ADDR_STATIC)
+    {
+        uint8_t* page = cpu->read_map[a->address >> 8];
+        off = jx_ram_offset(cpu, page);
+        if (!page && !io_register(cpu, a->address))
+            off = CPU_OFF(mem) + (a->address & 0xFF00);
+        if (off >= 0)
+        {
+            jx_rm(g, 0, 0, 0x0FB6, RAX, JCPU, NOREG, 1, off + (a->address & 0xFF));
+            return;
+        }
+        if (page)
+        {
+            // A snapshot page moves into mem on its first write, but stays
+            // RAM until the next flush; look it up at run time
+            jx_rm(g, 1, 0, 0x8B, RDX, JCPU, NOREG, 1, CPU_OFF(read_map) + (a->address >> 8) * 8);
+            jx_rm(g, 0, 0, 0x0FB6, RAX, RDX, NOREG, 1, a->address & 0xFF);
+            return;
+        }
+        jx_mov_imm(g, RCX, a->address);
+    }
+    else if (a->kind == JIT_ADDR_PAGE)
+    {
+        uint8_t* page = cpu->read_map[a->page];
+        off = jx_ram_offset(cpu, page);
+        if (off >= 0)
+        {
+            jx_rm(g, 0, 0, 0x0FB6, RAX, JCPU, RCX, 1, off - (a->page << 8));
+            return;
+        }
+        if (!page)
+        {
+            // Only the page's registers need the handler
+            jx_movzx8(g, RDX, RCX);
+            jx_rm(g, 0, 0, 0x0FA3, RDX, JCPU, NOREG, 1,
+                CPU_OFF(io) + a->page * (int32_t)sizeof(IoPage) + (int32_t)offsetof(IoPage, regs));
+            slow = jx_jcc(g, CC_C);
+            jx_rm(g, 0, 0, 0x0FB6, RAX, JCPU, RCX, 1, CPU_OFF(mem));
+            done = jx_jmp(g);
+            jx_patch(g, slow);
+            jx_mov(g, RSI, RCX);
+            jx_call(g, jit_read);
+            jx_movzx8(g, RAX, RAX);
+            jx_patch(g, done);
+            return;
+        }
+    }
+
+    if (a->kind != JIT_ADDR_STATIC)
+    {
+        jx_mov(g, RDX, RCX);
+        jx_shift(g, 5, RDX, 8);
+        jx_rm(g, 1, 0, 0x8B, RDX, JCPU, RDX, 8, CPU_OFF(read_map));
+        jx_rr(g, 1, 0, 0x85, RDX, RDX); // test rdx, rdx
+        slow = jx_jcc(g, CC_Z);
+        jx_movzx8(g, RAX, RCX);
+        jx_rm(g, 0, 0, 0x0FB6, RAX, RDX, RAX, 1, 0);
+        done = jx_jmp(g);
+        jx_patch(g, slow);
+    }
+    else
+    {
+        done = 0;
+    }
+    jx_mov(g, RSI, RCX);
+    jx_call(g, jit_read);
+    jx_movzx8(g, RAX, RAX);
+    if (done)
+        jx_patch(g, done);
+}
+
+// Write AL to a. If the write drops translated code or asks to stop and
+// exit_pc is not negative, leave the block there after finishing the
+// current instruction.
+static void jx_write(JitGen* g, const JitAddr* a, int cycles, int32_t exit_pc)
+{
+    size_t slow, done, kept;
+
+    if (a->kind == JIT_ADDR_STATIC)
+        jx_mov_imm(g, RCX, a->address);
+    if (a->kind == JIT_ADDR_DYNAMIC)
+    {
+        jx_mov(g, RDX, RCX);
+        jx_shift(g, 5, RDX, 8);
+        jx_rm(g, 1, 0, 0x8B, RDX, JCPU, RDX, 8, CPU_OFF(write_map));
+    }
+    else
+    {
+        int page = a->kind == JIT_ADDR_STATIC ? a->address >> 8 : a->page;
+        jx_rm(g, 1, 0, 0x8B, RDX, JCPU, NOREG, 1, CPU_OFF(write_map) + page * 8);
+    }
+    jx_rr(g, 1, 0, 0x85, RDX, RDX);
+    slow = jx_jcc(g, CC_Z);
+    jx_movzx8(g, RSI, RCX);
+    jx_rm(g, 0, 1, 0x88, RAX, RDX, RSI, 1, 0);
+    done = jx_jmp(g);
+    jx_patch(g, slow);
+    jx_movzx8(g, RDX, RAX);
+    jx_mov(g, RSI, RCX);
+    jx_call(g, jit_write);
+    if (exit_pc >= 0)
+    {
+        jx_rr(g, 0, 0, 0x85, RAX, RAX);
+        kept = jx_jcc(g, CC_Z);
+        jx_exit(g, g->count + 1, cycles, exit_pc);
+        jx_patch(g, kept);
+    }
+    jx_patch(g, done);
+}
+
+// Scratch slot in the block's stack frame
+#define jx_spill(g, reg) jx_rm(g, 0, 0, 0x89, reg, RSP, NOREG, 1, 0)
+#define jx_or_spill(g, reg) jx_rm(g, 0, 0, 0x0B, reg, RSP, NOREG, 1, 0)
+#define jx_unspill(g, reg) jx_rm(g, 0, 0, 0x8B, reg, RSP, NOREG, 1, 0)
+#define jx_spill_address(g) jx_rm(g, 0, 0, 0x89, RCX, RSP, NOREG, 1, 4)
+#define jx_reload_address(g) jx_rm(g, 0, 0, 0x8B, RCX, RSP, NOREG, 1, 4)
+
+// ECX = $0100 + SP. A push decrements SP afterwards, a pull increments it first.
+static void jx_stack_address(JitGen* g, int delta)
+{
+    if (delta > 0)
+        jx_rm(g, 0, 1, 0xFE, 0, JCPU, NOREG, 1, CPU_OFF(SP)); // inc byte [SP]
+    jx_rm(g, 0, 0, 0x0FB6, RCX, JCPU, NOREG, 1, CPU_OFF(SP));
+    jx_ri(g, 0, 0, RCX, 0x100);
+    if (delta < 0)
+        jx_rm(g, 0, 1, 0xFE, 1, JCPU, NOREG, 1, CPU_OFF(SP)); // dec byte [SP]
+}
+
+// Emit the effective address for mode. page_cross adds the penalty cycle
+// of indexed reads at run time.
+static JitAddr jx_address(JitGen* g, uint8_t mode, uint16_t operand, int page_cross)
+{
+    JitAddr a = { JIT_ADDR_DYNAMIC, 0, 0 };
+    JitAddr zp = { JIT_ADDR_PAGE, 0, 0 };
+    int index = JX;
+
+    switch (mode)
+    {
+    case AM_ZP:
+    case AM_ABS:
+        a.kind = JIT_ADDR_STATIC;
+        a.address = mode == AM_ZP ? (operand & 0xFF) : operand;
         break;
-    case 0x55: // EOR zpx
-        address = get_address(cpu, AM_ZPX);
-        cpu->A ^= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
+    case AM_ZPY:
+        index = JY;
+        // fall through
+    case AM_ZPX:
+        jx_mov(g, RCX, index);
+        jx_ri(g, 0, 0, RCX, operand & 0xFF);
+        jx_movzx8(g, RCX, RCX);
+        a = zp;
         break;
-    case 0x56: // LSR zpx
-        address = get_address(cpu, AM_ZPX);
-        value = cpu->mem[address];
-        cpu->P &= ~FLAG_C;
-        if (value & 0x01)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = value >> 1;
-        set_zero_and_negative_flags(cpu, cpu->mem[address]);
+    case AM_ABY:
+        index = JY;
+        // fall through
+    case AM_ABX:
+        jx_mov(g, RCX, index);
+        jx_ri(g, 0, 0, RCX, operand);
+        if (page_cross)
+        {
+            jx_ri(g, 0, 7, RCX, operand | 0xFF);
+            jx_setcc(g, CC_A, RAX);
+            jx_movzx8(g, RAX, RAX);
+            jx_rm(g, 1, 0, 0x01, RAX, JCPU, NOREG, 1, CPU_OFF(cycles));
+        }
+        jx_ri(g, 0, 4, RCX, 0xFFFF);
         break;
-    case 0x57: // SRE zpx
-        address = get_address(cpu, AM_ZPX);
-        value = cpu->mem[address];
-        cpu->P &= ~FLAG_C;
-        if (value & 0x01)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = value >> 1;
-        cpu->A ^= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
+    case AM_IZX:
+        jx_mov(g, RCX, JX);
+        jx_ri(g, 0, 0, RCX, operand & 0xFF);
+        jx_movzx8(g, RCX, RCX);
+        jx_read(g, &zp);
+        jx_spill(g, RAX);
+        jx_mov(g, RCX, JX);
+        jx_ri(g, 0, 0, RCX, (operand & 0xFF) + 1);
+        jx_movzx8(g, RCX, RCX);
+        jx_read(g, &zp);
+        jx_shift(g, 4, RAX, 8);
+        jx_or_spill(g, RAX);
+        jx_mov(g, RCX, RAX);
         break;
-    case 0x58: // CLI
-        cpu->P &= ~FLAG_I;
+    case AM_IZY:
+        a.kind = JIT_ADDR_STATIC;
+        a.address = operand & 0xFF;
+        jx_read(g, &a);
+        jx_spill(g, RAX);
+        a.address = (operand + 1) & 0xFF;
+        jx_read(g, &a);
+        jx_shift(g, 4, RAX, 8);
+        jx_or_spill(g, RAX);
+        jx_mov(g, RCX, RAX);
+        jx_rr(g, 0, 0, 0x01, JY, RCX); // add ecx, r13d
+        if (page_cross)
+        {
+            jx_movzx8(g, RAX, RAX);
+            jx_rr(g, 0, 0, 0x01, JY, RAX);
+            jx_shift(g, 5, RAX, 8);
+            jx_rm(g, 1, 0, 0x01, RAX, JCPU, NOREG, 1, CPU_OFF(cycles));
+        }
+        jx_ri(g, 0, 4, RCX, 0xFFFF);
+        a.kind = JIT_ADDR_DYNAMIC;
         break;
-    case 0x59: // EOR aby
-        address = get_address(cpu, AM_ABY);
-        cpu->A ^= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
+    }
+    return a;
+}
+
+// Addressing mode of the group-1 opcodes (ORA, AND, EOR, ADC, STA, LDA, CMP, SBC)
+static const uint8_t jit_group1_mode[8] = { AM_IZX, AM_ZP, AM_IMM, AM_ABS, AM_IZY, AM_ZPX, AM_ABY, AM_ABX };
+
+static int jit_operand_size(uint8_t mode)
+{
+    switch (mode)
+    {
+    case AM_IMP:
+        return 0;
+    case AM_ABS:
+    case AM_ABX:
+    case AM_ABY:
+    case AM_IND:
+        return 2;
+    default:
+        return 1;
+    }
+}
+
+// Addressing mode of a translatable opcode, or -1
+static int jit_mode(uint8_t op)
+{
+    if ((op & 3) == 1)
+        return op == 0x89 ? -1 : jit_group1_mode[(op >> 2) & 7];
+    if ((op & 3) == 3)
+    {
+        // No immediates, AHX, TAS or LAS; SAX and LAX index with Y
+        int mode = jit_group1_mode[(op >> 2) & 7];
+        if (mode == AM_IMM || op == 0x93 || op == 0x9B || op == 0x9F || op == 0xBB)
+            return -1;
+        if (op >> 6 == 2 && mode == AM_ZPX)
+            return AM_ZPY;
+        if (op >> 6 == 2 && mode == AM_ABX)
+            return AM_ABY;
+        return mode;
+    }
+
+    switch (op)
+    {
+    case 0x0A: case 0x2A: case 0x4A: case 0x6A: // Accumulator shifts
+    case 0x08: case 0x48: case 0x68: // PHP, PHA, PLA
+    case 0x18: case 0x38: case 0x58: case 0x78: case 0xB8: case 0xD8: // Flags
+    case 0x88: case 0xC8: case 0xCA: case 0xE8: // DEY, INY, DEX, INX
+    case 0x8A: case 0x98: case 0x9A: case 0xA8: case 0xAA: case 0xBA: // Transfers
+    case 0x60: case 0xEA: // RTS, NOP
+        return AM_IMP;
+    case 0xA0: case 0xA2: case 0xC0: case 0xE0:
+        return AM_IMM;
+    case 0x10: case 0x30: case 0x50: case 0x70: case 0x90: case 0xB0: case 0xD0: case 0xF0:
+        return AM_REL;
+    case 0x06: case 0x26: case 0x46: case 0x66: case 0xC6: case 0xE6:
+    case 0x24: case 0x84: case 0x86: case 0xA4: case 0xA6: case 0xC4: case 0xE4:
+        return AM_ZP;
+    case 0x16: case 0x36: case 0x56: case 0x76: case 0xD6: case 0xF6:
+    case 0x94: case 0xB4:
+        return AM_ZPX;
+    case 0x96: case 0xB6:
+        return AM_ZPY;
+    case 0x0E: case 0x2E: case 0x4E: case 0x6E: case 0xCE: case 0xEE:
+    case 0x2C: case 0x8C: case 0x8E: case 0xAC: case 0xAE: case 0xCC: case 0xEC:
+    case 0x20: case 0x4C:
+        return AM_ABS;
+    case 0x1E: case 0x3E: case 0x5E: case 0x7E: case 0xDE: case 0xFE:
+    case 0xBC:
+        return AM_ABX;
+    case 0xBE:
+        return AM_ABY;
+    default:
+        return -1;
+    }
+}
+
+// Host register operated on by an opcode's X/Y/A variants
+static int jit_index_register(uint8_t op)
+{
+    switch (op)
+    {
+    case 0x84: case 0x8C: case 0x94: case 0xA0: case 0xA4: case 0xAC: case 0xB4: case 0xBC:
+    case 0xC0: case 0xC4: case 0xCC:
+        return JY;
+    case 0x86: case 0x8E: case 0x96: case 0xA2: case 0xA6: case 0xAE: case 0xB6: case 0xBE:
+    case 0xE0: case 0xE4: case 0xEC:
+        return JX;
+    default:
+        return JA;
+    }
+}
+
+// Shift or rotate the byte register reg (digit of the D0 group: 2 rcl, 3 rcr, 4 shl, 5 shr)
+static void jx_shift_op(JitGen* g, int digit, int reg)
+{
+    if (digit == 2 || digit == 3)
+        jx_carry_in(g);
+    jx_rr(g, 0, 1, 0xD0, digit, reg);
+    jx_carry_out(g, CC_C);
+    jx_set_nz(g, reg);
+}
+
+// Merge host CF and OF into the 6502 C and V after ADC or SBC
+static void jx_carry_overflow_out(JitGen* g)
+{
+    jx_setcc(g, CC_C, RDX);
+    jx_setcc(g, CC_O, RCX);
+    jx_ri(g, 0, 4, JP, ~(FLAG_C | FLAG_V) & 0xFF);
+    jx_movzx8(g, RDX, RDX);
+    jx_rr(g, 0, 0, 0x09, RDX, JP);
+    jx_movzx8(g, RCX, RCX);
+    jx_shift(g, 4, RCX, 6);
+    jx_rr(g, 0, 0, 0x09, RCX, JP);
+    jx_set_nz(g, JA);
+}
+
+// Decimal ADC or SBC of the operand in AL: A and N, V, Z, C from table
+static void jx_decimal(JitGen* g, const uint16_t (*table)[256][256])
+{
+    jx_movzx8(g, RAX, RAX);
+    jx_movzx8(g, RCX, JA);
+    jx_shift(g, 4, RCX, 8);
+    jx_rr(g, 0, 0, 0x09, RCX, RAX); // or eax, ecx
+    jx_mov(g, RCX, JP);
+    jx_ri(g, 0, 4, RCX, FLAG_C);
+    jx_shift(g, 4, RCX, 16);
+    jx_rr(g, 0, 0, 0x09, RCX, RAX);
+    jx_byte(g, 0x48); // mov rdx, imm64
+    jx_byte(g, 0xBA);
+    jx_qword(g, (uint64_t)(uintptr_t)table);
+    jx_rm(g, 0, 0, 0x0FB7, RAX, RDX, RAX, 2, 0); // movzx eax, word [rdx + rax * 2]
+    jx_movzx8(g, JA, RAX);
+    jx_shift(g, 5, RAX, 8);
+    jx_ri(g, 0, 4, JP, ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C) & 0xFF);
+    jx_rr(g, 0, 0, 0x09, RAX, JP);
+    g->nz_live = 0;
+}
+
+// CMP, CPX, CPY of reg against AL
+static void jx_compare(JitGen* g, int reg)
+{
+    jx_rr(g, 0, 1, 0x38, RAX, reg); // cmp reg8, al
+    jx_carry_out(g, CC_NC);
+    jx_mov(g, JNZ, reg);
+    jx_rr(g, 0, 1, 0x28, RAX, JNZ); // sub r15b, al
+    g->nz_live = 1;
+}
+
+// The group-1 operation of row (bits 7-5 of the opcode, not STA) on A and
+// the operand in AL. Keeps AL except for decimal ADC and SBC.
+static void jx_alu(JitGen* g, int row)
+{
+    switch (row)
+    {
+    case 0: // ORA
+        jx_rr(g, 0, 1, 0x08, RAX, JA);
+        jx_set_nz(g, JA);
         break;
-    case 0x5A: // NOP
+    case 1: // AND
+        jx_rr(g, 0, 1, 0x20, RAX, JA);
+        jx_set_nz(g, JA);
         break;
-    case 0x5B: // SRE aby
-        address = get_address(cpu, AM_ABY);
-        value = cpu->mem[address];
-        cpu->P &= ~FLAG_C;
-        if (value & 0x01)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = value >> 1;
-        cpu->A ^= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
+    case 2: // EOR
+        jx_rr(g, 0, 1, 0x30, RAX, JA);
+        jx_set_nz(g, JA);
         break;
-    case 0x5C: // NOP abx
-        get_address(cpu, AM_ABX);
+    case 3: // ADC
+        if (g->decimal)
+        {
+            jx_decimal(g, decimal_adc);
+            break;
+        }
+        jx_carry_in(g);
+        jx_rr(g, 0, 1, 0x10, RAX, JA);
+        jx_carry_overflow_out(g);
         break;
-    case 0x5D: // EOR abx
-        address = get_address(cpu, AM_ABX);
-        cpu->A ^= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
+    case 5: // LDA
+        jx_mov(g, JA, RAX);
+        jx_set_nz(g, JA);
         break;
-    case 0x5E: // LSR abx
-        address = get_address(cpu, AM_ABX);
-        value = cpu->mem[address];
-        cpu->P &= ~FLAG_C;
-        if (value & 0x01)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = value >> 1;
-        set_zero_and_negative_flags(cpu, cpu->mem[address]);
+    case 6: // CMP
+        jx_compare(g, JA);
         break;
-    case 0x5F: // SRE abx
-        address = get_address(cpu, AM_ABX);
-        value = cpu->mem[address];
-        cpu->P &= ~FLAG_C;
-        if (value & 0x01)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = value >> 1;
-        cpu->A ^= cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
+    case 7: // SBC: the 6502 carry is the inverted borrow
+        if (g->decimal)
+        {
+            jx_decimal(g, decimal_sbc);
+            break;
+        }
+        jx_carry_in(g);
+        jx_byte(g, 0xF5); // cmc
+        jx_rr(g, 0, 1, 0x18, RAX, JA);
+        jx_byte(g, 0xF5);
+        jx_carry_overflow_out(g);
         break;
+    }
+}
+
+// Translate the instruction at pc. Returns 0 if it cannot be translated
+// (nothing emitted), 1 to continue the block, 2 if it ended the block.
+static int jit_translate_op(JitGen* g, uint16_t pc, uint8_t op, uint16_t operand, int mode)
+{
+    uint16_t next = pc + 1 + jit_operand_size(mode);
+    int cycles = g->cycles + cycle_table[op];
+    int reg = jit_index_register(op);
+    JitAddr a;
+
+    g->max_cycles += cycle_table[op] + page_cross_table[op];
+
+    // Group 1: ORA, AND, EOR, ADC, STA, LDA, CMP, SBC
+    if ((op & 3) == 1)
+    {
+        if (op >> 5 == 4) // STA
+        {
+            a = jx_address(g, mode, operand, 0);
+            jx_mov(g, RAX, JA);
+            jx_write(g, &a, cycles, next);
+            return 1;
+        }
+        if (mode == AM_IMM)
+        {
+            jx_mov_imm(g, RAX, operand & 0xFF);
+        }
+        else
+        {
+            a = jx_address(g, mode, operand, page_cross_table[op]);
+            jx_read(g, &a);
+        }
+        jx_alu(g, op >> 5);
+        return 1;
+    }
+
+    // Undocumented: SAX, LAX, and a read-modify-write paired with the
+    // group-1 operation of its row (SLO, RLA, SRE, RRA, DCP, ISC)
+    if ((op & 3) == 3)
+    {
+        static const int digits[4] = { 4, 2, 5, 3 };
+
+        if (op >> 5 == 4) // SAX
+        {
+            a = jx_address(g, mode, operand, 0);
+            jx_mov(g, RAX, JA);
+            jx_rr(g, 0, 1, 0x20, JX, RAX); // and al, bpl
+            jx_write(g, &a, cycles, next);
+            return 1;
+        }
+        if (op >> 5 == 5) // LAX
+        {
+            a = jx_address(g, mode, operand, page_cross_table[op]);
+            jx_read(g, &a);
+            jx_mov(g, JA, RAX);
+            jx_mov(g, JX, RAX);
+            jx_set_nz(g, JA);
+            return 1;
+        }
+        a = jx_address(g, mode, operand, 0);
+        if (a.kind != JIT_ADDR_STATIC)
+            jx_spill_address(g);
+        jx_read(g, &a);
+        if (op >= 0xC0)
+            jx_rr(g, 0, 1, 0xFE, op >= 0xE0 ? 0 : 1, RAX); // inc/dec al
+        else
+            jx_shift_op(g, digits[op >> 5], RAX);
+        if (g->decimal && (op >> 5 == 3 || op >> 5 == 7))
+        {
+            jx_spill(g, RAX);
+            jx_alu(g, op >> 5);
+            jx_unspill(g, RAX);
+        }
+        else
+        {
+            jx_alu(g, op >> 5);
+        }
+        if (a.kind != JIT_ADDR_STATIC)
+            jx_reload_address(g);
+        jx_write(g, &a, cycles, next);
+        return 1;
+    }
+
+    switch (op)
+    {
+    case 0xA0: case 0xA2: // LDY, LDX imm
+        jx_mov_imm(g, reg, operand & 0xFF);
+        jx_set_nz(g, reg);
+        return 1;
+    case 0xA4: case 0xA6: case 0xAC: case 0xAE: case 0xB4: case 0xB6: case 0xBC: case 0xBE: // LDY, LDX
+        a = jx_address(g, mode, operand, page_cross_table[op]);
+        jx_read(g, &a);
+        jx_mov(g, reg, RAX);
+        jx_set_nz(g, reg);
+        return 1;
+    case 0x84: case 0x86: case 0x8C: case 0x8E: case 0x94: case 0x96: // STY, STX
+        a = jx_address(g, mode, operand, 0);
+        jx_mov(g, RAX, reg);
+        jx_write(g, &a, cycles, next);
+        return 1;
+    case 0xC0: case 0xE0: // CPY, CPX imm
+        jx_mov_imm(g, RAX, operand & 0xFF);
+        jx_compare(g, reg);
+        return 1;
+    case 0xC4: case 0xCC: case 0xE4: case 0xEC: // CPY, CPX
+        a = jx_address(g, mode, operand, 0);
+        jx_read(g, &a);
+        jx_compare(g, reg);
+        return 1;
+    case 0x24: case 0x2C: // BIT
+        a = jx_address(g, mode, operand, 0);
+        jx_read(g, &a);
+        jx_ri(g, 0, 4, JP, ~(FLAG_N | FLAG_V | FLAG_Z) & 0xFF);
+        jx_mov(g, RCX, RAX);
+        jx_ri(g, 0, 4, RCX, FLAG_N | FLAG_V);
+        jx_rr(g, 0, 0, 0x09, RCX, JP);
+        jx_rr(g, 0, 1, 0x84, JA, RAX); // test al, bl
+        jx_setcc(g, CC_Z, RCX);
+        jx_movzx8(g, RCX, RCX);
+        jx_rr(g, 0, 0, 0x01, RCX, RCX); // add ecx, ecx
+        jx_rr(g, 0, 0, 0x09, RCX, JP);
+        g->nz_live = 0;
+        return 1;
+
+    case 0x0A: // ASL
+        jx_shift_op(g, 4, JA);
+        return 1;
+    case 0x2A: // ROL
+        jx_shift_op(g, 2, JA);
+        return 1;
+    case 0x4A: // LSR
+        jx_shift_op(g, 5, JA);
+        return 1;
+    case 0x6A: // ROR
+        jx_shift_op(g, 3, JA);
+        return 1;
+    case 0x06: case 0x16: case 0x0E: case 0x1E: // ASL
+    case 0x26: case 0x36: case 0x2E: case 0x3E: // ROL
+    case 0x46: case 0x56: case 0x4E: case 0x5E: // LSR
+    case 0x66: case 0x76: case 0x6E: case 0x7E: // ROR
+    case 0xC6: case 0xD6: case 0xCE: case 0xDE: // DEC
+    case 0xE6: case 0xF6: case 0xEE: case 0xFE: // INC
+        a = jx_address(g, mode, operand, 0);
+        if (a.kind != JIT_ADDR_STATIC)
+            jx_spill_address(g);
+        jx_read(g, &a);
+        if (op >= 0xC0)
+        {
+            jx_rr(g, 0, 1, 0xFE, op >= 0xE0 ? 0 : 1, RAX); // inc/dec al
+            jx_set_nz(g, RAX);
+        }
+        else
+        {
+            static const int digits[4] = { 4, 2, 5, 3 };
+            jx_shift_op(g, digits[op >> 5], RAX);
+        }
+        if (a.kind != JIT_ADDR_STATIC)
+            jx_reload_address(g);
+        jx_write(g, &a, cycles, next);
+        return 1;
+
+    case 0xAA: case 0xA8: // TAX, TAY
+        jx_mov(g, op == 0xAA ? JX : JY, JA);
+        jx_set_nz(g, JA);
+        return 1;
+    case 0x8A: case 0x98: // TXA, TYA
+        jx_mov(g, JA, op == 0x8A ? JX : JY);
+        jx_set_nz(g, JA);
+        return 1;
+    case 0xBA: // TSX
+        jx_rm(g, 0, 0, 0x0FB6, JX, JCPU, NOREG, 1, CPU_OFF(SP));
+        jx_set_nz(g, JX);
+        return 1;
+    case 0x9A: // TXS
+        jx_rm(g, 0, 1, 0x88, JX, JCPU, NOREG, 1, CPU_OFF(SP));
+        return 1;
+    case 0xE8: case 0xC8: // INX, INY
+        jx_rr(g, 0, 1, 0xFE, 0, op == 0xE8 ? JX : JY);
+        jx_set_nz(g, op == 0xE8 ? JX : JY);
+        return 1;
+    case 0xCA: case 0x88: // DEX, DEY
+        jx_rr(g, 0, 1, 0xFE, 1, op == 0xCA ? JX : JY);
+        jx_set_nz(g, op == 0xCA ? JX : JY);
+        return 1;
+
+    case 0x18: // CLC
+        jx_ri(g, 0, 4, JP, ~FLAG_C & 0xFF);
+        return 1;
+    case 0x38: // SEC
+        jx_ri(g, 0, 1, JP, FLAG_C);
+        return 1;
+    case 0x58: // CLI
+        jx_ri(g, 0, 4, JP, ~FLAG_I & 0xFF);
+        return 1;
+    case 0x78: // SEI
+        jx_ri(g, 0, 1, JP, FLAG_I);
+        return 1;
+    case 0xB8: // CLV
+        jx_ri(g, 0, 4, JP, ~FLAG_V & 0xFF);
+        return 1;
+    case 0xD8: // CLD
+        jx_ri(g, 0, 4, JP, ~FLAG_D & 0xFF);
+        if (!g->decimal)
+            return 1;
+        // The rest runs in binary mode, a block of its own
+        g->count++;
+        g->decimal = 0;
+        jx_exit_to(g, g->count, cycles, next);
+        return 2;
+    case 0xEA: // NOP
+        return 1;
+
+    case 0x48: // PHA
+    case 0x08: // PHP
+        if (op == 0x08 && g->nz_live)
+        {
+            jx_flush_nz(g);
+            g->nz_live = 0;
+        }
+        jx_stack_address(g, -1);
+        jx_mov(g, RAX, op == 0x48 ? JA : JP);
+        a.kind = JIT_ADDR_PAGE;
+        a.page = 0x01;
+        jx_write(g, &a, cycles, next);
+        return 1;
+    case 0x68: // PLA
+        jx_stack_address(g, 1);
+        a.kind = JIT_ADDR_PAGE;
+        a.page = 0x01;
+        jx_read(g, &a);
+        jx_mov(g, JA, RAX);
+        jx_set_nz(g, JA);
+        return 1;
+
+    case 0x20: // JSR: push the address of its last byte
+        a.kind = JIT_ADDR_PAGE;
+        a.page = 0x01;
+        jx_stack_address(g, -1);
+        jx_mov_imm(g, RAX, (uint16_t)(pc + 2) >> 8);
+        jx_write(g, &a, cycles, -1);
+        jx_stack_address(g, -1);
+        jx_mov_imm(g, RAX, (pc + 2) & 0xFF);
+        jx_write(g, &a, cycles, -1);
+        g->cycles = cycles;
+        g->count++;
+        jx_exit_to(g, g->count, g->cycles, operand);
+        return 2;
+    case 0x60: // RTS
+        a.kind = JIT_ADDR_PAGE;
+        a.page = 0x01;
+        jx_stack_address(g, 1);
+        jx_read(g, &a);
+        jx_spill(g, RAX);
+        jx_stack_address(g, 1);
+        jx_read(g, &a);
+        jx_shift(g, 4, RAX, 8);
+        jx_or_spill(g, RAX);
+        jx_ri(g, 0, 0, RAX, 1);
+        g->cycles = cycles;
+        g->count++;
+        jx_exit(g, g->count, g->cycles, -1);
+        return 2;
+    case 0x4C: // JMP abs
+        g->cycles = cycles;
+        g->count++;
+        if (operand == g->start)
+            jx_loop(g, g->cycles);
+        else
+            jx_exit_to(g, g->count, g->cycles, operand);
+        return 2;
+
+    case 0x10: case 0x30: case 0x50: case 0x70: case 0x90: case 0xB0: case 0xD0: case 0xF0:
+    {
+        // Bits 7-6 pick the flag, bit 5 the value that takes the branch
+        static const uint8_t flags[4] = { FLAG_N, FLAG_V, FLAG_C, FLAG_Z };
+        uint8_t flag = flags[op >> 6];
+        uint16_t target = next + (int8_t)operand;
+        int penalty = ((next ^ target) & 0xFF00) ? 2 : 1;
+        int taken_cc;
+        size_t not_taken;
+
+        if (g->nz_live && (flag == FLAG_N || flag == FLAG_Z))
+        {
+            jx_rr(g, 0, 1, 0x84, JNZ, JNZ); // test r15b, r15b
+            if (flag == FLAG_N)
+                taken_cc = (op & 0x20) ? CC_S : CC_NS;
+            else
+                taken_cc = (op & 0x20) ? CC_Z : CC_NZ;
+        }
+        else
+        {
+            jx_rr(g, 0, 1, 0xF6, 0, JP); // test r14b, flag
+            jx_byte(g, flag);
+            taken_cc = (op & 0x20) ? CC_NZ : CC_Z;
+        }
+        not_taken = jx_jcc(g, taken_cc ^ 1);
+        g->count++;
+        g->max_cycles += penalty;
+        if (target == g->start)
+            jx_loop(g, cycles + penalty);
+        else
+            jx_exit_to(g, g->count, cycles + penalty, target);
+        jx_patch(g, not_taken);
+        g->cycles = cycles;
+        jx_exit_to(g, g->count, g->cycles, next);
+        return 2;
+    }
+    }
+    return 0;
+}
+
+// Let the code buffer be written (1) or run (0), never both. macOS maps
+// it MAP_JIT and switches it per thread; elsewhere it is remapped.
+static void jit_writable(Jit* jit, int writable)
+{
+#if defined(__APPLE__)
+    (void)jit;
+    pthread_jit_write_protect_np(!writable);
+#else
+    mprotect(jit->code, JIT_CODE_SIZE, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC);
+#endif
+}
+
+// Point the jump ending at site to target, both offsets in the code buffer
+static void jit_point(Jit* jit, uint32_t site, uint32_t target)
+{
+    int32_t rel = (int32_t)(target - site);
+    memcpy(&jit->code[site - 4], &rel, 4);
+}
+
+// Chain the exits to start with the decimal flag given to block, or
+// unchain them when block is NULL. The buffer must be writable.
+static void jit_relink(Jit* jit, int decimal, uint16_t start, const JitBlock* block)
+{
+    for (int32_t i = jit->link_head[decimal][start]; i > 0; i = jit->links[i - 1].next)
+    {
+        const JitLink* link = &jit->links[i - 1];
+        jit_point(jit, link->site, block ? block->chain : link->home);
+    }
+}
+
+// Drop every block and give the code pages their writes back
+void jit_flush(CPU* cpu)
+{
+    Jit* jit = cpu->jit;
+
+    for (int page = 0; page < 256; page++)
+    {
+        if (jit->page_refs[page])
+            unwatch_code_page(cpu, (uint8_t)page);
+    }
+    memset(jit->entry, 0, sizeof(jit->entry));
+    memset(jit->code_refs, 0, sizeof(jit->code_refs));
+    memset(jit->page_refs, 0, sizeof(jit->page_refs));
+    memset(jit->link_head, 0, sizeof(jit->link_head));
+    jit->block_count = 0;
+    jit->code_used = 0;
+    jit->link_count = 0;
+}
+
+// Add (+1) or remove (-1) a block's claim on its code bytes
+static void jit_claim(CPU* cpu, const JitBlock* block, int delta);
+
+// Drop the blocks covering address
+static void jit_invalidate(CPU* cpu, uint16_t address)
+{
+    Jit* jit = cpu->jit;
+    int first = address >= JIT_MAX_BYTES ? address - (JIT_MAX_BYTES - 1) : 0;
+
+    for (int decimal = 0; decimal < 2; decimal++)
+    {
+        for (int start = first; start <= address; start++)
+        {
+            int32_t index = jit->entry[decimal][start];
+            if (index > 0 && jit->blocks[index - 1].end > address)
+            {
+                jit_claim(cpu, &jit->blocks[index - 1], -1);
+                jit->entry[decimal][start] = 0;
+                if (jit->link_head[decimal][start])
+                {
+                    jit_writable(jit, 1);
+                    jit_relink(jit, decimal, (uint16_t)start, NULL);
+                    jit_writable(jit, 0);
+                }
+            }
+        }
+    }
+    jit->invalidated = 1;
+}
+
+// A watched write changed address
+void jit_code_written(CPU* cpu, uint16_t address)
+{
+    if (cpu->jit->code_refs[address])
+        jit_invalidate(cpu, address);
+}
+
+static void jit_claim(CPU* cpu, const JitBlock* block, int delta)
+{
+    Jit* jit = cpu->jit;
+
+    for (uint32_t address = block->start; address < block->end; address++)
+    {
+        unsigned page = address >> 8;
+        jit->code_refs[address] += delta;
+        if (delta > 0 && jit->page_refs[page]++ == 0)
+            watch_code_page(cpu, (uint8_t)page);
+        else if (delta < 0 && --jit->page_refs[page] == 0)
+            unwatch_code_page(cpu, (uint8_t)page);
+    }
+}
+
+// Code byte at address, or -1 if it is not in RAM
+static int jit_code_byte(CPU* cpu, uint32_t address)
+{
+    if (address > 0xFFFF || !cpu->read_map[address >> 8])
+        return -1;
+    return cpu->read_map[address >> 8][address & 0xFF];
+}
+
+// Translate the block starting at start with the decimal flag set or not.
+// Returns its index, or -1 if its first instruction cannot be translated.
+static int jit_translate(CPU* cpu, uint16_t start, int decimal)
+{
+    Jit* jit = cpu->jit;
+    JitGen g;
+    uint32_t pc = start;
+    int ended = 0;
+
+    if (jit->block_count == JIT_MAX_BLOCKS || jit->link_count > JIT_MAX_LINKS - 2 || JIT_CODE_SIZE - jit->code_used < JIT_BLOCK_SPACE)
+        jit_flush(cpu);
+    jit_writable(jit, 1);
+
+    memset(&g, 0, sizeof(g));
+    g.cpu = cpu;
+    g.buf = jit->code + jit->code_used;
+    g.start = start;
+    g.decimal = decimal;
+
+    // Prologue: save the callee-saved registers, pin the 6502 registers
+    static const int saved[6] = { RBX, RBP, R12, R13, R14, R15 };
+    for (int i = 0; i < 6; i++)
+    {
+        if (saved[i] >= 8)
+            jx_byte(&g, 0x41);
+        jx_byte(&g, 0x50 + (saved[i] & 7));
+    }
+    jx_ri(&g, 1, 5, RSP, 8); // Scratch slot, keeps calls aligned
+    jx_rr(&g, 1, 0, 0x89, RDI, JCPU);
+    jx_rm(&g, 0, 0, 0x0FB6, JA, JCPU, NOREG, 1, CPU_OFF(A));
+    jx_rm(&g, 0, 0, 0x0FB6, JX, JCPU, NOREG, 1, CPU_OFF(X));
+    jx_rm(&g, 0, 0, 0x0FB6, JY, JCPU, NOREG, 1, CPU_OFF(Y));
+    jx_rm(&g, 0, 0, 0x0FB6, JP, JCPU, NOREG, 1, CPU_OFF(P));
+    g.loop = g.pos;
+
+    while (!ended && g.count < JIT_MAX_INSTRUCTIONS)
+    {
+        int op = jit_code_byte(cpu, pc);
+        int mode = op < 0 ? -1 : jit_mode((uint8_t)op);
+        if (mode < 0)
+            break;
+
+        int size = jit_operand_size((uint8_t)mode);
+        int lo = size > 0 ? jit_code_byte(cpu, pc + 1) : 0;
+        int hi = size > 1 ? jit_code_byte(cpu, pc + 2) : 0;
+        if (lo < 0 || hi < 0)
+            break;
+
+        int result = jit_translate_op(&g, (uint16_t)pc, (uint8_t)op, (uint16_t)(lo | (hi << 8)), mode);
+        if (result == 0)
+            break;
+        if (result == 1)
+        {
+            g.count++;
+            g.cycles += cycle_table[op];
+        }
+        ended = result == 2;
+        pc += 1 + size;
+    }
+
+    if (g.count == 0)
+    {
+        jit_writable(jit, 0);
+        return -1;
+    }
+    if (!ended)
+        jx_exit_to(&g, g.count, g.cycles, (uint16_t)pc);
+
+    // Epilogue
+    size_t epilogue = g.pos;
+    for (int i = 0; i < g.exit_count; i++)
+        jx_patch(&g, g.exits[i]);
+    jx_rm(&g, 0, 1, 0x88, JA, JCPU, NOREG, 1, CPU_OFF(A));
+    jx_rm(&g, 0, 1, 0x88, JX, JCPU, NOREG, 1, CPU_OFF(X));
+    jx_rm(&g, 0, 1, 0x88, JY, JCPU, NOREG, 1, CPU_OFF(Y));
+    jx_rm(&g, 0, 1, 0x88, JP, JCPU, NOREG, 1, CPU_OFF(P));
+    jx_ri(&g, 1, 0, RSP, 8);
+    for (int i = 5; i >= 0; i--)
+    {
+        if (saved[i] >= 8)
+            jx_byte(&g, 0x41);
+        jx_byte(&g, 0x58 + (saved[i] & 7));
+    }
+    jx_byte(&g, 0xC3);
+
+    // Chain entry: a chained exit jumps here with PC at start and the 6502
+    // registers still pinned. Run the body if run_jit() would run the
+    // block, otherwise leave through the epilogue.
+    size_t chain = g.pos;
+    size_t bail[4];
+    jx_mi(&g, 0, 7, JCPU, CPU_OFF(jit_left), g.count);
+    bail[0] = jx_jcc(&g, CC_L);
+    jx_rm(&g, 1, 0, 0x8B, RAX, JCPU, NOREG, 1, CPU_OFF(cycles));
+    jx_ri(&g, 1, 0, RAX, g.max_cycles);
+    jx_rm(&g, 1, 0, 0x3B, RAX, JCPU, NOREG, 1, CPU_OFF(jit_cycle_limit));
+    bail[1] = jx_jcc(&g, CC_NC);
+    jx_rm(&g, 0, 0, 0x8B, RAX, JCPU, NOREG, 1, CPU_OFF(stop_pc));
+    jx_ri(&g, 0, 5, RAX, start);
+    jx_ri(&g, 0, 7, RAX, (int32_t)(pc - start)); // stop_pc inside the block: CF
+    bail[2] = jx_jcc(&g, CC_C);
+    jx_rm(&g, 0, 1, 0x80, 7, JCPU, NOREG, 1, CPU_OFF(stop)); // cmp byte [stop], 0
+    jx_byte(&g, 0);
+    bail[3] = jx_jcc(&g, CC_NZ);
+    jx_point(&g, jx_jmp(&g), g.loop);
+    for (int i = 0; i < 4; i++)
+        jx_point(&g, bail[i], epilogue);
+
+    uint32_t base = (uint32_t)(g.buf - jit->code);
+    JitBlock* block = &jit->blocks[jit->block_count];
+    block->start = start;
+    block->end = pc;
+    block->length = g.count;
+    block->max_cycles = g.max_cycles;
+    block->code = (void (*)(CPU*))(void*)g.buf;
+    block->chain = base + (uint32_t)chain;
+    jit->code_used += (g.pos + 15) & ~(size_t)15;
+    jit_claim(cpu, block, 1);
+
+    // Chain the new exits to blocks already there, and exits already
+    // there to the new block
+    for (int i = 0; i < g.link_count; i++)
+    {
+        JitLink* link = &jit->links[jit->link_count];
+        int32_t* head = &jit->link_head[g.links[i].decimal][g.links[i].pc];
+        int32_t target = jit->entry[g.links[i].decimal][g.links[i].pc];
+        link->site = base + (uint32_t)g.links[i].at;
+        link->home = base + (uint32_t)epilogue;
+        link->next = *head;
+        *head = ++jit->link_count;
+        if (target > 0)
+            jit_point(jit, link->site, jit->blocks[target - 1].chain);
+    }
+    jit_relink(jit, decimal, start, block);
+    jit_writable(jit, 0);
+    return jit->block_count++;
+}
+
+static int jit_init(CPU* cpu)
+{
+    Jit* jit = calloc(1, sizeof(Jit));
+    if (!jit)
+        return 0;
+#if defined(__APPLE__)
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS | MAP_JIT, -1, 0);
+#else
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#endif
+    if (jit->code == MAP_FAILED)
+    {
+        free(jit);
+        return 0;
+    }
+    cpu->jit = jit;
+    return 1;
+}
+
+void jit_release(CPU* cpu)
+{
+    jit_flush(cpu);
+    munmap(cpu->jit->code, JIT_CODE_SIZE);
+    free(cpu->jit);
+    cpu->jit = NULL;
+}
+
+// run_until() for --jit: translated blocks where possible, the reference
+// interpreter for the rest. A block only runs when it cannot overrun the
+// instruction or cycle budget or pass stop_pc, so both engines stop in the
+// same place; a chained block checks the same on entry.
+static int run_jit(CPU* cpu, int max_instructions, uint64_t max_cycles)
+{
+    uint64_t start = cpu->cycles;
+    int executed = 0;
+
+    cpu->stop = STOP_NONE;
+    cpu->jit_cycle_limit = cycle_limit(start, max_cycles);
+    while (executed < max_instructions && cpu->cycles - start < max_cycles)
+    {
+        if (cpu->PC == cpu->stop_pc)
+        {
+            cpu->stop = STOP_PC;
+            break;
+        }
+
+        JitBlock* block = NULL;
+        int decimal = (cpu->P & FLAG_D) != 0;
+        int32_t index = cpu->jit->entry[decimal][cpu->PC];
+        if (index == 0)
+        {
+            index = jit_translate(cpu, cpu->PC, decimal);
+            index = index < 0 ? -1 : index + 1;
+            cpu->jit->entry[decimal][cpu->PC] = index;
+        }
+        if (index > 0)
+            block = &cpu->jit->blocks[index - 1];
+        if (block && block->length <= max_instructions - executed
+            && max_cycles - (cpu->cycles - start) > (uint64_t)block->max_cycles
+            && (cpu->stop_pc < block->start || cpu->stop_pc >= (int32_t)block->end))
+        {
+            cpu->jit_left = max_instructions - executed;
+            block->code(cpu);
+            executed = max_instructions - cpu->jit_left;
+            if (cpu->stop)
+                break;
+            continue;
+        }
+
+        // A BRK stop returns 0 cycles without executing
+        if (execute_instruction(cpu) > 0)
+            executed++;
+        if (cpu->stop)
+            break;
+    }
+    return executed;
+}
+
+#endif // JIT_X64
+
+// The interpreter engine: run through the computed-goto engine or the
+// switch in execute_instruction() (see THREADED_DISPATCH) until
+// max_instructions have executed, at least max_cycles have elapsed, or a
+// stop condition is hit (cpu->stop says which). Returns the number of
+// instructions executed.
+static int run_interpreter(CPU* cpu, int max_instructions, uint64_t max_cycles)
+{
+#if THREADED_DISPATCH
+    return run_threaded(cpu, max_instructions, max_cycles);
+#else
+    uint64_t limit = cycle_limit(cpu->cycles, max_cycles);
+    int executed = 0;
+    cpu->stop = STOP_NONE;
+    while (executed < max_instructions && cpu->cycles < limit)
+    {
+        if (cpu->PC == cpu->stop_pc)
+        {
+            cpu->stop = STOP_PC;
+            break;
+        }
+        // A BRK stop returns 0 cycles without executing
+        if (execute_instruction(cpu) > 0)
+            executed++;
+        if (cpu->stop)
+            break;
+    }
+    return executed;
+#endif
+}
+
+// Run on the engine the CPU is set to
+static int run_engine(CPU* cpu, int max_instructions, uint64_t max_cycles)
+{
+    switch (cpu->engine)
+    {
+    case ENGINE_PREDECODE:
+        if (cpu->decoded || decode_init(cpu))
+            return run_predecoded(cpu, max_instructions, max_cycles);
+        fprintf(stderr, "Could not set up the decode cache, using the interpreter\n");
+        cpu->engine = ENGINE_INTERPRETER;
+        break;
+#if JIT_X64
+    case ENGINE_JIT:
+        if (cpu->jit || jit_init(cpu))
+            return run_jit(cpu, max_instructions, max_cycles);
+        fprintf(stderr, "Could not set up the JIT, using the interpreter\n");
+        cpu->engine = ENGINE_INTERPRETER;
+        break;
+#endif
+    }
+
+    return run_interpreter(cpu, max_instructions, max_cycles);
+}
+
+// Run with no interrupt to take: on the tracer, the profiler or the engine
+static int run_span(CPU* cpu, int max_instructions, uint64_t max_cycles)
+{
+#if TRACE
+    // A trace runs the reference interpreter, so the engines themselves
+    // carry no trace code
+    if (cpu->trace)
+    {
+        uint64_t start = cpu->cycles;
+        int executed = 0;
+        cpu->stop = STOP_NONE;
+        while (executed < max_instructions && cpu->cycles - start < max_cycles)
+        {
+            if (cpu->PC == cpu->stop_pc)
+            {
+                cpu->stop = STOP_PC;
+                break;
+            }
+            trace_add(cpu->trace, cpu, cpu->PC, cpu->A, cpu->X, cpu->Y, cpu->SP, cpu->P, cpu->cycles);
+            if (execute_instruction(cpu) > 0)
+                executed++;
+            if (cpu->stop)
+                break;
+        }
+        trace_publish(cpu->trace);
+        return executed;
+    }
+#endif
+
+    if (cpu->profile)
+        return profile_run(cpu, max_instructions, max_cycles);
+    return run_engine(cpu, max_instructions, max_cycles);
+}
+
+#define IDLE_MAX_INSTRUCTIONS 8 // Longest idle loop recognised
+
+// Opcodes an idle loop may hold: they write nothing, leave the interrupt
+// mask alone and read at most one operand, at an address known before
+// they run
+static const uint8_t idle_table[256] = {
+    //0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
+    0, 0, 0, 0, 0, 1, 0, 0, 0, 1, 1, 0, 0, 1, 0, 0,  // 0x
+    1, 0, 0, 0, 0, 1, 0, 0, 1, 1, 0, 0, 0, 1, 0, 0,  // 1x
+    0, 0, 0, 0, 1, 1, 0, 0, 0, 1, 1, 0, 1, 1, 0, 0,  // 2x
+    1, 0, 0, 0, 0, 1, 0, 0, 1, 1, 0, 0, 0, 1, 0, 0,  // 3x
+    0, 0, 0, 0, 0, 1, 0, 0, 0, 1, 1, 0, 1, 1, 0, 0,  // 4x
+    1, 0, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0,  // 5x
+    0, 0, 0, 0, 0, 1, 0, 0, 0, 1, 1, 0, 0, 1, 0, 0,  // 6x
+    1, 0, 0, 0, 0, 1, 0, 0, 1, 1, 0, 0, 0, 1, 0, 0,  // 7x
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 1, 0, 0, 0, 0, 0,  // 8x
+    1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 1, 0, 0, 0, 0, 0,  // 9x
+    1, 0, 1, 0, 1, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1, 0,  // Ax
+    1, 0, 0, 0, 1, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1, 0,  // Bx
+    1, 0, 0, 0, 1, 1, 0, 0, 1, 1, 1, 0, 1, 1, 0, 0,  // Cx
+    1, 0, 0, 0, 0, 1, 0, 0, 1, 1, 0, 0, 0, 1, 0, 0,  // Dx
+    1, 0, 0, 0, 1, 1, 0, 0, 1, 1, 1, 0, 1, 1, 0, 0,  // Ex
+    1, 0, 0, 0, 0, 1, 0, 0, 1, 1, 0, 0, 0, 1, 0, 0,  // Fx
+};
+
+// Whether the idle_table instruction with the given opcode and operand
+// bytes reads memory, and where
+static int idle_operand(uint8_t opcode, uint16_t operand, uint8_t X, uint8_t Y, uint16_t* address)
+{
+    switch (opcode_modes[opcode])
+    {
+    case AM_ZP:
+        *address = operand & 0xFF;
+        return 1;
+    case AM_ZPX:
+        *address = (uint8_t)(operand + X);
+        return 1;
+    case AM_ZPY:
+        *address = (uint8_t)(operand + Y);
+        return 1;
+    case AM_ABS:
+        *address = operand;
+        return opcode != 0x4C;
+    case AM_ABX:
+        *address = operand + X;
+        return 1;
+    case AM_ABY:
+        *address = operand + Y;
+        return 1;
+    }
+    return 0;
+}
+
+// What a read of the address waits for: IDLE_LOOP for RAM, else what its
+// device says (0 if it may have an effect)
+static int idle_read(CPU* cpu, uint16_t address)
+{
+    IoPage* io = &cpu->io[address >> 8];
+    if (cpu->read_map[address >> 8] || !io_register(cpu, address))
+        return IDLE_LOOP;
+    return io->idle ? io->idle(cpu, address, io->ctx) : 0;
+}
+
+// Look for an idle loop at PC: a few instructions that write nothing and
+// come back to the same registers, so that every further pass would do
+// exactly the same until an event or input changes what they read. Runs
+// one pass, within the limits, adding the instructions run to *executed.
+// Returns IDLE_LOOP with what the loop waits for, or 0 if the pass did
+// not come back (or never ran).
+static int idle_loop(CPU* cpu, int max_instructions, uint64_t max_cycles, int* executed)
+{
+    uint8_t A = cpu->A, X = cpu->X, Y = cpu->Y, SP = cpu->SP, P = cpu->P;
+    uint16_t PC = cpu->PC;
+    uint64_t start = cpu->cycles;
+    int waits = cpu->interrupts.control ? IDLE_LOOP | IDLE_EVENT : IDLE_LOOP;
+
+    for (int i = 0; i < IDLE_MAX_INSTRUCTIONS && i < max_instructions && cpu->cycles - start < max_cycles; i++)
+    {
+        uint16_t pc = cpu->PC;
+        uint8_t opcode = peek_byte(cpu, pc);
+        // The code itself must not sit on device registers either
+        if (!idle_table[opcode] || pc == cpu->stop_pc || !cpu->read_map[pc >> 8] || !cpu->read_map[(uint16_t)(pc + 2) >> 8])
+            return 0;
+        uint16_t address;
+        if (idle_operand(opcode, peek_byte(cpu, pc + 1) | (peek_byte(cpu, pc + 2) << 8), cpu->X, cpu->Y, &address))
+        {
+            int wait = idle_read(cpu, address);
+            if (!wait)
+                return 0;
+            waits |= wait;
+        }
+
+        execute_instruction(cpu);
+        (*executed)++;
+        if (cpu->PC == PC && cpu->A == A && cpu->X == X && cpu->Y == Y && cpu->SP == SP && cpu->P == P)
+            return waits;
+    }
+    return 0;
+}
+
+// Run up to max_instructions, until at least max_cycles have elapsed.
+// Returns the number of instructions executed; a stop condition ends the
+// batch early. The run is split where the next vblank or timer event is
+// due, and interrupts are taken between the spans. Where a span starts in
+// an idle loop, its passes are counted off to the end of the span rather
+// than run (see idle_loop()), so idle programs cost next to nothing. With
+// watchdog set, an idle loop that no interrupt can end stops the run there.
+int run_until(CPU* cpu, int max_instructions, uint64_t max_cycles)
+{
+    Interrupts* interrupts = &cpu->interrupts;
+    uint64_t start = cpu->cycles;
+    int executed = 0;
+
+    cpu->stop = STOP_NONE;
+    while (executed < max_instructions && cpu->cycles - start < max_cycles)
+    {
+        interrupt_update(cpu);
+        int irq = interrupts->status & interrupts->control & INT_TIMER;
+        if (interrupts->nmi)
+        {
+            interrupts->nmi = 0;
+            handle_interrupt(cpu, 0xFFFA);
+            continue;
+        }
+        if (irq && !(cpu->P & FLAG_I))
+        {
+            handle_interrupt(cpu, 0xFFFE);
+            continue;
+        }
+
+        uint64_t budget = max_cycles - (cpu->cycles - start);
+        if (interrupts->vblank_at - cpu->cycles < budget)
+            budget = interrupts->vblank_at - cpu->cycles;
+        if (interrupts->timer_at - cpu->cycles < budget)
+            budget = interrupts->timer_at - cpu->cycles;
+
+        cpu->idle = 0;
+        int observed = cpu->trace || cpu->profile;
+        if (!irq && (!observed || cpu->watchdog))
+        {
+            uint8_t A = cpu->A, X = cpu->X, Y = cpu->Y, SP = cpu->SP, P = cpu->P;
+            uint16_t PC = cpu->PC;
+            uint64_t before = cpu->cycles;
+            int pass = executed;
+            cpu->idle = (uint8_t)idle_loop(cpu, max_instructions - executed, budget, &executed);
+            uint64_t period = cpu->cycles - before;
+            pass = executed - pass;
+
+            // Traces and profiles see every instruction, idle or not: for
+            // them the probe only serves the watchdog, and its pass is
+            // taken back. It wrote nothing and read nothing that changes
+            // when read.
+            if (observed)
+            {
+                cpu->A = A, cpu->X = X, cpu->Y = Y, cpu->SP = SP, cpu->P = P;
+                cpu->PC = PC;
+                cpu->cycles = before;
+                executed -= pass;
+            }
+            if (cpu->idle && cpu->watchdog && !(cpu->idle & IDLE_EVENT))
+            {
+                // Run the pass again where they see it, to end as unobserved
+                if (observed)
+                    executed += run_span(cpu, pass, period);
+                cpu->stop = STOP_TRAP;
+                break;
+            }
+            if (observed)
+                cpu->idle = 0;
+            else
+            {
+                if (period >= budget || executed >= max_instructions)
+                    continue;
+                budget -= period;
+                if (cpu->idle)
+                {
+                    uint64_t passes = budget / period;
+                    if (passes > (uint64_t)((max_instructions - executed) / pass))
+                        passes = (max_instructions - executed) / pass;
+                    cpu->cycles += passes * period;
+                    executed += (int)passes * pass;
+                    budget -= passes * period;
+                    if (budget == 0 || executed >= max_instructions)
+                        continue;
+                }
+            }
+        }
+
+        // A masked IRQ is taken once CLI, PLP or RTI unmasks it, so look
+        // again after every instruction until then
+        executed += run_span(cpu, irq ? 1 : max_instructions - executed, budget);
+        if (cpu->stop == STOP_IO)
+            cpu->stop = STOP_NONE;
+        else if (cpu->stop)
+            break;
+    }
+    return executed;
+}
+
+// Run up to n_instructions. Returns the number of instructions executed;
+// a stop condition ends the batch early.
+int run_for(CPU* cpu, int n_instructions)
+{
+    return run_until(cpu, n_instructions, UINT64_MAX);
+}
+
+// Run whole instructions until at least budget cycles have elapsed and
+// return the cycles consumed. The last instruction may overshoot the
+// budget; callers pacing against a fixed quantum should carry the excess.
+uint64_t run_cycles(CPU* cpu, uint64_t budget)
+{
+    uint64_t start = cpu->cycles;
+    run_until(cpu, INT_MAX, budget);
+    return cpu->cycles - start;
+}
+
+// Hand the records added so far to the writer
+void trace_publish(Tracer* tracer)
+{
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&tracer->published, (int)tracer->head);
+}
+
+// The ring is full: wait for the writer to save some of it
+void trace_wait(Tracer* tracer)
+{
+    trace_publish(tracer);
+    for (;;)
+    {
+        uint32_t saved = (uint32_t)SDL_AtomicGet(&tracer->saved);
+        SDL_MemoryBarrierAcquire();
+        if (tracer->head - saved < TRACE_RING)
+        {
+            tracer->limit = saved + TRACE_RING;
+            return;
+        }
+        SDL_Delay(1);
+    }
+}
+
+// Writer thread: save published records until the trace is closed
+static int trace_writer(void* data)
+{
+    Tracer* tracer = data;
+    uint32_t saved = 0;
+
+    for (;;)
+    {
+        // Read closing first, so nothing published before it is missed
+        int closing = SDL_AtomicGet(&tracer->closing);
+        uint32_t published = (uint32_t)SDL_AtomicGet(&tracer->published);
+        SDL_MemoryBarrierAcquire();
+        if (published == saved)
+        {
+            if (closing)
+                return 0;
+            SDL_Delay(1);
+            continue;
+        }
+
+        // Up to the end of the ring at a time
+        uint32_t first = saved & (TRACE_RING - 1);
+        uint32_t count = published - saved;
+        if (count > TRACE_RING - first)
+            count = TRACE_RING - first;
+        if (!tracer->failed && fwrite(&tracer->ring[first], sizeof(TraceRecord), count, tracer->file) != count)
+            tracer->failed = 1;
+        saved += count;
+        SDL_MemoryBarrierRelease();
+        SDL_AtomicSet(&tracer->saved, (int)saved);
+    }
+}
+
+// Start a trace file. Returns NULL after printing why it could not.
+Tracer* trace_open(const char* filename)
+{
+    Tracer* tracer = calloc(1, sizeof(Tracer));
+    if (!tracer || !(tracer->ring = malloc(TRACE_RING * sizeof(TraceRecord))))
+    {
+        fprintf(stderr, "Out of memory\n");
+        free(tracer);
+        return NULL;
+    }
+    tracer->limit = TRACE_RING;
+    tracer->file = fopen(filename, "wb");
+    if (!tracer->file || fwrite(TRACE_MAGIC, 1, 8, tracer->file) != 8)
+    {
+        fprintf(stderr, "Error opening trace file '%s': %s\n", filename, strerror(errno));
+        if (tracer->file)
+            fclose(tracer->file);
+        free(tracer->ring);
+        free(tracer);
+        return NULL;
+    }
+    tracer->writer = SDL_CreateThread(trace_writer, "trace", tracer);
+    if (!tracer->writer)
+    {
+        fprintf(stderr, "Could not start the trace writer: %s\n", SDL_GetError());
+        fclose(tracer->file);
+        free(tracer->ring);
+        free(tracer);
+        return NULL;
+    }
+    return tracer;
+}
+
+// Save the rest of the trace and free it. Returns 0 if any of it could not
+// be written.
+int trace_close(Tracer* tracer)
+{
+    trace_publish(tracer);
+    SDL_AtomicSet(&tracer->closing, 1);
+    SDL_WaitThread(tracer->writer, NULL);
+
+    int ok = !tracer->failed;
+    if (fclose(tracer->file) != 0)
+        ok = 0;
+    free(tracer->ring);
+    free(tracer);
+    return ok;
+}
+
+// Bytes an opcode takes, with its operand
+int instruction_length(uint8_t opcode)
+{
+    switch (opcode_modes[opcode])
+    {
+    case AM_IMP:
+        return 1;
+    case AM_ABS:
+    case AM_ABX:
+    case AM_ABY:
+    case AM_IND:
+        return 3;
+    default:
+        return 2;
+    }
+}
+
+// Write the instruction in bytes, found at pc, as assembly text. Returns
+// its length in bytes.
+int disassemble(uint16_t pc, const uint8_t* bytes, char* text, size_t size)
+{
+    const char* name = opcode_names[bytes[0]];
+    uint8_t zp = bytes[1];
+    uint16_t word = bytes[1] | (bytes[2] << 8);
+
+    switch (opcode_modes[bytes[0]])
+    {
+    case AM_IMM: snprintf(text, size, "%s #$%02X", name, zp); break;
+    case AM_ZP: snprintf(text, size, "%s $%02X", name, zp); break;
+    case AM_ZPX: snprintf(text, size, "%s $%02X,X", name, zp); break;
+    case AM_ZPY: snprintf(text, size, "%s $%02X,Y", name, zp); break;
+    case AM_IZX: snprintf(text, size, "%s ($%02X,X)", name, zp); break;
+    case AM_IZY: snprintf(text, size, "%s ($%02X),Y", name, zp); break;
+    case AM_ABS: snprintf(text, size, "%s $%04X", name, word); break;
+    case AM_ABX: snprintf(text, size, "%s $%04X,X", name, word); break;
+    case AM_ABY: snprintf(text, size, "%s $%04X,Y", name, word); break;
+    case AM_IND: snprintf(text, size, "%s ($%04X)", name, word); break;
+    case AM_REL: snprintf(text, size, "%s $%04X", name, (uint16_t)(pc + 2 + (int8_t)zp)); break;
+    default: snprintf(text, size, "%s", name); break;
+    }
+    return instruction_length(bytes[0]);
+}
+
+// Print a trace file as text, one instruction per line: cycle count, PC,
+// instruction bytes, disassembly, then the registers it started with
+int decode_trace(const char* filename)
+{
+    static TraceRecord records[4096];
+    char magic[8];
+    size_t count;
+    FILE* fp = fopen(filename, "rb");
+
+    if (!fp)
+    {
+        fprintf(stderr, "Error opening trace file '%s': %s\n", filename, strerror(errno));
+        return STATUS_ERROR;
+    }
+    if (fread(magic, 1, 8, fp) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0)
+    {
+        fprintf(stderr, "Error: '%s' is not a trace file.\n", filename);
+        fclose(fp);
+        return STATUS_ERROR;
+    }
+
+    while ((count = fread(records, sizeof(TraceRecord), 4096, fp)) > 0)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            const TraceRecord* r = &records[i];
+            uint8_t bytes[3] = { r->opcode, r->operand[0], r->operand[1] };
+            uint16_t pc = r->pc[0] | (r->pc[1] << 8);
+            uint64_t cycles = 0;
+            char text[32];
+            char hex[12] = "";
+
+            for (int b = 5; b >= 0; b--)
+                cycles = (cycles << 8) | r->cycles[b];
+            int length = disassemble(pc, bytes, text, sizeof(text));
+            for (int b = 0; b < length; b++)
+                snprintf(hex + 3 * b, sizeof(hex) - 3 * b, "%02X ", bytes[b]);
+            printf("%12llu  %04X  %-9s %-14s A:%02X X:%02X Y:%02X SP:%02X P:%02X\n",
+                (unsigned long long)cycles, pc, hex, text, r->a, r->x, r->y, r->sp, r->p);
+        }
+    }
+    fclose(fp);
+    return STATUS_OK;
+}
+
+// Create an empty profile rooted at the CPU's current PC. sample_every is
+// the cycles between samples, or 0 to count every instruction.
+Profiler* profile_create(const CPU* cpu, uint64_t sample_every)
+{
+    Profiler* profiler = calloc(1, sizeof(Profiler));
+    if (!profiler)
+        return NULL;
+    profiler->nodes = calloc(PROFILE_NODES, sizeof(ProfileNode));
+    profiler->node_table = calloc(PROFILE_NODES * 2, sizeof(uint32_t));
+    if (!profiler->nodes || !profiler->node_table)
+    {
+        profile_free(profiler);
+        return NULL;
+    }
+    profiler->nodes[0].entry = cpu->PC;
+    profiler->node_count = 1;
+    profiler->depth = 1;
+    profiler->sample_every = sample_every;
+    profiler->next_sample = cpu->cycles + sample_every;
+    return profiler;
+}
+
+void profile_free(Profiler* profiler)
+{
+    if (!profiler)
+        return;
+    for (int i = 0; i < profiler->symbol_count; i++)
+        free(profiler->symbols[i].name);
+    free(profiler->symbols);
+    free(profiler->nodes);
+    free(profiler->node_table);
+    free(profiler);
+}
+
+// The node for entry called from parent, added if new. Once the table is
+// full, new callees are charged to their caller.
+static uint32_t profile_node(Profiler* profiler, uint32_t parent, uint16_t entry)
+{
+    uint32_t mask = PROFILE_NODES * 2 - 1;
+    uint32_t slot = ((parent * 0x9E3779B1u) ^ (entry * 0x85EBCA6Bu)) & mask;
+
+    for (; profiler->node_table[slot]; slot = (slot + 1) & mask)
+    {
+        uint32_t index = profiler->node_table[slot] - 1;
+        if (profiler->nodes[index].parent == parent && profiler->nodes[index].entry == entry)
+            return index;
+    }
+    if (profiler->node_count == PROFILE_NODES)
+        return parent;
+    ProfileNode* node = &profiler->nodes[profiler->node_count];
+    node->parent = parent;
+    node->entry = entry;
+    profiler->node_table[slot] = ++profiler->node_count;
+    return profiler->node_count - 1;
+}
+
+// Follow a JSR or RTS that just ran. A frame ends once the stack pointer
+// is back above its return address, so code that drops return addresses
+// or returns through a jump table doesn't leave frames behind.
+static void profile_call(Profiler* profiler, const CPU* cpu, uint8_t opcode)
+{
+    int sp = opcode == 0x20 ? cpu->SP + 2 : cpu->SP;
+
+    while (profiler->depth > 1 && profiler->stack[profiler->depth - 1].sp <= sp)
+        profiler->depth--;
+    if (opcode == 0x20 && profiler->depth < PROFILE_DEPTH)
+    {
+        profiler->stack[profiler->depth].node = profile_node(profiler, profiler->stack[profiler->depth - 1].node, cpu->PC);
+        profiler->stack[profiler->depth].sp = sp;
+        profiler->depth++;
+    }
+}
+
+// Take a sample where the CPU is now. Sampled runs don't see JSR and RTS,
+// so the call stack is read from the hardware stack: every address on it
+// that follows a JSR is taken for a return address. Data that happens to
+// look like one adds a frame.
+static void profile_sample(Profiler* profiler, const CPU* cpu)
+{
+    const uint8_t* stack = ram_page(cpu, 0x01);
+    uint16_t callees[128];
+    int depth = 0;
+
+    for (int sp = cpu->SP + 1; sp < 0xFF; sp++)
+    {
+        uint16_t jsr = (uint16_t)((stack[sp] | (stack[sp + 1] << 8)) - 2);
+        if (peek_byte(cpu, jsr) == 0x20)
+        {
+            callees[depth++] = peek_byte(cpu, (uint16_t)(jsr + 1)) | (peek_byte(cpu, (uint16_t)(jsr + 2)) << 8);
+            sp++;
+        }
+    }
+
+    // Keep the outermost frames if the stack is deeper than a profile's
+    uint32_t node = 0;
+    for (int i = depth - 1; i >= 0 && i >= depth - (PROFILE_DEPTH - 1); i--)
+        node = profile_node(profiler, node, callees[i]);
+    profiler->nodes[node].weight++;
+    profiler->pc_weight[cpu->PC]++;
+    profiler->opcode_weight[peek_byte(cpu, cpu->PC)]++;
+    profiler->weight++;
+}
+
+// run_until() for a profiled CPU
+int profile_run(CPU* cpu, int max_instructions, uint64_t max_cycles)
+{
+    Profiler* profiler = cpu->profile;
+    uint64_t start = cpu->cycles;
+    int executed = 0;
+
+    cpu->stop = STOP_NONE;
+    if (profiler->sample_every)
+    {
+        while (executed < max_instructions && cpu->cycles - start < max_cycles)
+        {
+            if (cpu->cycles >= profiler->next_sample)
+            {
+                profile_sample(profiler, cpu);
+                profiler->next_sample += profiler->sample_every;
+                if (profiler->next_sample <= cpu->cycles)
+                    profiler->next_sample = cpu->cycles + profiler->sample_every;
+            }
+            uint64_t budget = max_cycles - (cpu->cycles - start);
+            if (budget > profiler->next_sample - cpu->cycles)
+                budget = profiler->next_sample - cpu->cycles;
+            executed += run_engine(cpu, max_instructions - executed, budget);
+            if (cpu->stop)
+                break;
+        }
+        return executed;
+    }
+
+    while (executed < max_instructions && cpu->cycles - start < max_cycles)
+    {
+        uint16_t pc = cpu->PC;
+        if (pc == cpu->stop_pc)
+        {
+            cpu->stop = STOP_PC;
+            break;
+        }
+        uint8_t opcode = peek_byte(cpu, pc);
+        int cycles = execute_instruction(cpu);
+        if (cycles > 0)
+        {
+            executed++;
+            profiler->pc_weight[pc] += cycles;
+            profiler->pc_count[pc]++;
+            profiler->opcode_weight[opcode] += cycles;
+            profiler->opcode_count[opcode]++;
+            profiler->nodes[profiler->stack[profiler->depth - 1].node].weight += cycles;
+            profiler->nodes[profiler->stack[profiler->depth - 1].node].count++;
+            profiler->weight += cycles;
+            profiler->instructions++;
+            if (opcode == 0x20 || opcode == 0x60)
+                profile_call(profiler, cpu, opcode);
+        }
+        if (cpu->stop)
+            break;
+    }
+    return executed;
+}
+
+// Profiling starts again after a pause. Calls made in the meantime were
+// not followed, so start over from the root.
+void profile_resume(Profiler* profiler, const CPU* cpu)
+{
+    profiler->depth = 1;
+    profiler->next_sample = cpu->cycles + profiler->sample_every;
+}
+
+static int symbol_order(const void* a, const void* b)
+{
+    const Symbol* x = a;
+    const Symbol* y = b;
+    return x->address != y->address ? (x->address < y->address ? -1 : 1) : strcmp(x->name, y->name);
+}
+
+// Load labels from an assembler symbol file: VICE label files as ld65 and
+// others write them ("al C000 .name"), and "name = $C000" lines, which
+// most assemblers can list ("name equ $C000" and "name: $C000" work too).
+// Other lines are skipped. Returns 0 after printing why it could not.
+int profile_load_symbols(Profiler* profiler, const char* filename)
+{
+    char line[256];
+    int capacity = 0;
+    FILE* fp = fopen(filename, "r");
+
+    if (!fp)
+    {
+        fprintf(stderr, "Error opening symbol file '%s': %s\n", filename, strerror(errno));
+        return 0;
+    }
+    while (fgets(line, sizeof(line), fp))
+    {
+        char* words[4];
+        int count = 0;
+        uint64_t value;
+        char* comment = strchr(line, ';');
+        if (comment)
+            *comment = '\0';
+        for (char* word = strtok(line, " \t\r\n=:"); word && count < 4; word = strtok(NULL, " \t\r\n=:"))
+            words[count++] = word;
+
+        const char* name;
+        if (count == 3 && strcmp(words[0], "al") == 0)
+        {
+            char* end;
+            value = strtoul(words[1], &end, 16);
+            if (*end != '\0' || value > 0xFFFF)
+                continue;
+            name = words[2][0] == '.' ? words[2] + 1 : words[2];
+        }
+        else if ((count == 2 || (count == 3 && (strcmp(words[1], "equ") == 0 || strcmp(words[1], "EQU") == 0))) &&
+                 parse_number(words[count - 1], 0xFFFF, &value))
+            name = words[0];
+        else
+            continue;
+
+        if (profiler->symbol_count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 256;
+            Symbol* grown = realloc(profiler->symbols, capacity * sizeof(Symbol));
+            if (!grown)
+                break;
+            profiler->symbols = grown;
+        }
+        Symbol* symbol = &profiler->symbols[profiler->symbol_count];
+        symbol->address = (uint16_t)value;
+        symbol->name = malloc(strlen(name) + 1);
+        if (!symbol->name)
+            break;
+        strcpy(symbol->name, name);
+        profiler->symbol_count++;
+    }
+    int failed = ferror(fp) || !feof(fp);
+    fclose(fp);
+    if (failed)
+    {
+        fprintf(stderr, "Error reading symbol file '%s'\n", filename);
+        return 0;
+    }
+    qsort(profiler->symbols, profiler->symbol_count, sizeof(Symbol), symbol_order);
+    return 1;
+}
+
+// Name an address: its label, the nearest label less than 256 bytes
+// before it plus an offset, or else just the address
+static void profile_name(const Profiler* profiler, uint16_t address, char* text, size_t size)
+{
+    int low = 0;
+    int high = profiler->symbol_count;
+
+    // First symbol above the address
+    while (low < high)
+    {
+        int mid = (low + high) / 2;
+        if (profiler->symbols[mid].address <= address)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (low == 0 || address - profiler->symbols[low - 1].address >= 0x100)
+    {
+        snprintf(text, size, "$%04X", address);
+        return;
+    }
+    const Symbol* symbol = &profiler->symbols[low - 1];
+    if (symbol->address == address)
+        snprintf(text, size, "%s", symbol->name);
+    else
+        snprintf(text, size, "%s+%d", symbol->name, address - symbol->address);
+}
+
+typedef struct {
+    uint64_t weight;
+    uint64_t count;
+    uint32_t key;
+} ProfileRow;
+
+// What the rows of a profile table are
+enum { ROWS_ADDRESSES, ROWS_FUNCTIONS, ROWS_OPCODES };
+
+// Heaviest first
+static int profile_row_order(const void* a, const void* b)
+{
+    const ProfileRow* x = a;
+    const ProfileRow* y = b;
+    if (x->weight != y->weight)
+        return x->weight > y->weight ? -1 : 1;
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+// Print the heaviest rows as a table. A function's weight is its own
+// time, without the functions it calls.
+static void profile_table(FILE* fp, const Profiler* profiler, const CPU* cpu, const char* title, ProfileRow* rows, int count, int kind)
+{
+    static const char* const mode_names[] = {
+        "#imm", "zp", "zp,X", "zp,Y", "(zp,X)", "(zp),Y", "abs", "abs,X", "abs,Y", "(abs)", "rel", "",
+    };
+    int n = 0;
+
+    for (int i = 0; i < count; i++)
+        if (rows[i].weight)
+            rows[n++] = rows[i];
+    qsort(rows, n, sizeof(ProfileRow), profile_row_order);
+    if (n > PROFILE_TOP)
+        n = PROFILE_TOP;
+
+    fprintf(fp, "\n%s\n", title);
+    if (profiler->sample_every)
+        fprintf(fp, "     samples    share\n");
+    else
+        fprintf(fp, "      cycles    share   instructions\n");
+    for (int i = 0; i < n; i++)
+    {
+        char name[64];
+        char text[32] = "";
+        if (kind == ROWS_OPCODES)
+        {
+            int mode = opcode_modes[rows[i].key];
+            snprintf(name, sizeof(name), "%02X %s%s%s", rows[i].key, opcode_names[rows[i].key], mode == AM_IMP ? "" : " ", mode_names[mode]);
+        }
+        else
+            profile_name(profiler, (uint16_t)rows[i].key, name, sizeof(name));
+        if (kind == ROWS_ADDRESSES)
+        {
+            uint8_t bytes[3];
+            for (int b = 0; b < 3; b++)
+                bytes[b] = peek_byte(cpu, (uint16_t)(rows[i].key + b));
+            disassemble((uint16_t)rows[i].key, bytes, text, sizeof(text));
+        }
+        fprintf(fp, "%12llu  %6.2f%%", (unsigned long long)rows[i].weight, 100.0 * rows[i].weight / profiler->weight);
+        if (!profiler->sample_every)
+            fprintf(fp, "  %13llu", (unsigned long long)rows[i].count);
+        if (text[0])
+            fprintf(fp, "  %-24s %s\n", name, text);
+        else
+            fprintf(fp, "  %s\n", name);
+    }
+}
+
+// Write the profile as a text report: totals, then the heaviest
+// addresses, functions and opcodes. Addresses are disassembled from memory
+// as it is now. Returns 0 after printing why it could not.
+int profile_report(const Profiler* profiler, const CPU* cpu, const char* filename)
+{
+    ProfileRow* rows = calloc(65536, sizeof(ProfileRow));
+    FILE* fp = fopen(filename, "w");
+
+    if (!rows || !fp)
+    {
+        fprintf(stderr, "Error opening profile '%s': %s\n", filename, rows ? strerror(errno) : "out of memory");
+        free(rows);
+        if (fp)
+            fclose(fp);
+        return 0;
+    }
+    if (profiler->sample_every)
+        fprintf(fp, "Sampled profile: %llu samples, one every %llu cycles\n",
+            (unsigned long long)profiler->weight, (unsigned long long)profiler->sample_every);
+    else
+        fprintf(fp, "Exact profile: %llu instructions, %llu cycles\n",
+            (unsigned long long)profiler->instructions, (unsigned long long)profiler->weight);
+
+    for (int i = 0; i < 65536; i++)
+        rows[i] = (ProfileRow){ profiler->pc_weight[i], profiler->pc_count[i], i };
+    profile_table(fp, profiler, cpu, "Addresses", rows, 65536, ROWS_ADDRESSES);
+
+    for (int i = 0; i < 65536; i++)
+        rows[i] = (ProfileRow){ 0, 0, i };
+    for (uint32_t i = 0; i < profiler->node_count; i++)
+    {
+        rows[profiler->nodes[i].entry].weight += profiler->nodes[i].weight;
+        rows[profiler->nodes[i].entry].count += profiler->nodes[i].count;
+    }
+    profile_table(fp, profiler, cpu, "Functions (own time)", rows, 65536, ROWS_FUNCTIONS);
+
+    for (int i = 0; i < 256; i++)
+        rows[i] = (ProfileRow){ profiler->opcode_weight[i], profiler->opcode_count[i], i };
+    profile_table(fp, profiler, cpu, "Opcodes", rows, 256, ROWS_OPCODES);
+
+    free(rows);
+    int failed = ferror(fp);
+    if (fclose(fp) != 0 || failed)
+    {
+        fprintf(stderr, "Error writing profile '%s'\n", filename);
+        return 0;
+    }
+    return 1;
+}
 
-        // --- 6x ---
-    case 0x60: // RTS
-        cpu->PC = pull_byte(cpu);
-        cpu->PC |= pull_byte(cpu) << 8;
-        cpu->PC++; // Increment PC after returning
-        break;
-    case 0x61: // ADC izx
-        address = get_address(cpu, AM_IZX);
-        value = cpu->mem[address];
-        uint16_t result = cpu->A + value + (cpu->P & FLAG_C ? 1 : 0);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (result & 0x100)
-            cpu->P |= FLAG_C;
-        if ((cpu->A ^ result) & (value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x63: // RRA izx
-        address = get_address(cpu, AM_IZX);
-        value = cpu->mem[address];
-        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
-        cpu->P &= ~FLAG_C;
-        if (value & 0x01)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = (value >> 1) | (temp_carry << 7);
-        value = cpu->mem[address];
-        result = cpu->A + value + (cpu->P & FLAG_C ? 1 : 0);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (result & 0x100)
-            cpu->P |= FLAG_C;
-        if ((cpu->A ^ result) & (value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x64: // NOP zp
-        get_address(cpu, AM_ZP);
-        break;
-    case 0x65: // ADC zp
-        address = get_address(cpu, AM_ZP);
-        value = cpu->mem[address];
-        result = cpu->A + value + (cpu->P & FLAG_C ? 1 : 0);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (result & 0x100)
-            cpu->P |= FLAG_C;
-        if ((cpu->A ^ result) & (value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x66: // ROR zp
-        address = get_address(cpu, AM_ZP);
-        value = cpu->mem[address];
-        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
-        cpu->P &= ~FLAG_C;
-        if (value & 0x01)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = (value >> 1) | (temp_carry << 7);
-        set_zero_and_negative_flags(cpu, cpu->mem[address]);
-        break;
-    case 0x67: // RRA zp
-        address = get_address(cpu, AM_ZP);
-        value = cpu->mem[address];
-        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
-        cpu->P &= ~FLAG_C;
-        if (value & 0x01)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = (value >> 1) | (temp_carry << 7);
-        value = cpu->mem[address];
-        result = cpu->A + value + (cpu->P & FLAG_C ? 1 : 0);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (result & 0x100)
-            cpu->P |= FLAG_C;
-        if ((cpu->A ^ result) & (value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x68: // PLA
-        cpu->A = pull_byte(cpu);
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x69: // ADC imm
-        address = get_address(cpu, AM_IMM);
-        value = cpu->mem[address];
-        result = cpu->A + value + (cpu->P & FLAG_C ? 1 : 0);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (result & 0x100)
-            cpu->P |= FLAG_C;
-        if ((cpu->A ^ result) & (value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x6A: // ROR
-        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
-        cpu->P &= ~FLAG_C;
-        if (cpu->A & 0x01)
-            cpu->P |= FLAG_C;
-        cpu->A = (cpu->A >> 1) | (temp_carry << 7);
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x6B: // ARR imm
-        address = get_address(cpu, AM_IMM);
-        cpu->A &= cpu->mem[address];
-        temp_byte = cpu->A; // Store result of AND
-        cpu->P &= ~FLAG_C;
-        if ((cpu->A & 0x01))
-            cpu->P |= FLAG_C;
-        cpu->A = (cpu->A >> 1) | ((cpu->P & FLAG_C) << 7);
-        uint8_t temp_result = (temp_byte + (temp_byte & 0x0F));
-        cpu->P &= ~FLAG_V;
-        if ((temp_result ^ cpu->A) & 0x40)
-            cpu->P |= FLAG_V;
+// Write the call stacks in the folded format flamegraph tools read: one
+// line per stack, callers first and separated by ';', then its weight.
+// Returns 0 after printing why it could not.
+int profile_folded(const Profiler* profiler, const char* filename)
+{
+    FILE* fp = fopen(filename, "w");
 
-        set_zero_and_negative_flags(cpu, cpu->A);
+    if (!fp)
+    {
+        fprintf(stderr, "Error opening flamegraph file '%s': %s\n", filename, strerror(errno));
+        return 0;
+    }
+    for (uint32_t i = 0; i < profiler->node_count; i++)
+    {
+        uint32_t path[PROFILE_DEPTH];
+        int depth = 0;
 
-        break;
-    case 0x6C: // JMP ind
-        cpu->PC = get_address(cpu, AM_IND);
-        break;
-    case 0x6D: // ADC abs
-        address = get_address(cpu, AM_ABS);
-        value = cpu->mem[address];
-        result = cpu->A + value + (cpu->P & FLAG_C ? 1 : 0);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (result & 0x100)
-            cpu->P |= FLAG_C;
-        if ((cpu->A ^ result) & (value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x6E: // ROR abs
-        address = get_address(cpu, AM_ABS);
-        value = cpu->mem[address];
-        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
-        cpu->P &= ~FLAG_C;
-        if (value & 0x01)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = (value >> 1) | (temp_carry << 7);
-        set_zero_and_negative_flags(cpu, cpu->mem[address]);
-        break;
-    case 0x6F: // RRA abs
-        address = get_address(cpu, AM_ABS);
-        value = cpu->mem[address];
-        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
-        cpu->P &= ~FLAG_C;
-        if (value & 0x01)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = (value >> 1) | (temp_carry << 7);
-        value = cpu->mem[address];
-        result = cpu->A + value + (cpu->P & FLAG_C ? 1 : 0);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (result & 0x100)
-            cpu->P |= FLAG_C;
-        if ((cpu->A ^ result) & (value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-        // --- 7x ---
-    case 0x70: // BVS rel
-        address = get_address(cpu, AM_REL);
-        if (cpu->P & FLAG_V)
-            cpu->PC = address;
-        break;
-    case 0x71: // ADC izy
-        address = get_address(cpu, AM_IZY);
-        value = cpu->mem[address];
-        result = cpu->A + value + (cpu->P & FLAG_C ? 1 : 0);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (result & 0x100)
-            cpu->P |= FLAG_C;
-        if ((cpu->A ^ result) & (value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x73: // RRA izy
-        address = get_address(cpu, AM_IZY);
-        value = cpu->mem[address];
-        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
-        cpu->P &= ~FLAG_C;
-        if (value & 0x01)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = (value >> 1) | (temp_carry << 7);
-        value = cpu->mem[address];
-        result = cpu->A + value + (cpu->P & FLAG_C ? 1 : 0);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (result & 0x100)
-            cpu->P |= FLAG_C;
-        if ((cpu->A ^ result) & (value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x74: // NOP zpx
-        get_address(cpu, AM_ZPX);
-        break;
-    case 0x75: // ADC zpx
-        address = get_address(cpu, AM_ZPX);
-        value = cpu->mem[address];
-        result = cpu->A + value + (cpu->P & FLAG_C ? 1 : 0);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (result & 0x100)
-            cpu->P |= FLAG_C;
-        if ((cpu->A ^ result) & (value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x76: // ROR zpx
-        address = get_address(cpu, AM_ZPX);
-        value = cpu->mem[address];
-        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
-        cpu->P &= ~FLAG_C;
-        if (value & 0x01)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = (value >> 1) | (temp_carry << 7);
-        set_zero_and_negative_flags(cpu, cpu->mem[address]);
-        break;
-    case 0x77: // RRA zpx
-        address = get_address(cpu, AM_ZPX);
-        value = cpu->mem[address];
-        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
-        cpu->P &= ~FLAG_C;
-        if (value & 0x01)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = (value >> 1) | (temp_carry << 7);
-        value = cpu->mem[address];
-        result = cpu->A + value + (cpu->P & FLAG_C ? 1 : 0);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (result & 0x100)
-            cpu->P |= FLAG_C;
-        if ((cpu->A ^ result) & (value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x78: // SEI
-        cpu->P |= FLAG_I;
-        break;
-    case 0x79: // ADC aby
-        address = get_address(cpu, AM_ABY);
-        value = cpu->mem[address];
-        result = cpu->A + value + (cpu->P & FLAG_C ? 1 : 0);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (result & 0x100)
-            cpu->P |= FLAG_C;
-        if ((cpu->A ^ result) & (value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x7A: // NOP
-        break;
-    case 0x7B: // RRA aby
-        address = get_address(cpu, AM_ABY);
-        value = cpu->mem[address];
-        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
-        cpu->P &= ~FLAG_C;
-        if (value & 0x01)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = (value >> 1) | (temp_carry << 7);
-        value = cpu->mem[address];
-        result = cpu->A + value + (cpu->P & FLAG_C ? 1 : 0);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (result & 0x100)
-            cpu->P |= FLAG_C;
-        if ((cpu->A ^ result) & (value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x7C: // NOP abx
-        get_address(cpu, AM_ABX);
-        break;
-    case 0x7D: // ADC abx
-        address = get_address(cpu, AM_ABX);
-        value = cpu->mem[address];
-        result = cpu->A + value + (cpu->P & FLAG_C ? 1 : 0);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (result & 0x100)
-            cpu->P |= FLAG_C;
-        if ((cpu->A ^ result) & (value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x7E: // ROR abx
-        address = get_address(cpu, AM_ABX);
-        value = cpu->mem[address];
-        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
-        cpu->P &= ~FLAG_C;
-        if (value & 0x01)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = (value >> 1) | (temp_carry << 7);
-        set_zero_and_negative_flags(cpu, cpu->mem[address]);
-        break;
-    case 0x7F: // RRA abx
-        address = get_address(cpu, AM_ABX);
-        value = cpu->mem[address];
-        temp_carry = (cpu->P & FLAG_C) ? 1 : 0;
-        cpu->P &= ~FLAG_C;
-        if (value & 0x01)
-            cpu->P |= FLAG_C;
-        cpu->mem[address] = (value >> 1) | (temp_carry << 7);
-        value = cpu->mem[address];
-        result = cpu->A + value + (cpu->P & FLAG_C ? 1 : 0);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (result & 0x100)
-            cpu->P |= FLAG_C;
-        if ((cpu->A ^ result) & (value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
+        if (!profiler->nodes[i].weight)
+            continue;
+        for (uint32_t node = i; node; node = profiler->nodes[node].parent)
+            path[depth++] = node;
+        path[depth++] = 0;
+        while (depth--)
+        {
+            char name[64];
+            profile_name(profiler, profiler->nodes[path[depth]].entry, name, sizeof(name));
+            fprintf(fp, "%s%c", name, depth ? ';' : ' ');
+        }
+        fprintf(fp, "%llu\n", (unsigned long long)profiler->nodes[i].weight);
+    }
+    int failed = ferror(fp);
+    if (fclose(fp) != 0 || failed)
+    {
+        fprintf(stderr, "Error writing flamegraph file '%s'\n", filename);
+        return 0;
+    }
+    return 1;
+}
+
+// Lockstep batch engine. A Batch steps many machines that run the same
+// program as a structure of arrays: each register is an array with one
+// entry per lane, and memory is interleaved so the lanes' copies of an
+// address are adjacent. An instruction whose address is the same in every
+// lane then reads or writes all lanes with one vector access, and the lane
+// loops below compile to SIMD (AVX2/AVX-512 with -march=native, SSE2 on
+// any x86-64). Lanes at different PCs take turns, lowest PC first, which
+// lets lanes that took different branches line up again at the join.
+//
+// Lanes see the headless bus: RAM everywhere except the $FE/$FF registers.
+// Opcodes without a vector version run one lane at a time through
+// execute_instruction(), so every lane gives exactly the results the
+// scalar engines do.
+#define LANE_LOOP for (int l = 0; l < BATCH_LANES; l++)
+
+// Vector operations of batch_table
+enum {
+    BOP_NONE, // Run through batch_fallback()
+    BOP_LDA, BOP_LDX, BOP_LDY, BOP_STA, BOP_STX, BOP_STY,
+    BOP_ORA, BOP_AND, BOP_EOR, BOP_ADC, BOP_SBC, BOP_CMP, BOP_CPX, BOP_CPY, BOP_BIT,
+    BOP_INC, BOP_DEC, BOP_ASL, BOP_LSR, BOP_ROL, BOP_ROR,
+    BOP_INX, BOP_INY, BOP_DEX, BOP_DEY, BOP_TAX, BOP_TAY, BOP_TXA, BOP_TYA, BOP_TSX, BOP_TXS,
+    BOP_FLAG, BOP_BRANCH, BOP_JMP, BOP_JSR, BOP_RTS, BOP_PHA, BOP_PHP, BOP_PLA, BOP_PLP, BOP_NOP,
+};
+
+typedef struct {
+    uint8_t op;   // BOP_*
+    uint8_t mode; // AM_*; AM_IMP for accumulator shifts
+    uint8_t flag; // Flag BOP_FLAG sets or clears, or BOP_BRANCH tests
+    uint8_t set;  // Whether the flag is set, or must be set to branch
+} BatchOp;
+
+static const BatchOp batch_table[256] = {
+    [0x69] = { BOP_ADC, AM_IMM }, [0x65] = { BOP_ADC, AM_ZP }, [0x75] = { BOP_ADC, AM_ZPX }, [0x6D] = { BOP_ADC, AM_ABS },
+    [0x7D] = { BOP_ADC, AM_ABX }, [0x79] = { BOP_ADC, AM_ABY }, [0x61] = { BOP_ADC, AM_IZX }, [0x71] = { BOP_ADC, AM_IZY },
+    [0x29] = { BOP_AND, AM_IMM }, [0x25] = { BOP_AND, AM_ZP }, [0x35] = { BOP_AND, AM_ZPX }, [0x2D] = { BOP_AND, AM_ABS },
+    [0x3D] = { BOP_AND, AM_ABX }, [0x39] = { BOP_AND, AM_ABY }, [0x21] = { BOP_AND, AM_IZX }, [0x31] = { BOP_AND, AM_IZY },
+    [0x0A] = { BOP_ASL, AM_IMP }, [0x06] = { BOP_ASL, AM_ZP }, [0x16] = { BOP_ASL, AM_ZPX }, [0x0E] = { BOP_ASL, AM_ABS },
+    [0x1E] = { BOP_ASL, AM_ABX },
+    [0x10] = { BOP_BRANCH, AM_REL, FLAG_N, 0 }, [0x30] = { BOP_BRANCH, AM_REL, FLAG_N, 1 },
+    [0x50] = { BOP_BRANCH, AM_REL, FLAG_V, 0 }, [0x70] = { BOP_BRANCH, AM_REL, FLAG_V, 1 },
+    [0x90] = { BOP_BRANCH, AM_REL, FLAG_C, 0 }, [0xB0] = { BOP_BRANCH, AM_REL, FLAG_C, 1 },
+    [0xD0] = { BOP_BRANCH, AM_REL, FLAG_Z, 0 }, [0xF0] = { BOP_BRANCH, AM_REL, FLAG_Z, 1 },
+    [0x24] = { BOP_BIT, AM_ZP }, [0x2C] = { BOP_BIT, AM_ABS },
+    [0x18] = { BOP_FLAG, AM_IMP, FLAG_C, 0 }, [0x38] = { BOP_FLAG, AM_IMP, FLAG_C, 1 },
+    [0x58] = { BOP_FLAG, AM_IMP, FLAG_I, 0 }, [0x78] = { BOP_FLAG, AM_IMP, FLAG_I, 1 },
+    [0xB8] = { BOP_FLAG, AM_IMP, FLAG_V, 0 },
+    [0xD8] = { BOP_FLAG, AM_IMP, FLAG_D, 0 }, [0xF8] = { BOP_FLAG, AM_IMP, FLAG_D, 1 },
+    [0xC9] = { BOP_CMP, AM_IMM }, [0xC5] = { BOP_CMP, AM_ZP }, [0xD5] = { BOP_CMP, AM_ZPX }, [0xCD] = { BOP_CMP, AM_ABS },
+    [0xDD] = { BOP_CMP, AM_ABX }, [0xD9] = { BOP_CMP, AM_ABY }, [0xC1] = { BOP_CMP, AM_IZX }, [0xD1] = { BOP_CMP, AM_IZY },
+    [0xE0] = { BOP_CPX, AM_IMM }, [0xE4] = { BOP_CPX, AM_ZP }, [0xEC] = { BOP_CPX, AM_ABS },
+    [0xC0] = { BOP_CPY, AM_IMM }, [0xC4] = { BOP_CPY, AM_ZP }, [0xCC] = { BOP_CPY, AM_ABS },
+    [0xC6] = { BOP_DEC, AM_ZP }, [0xD6] = { BOP_DEC, AM_ZPX }, [0xCE] = { BOP_DEC, AM_ABS }, [0xDE] = { BOP_DEC, AM_ABX },
+    [0xCA] = { BOP_DEX, AM_IMP }, [0x88] = { BOP_DEY, AM_IMP },
+    [0x49] = { BOP_EOR, AM_IMM }, [0x45] = { BOP_EOR, AM_ZP }, [0x55] = { BOP_EOR, AM_ZPX }, [0x4D] = { BOP_EOR, AM_ABS },
+    [0x5D] = { BOP_EOR, AM_ABX }, [0x59] = { BOP_EOR, AM_ABY }, [0x41] = { BOP_EOR, AM_IZX }, [0x51] = { BOP_EOR, AM_IZY },
+    [0xE6] = { BOP_INC, AM_ZP }, [0xF6] = { BOP_INC, AM_ZPX }, [0xEE] = { BOP_INC, AM_ABS }, [0xFE] = { BOP_INC, AM_ABX },
+    [0xE8] = { BOP_INX, AM_IMP }, [0xC8] = { BOP_INY, AM_IMP },
+    [0x4C] = { BOP_JMP, AM_ABS }, [0x20] = { BOP_JSR, AM_ABS },
+    [0xA9] = { BOP_LDA, AM_IMM }, [0xA5] = { BOP_LDA, AM_ZP }, [0xB5] = { BOP_LDA, AM_ZPX }, [0xAD] = { BOP_LDA, AM_ABS },
+    [0xBD] = { BOP_LDA, AM_ABX }, [0xB9] = { BOP_LDA, AM_ABY }, [0xA1] = { BOP_LDA, AM_IZX }, [0xB1] = { BOP_LDA, AM_IZY },
+    [0xA2] = { BOP_LDX, AM_IMM }, [0xA6] = { BOP_LDX, AM_ZP }, [0xB6] = { BOP_LDX, AM_ZPY }, [0xAE] = { BOP_LDX, AM_ABS },
+    [0xBE] = { BOP_LDX, AM_ABY },
+    [0xA0] = { BOP_LDY, AM_IMM }, [0xA4] = { BOP_LDY, AM_ZP }, [0xB4] = { BOP_LDY, AM_ZPX }, [0xAC] = { BOP_LDY, AM_ABS },
+    [0xBC] = { BOP_LDY, AM_ABX },
+    [0x4A] = { BOP_LSR, AM_IMP }, [0x46] = { BOP_LSR, AM_ZP }, [0x56] = { BOP_LSR, AM_ZPX }, [0x4E] = { BOP_LSR, AM_ABS },
+    [0x5E] = { BOP_LSR, AM_ABX },
+    [0xEA] = { BOP_NOP, AM_IMP },
+    [0x09] = { BOP_ORA, AM_IMM }, [0x05] = { BOP_ORA, AM_ZP }, [0x15] = { BOP_ORA, AM_ZPX }, [0x0D] = { BOP_ORA, AM_ABS },
+    [0x1D] = { BOP_ORA, AM_ABX }, [0x19] = { BOP_ORA, AM_ABY }, [0x01] = { BOP_ORA, AM_IZX }, [0x11] = { BOP_ORA, AM_IZY },
+    [0x48] = { BOP_PHA, AM_IMP }, [0x08] = { BOP_PHP, AM_IMP }, [0x68] = { BOP_PLA, AM_IMP }, [0x28] = { BOP_PLP, AM_IMP },
+    [0x2A] = { BOP_ROL, AM_IMP }, [0x26] = { BOP_ROL, AM_ZP }, [0x36] = { BOP_ROL, AM_ZPX }, [0x2E] = { BOP_ROL, AM_ABS },
+    [0x3E] = { BOP_ROL, AM_ABX },
+    [0x6A] = { BOP_ROR, AM_IMP }, [0x66] = { BOP_ROR, AM_ZP }, [0x76] = { BOP_ROR, AM_ZPX }, [0x6E] = { BOP_ROR, AM_ABS },
+    [0x7E] = { BOP_ROR, AM_ABX },
+    [0x60] = { BOP_RTS, AM_IMP },
+    [0xE9] = { BOP_SBC, AM_IMM }, [0xE5] = { BOP_SBC, AM_ZP }, [0xF5] = { BOP_SBC, AM_ZPX }, [0xED] = { BOP_SBC, AM_ABS },
+    [0xFD] = { BOP_SBC, AM_ABX }, [0xF9] = { BOP_SBC, AM_ABY }, [0xE1] = { BOP_SBC, AM_IZX }, [0xF1] = { BOP_SBC, AM_IZY },
+    [0x85] = { BOP_STA, AM_ZP }, [0x95] = { BOP_STA, AM_ZPX }, [0x8D] = { BOP_STA, AM_ABS }, [0x9D] = { BOP_STA, AM_ABX },
+    [0x99] = { BOP_STA, AM_ABY }, [0x81] = { BOP_STA, AM_IZX }, [0x91] = { BOP_STA, AM_IZY },
+    [0x86] = { BOP_STX, AM_ZP }, [0x96] = { BOP_STX, AM_ZPY }, [0x8E] = { BOP_STX, AM_ABS },
+    [0x84] = { BOP_STY, AM_ZP }, [0x94] = { BOP_STY, AM_ZPX }, [0x8C] = { BOP_STY, AM_ABS },
+    [0xAA] = { BOP_TAX, AM_IMP }, [0xA8] = { BOP_TAY, AM_IMP }, [0xBA] = { BOP_TSX, AM_IMP }, [0x8A] = { BOP_TXA, AM_IMP },
+    [0x9A] = { BOP_TXS, AM_IMP }, [0x98] = { BOP_TYA, AM_IMP },
+};
+
+struct Batch {
+    uint8_t A[BATCH_LANES];
+    uint8_t X[BATCH_LANES];
+    uint8_t Y[BATCH_LANES];
+    uint8_t SP[BATCH_LANES];
+    uint8_t P[BATCH_LANES];
+    uint8_t active[BATCH_LANES]; // 0xFF while the lane runs
+    uint8_t stop[BATCH_LANES];
+    uint8_t stop_on_brk[BATCH_LANES];
+    uint8_t watchdog[BATCH_LANES];
+    KeyQueue keys[BATCH_LANES];
+    uint16_t PC[BATCH_LANES];
+    int32_t stop_pc[BATCH_LANES];
+    uint8_t stop_map[8192]; // One bit per address that some lane stops at
+    uint32_t rng[BATCH_LANES];
+    uint64_t cycles[BATCH_LANES];
+    uint64_t instructions[BATCH_LANES];
+    uint64_t max_instructions[BATCH_LANES];
+    uint64_t max_cycles[BATCH_LANES];
+    // With watchdog set, where run_until() would look for an idle loop:
+    // at each vblank, and every INT_MAX instructions where run_headless()
+    // calls it again
+    uint64_t vblank_at[BATCH_LANES];
+    uint64_t clock[BATCH_LANES];
+
+    // Steps count into these narrow counters, which vectorize better, and
+    // batch_sync() adds them to cycles and instructions once one of them
+    // reaches its quota
+    uint16_t run_cycles[BATCH_LANES];
+    uint16_t run_instructions[BATCH_LANES];
+    uint16_t cycle_quota[BATCH_LANES];
+    uint16_t instruction_quota[BATCH_LANES];
+
+    // Runs one lane's instruction for batch_fallback(); its bus reads and
+    // writes the lane in mem
+    CPU scalar;
+    int lane;
+
+    uint8_t mem[65536 * BATCH_LANES]; // Address a of lane l is at a * BATCH_LANES + l
+};
+
+// Lanes have no interrupt controller. A lane that touches its registers
+// leaves the batch with this in stop, for its job to run on its own.
+#define BATCH_LEFT 0xFF
+
+static int batch_device(uint16_t address)
+{
+    return address >= INT_CONTROL && address <= INT_TIMER_HI;
+}
+
+static void batch_leave(Batch* batch, int lane)
+{
+    batch->active[lane] = 0;
+    batch->stop[lane] = BATCH_LEFT;
+}
+
+static uint8_t batch_read(Batch* batch, int lane, uint16_t address)
+{
+    if (address == 0x00FE)
+        return next_random(&batch->rng[lane]);
+    if (address == 0x00FF)
+        return key_pop(&batch->keys[lane]);
+    if (batch_device(address))
+        batch_leave(batch, lane);
+    return batch->mem[(size_t)address * BATCH_LANES + lane];
+}
+
+static void batch_write(Batch* batch, int lane, uint16_t address, uint8_t value)
+{
+    if (batch_device(address))
+        batch_leave(batch, lane);
+    batch->mem[(size_t)address * BATCH_LANES + lane] = value;
+}
+
+static uint8_t batch_lane_read(CPU* cpu, uint16_t address, void* ctx)
+{
+    Batch* batch = ctx;
+    return batch_read(batch, batch->lane, address);
+}
+
+static void batch_lane_write(CPU* cpu, uint16_t address, uint8_t value, void* ctx)
+{
+    Batch* batch = ctx;
+    batch_write(batch, batch->lane, address, value);
+}
+
+Batch* batch_create(void)
+{
+    Batch* batch = calloc(1, sizeof(Batch));
+    if (!batch)
+        return NULL;
+    reset(&batch->scalar);
+    for (int page = 0; page < 256; page++)
+        map_io(&batch->scalar, (uint8_t)page, batch_lane_read, batch_lane_write, batch);
+    return batch;
+}
+
+// Add a lane's step counters to its totals
+static void batch_fold(Batch* batch, int lane)
+{
+    batch->cycles[lane] += batch->run_cycles[lane];
+    batch->instructions[lane] += batch->run_instructions[lane];
+    batch->run_cycles[lane] = 0;
+    batch->run_instructions[lane] = 0;
+}
+
+static int batch_idle_loop(Batch* batch, int lane, uint64_t max_instructions, uint64_t max_cycles);
+
+// Fold the counters, then retire the lane if it reached a limit or give it
+// quotas that end short of them. No step adds more than 10 cycles, so the
+// counters cannot overflow past a quota. With watchdog set, the quotas also
+// end where run_until() would look for an idle loop, and the lane stops
+// there if it is trapped in one, as run_until() would stop it.
+static void batch_sync(Batch* batch, int lane)
+{
+    for (;;)
+    {
+        batch_fold(batch, lane);
+        if (batch->instructions[lane] >= batch->max_instructions[lane] || batch->cycles[lane] >= batch->max_cycles[lane])
+        {
+            batch->active[lane] = 0;
+            return;
+        }
+        if (!batch->watchdog[lane] || (batch->cycles[lane] < batch->vblank_at[lane] && batch->instructions[lane] % INT_MAX))
+            break;
+
+        if (batch->cycles[lane] >= batch->vblank_at[lane])
+            batch->vblank_at[lane] = vblank_after(batch->clock[lane], batch->cycles[lane]);
+        uint64_t instructions = INT_MAX - batch->instructions[lane] % INT_MAX;
+        if (instructions > batch->max_instructions[lane] - batch->instructions[lane])
+            instructions = batch->max_instructions[lane] - batch->instructions[lane];
+        uint64_t end = batch->vblank_at[lane] < batch->max_cycles[lane] ? batch->vblank_at[lane] : batch->max_cycles[lane];
+        uint64_t before = batch->instructions[lane];
+        int waits = batch_idle_loop(batch, lane, instructions, end - batch->cycles[lane]);
+        if (!batch->active[lane])
+            return;
+        if (waits && !(waits & IDLE_EVENT))
+        {
+            batch->stop[lane] = STOP_TRAP;
+            batch->active[lane] = 0;
+            return;
+        }
+        // Look again if the pass ran into the next place to look
+        if (batch->instructions[lane] == before)
+            break;
+    }
 
-        // --- 8x ---
-    case 0x80: // NOP imm
-        get_address(cpu, AM_IMM);
-        break;
-    case 0x81: // STA izx
-        address = get_address(cpu, AM_IZX);
-        cpu->mem[address] = cpu->A;
-        break;
-    case 0x82: // NOP imm
-        get_address(cpu, AM_IMM);
-        break;
-    case 0x83: // SAX izx
-        address = get_address(cpu, AM_IZX);
-        cpu->mem[address] = cpu->A & cpu->X;
-        break;
-    case 0x84: // STY zp
-        address = get_address(cpu, AM_ZP);
-        cpu->mem[address] = cpu->Y;
-        break;
-    case 0x85: // STA zp
-        address = get_address(cpu, AM_ZP);
-        cpu->mem[address] = cpu->A;
-        break;
-    case 0x86: // STX zp
-        address = get_address(cpu, AM_ZP);
-        cpu->mem[address] = cpu->X;
-        break;
-    case 0x87: // SAX zp
-        address = get_address(cpu, AM_ZP);
-        cpu->mem[address] = cpu->A & cpu->X;
-        break;
-    case 0x88: // DEY
-        cpu->Y--;
-        set_zero_and_negative_flags(cpu, cpu->Y);
-        break;
-    case 0x8A: // TXA
-        cpu->A = cpu->X;
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x8B: // XAA imm
-        address = get_address(cpu, AM_IMM);
-        cpu->A = cpu->X & cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
+    uint64_t instructions = batch->max_instructions[lane] - batch->instructions[lane];
+    uint64_t cycles = batch->max_cycles[lane] - batch->cycles[lane];
+    if (batch->watchdog[lane])
+    {
+        if (instructions > INT_MAX - batch->instructions[lane] % INT_MAX)
+            instructions = INT_MAX - batch->instructions[lane] % INT_MAX;
+        if (cycles > batch->vblank_at[lane] - batch->cycles[lane])
+            cycles = batch->vblank_at[lane] - batch->cycles[lane];
+    }
+    batch->instruction_quota[lane] = instructions > 0xFF00 ? 0xFF00 : (uint16_t)instructions;
+    batch->cycle_quota[lane] = cycles > 0xFF00 ? 0xFF00 : (uint16_t)cycles;
+}
 
-        break;
-    case 0x8C: // STY abs
-        address = get_address(cpu, AM_ABS);
-        cpu->mem[address] = cpu->Y;
-        break;
-    case 0x8D: // STA abs
-        address = get_address(cpu, AM_ABS);
-        cpu->mem[address] = cpu->A;
-        break;
-    case 0x8E: // STX abs
-        address = get_address(cpu, AM_ABS);
-        cpu->mem[address] = cpu->X;
-        break;
-    case 0x8F: // SAX abs
-        address = get_address(cpu, AM_ABS);
-        cpu->mem[address] = cpu->A & cpu->X;
-        break;
-        // --- 9x ---
-    case 0x90: // BCC rel
-        address = get_address(cpu, AM_REL);
-        if (!(cpu->P & FLAG_C))
-            cpu->PC = address;
-        break;
-    case 0x91: // STA izy
-        address = get_address(cpu, AM_IZY);
-        cpu->mem[address] = cpu->A;
-        break;
-    case 0x93: // AHX izy
-        address = get_address(cpu, AM_IZY);
-        cpu->mem[address] = cpu->A & cpu->X & (address >> 8);
-        break;
-    case 0x94: // STY zpx
-        address = get_address(cpu, AM_ZPX);
-        cpu->mem[address] = cpu->Y;
-        break;
-    case 0x95: // STA zpx
-        address = get_address(cpu, AM_ZPX);
-        cpu->mem[address] = cpu->A;
-        break;
-    case 0x96: // STX zpy
-        address = get_address(cpu, AM_ZPY);
-        cpu->mem[address] = cpu->X;
-        break;
-    case 0x97: // SAX zpy
-        address = get_address(cpu, AM_ZPY);
-        cpu->mem[address] = cpu->A & cpu->X;
-        break;
-    case 0x98: // TYA
-        cpu->A = cpu->Y;
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0x99: // STA aby
-        address = get_address(cpu, AM_ABY);
-        cpu->mem[address] = cpu->A;
-        break;
-    case 0x9A: // TXS
-        cpu->SP = cpu->X;
-        break;
-    case 0x9B: // TAS aby
-        address = get_address(cpu, AM_ABY);
-        cpu->SP = cpu->A & cpu->X;
-        cpu->mem[address] = cpu->SP & (address >> 8);
-        break;
-    case 0x9C: // SHY abx
-        address = get_address(cpu, AM_ABX);
-        cpu->mem[address] = cpu->Y & (address >> 8);
-        break;
-    case 0x9D: // STA abx
-        address = get_address(cpu, AM_ABX);
-        cpu->mem[address] = cpu->A;
-        break;
-    case 0x9E: // SHX aby
-        address = get_address(cpu, AM_ABY);
-        cpu->mem[address] = cpu->X & (address >> 8);
-        break;
-    case 0x9F: // AHX aby
-        address = get_address(cpu, AM_ABY);
-        cpu->mem[address] = cpu->A & cpu->X & (address >> 8);
-        break;
-        // --- Ax ---
-    case 0xA0: // LDY imm
-        address = get_address(cpu, AM_IMM);
-        cpu->Y = cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->Y);
-        break;
-    case 0xA1: // LDA izx
-        address = get_address(cpu, AM_IZX);
-        cpu->A = cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0xA2: // LDX imm
-        address = get_address(cpu, AM_IMM);
-        cpu->X = cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->X);
-        break;
-    case 0xA3: // LAX izx
-        address = get_address(cpu, AM_IZX);
-        cpu->A = cpu->X = cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0xA4: // LDY zp
-        address = get_address(cpu, AM_ZP);
-        cpu->Y = cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->Y);
-        break;
-    case 0xA5: // LDA zp
-        address = get_address(cpu, AM_ZP);
-        cpu->A = cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0xA6: // LDX zp
-        address = get_address(cpu, AM_ZP);
-        cpu->X = cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->X);
-        break;
-    case 0xA7: // LAX zp
-        address = get_address(cpu, AM_ZP);
-        cpu->A = cpu->X = cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0xA8: // TAY
-        cpu->Y = cpu->A;
-        set_zero_and_negative_flags(cpu, cpu->Y);
-        break;
-    case 0xA9: // LDA imm
-        address = get_address(cpu, AM_IMM);
-        cpu->A = cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0xAA: // TAX
-        cpu->X = cpu->A;
-        set_zero_and_negative_flags(cpu, cpu->X);
-        break;
-    case 0xAB: // LAX imm
-        address = get_address(cpu, AM_IMM);
-        cpu->A = cpu->X = cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0xAC: // LDY abs
-        address = get_address(cpu, AM_ABS);
-        cpu->Y = cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->Y);
-        break;
-    case 0xAD: // LDA abs
-        address = get_address(cpu, AM_ABS);
-        cpu->A = cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0xAE: // LDX abs
-        address = get_address(cpu, AM_ABS);
-        cpu->X = cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->X);
-        break;
-    case 0xAF: // LAX abs
-        address = get_address(cpu, AM_ABS);
-        cpu->A = cpu->X = cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
+// Copy a started machine into a lane, to run with the given limits
+void batch_load(Batch* batch, int lane, const Machine* machine, uint64_t max_instructions, uint64_t max_cycles)
+{
+    const CPU* cpu = &machine->cpu;
 
-        // --- Bx ---
-    case 0xB0: // BCS rel
-        address = get_address(cpu, AM_REL);
-        if (cpu->P & FLAG_C)
-            cpu->PC = address;
-        break;
-    case 0xB1: // LDA izy
-        address = get_address(cpu, AM_IZY);
-        cpu->A = cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0xB3: // LAX izy
-        address = get_address(cpu, AM_IZY);
-        cpu->A = cpu->X = cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0xB4: // LDY zpx
-        address = get_address(cpu, AM_ZPX);
-        cpu->Y = cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->Y);
-        break;
-    case 0xB5: // LDA zpx
-        address = get_address(cpu, AM_ZPX);
-        cpu->A = cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0xB6: // LDX zpy
-        address = get_address(cpu, AM_ZPY);
-        cpu->X = cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->X);
-        break;
-    case 0xB7: // LAX zpy
-        address = get_address(cpu, AM_ZPY);
-        cpu->A = cpu->X = cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0xB8: // CLV
-        cpu->P &= ~FLAG_V;
-        break;
-    case 0xB9: // LDA aby
-        address = get_address(cpu, AM_ABY);
-        cpu->A = cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0xBA: // TSX
-        cpu->X = cpu->SP;
-        set_zero_and_negative_flags(cpu, cpu->X);
-        break;
-    case 0xBB: // LAS aby
-        address = get_address(cpu, AM_ABY);
-        cpu->A = cpu->X = cpu->SP = cpu->mem[address] & cpu->SP;
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0xBC: // LDY abx
-        address = get_address(cpu, AM_ABX);
-        cpu->Y = cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->Y);
-        break;
-    case 0xBD: // LDA abx
-        address = get_address(cpu, AM_ABX);
-        cpu->A = cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
-    case 0xBE: // LDX aby
-        address = get_address(cpu, AM_ABY);
-        cpu->X = cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->X);
-        break;
-    case 0xBF: // LAX aby
-        address = get_address(cpu, AM_ABY);
-        cpu->A = cpu->X = cpu->mem[address];
-        set_zero_and_negative_flags(cpu, cpu->A);
-        break;
+    batch->A[lane] = cpu->A;
+    batch->X[lane] = cpu->X;
+    batch->Y[lane] = cpu->Y;
+    batch->SP[lane] = cpu->SP;
+    batch->P[lane] = cpu->P;
+    batch->PC[lane] = cpu->PC;
+    batch->stop_pc[lane] = cpu->stop_pc;
+    if (cpu->stop_pc >= 0)
+        batch->stop_map[cpu->stop_pc >> 3] |= 1 << (cpu->stop_pc & 7);
+    batch->stop_on_brk[lane] = cpu->stop_on_brk;
+    batch->watchdog[lane] = cpu->watchdog;
+    batch->vblank_at[lane] = cpu->interrupts.vblank_at;
+    batch->clock[lane] = cpu->interrupts.clock;
+    batch->stop[lane] = STOP_NONE;
+    batch->keys[lane] = machine->keys;
+    batch->rng[lane] = machine->rng;
+    batch->cycles[lane] = cpu->cycles;
+    batch->instructions[lane] = 0;
+    batch->max_instructions[lane] = max_instructions;
+    batch->max_cycles[lane] = max_cycles;
+    batch->run_cycles[lane] = 0;
+    batch->run_instructions[lane] = 0;
+    for (size_t address = 0; address < 65536; address++)
+        batch->mem[address * BATCH_LANES + lane] = ram_page(cpu, (int)(address >> 8))[address & 0xFF];
+    batch->active[lane] = 0xFF;
+    batch_sync(batch, lane);
+}
+
+// Leave every lane empty, ready for batch_load()
+void batch_clear(Batch* batch)
+{
+    memset(batch->active, 0, sizeof(batch->active));
+    memset(batch->stop_map, 0, sizeof(batch->stop_map));
+}
+
+// Run a lane's next instruction through the reference interpreter. Returns
+// 0 if that stopped the lane.
+static int batch_execute(Batch* batch, int lane)
+{
+    CPU* cpu = &batch->scalar;
+
+    batch_fold(batch, lane);
+    cpu->A = batch->A[lane];
+    cpu->X = batch->X[lane];
+    cpu->Y = batch->Y[lane];
+    cpu->SP = batch->SP[lane];
+    cpu->P = batch->P[lane];
+    cpu->PC = batch->PC[lane];
+    cpu->cycles = batch->cycles[lane];
+    cpu->stop_on_brk = batch->stop_on_brk[lane];
+    cpu->stop = STOP_NONE;
+    batch->lane = lane;
+
+    // A BRK stop returns 0 cycles without executing
+    if (execute_instruction(cpu) > 0)
+        batch->instructions[lane]++;
+
+    batch->A[lane] = cpu->A;
+    batch->X[lane] = cpu->X;
+    batch->Y[lane] = cpu->Y;
+    batch->SP[lane] = cpu->SP;
+    batch->P[lane] = cpu->P;
+    batch->PC[lane] = cpu->PC;
+    batch->cycles[lane] = cpu->cycles;
+    if (cpu->stop)
+    {
+        batch->stop[lane] = cpu->stop;
+        batch->active[lane] = 0;
+    }
+    return batch->active[lane] != 0;
+}
+
+static void batch_fallback(Batch* batch, int lane)
+{
+    if (batch_execute(batch, lane))
+        batch_sync(batch, lane);
+}
+
+// What a lane's read of the address waits for, as idle_read() tells for a
+// machine
+static int batch_idle_read(Batch* batch, int lane, uint16_t address)
+{
+    if (address == 0x00FE)
+        return 0;
+    if (address == 0x00FF)
+        return batch->keys[lane].count == 0 ? IDLE_INPUT : 0;
+    return batch_device(address) ? IDLE_EVENT : IDLE_LOOP;
+}
+
+// idle_loop() for a lane, running the pass through the reference
+// interpreter
+static int batch_idle_loop(Batch* batch, int lane, uint64_t max_instructions, uint64_t max_cycles)
+{
+    uint8_t A = batch->A[lane], X = batch->X[lane], Y = batch->Y[lane], SP = batch->SP[lane], P = batch->P[lane];
+    uint16_t PC = batch->PC[lane];
+    uint64_t start = batch->cycles[lane];
+    int waits = IDLE_LOOP;
+
+    for (uint64_t i = 0; i < IDLE_MAX_INSTRUCTIONS && i < max_instructions && batch->cycles[lane] - start < max_cycles; i++)
+    {
+        uint16_t pc = batch->PC[lane];
+        uint8_t code[3];
+        for (int k = 0; k < 3; k++)
+        {
+            // A machine's code must not sit on device pages
+            uint16_t address = pc + k;
+            if (address >> 8 == 0 || address >> 8 == INT_CONTROL >> 8)
+                return 0;
+            code[k] = batch->mem[(size_t)address * BATCH_LANES + lane];
+        }
+        if (!idle_table[code[0]] || pc == batch->stop_pc[lane])
+            return 0;
+        uint16_t address;
+        if (idle_operand(code[0], code[1] | (code[2] << 8), batch->X[lane], batch->Y[lane], &address))
+        {
+            int wait = batch_idle_read(batch, lane, address);
+            if (!wait)
+                return 0;
+            waits |= wait;
+        }
 
-        // --- Cx ---
-    case 0xC0: // CPY imm
-        address = get_address(cpu, AM_IMM);
-        value = cpu->mem[address];
-        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
-        if (cpu->Y >= value)
-            cpu->P |= FLAG_C;
-        set_zero_and_negative_flags(cpu, cpu->Y - value);
-        break;
-    case 0xC1: // CMP izx
-        address = get_address(cpu, AM_IZX);
-        value = cpu->mem[address];
-        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
-        if (cpu->A >= value)
-            cpu->P |= FLAG_C;
-        set_zero_and_negative_flags(cpu, cpu->A - value);
-        break;
-    case 0xC2: // NOP imm
-        get_address(cpu, AM_IMM);
-        break;
-    case 0xC3: // DCP izx
-        address = get_address(cpu, AM_IZX);
-        value = cpu->mem[address];
-        value--;
-        cpu->mem[address] = value;
-        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
-        if (cpu->A >= value)
-            cpu->P |= FLAG_C;
-        set_zero_and_negative_flags(cpu, cpu->A - value);
-        break;
-    case 0xC4: // CPY zp
-        address = get_address(cpu, AM_ZP);
-        value = cpu->mem[address];
-        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
-        if (cpu->Y >= value)
-            cpu->P |= FLAG_C;
-        set_zero_and_negative_flags(cpu, cpu->Y - value);
-        break;
-    case 0xC5: // CMP zp
-        address = get_address(cpu, AM_ZP);
-        value = cpu->mem[address];
-        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
-        if (cpu->A >= value)
-            cpu->P |= FLAG_C;
-        set_zero_and_negative_flags(cpu, cpu->A - value);
-        break;
-    case 0xC6: // DEC zp
-        address = get_address(cpu, AM_ZP);
-        value = cpu->mem[address];
-        value--;
-        cpu->mem[address] = value;
-        set_zero_and_negative_flags(cpu, value);
-        break;
-    case 0xC7: // DCP zp
-        address = get_address(cpu, AM_ZP);
-        value = cpu->mem[address];
-        value--;
-        cpu->mem[address] = value;
-        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
-        if (cpu->A >= value)
-            cpu->P |= FLAG_C;
-        set_zero_and_negative_flags(cpu, cpu->A - value);
-        break;
-    case 0xC8: // INY
-        cpu->Y++;
-        set_zero_and_negative_flags(cpu, cpu->Y);
-        break;
-    case 0xC9: // CMP imm
-        address = get_address(cpu, AM_IMM);
-        value = cpu->mem[address];
-        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
-        if (cpu->A >= value)
-            cpu->P |= FLAG_C;
-        set_zero_and_negative_flags(cpu, cpu->A - value);
-        break;
-    case 0xCA: // DEX
-        cpu->X--;
-        set_zero_and_negative_flags(cpu, cpu->X);
-        break;
-    case 0xCB: // AXS imm
-        address = get_address(cpu, AM_IMM);
-        value = cpu->mem[address];
-        cpu->X = (cpu->A & cpu->X) - value;
-        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
-        if ((cpu->A & cpu->X) >= value)
-            cpu->P |= FLAG_C;
-        set_zero_and_negative_flags(cpu, cpu->X);
+        if (!batch_execute(batch, lane))
+            return 0;
+        if (batch->PC[lane] == PC && batch->A[lane] == A && batch->X[lane] == X && batch->Y[lane] == Y &&
+            batch->SP[lane] == SP && batch->P[lane] == P)
+            return waits;
+    }
+    return 0;
+}
 
-        break;
-    case 0xCC: // CPY abs
-        address = get_address(cpu, AM_ABS);
-        value = cpu->mem[address];
-        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
-        if (cpu->Y >= value)
-            cpu->P |= FLAG_C;
-        set_zero_and_negative_flags(cpu, cpu->Y - value);
-        break;
-    case 0xCD: // CMP abs
-        address = get_address(cpu, AM_ABS);
-        value = cpu->mem[address];
-        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
-        if (cpu->A >= value)
-            cpu->P |= FLAG_C;
-        set_zero_and_negative_flags(cpu, cpu->A - value);
-        break;
-    case 0xCE: // DEC abs
-        address = get_address(cpu, AM_ABS);
-        value = cpu->mem[address];
-        value--;
-        cpu->mem[address] = value;
-        set_zero_and_negative_flags(cpu, value);
-        break;
-    case 0xCF: // DCP abs
-        address = get_address(cpu, AM_ABS);
-        value = cpu->mem[address];
-        value--;
-        cpu->mem[address] = value;
-        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
-        if (cpu->A >= value)
-            cpu->P |= FLAG_C;
-        set_zero_and_negative_flags(cpu, cpu->A - value);
-        break;
+// Operand reads and writes for the lanes in m. A uniform address touches
+// every lane's copy at once; otherwise each lane uses its own address.
+static void batch_load_operand(Batch* batch, const uint8_t* m, int uniform, uint16_t address, const uint16_t* addresses, uint8_t* value)
+{
+    if (uniform && address != 0x00FE && address != 0x00FF && !batch_device(address))
+    {
+        const uint8_t* src = &batch->mem[(size_t)address * BATCH_LANES];
+        LANE_LOOP
+            value[l] = src[l];
+        return;
+    }
+    LANE_LOOP
+    {
+        if (m[l])
+            value[l] = batch_read(batch, l, uniform ? address : addresses[l]);
+    }
+}
 
-        // --- Dx ---
-    case 0xD0: // BNE rel
-        address = get_address(cpu, AM_REL);
-        if (!(cpu->P & FLAG_Z))
-            cpu->PC = address;
-        break;
-    case 0xD1: // CMP izy
-        address = get_address(cpu, AM_IZY);
-        value = cpu->mem[address];
-        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
-        if (cpu->A >= value)
-            cpu->P |= FLAG_C;
-        set_zero_and_negative_flags(cpu, cpu->A - value);
-        break;
-    case 0xD3: // DCP izy
-        address = get_address(cpu, AM_IZY);
-        value = cpu->mem[address];
-        value--;
-        cpu->mem[address] = value;
-        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
-        if (cpu->A >= value)
-            cpu->P |= FLAG_C;
-        set_zero_and_negative_flags(cpu, cpu->A - value);
-        break;
-    case 0xD4: // NOP zpx
-        get_address(cpu, AM_ZPX);
-        break;
-    case 0xD5: // CMP zpx
-        address = get_address(cpu, AM_ZPX);
-        value = cpu->mem[address];
-        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
-        if (cpu->A >= value)
-            cpu->P |= FLAG_C;
-        set_zero_and_negative_flags(cpu, cpu->A - value);
-        break;
-    case 0xD6: // DEC zpx
-        address = get_address(cpu, AM_ZPX);
-        value = cpu->mem[address];
-        value--;
-        cpu->mem[address] = value;
-        set_zero_and_negative_flags(cpu, value);
-        break;
-    case 0xD7: // DCP zpx
-        address = get_address(cpu, AM_ZPX);
-        value = cpu->mem[address];
-        value--;
-        cpu->mem[address] = value;
-        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
-        if (cpu->A >= value)
-            cpu->P |= FLAG_C;
-        set_zero_and_negative_flags(cpu, cpu->A - value);
-        break;
-    case 0xD8: // CLD
-        cpu->P &= ~FLAG_D;
-        break;
-    case 0xD9: // CMP aby
-        address = get_address(cpu, AM_ABY);
-        value = cpu->mem[address];
-        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
-        if (cpu->A >= value)
-            cpu->P |= FLAG_C;
-        set_zero_and_negative_flags(cpu, cpu->A - value);
-        break;
-    case 0xDA: // NOP
-        break;
-    case 0xDB: // DCP aby
-        address = get_address(cpu, AM_ABY);
-        value = cpu->mem[address];
-        value--;
-        cpu->mem[address] = value;
-        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
-        if (cpu->A >= value)
-            cpu->P |= FLAG_C;
-        set_zero_and_negative_flags(cpu, cpu->A - value);
-        break;
-    case 0xDC: // NOP abx
-        get_address(cpu, AM_ABX);
-        break;
-    case 0xDD: // CMP abx
-        address = get_address(cpu, AM_ABX);
-        value = cpu->mem[address];
-        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
-        if (cpu->A >= value)
-            cpu->P |= FLAG_C;
-        set_zero_and_negative_flags(cpu, cpu->A - value);
-        break;
-    case 0xDE: // DEC abx
-        address = get_address(cpu, AM_ABX);
-        value = cpu->mem[address];
-        value--;
-        cpu->mem[address] = value;
-        set_zero_and_negative_flags(cpu, value);
-        break;
-    case 0xDF: // DCP abx
-        address = get_address(cpu, AM_ABX);
-        value = cpu->mem[address];
-        value--;
-        cpu->mem[address] = value;
-        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
-        if (cpu->A >= value)
-            cpu->P |= FLAG_C;
-        set_zero_and_negative_flags(cpu, cpu->A - value);
-        break;
+static void batch_store_operand(Batch* batch, const uint8_t* m, int uniform, uint16_t address, const uint16_t* addresses, const uint8_t* value)
+{
+    if (uniform && !batch_device(address))
+    {
+        uint8_t* dst = &batch->mem[(size_t)address * BATCH_LANES];
+        LANE_LOOP
+            dst[l] = (dst[l] & ~m[l]) | (value[l] & m[l]);
+        return;
+    }
+    LANE_LOOP
+    {
+        if (m[l])
+            batch_write(batch, l, uniform ? address : addresses[l], value[l]);
+    }
+}
+
+static void batch_push(Batch* batch, const uint8_t* m, const uint8_t* value)
+{
+    LANE_LOOP
+    {
+        if (m[l])
+            batch->mem[(size_t)(0x100 + batch->SP[l]--) * BATCH_LANES + l] = value[l];
+    }
+}
+
+static void batch_pull(Batch* batch, const uint8_t* m, uint8_t* value)
+{
+    LANE_LOOP
+    {
+        if (m[l])
+            value[l] = batch->mem[(size_t)(0x100 + ++batch->SP[l]) * BATCH_LANES + l];
+    }
+}
+
+FORCE_INLINE uint8_t lane_nz(uint8_t p, uint8_t value)
+{
+    return (p & ~(FLAG_N | FLAG_Z)) | (value & FLAG_N) | (value ? 0 : FLAG_Z);
+}
+
+// Keep a lane's register unless it is in the group
+#define BLEND(old, new) (uint8_t)(((old) & ~m[l]) | ((new) & m[l]))
+
+// Give the group's lanes a new register value and set N and Z from it
+#define LANE_RESULT(reg, expr) \
+    do { \
+        LANE_LOOP \
+        { \
+            uint8_t result_ = (expr); \
+            reg[l] = BLEND(reg[l], result_); \
+            P[l] = BLEND(P[l], lane_nz(P[l], result_)); \
+        } \
+    } while (0)
+
+// Run the instruction at the lowest PC for every lane there whose code
+// bytes match. Returns 0 once no lane is left running.
+static int batch_step(Batch* batch)
+{
+    uint8_t m[BATCH_LANES];
+    uint16_t pc = 0xFFFF;
+    uint8_t any = 0;
+
+    LANE_LOOP
+    {
+        uint16_t key = batch->PC[l] | (uint16_t)(batch->active[l] ? 0 : 0xFFFF);
+        pc = key < pc ? key : pc;
+    }
+    LANE_LOOP
+    {
+        m[l] = batch->active[l] & (uint8_t)-(batch->PC[l] == pc);
+        any |= m[l];
+    }
+    if (!any)
+        return 0;
+
+    // Same order as run_until(): the limits were checked after the last
+    // instruction, stop_pc is checked before this one
+    if (batch->stop_map[pc >> 3] & (1 << (pc & 7)))
+    {
+        any = 0;
+        LANE_LOOP
+        {
+            uint8_t stop = m[l] & (uint8_t)-(batch->stop_pc[l] == pc);
+            batch->active[l] &= ~stop;
+            batch->stop[l] |= stop & STOP_PC;
+            m[l] &= ~stop;
+            any |= m[l];
+        }
+        if (!any)
+            return 1;
+    }
+
+    int first = 0;
+    while (!m[first])
+        first++;
+    const uint8_t* code = &batch->mem[(size_t)pc * BATCH_LANES];
+    uint8_t opcode = code[first];
+    BatchOp entry = batch_table[opcode];
+    int length = entry.mode == AM_IMP ? 1 : (entry.mode >= AM_ABS && entry.mode <= AM_IND ? 3 : 2);
+
+    // Lanes whose code differs wait for a later step
+    LANE_LOOP
+        m[l] &= (uint8_t)-(code[l] == opcode);
+    uint8_t b1 = 0, b2 = 0;
+    if (length > 1)
+    {
+        const uint8_t* operand = &batch->mem[(size_t)(uint16_t)(pc + 1) * BATCH_LANES];
+        b1 = operand[first];
+        LANE_LOOP
+            m[l] &= (uint8_t)-(operand[l] == b1);
+    }
+    if (length > 2)
+    {
+        const uint8_t* operand = &batch->mem[(size_t)(uint16_t)(pc + 2) * BATCH_LANES];
+        b2 = operand[first];
+        LANE_LOOP
+            m[l] &= (uint8_t)-(operand[l] == b2);
+    }
+
+    // Code read from the interrupt controller's registers reads them, which
+    // lanes do not have: those jobs run on their own
+    for (int k = 0; k < length; k++)
+    {
+        if (batch_device((uint16_t)(pc + k)))
+        {
+            LANE_LOOP
+            {
+                if (m[l])
+                    batch_leave(batch, l);
+            }
+            return 1;
+        }
+    }
 
-        // --- Ex ---
-    case 0xE0: // CPX imm
-        address = get_address(cpu, AM_IMM);
-        value = cpu->mem[address];
-        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
-        if (cpu->X >= value)
-            cpu->P |= FLAG_C;
-        set_zero_and_negative_flags(cpu, cpu->X - value);
-        break;
-    case 0xE1: // SBC izx
-        address = get_address(cpu, AM_IZX);
-        value = cpu->mem[address];
-        result = cpu->A - value - ((cpu->P & FLAG_C) ? 0 : 1);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (!(result & 0x100))
-            cpu->P |= FLAG_C;
+    // Code read from $FE/$FF goes through the registers, leave it to the
+    // interpreter like the opcodes without a vector version
+    if (entry.op == BOP_NONE || (pc < 0x100 && pc + length > 0xFE))
+    {
+        LANE_LOOP
+        {
+            if (m[l])
+                batch_fallback(batch, l);
+        }
+        return 1;
+    }
 
-        if ((cpu->A ^ result) & (~value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
+    uint8_t value[BATCH_LANES] = { 0 };
+    uint8_t crossed[BATCH_LANES] = { 0 };
+    uint16_t addresses[BATCH_LANES];
+    uint16_t address = 0;
+    int uniform = 1;
+    const uint8_t* index = batch->X;
 
+    switch (entry.mode)
+    {
+    case AM_IMM:
+        LANE_LOOP
+            value[l] = b1;
         break;
-    case 0xE2: // NOP imm
-        get_address(cpu, AM_IMM);
+    case AM_ZP:
+        address = b1;
         break;
-    case 0xE3: // ISC izx
-        address = get_address(cpu, AM_IZX);
-        value = cpu->mem[address];
-        value++;
-        cpu->mem[address] = value;
-        result = cpu->A - value - ((cpu->P & FLAG_C) ? 0 : 1);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (!(result & 0x100))
-            cpu->P |= FLAG_C;
-        if ((cpu->A ^ result) & (~value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
+    case AM_ABS:
+        address = b1 | (b2 << 8);
         break;
-    case 0xE4: // CPX zp
-        address = get_address(cpu, AM_ZP);
-        value = cpu->mem[address];
-        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
-        if (cpu->X >= value)
-            cpu->P |= FLAG_C;
-        set_zero_and_negative_flags(cpu, cpu->X - value);
+    case AM_ZPY:
+        index = batch->Y;
+        // Fall through
+    case AM_ZPX:
+    {
+        uint8_t differ = 0;
+        LANE_LOOP
+            differ |= m[l] & (index[l] ^ index[first]);
+        uniform = !differ;
+        address = (b1 + index[first]) & 0xFF;
+        LANE_LOOP
+            addresses[l] = (b1 + index[l]) & 0xFF;
         break;
-    case 0xE5: // SBC zp
-        address = get_address(cpu, AM_ZP);
-        value = cpu->mem[address];
-        result = cpu->A - value - ((cpu->P & FLAG_C) ? 0 : 1);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (!(result & 0x100))
-            cpu->P |= FLAG_C;
-        if ((cpu->A ^ result) & (~value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
+    }
+    case AM_ABY:
+        index = batch->Y;
+        // Fall through
+    case AM_ABX:
+    {
+        uint16_t base = b1 | (b2 << 8);
+        uint8_t differ = 0;
+        LANE_LOOP
+        {
+            differ |= m[l] & (index[l] ^ index[first]);
+            addresses[l] = base + index[l];
+            crossed[l] = (uint8_t)-(((base ^ addresses[l]) >> 8) != 0);
+        }
+        uniform = !differ;
+        address = addresses[first];
         break;
-    case 0xE6: // INC zp
-        address = get_address(cpu, AM_ZP);
-        value = cpu->mem[address];
-        value++;
-        cpu->mem[address] = value;
-        set_zero_and_negative_flags(cpu, value);
+    }
+    case AM_IZX:
+        uniform = 0;
+        LANE_LOOP
+        {
+            if (m[l])
+            {
+                uint8_t pointer = (b1 + batch->X[l]) & 0xFF;
+                addresses[l] = batch_read(batch, l, pointer);
+                addresses[l] |= batch_read(batch, l, (pointer + 1) & 0xFF) << 8;
+            }
+        }
         break;
-    case 0xE7: // ISC zp
-        address = get_address(cpu, AM_ZP);
-        value = cpu->mem[address];
-        value++;
-        cpu->mem[address] = value;
-        result = cpu->A - value - ((cpu->P & FLAG_C) ? 0 : 1);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (!(result & 0x100))
-            cpu->P |= FLAG_C;
-        if ((cpu->A ^ result) & (~value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
+    case AM_IZY:
+        uniform = 0;
+        LANE_LOOP
+        {
+            if (m[l])
+            {
+                uint16_t base = batch_read(batch, l, b1);
+                base |= batch_read(batch, l, (b1 + 1) & 0xFF) << 8;
+                addresses[l] = base + batch->Y[l];
+                crossed[l] = (uint8_t)-(((base ^ addresses[l]) >> 8) != 0);
+            }
+        }
         break;
-    case 0xE8: // INX
-        cpu->X++;
-        set_zero_and_negative_flags(cpu, cpu->X);
+    }
+
+    uint8_t* A = batch->A;
+    uint8_t* X = batch->X;
+    uint8_t* Y = batch->Y;
+    uint8_t* P = batch->P;
+    uint16_t next = pc + length;
+    uint8_t extra = 0; // Cycles a taken branch adds
+    uint8_t taken[BATCH_LANES] = { 0 };
+
+    switch (entry.op)
+    {
+    case BOP_LDA:
+    case BOP_LDX:
+    case BOP_LDY:
+    {
+        uint8_t* reg = entry.op == BOP_LDA ? A : (entry.op == BOP_LDX ? X : Y);
+        if (entry.mode != AM_IMM)
+            batch_load_operand(batch, m, uniform, address, addresses, value);
+        LANE_RESULT(reg, value[l]);
         break;
-    case 0xE9: // SBC imm
-        address = get_address(cpu, AM_IMM);
-        value = cpu->mem[address];
-        result = cpu->A - value - ((cpu->P & FLAG_C) ? 0 : 1);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (!(result & 0x100))
-            cpu->P |= FLAG_C;
-        if ((cpu->A ^ result) & (~value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
+    }
+    case BOP_STA:
+    case BOP_STX:
+    case BOP_STY:
+        batch_store_operand(batch, m, uniform, address, addresses, entry.op == BOP_STA ? A : (entry.op == BOP_STX ? X : Y));
+        break;
+    case BOP_ORA:
+    case BOP_AND:
+    case BOP_EOR:
+        if (entry.mode != AM_IMM)
+            batch_load_operand(batch, m, uniform, address, addresses, value);
+        if (entry.op == BOP_ORA)
+            LANE_RESULT(A, A[l] | value[l]);
+        else if (entry.op == BOP_AND)
+            LANE_RESULT(A, A[l] & value[l]);
+        else
+            LANE_RESULT(A, A[l] ^ value[l]);
+        break;
+    case BOP_ADC:
+    case BOP_SBC:
+        if (entry.mode != AM_IMM)
+            batch_load_operand(batch, m, uniform, address, addresses, value);
+        // Decimal mode takes a table lookup per lane, see adc_core()
+        any = 0;
+        LANE_LOOP
+            any |= m[l] & P[l];
+        if (any & FLAG_D)
+        {
+            LANE_LOOP
+            {
+                if (m[l])
+                    A[l] = entry.op == BOP_SBC ? sbc_core(A[l], value[l], &P[l]) : adc_core(A[l], value[l], &P[l]);
+            }
+            break;
+        }
+        // SBC is ADC of the inverted operand
+        LANE_LOOP
+        {
+            uint8_t operand = entry.op == BOP_SBC ? (uint8_t)~value[l] : value[l];
+            uint16_t result = A[l] + operand + (P[l] & FLAG_C);
+            uint8_t p = P[l] & ~(FLAG_V | FLAG_C);
+            p |= (result >> 8) & FLAG_C;
+            p |= ((A[l] ^ result) & (operand ^ result) & 0x80) >> 1;
+            A[l] = BLEND(A[l], (uint8_t)result);
+            P[l] = BLEND(P[l], lane_nz(p, (uint8_t)result));
+        }
         break;
-    case 0xEA: // NOP
+    case BOP_CMP:
+    case BOP_CPX:
+    case BOP_CPY:
+    {
+        const uint8_t* reg = entry.op == BOP_CMP ? A : (entry.op == BOP_CPX ? X : Y);
+        if (entry.mode != AM_IMM)
+            batch_load_operand(batch, m, uniform, address, addresses, value);
+        LANE_LOOP
+        {
+            uint8_t p = (P[l] & ~FLAG_C) | (reg[l] >= value[l] ? FLAG_C : 0);
+            P[l] = BLEND(P[l], lane_nz(p, (uint8_t)(reg[l] - value[l])));
+        }
         break;
-    case 0xEB: // SBC imm
-        address = get_address(cpu, AM_IMM);
-        value = cpu->mem[address];
-        result = cpu->A - value - ((cpu->P & FLAG_C) ? 0 : 1);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (!(result & 0x100))
-            cpu->P |= FLAG_C;
-        if ((cpu->A ^ result) & (~value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
+    }
+    case BOP_BIT:
+        batch_load_operand(batch, m, uniform, address, addresses, value);
+        LANE_LOOP
+        {
+            uint8_t p = (P[l] & ~(FLAG_N | FLAG_V | FLAG_Z)) | (value[l] & (FLAG_N | FLAG_V));
+            p |= (A[l] & value[l]) ? 0 : FLAG_Z;
+            P[l] = BLEND(P[l], p);
+        }
         break;
-    case 0xEC: // CPX abs
-        address = get_address(cpu, AM_ABS);
-        value = cpu->mem[address];
-        cpu->P &= ~(FLAG_N | FLAG_Z | FLAG_C);
-        if (cpu->X >= value)
-            cpu->P |= FLAG_C;
-        set_zero_and_negative_flags(cpu, cpu->X - value);
+    case BOP_INC:
+    case BOP_DEC:
+    case BOP_ASL:
+    case BOP_LSR:
+    case BOP_ROL:
+    case BOP_ROR:
+    {
+        uint8_t* data = entry.mode == AM_IMP ? A : value;
+        uint8_t result[BATCH_LANES];
+        uint8_t carry[BATCH_LANES];
+        if (entry.mode != AM_IMP)
+            batch_load_operand(batch, m, uniform, address, addresses, value);
+        switch (entry.op)
+        {
+        case BOP_INC:
+            LANE_LOOP
+            {
+                result[l] = data[l] + 1;
+                carry[l] = P[l] & FLAG_C;
+            }
+            break;
+        case BOP_DEC:
+            LANE_LOOP
+            {
+                result[l] = data[l] - 1;
+                carry[l] = P[l] & FLAG_C;
+            }
+            break;
+        case BOP_ASL:
+            LANE_LOOP
+            {
+                result[l] = data[l] << 1;
+                carry[l] = data[l] >> 7;
+            }
+            break;
+        case BOP_LSR:
+            LANE_LOOP
+            {
+                result[l] = data[l] >> 1;
+                carry[l] = data[l] & FLAG_C;
+            }
+            break;
+        case BOP_ROL:
+            LANE_LOOP
+            {
+                result[l] = (data[l] << 1) | (P[l] & FLAG_C);
+                carry[l] = data[l] >> 7;
+            }
+            break;
+        default:
+            LANE_LOOP
+            {
+                result[l] = (data[l] >> 1) | (P[l] << 7);
+                carry[l] = data[l] & FLAG_C;
+            }
+            break;
+        }
+        LANE_LOOP
+        {
+            P[l] = BLEND(P[l], lane_nz((P[l] & ~FLAG_C) | carry[l], result[l]));
+            data[l] = BLEND(data[l], result[l]);
+        }
+        if (entry.mode != AM_IMP)
+            batch_store_operand(batch, m, uniform, address, addresses, value);
         break;
-    case 0xED: // SBC abs
-        address = get_address(cpu, AM_ABS);
-        value = cpu->mem[address];
-        result = cpu->A - value - ((cpu->P & FLAG_C) ? 0 : 1);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (!(result & 0x100))
-            cpu->P |= FLAG_C;
-        if ((cpu->A ^ result) & (~value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
+    }
+    case BOP_INX:
+        LANE_RESULT(X, X[l] + 1);
         break;
-    case 0xEE: // INC abs
-        address = get_address(cpu, AM_ABS);
-        value = cpu->mem[address];
-        value++;
-        cpu->mem[address] = value;
-        set_zero_and_negative_flags(cpu, value);
+    case BOP_INY:
+        LANE_RESULT(Y, Y[l] + 1);
         break;
-    case 0xEF: // ISC abs
-        address = get_address(cpu, AM_ABS);
-        value = cpu->mem[address];
-        value++;
-        cpu->mem[address] = value;
-        result = cpu->A - value - ((cpu->P & FLAG_C) ? 0 : 1);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (!(result & 0x100))
-            cpu->P |= FLAG_C;
-        if ((cpu->A ^ result) & (~value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
+    case BOP_DEX:
+        LANE_RESULT(X, X[l] - 1);
         break;
-
-        // --- Fx ---
-    case 0xF0: // BEQ rel
-        address = get_address(cpu, AM_REL);
-        if (cpu->P & FLAG_Z)
-            cpu->PC = address;
+    case BOP_DEY:
+        LANE_RESULT(Y, Y[l] - 1);
         break;
-    case 0xF1: // SBC izy
-        address = get_address(cpu, AM_IZY);
-        value = cpu->mem[address];
-        result = cpu->A - value - ((cpu->P & FLAG_C) ? 0 : 1);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (!(result & 0x100))
-            cpu->P |= FLAG_C;
-        if ((cpu->A ^ result) & (~value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
+    case BOP_TAX:
+        LANE_RESULT(X, A[l]);
         break;
-    case 0xF3: // ISC izy
-        address = get_address(cpu, AM_IZY);
-        value = cpu->mem[address];
-        value++;
-        cpu->mem[address] = value;
-        result = cpu->A - value - ((cpu->P & FLAG_C) ? 0 : 1);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (!(result & 0x100))
-            cpu->P |= FLAG_C;
-        if ((cpu->A ^ result) & (~value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
+    case BOP_TAY:
+        LANE_RESULT(Y, A[l]);
         break;
-    case 0xF4: // NOP zpx
-        get_address(cpu, AM_ZPX);
+    case BOP_TXA:
+        LANE_RESULT(A, X[l]);
         break;
-    case 0xF5: // SBC zpx
-        address = get_address(cpu, AM_ZPX);
-        value = cpu->mem[address];
-        result = cpu->A - value - ((cpu->P & FLAG_C) ? 0 : 1);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (!(result & 0x100))
-            cpu->P |= FLAG_C;
-        if ((cpu->A ^ result) & (~value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
+    case BOP_TYA:
+        LANE_RESULT(A, Y[l]);
         break;
-    case 0xF6: // INC zpx
-        address = get_address(cpu, AM_ZPX);
-        value = cpu->mem[address];
-        value++;
-        cpu->mem[address] = value;
-        set_zero_and_negative_flags(cpu, value);
+    case BOP_TSX:
+        LANE_RESULT(X, batch->SP[l]);
         break;
-    case 0xF7: // ISC zpx
-        address = get_address(cpu, AM_ZPX);
-        value = cpu->mem[address];
-        value++;
-        cpu->mem[address] = value;
-        result = cpu->A - value - ((cpu->P & FLAG_C) ? 0 : 1);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (!(result & 0x100))
-            cpu->P |= FLAG_C;
-        if ((cpu->A ^ result) & (~value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
+    case BOP_TXS:
+        LANE_LOOP
+            batch->SP[l] = BLEND(batch->SP[l], X[l]);
         break;
-    case 0xF8: // SED
-        cpu->P |= FLAG_D;
+    case BOP_FLAG:
+    {
+        uint8_t set = entry.set ? entry.flag : 0;
+        LANE_LOOP
+            P[l] = BLEND(P[l], (P[l] & ~entry.flag) | set);
         break;
-    case 0xF9: // SBC aby
-        address = get_address(cpu, AM_ABY);
-        value = cpu->mem[address];
-        result = cpu->A - value - ((cpu->P & FLAG_C) ? 0 : 1);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (!(result & 0x100))
-            cpu->P |= FLAG_C;
-        if ((cpu->A ^ result) & (~value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
+    }
+    case BOP_BRANCH:
+    {
+        uint16_t target = next + (int8_t)b1;
+        uint8_t want = entry.set ? entry.flag : 0;
+        LANE_LOOP
+            taken[l] = m[l] & (uint8_t)-((P[l] & entry.flag) == want);
+        extra = ((next ^ target) & 0xFF00) ? 2 : 1;
+        LANE_LOOP
+            batch->PC[l] = taken[l] ? target : batch->PC[l];
         break;
-    case 0xFA: // NOP
+    }
+    case BOP_JMP:
+        next = b1 | (b2 << 8);
         break;
-    case 0xFB: // ISC aby
-        address = get_address(cpu, AM_ABY);
-        value = cpu->mem[address];
-        value++;
-        cpu->mem[address] = value;
-        result = cpu->A - value - ((cpu->P & FLAG_C) ? 0 : 1);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (!(result & 0x100))
-            cpu->P |= FLAG_C;
-        if ((cpu->A ^ result) & (~value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
+    case BOP_JSR:
+    {
+        // Push the address of the operand's last byte; RTS adds one
+        uint8_t high[BATCH_LANES];
+        uint8_t low[BATCH_LANES];
+        LANE_LOOP
+        {
+            high[l] = (uint16_t)(pc + 2) >> 8;
+            low[l] = (uint8_t)(pc + 2);
+        }
+        batch_push(batch, m, high);
+        batch_push(batch, m, low);
+        next = b1 | (b2 << 8);
         break;
-    case 0xFC: // NOP abx
-        get_address(cpu, AM_ABX);
+    }
+    case BOP_RTS:
+    {
+        uint8_t low[BATCH_LANES];
+        uint8_t high[BATCH_LANES];
+        batch_pull(batch, m, low);
+        batch_pull(batch, m, high);
+        LANE_LOOP
+        {
+            if (m[l])
+                batch->PC[l] = (uint16_t)((low[l] | (high[l] << 8)) + 1);
+        }
         break;
-    case 0xFD: // SBC abx
-        address = get_address(cpu, AM_ABX);
-        value = cpu->mem[address];
-        result = cpu->A - value - ((cpu->P & FLAG_C) ? 0 : 1);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (!(result & 0x100))
-            cpu->P |= FLAG_C;
-        if ((cpu->A ^ result) & (~value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
+    }
+    case BOP_PHA:
+        batch_push(batch, m, A);
         break;
-    case 0xFE: // INC abx
-        address = get_address(cpu, AM_ABX);
-        value = cpu->mem[address];
-        value++;
-        cpu->mem[address] = value;
-        set_zero_and_negative_flags(cpu, value);
+    case BOP_PHP:
+        batch_push(batch, m, P);
         break;
-    case 0xFF: // ISC abx
-        address = get_address(cpu, AM_ABX);
-        value = cpu->mem[address];
-        value++;
-        cpu->mem[address] = value;
-        result = cpu->A - value - ((cpu->P & FLAG_C) ? 0 : 1);
-        cpu->P &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
-        if (!(result & 0x100))
-            cpu->P |= FLAG_C;
-        if ((cpu->A ^ result) & (~value ^ result) & 0x80)
-            cpu->P |= FLAG_V;
-        cpu->A = result & 0xFF;
-        set_zero_and_negative_flags(cpu, cpu->A);
+    case BOP_PLA:
+        batch_pull(batch, m, value);
+        LANE_RESULT(A, value[l]);
         break;
-    default:
-        printf("Unknown Opcode: 0x%02X at $%04X\n", opcode, cpu->PC - 1);
-        cpu->PC = 0xFFFF;
+    case BOP_PLP:
+        batch_pull(batch, m, value);
+        LANE_LOOP
+            P[l] = BLEND(P[l], value[l] | 0x20);
         break;
     }
 
-    if (address >= 0x200 && address < (0x200 + SCREEN_WIDTH * SCREEN_HEIGHT))
+    // Lanes the instruction did not move (RTS and taken branches did)
+    // continue at the next instruction or the jump target
+    if (entry.op != BOP_RTS)
+    {
+        LANE_LOOP
+            batch->PC[l] = (m[l] & ~taken[l]) ? next : batch->PC[l];
+    }
+
+    uint8_t cycles = cycle_table[opcode];
+    uint8_t cross = page_cross_table[opcode] ? 1 : 0;
+    uint8_t due = 0;
+    LANE_LOOP
+    {
+        uint16_t used = (cycles + (crossed[l] & cross) + (taken[l] & extra)) & (uint16_t)-(m[l] & 1);
+        batch->run_cycles[l] += used;
+        batch->run_instructions[l] += m[l] & 1;
+        due |= m[l] & ((uint8_t)-(batch->run_cycles[l] >= batch->cycle_quota[l]) | (uint8_t)-(batch->run_instructions[l] >= batch->instruction_quota[l]));
+    }
+    if (due)
     {
-        pixels[address - 0x200] = palette[cpu->mem[address]];
+        LANE_LOOP
+        {
+            if (m[l])
+                batch_sync(batch, l);
+        }
     }
+    return 1;
+}
+
+// Run every loaded lane until it stops or reaches its limits
+void batch_run(Batch* batch)
+{
+    while (batch_step(batch))
+        ;
+}
+
+// Fill in how a lane's run ended, like finish_run() does for a CPU
+void batch_result(Batch* batch, int lane, const Options* opt, RunResult* result)
+{
+    CPU* cpu = &batch->scalar;
+
+    batch_fold(batch, lane);
+    cpu->A = batch->A[lane];
+    cpu->X = batch->X[lane];
+    cpu->Y = batch->Y[lane];
+    cpu->SP = batch->SP[lane];
+    cpu->P = batch->P[lane];
+    cpu->PC = batch->PC[lane];
+    cpu->cycles = batch->cycles[lane];
+    cpu->stop = batch->stop[lane];
+    finish_run(cpu, opt, batch->instructions[lane], 0, result);
+}
+
+// Whether a lane left the batch before its job was done
+int batch_left(const Batch* batch, int lane)
+{
+    return batch->stop[lane] == BATCH_LEFT;
 }
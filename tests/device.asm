@@ -0,0 +1,7 @@
+; Runs from wherever it is loaded. Loaded at $4200, its code sits on the
+; interrupt controller's registers, which the batch engine must not read as RAM.
+        LDX #0
+loop:   INX
+        TXA
+        STA $10
+        JMP loop
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Regression checks for a built emulator: tests/run.sh [path to 6502]
+emu=${1:-./6502}
+dir=$(dirname "$0")
+profile=${TMPDIR:-/tmp}/6502-test-profile.$$
+failed=0
+
+# expect <stop reason> <args...>: the run's summary must give that stop reason
+expect()
+{
+    want=$1
+    shift
+    summary=$("$emu" --headless "$@" | tail -n 1)
+    case "$summary" in
+    *"\"stop\":\"$want\""*) echo "ok: $*" ;;
+    *) echo "FAILED: $* gave $summary, expected \"stop\":\"$want\""; failed=1 ;;
+    esac
+}
+
+expect trap --max-cycles 5000000 "$dir/selfjump.asm"
+expect trap --max-cycles 5000000 --profile "$profile" "$dir/selfjump.asm"
+expect trap --max-cycles 5000000 --profile "$profile" --profile-sample 100 "$dir/selfjump.asm"
+expect trap --max-cycles 5000000 --engine jit --profile "$profile" "$dir/selfjump.asm"
+expect cycle_limit --no-watchdog --max-cycles 100000 --profile "$profile" "$dir/selfjump.asm"
+
+# Batched farm jobs must end as they do one by one, with code loaded on
+# the interrupt controller's registers at $4200 too
+jobs=${TMPDIR:-/tmp}/6502-test-jobs.$$
+for i in 1 2; do
+    echo "--seed 0 --load 0x4200 --max-cycles 50000 $dir/device.asm"
+done > "$jobs"
+single=$("$emu" --farm "$jobs")
+batched=$("$emu" --farm "$jobs" --batch 2)
+if [ "$single" = "$batched" ]; then
+    echo "ok: --farm --batch 2 with code at \$4200"
+else
+    echo "FAILED: --farm --batch 2 with code at \$4200 gave $batched, expected $single"
+    failed=1
+fi
+
+rm -f "$profile" "$jobs"
+exit $failed
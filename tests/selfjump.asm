@@ -0,0 +1,11 @@
+; Ends the way test programs signal a result: by jumping to itself.
+; Headless runs must stop here with "stop":"trap", profiled or not.
+*=$0600
+  lda #$55
+  sta $10
+  ldx #3
+loop:
+  dex
+  bne loop
+done:
+  jmp done